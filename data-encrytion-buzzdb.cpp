@@ -15,26 +15,394 @@
 #include <limits>
 #include <thread>
 #include <queue>
+#include <deque>
 #include <optional>
-#include <regex>
+#include <atomic>
+#include <array>
+#include <utility>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <unordered_set>
 #include <stdexcept>
-
+#include <cstring>
+#include <cstdlib>
+#include <filesystem>
+#include <type_traits>
+#include <algorithm>
+#include <numeric>
+#include <random>
+#include <functional>
+#include <bit>
+#include <charconv>
+#include <string_view>
+#include <cmath>
+#include <set>
+#include <tuple>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <zlib.h>
 #include <openssl/evp.h>
 #include <openssl/rand.h>
 
-unsigned char key[32];
+// Debug tracing is compiled out unless built with -DBUZZDB_TRACE (make TRACE=1)
+#ifdef BUZZDB_TRACE
+#define BUZZDB_TRACE_LOG(message)                   \
+    do                                              \
+    {                                               \
+        std::ostringstream trace_stream;            \
+        trace_stream << "[trace] " << message << "\n"; \
+        std::clog << trace_stream.str();            \
+    } while (0)
+#else
+#define BUZZDB_TRACE_LOG(message) \
+    do                            \
+    {                             \
+    } while (0)
+#endif
+
+constexpr size_t STAT_SHARDS = 16;
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+// Each thread sticks to one shard of every counter, so threads rarely share
+// a cache line when they bump the same statistic.
+size_t statShard()
+{
+    thread_local size_t shard = std::hash<std::thread::id>{}(std::this_thread::get_id()) % STAT_SHARDS;
+    return shard;
+}
+
+// Lock-free counter. Adds go to the calling thread's shard; reads sum them.
+class StatCounter
+{
+private:
+    struct alignas(CACHE_LINE_SIZE) Shard
+    {
+        std::atomic<uint64_t> value = 0;
+    };
+    std::array<Shard, STAT_SHARDS> shards;
+
+public:
+    void add(uint64_t amount = 1)
+    {
+        shards[statShard()].value.fetch_add(amount, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const
+    {
+        uint64_t total = 0;
+        for (const auto &shard : shards)
+        {
+            total += shard.value.load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+};
+
+struct HistogramSnapshot
+{
+    static constexpr size_t NUM_BUCKETS = 64;
+
+    uint64_t count = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    std::array<uint64_t, NUM_BUCKETS> buckets{}; // Bucket i counts values in [2^(i-1), 2^i)
+
+    double mean() const { return count == 0 ? 0.0 : static_cast<double>(sum) / count; }
+
+    // Upper bound of the bucket holding the given percentile
+    uint64_t percentile(double percent) const
+    {
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * count);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; i++)
+        {
+            seen += buckets[i];
+            if (seen > rank)
+            {
+                return std::min(max, i == 0 ? 0 : (uint64_t(1) << i) - 1);
+            }
+        }
+        return max;
+    }
+};
+
+// Lock-free histogram with power-of-two buckets, used for latencies in ns
+class StatHistogram
+{
+private:
+    std::array<std::atomic<uint64_t>, HistogramSnapshot::NUM_BUCKETS> buckets{};
+    StatCounter count;
+    StatCounter sum;
+    std::atomic<uint64_t> max = 0;
+
+public:
+    void record(uint64_t value)
+    {
+        size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        buckets[std::min(bucket, buckets.size() - 1)].fetch_add(1, std::memory_order_relaxed);
+        count.add();
+        sum.add(value);
+        uint64_t current = max.load(std::memory_order_relaxed);
+        while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    HistogramSnapshot snapshot() const
+    {
+        HistogramSnapshot snapshot;
+        for (size_t i = 0; i < buckets.size(); i++)
+        {
+            snapshot.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        }
+        snapshot.count = count.value();
+        snapshot.sum = sum.value();
+        snapshot.max = max.load(std::memory_order_relaxed);
+        return snapshot;
+    }
+};
+
+struct StatsSnapshot
+{
+    std::map<std::string, uint64_t> counters;
+    std::map<std::string, HistogramSnapshot> histograms;
+
+    void print(std::ostream &out) const
+    {
+        std::ostringstream buffer;
+        for (const auto &[name, value] : counters)
+        {
+            buffer << "Stats :: " << name << " " << value << "\n";
+        }
+        for (const auto &[name, histogram] : histograms)
+        {
+            buffer << "Stats :: " << name << " count " << histogram.count
+                   << " mean " << static_cast<uint64_t>(histogram.mean())
+                   << " p50 " << histogram.percentile(50)
+                   << " p99 " << histogram.percentile(99)
+                   << " max " << histogram.max << "\n";
+        }
+        out << buffer.str();
+        out.flush();
+    }
+};
+
+// Process-wide registry of named statistics. Counters and histograms are
+// created on first lookup and live as long as the process, so hot paths look
+// them up once and keep the reference.
+class StatsRegistry
+{
+private:
+    std::mutex latch; // Guards the maps, not the statistics themselves
+    std::map<std::string, std::unique_ptr<StatCounter>> counters;
+    std::map<std::string, std::unique_ptr<StatHistogram>> histograms;
+
+    std::mutex dump_latch;
+    std::condition_variable dump_wake;
+    bool dump_stopping = false;
+    std::thread dump_thread;
+
+public:
+    static StatsRegistry &global()
+    {
+        static StatsRegistry registry;
+        return registry;
+    }
+
+    ~StatsRegistry()
+    {
+        stopPeriodicDump();
+    }
+
+    StatCounter &counter(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(latch);
+        auto &counter = counters[name];
+        if (!counter)
+        {
+            counter = std::make_unique<StatCounter>();
+        }
+        return *counter;
+    }
+
+    StatHistogram &histogram(const std::string &name)
+    {
+        std::lock_guard<std::mutex> lock(latch);
+        auto &histogram = histograms[name];
+        if (!histogram)
+        {
+            histogram = std::make_unique<StatHistogram>();
+        }
+        return *histogram;
+    }
+
+    StatsSnapshot snapshot()
+    {
+        std::lock_guard<std::mutex> lock(latch);
+        StatsSnapshot snapshot;
+        for (const auto &[name, counter] : counters)
+        {
+            snapshot.counters[name] = counter->value();
+        }
+        for (const auto &[name, histogram] : histograms)
+        {
+            snapshot.histograms[name] = histogram->snapshot();
+        }
+        return snapshot;
+    }
+
+    // Prints a snapshot to `out` every `interval` until stopped
+    void startPeriodicDump(std::chrono::milliseconds interval, std::ostream &out)
+    {
+        stopPeriodicDump();
+        dump_stopping = false;
+        dump_thread = std::thread([this, interval, &out]
+                                  {
+            std::unique_lock<std::mutex> lock(dump_latch);
+            while (!dump_wake.wait_for(lock, interval, [this]
+                                       { return dump_stopping; }))
+            {
+                snapshot().print(out);
+            } });
+    }
+
+    void stopPeriodicDump()
+    {
+        if (dump_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(dump_latch);
+                dump_stopping = true;
+            }
+            dump_wake.notify_one();
+            dump_thread.join();
+        }
+    }
+};
+
+// Statistics kept by the storage and buffer layers
+struct EngineStats
+{
+    StatCounter &buffer_hits = StatsRegistry::global().counter("buffer.hits");
+    StatCounter &buffer_misses = StatsRegistry::global().counter("buffer.misses");
+    StatCounter &buffer_evictions = StatsRegistry::global().counter("buffer.evictions");
+    StatCounter &buffer_dirty_writes = StatsRegistry::global().counter("buffer.dirty_writes");
+    StatCounter &buffer_flushes = StatsRegistry::global().counter("buffer.flushes");
+    StatCounter &buffer_prefetches = StatsRegistry::global().counter("buffer.prefetches");
+    StatCounter &buffer_ring_recycles = StatsRegistry::global().counter("buffer.ring_recycles");
+    StatCounter &secondary_hits = StatsRegistry::global().counter("secondary_cache.hits");
+    StatCounter &secondary_misses = StatsRegistry::global().counter("secondary_cache.misses");
+    StatCounter &secondary_insertions = StatsRegistry::global().counter("secondary_cache.insertions");
+    StatCounter &secondary_evictions = StatsRegistry::global().counter("secondary_cache.evictions");
+    StatCounter &bytes_encrypted = StatsRegistry::global().counter("crypto.bytes_encrypted");
+    StatCounter &bytes_decrypted = StatsRegistry::global().counter("crypto.bytes_decrypted");
+    StatHistogram &encrypt_latency = StatsRegistry::global().histogram("crypto.encrypt_latency_ns");
+    StatHistogram &decrypt_latency = StatsRegistry::global().histogram("crypto.decrypt_latency_ns");
+    StatHistogram &read_latency = StatsRegistry::global().histogram("storage.read_latency_ns");
+    StatHistogram &write_latency = StatsRegistry::global().histogram("storage.write_latency_ns");
+    StatCounter &spill_files = StatsRegistry::global().counter("storage.spill_files");
+    StatCounter &spill_bytes = StatsRegistry::global().counter("storage.spill_bytes");
+    StatCounter &scan_pages_skipped = StatsRegistry::global().counter("scan.pages_skipped");
+    StatCounter &plan_cache_hits = StatsRegistry::global().counter("query.plan_cache_hits");
+    StatCounter &plan_cache_misses = StatsRegistry::global().counter("query.plan_cache_misses");
+};
+
+EngineStats &engineStats()
+{
+    static EngineStats stats;
+    return stats;
+}
+
+// Records the time from construction to destruction into a histogram
+class ScopedLatency
+{
+private:
+    StatHistogram &histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+    explicit ScopedLatency(StatHistogram &histogram) : histogram(histogram) {}
+
+    ~ScopedLatency()
+    {
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        histogram.record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+};
+
+const std::string key_filename = "buzzdb.key";
+
+unsigned char key[32];      // AES-256-CTR key of spill files and the secondary cache
+unsigned char page_key[64]; // The two AES-256 keys of page encryption (XTS)
 
-void generate_key()
+// Reads the keys from key_filename, so that files written by an earlier
+// run can be read back, or generates them and stores them there when the
+// file does not exist yet. Returns true when the keys were generated. A
+// data file left without its key could not be read, so that is an error.
+bool load_or_generate_key(const std::string &data_filename)
 {
-    RAND_bytes(key, sizeof(key));
+    std::ifstream in(key_filename, std::ios::binary);
+    if (in)
+    {
+        in.read(reinterpret_cast<char *>(key), sizeof(key));
+        in.read(reinterpret_cast<char *>(page_key), sizeof(page_key));
+        if (!in || in.peek() != std::char_traits<char>::eof())
+        {
+            throw std::runtime_error("Key file " + key_filename + " is damaged.");
+        }
+        return false;
+    }
+    std::error_code error;
+    if (std::filesystem::file_size(data_filename, error) > 0 && !error)
+    {
+        throw std::runtime_error(data_filename + " was written under a key that " + key_filename +
+                                 " no longer holds; remove it to start over.");
+    }
+    if (RAND_bytes(key, sizeof(key)) != 1 || RAND_bytes(page_key, sizeof(page_key)) != 1)
+    {
+        throw std::runtime_error("Unable to generate a key.");
+    }
+    std::ofstream out(key_filename, std::ios::binary | std::ios::trunc);
+    std::filesystem::permissions(key_filename, std::filesystem::perms::owner_read | std::filesystem::perms::owner_write,
+                                 std::filesystem::perm_options::replace);
+    out.write(reinterpret_cast<const char *>(key), sizeof(key));
+    out.write(reinterpret_cast<const char *>(page_key), sizeof(page_key));
+    if (!out.flush())
+    {
+        throw std::runtime_error("Unable to write key file " + key_filename + ".");
+    }
+    return true;
+}
+
+// Initial counter block of AES-CTR. Every ciphertext kept under the same
+// key needs a nonce of its own: two texts encrypted under one nonce share a
+// keystream, which XORing the ciphertexts cancels out.
+using Nonce = std::array<unsigned char, 16>;
+
+Nonce randomNonce()
+{
+    Nonce nonce;
+    if (RAND_bytes(nonce.data(), nonce.size()) != 1)
+    {
+        throw std::runtime_error("Unable to generate a nonce.");
+    }
+    return nonce;
 }
 
-std::string encrypt(const std::string &text, const unsigned char *key)
+std::string encrypt(const std::string &text, const unsigned char *key, const Nonce &nonce)
 {
+    ScopedLatency latency(engineStats().encrypt_latency);
+    engineStats().bytes_encrypted.add(text.size());
     int len1, len2;
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    unsigned char iv[16] = {0}; // Fixed IV (insecure)
-    EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv);
+    EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, nonce.data());
 
     std::vector<unsigned char> encrypt_text(text.size() + EVP_MAX_BLOCK_LENGTH);
     EVP_EncryptUpdate(ctx, encrypt_text.data(), &len1, (unsigned char *)text.data(), text.size());
@@ -44,12 +412,13 @@ std::string encrypt(const std::string &text, const unsigned char *key)
     return std::string((char *)encrypt_text.data(), len1 + len2);
 }
 
-std::string decrypt(const std::string &encrypt_text, const unsigned char *key)
+std::string decrypt(const std::string &encrypt_text, const unsigned char *key, const Nonce &nonce)
 {
+    ScopedLatency latency(engineStats().decrypt_latency);
+    engineStats().bytes_decrypted.add(encrypt_text.size());
     int len1, len2;
     EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    unsigned char iv[16] = {0}; // Same fixed IV
-    EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, iv);
+    EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), NULL, key, nonce.data());
 
     std::vector<unsigned char> text(encrypt_text.size() + EVP_MAX_BLOCK_LENGTH);
     EVP_DecryptUpdate(ctx, text.data(), &len1, (unsigned char *)encrypt_text.data(), encrypt_text.size());
@@ -59,6 +428,28 @@ std::string decrypt(const std::string &encrypt_text, const unsigned char *key)
     return std::string((char *)text.data(), len1 + len2);
 }
 
+// Pages at rest are encrypted with AES-256-XTS, the mode disk encryption
+// uses for sectors. The page number is the tweak, so no two pages of a file
+// share a keystream, and a page keeps its size without room for a nonce.
+void cryptPage(uint32_t page_number, const char *in, char *out, size_t size, bool encrypting)
+{
+    ScopedLatency latency(encrypting ? engineStats().encrypt_latency : engineStats().decrypt_latency);
+    (encrypting ? engineStats().bytes_encrypted : engineStats().bytes_decrypted).add(size);
+    unsigned char tweak[16] = {0};
+    std::memcpy(tweak, &page_number, sizeof(page_number));
+    int len1, len2;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    bool ok = ctx != nullptr &&
+              EVP_CipherInit_ex(ctx, EVP_aes_256_xts(), NULL, page_key, tweak, encrypting) == 1 &&
+              EVP_CipherUpdate(ctx, (unsigned char *)out, &len1, (const unsigned char *)in, size) == 1 &&
+              EVP_CipherFinal_ex(ctx, (unsigned char *)out + len1, &len2) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    if (!ok)
+    {
+        throw std::runtime_error("Unable to encrypt or decrypt page " + std::to_string(page_number) + ".");
+    }
+}
+
 enum FieldType
 {
     INT,
@@ -310,13 +701,31 @@ struct Slot
     uint16_t length = INVALID_VALUE; // Length of the slot
 };
 
+// Lets a SlottedPage either own its buffer or view a frame that lives in
+// the buffer pool's arena.
+struct PageBufferDeleter
+{
+    bool owned = true;
+
+    void operator()(char *buffer) const
+    {
+        if (owned)
+        {
+            delete[] buffer;
+        }
+    }
+};
+
 // Slotted Page class
 class SlottedPage
 {
 public:
-    std::unique_ptr<char[]> page_data = std::make_unique<char[]>(PAGE_SIZE);
+    std::unique_ptr<char[], PageBufferDeleter> page_data{new char[PAGE_SIZE]()};
     size_t metadata_size = sizeof(Slot) * MAX_SLOTS;
 
+    // View over an existing frame; the contents are left untouched.
+    explicit SlottedPage(char *frame) : page_data(frame, PageBufferDeleter{false}) {}
+
     SlottedPage()
     {
         // Empty page -> initialize slot array inside page
@@ -331,6 +740,12 @@ public:
 
     // Add a tuple, returns true if it fits, false otherwise.
     bool addTuple(std::unique_ptr<Tuple> tuple)
+    {
+        return insertTuple(std::move(tuple)).has_value();
+    }
+
+    // Add a tuple, returns the slot it went into, or nothing if it does not fit.
+    std::optional<size_t> insertTuple(std::unique_ptr<Tuple> tuple)
     {
 
         // Serialize the tuple into a char array
@@ -354,7 +769,7 @@ public:
         if (slot_itr == MAX_SLOTS)
         {
             // std::cout << "Page does not contain an empty slot with sufficient space to store the tuple.";
-            return false;
+            return std::nullopt;
         }
 
         // Identify the offset where the tuple will be placed in the page
@@ -385,7 +800,7 @@ public:
         {
             slot_array[slot_itr].empty = true;
             slot_array[slot_itr].offset = INVALID_VALUE;
-            return false;
+            return std::nullopt;
         }
 
         assert(offset != INVALID_VALUE);
@@ -402,7 +817,30 @@ public:
                     serializedTuple.c_str(),
                     tuple_size);
 
-        return true;
+        return slot_itr;
+    }
+
+    // Tells whether addTuple would find room for a tuple of the given size.
+    // Only reads the slot array, so it can run under optimistic latching.
+    bool hasSpaceFor(size_t tuple_size) const
+    {
+        const Slot *slot_array = reinterpret_cast<const Slot *>(page_data.get());
+        for (size_t slot_itr = 0; slot_itr < MAX_SLOTS; slot_itr++)
+        {
+            if (slot_array[slot_itr].empty == true and
+                slot_array[slot_itr].length >= tuple_size)
+            {
+                size_t offset = slot_array[slot_itr].offset;
+                if (offset == INVALID_VALUE)
+                {
+                    offset = slot_itr != 0
+                                 ? slot_array[slot_itr - 1].offset + slot_array[slot_itr - 1].length
+                                 : metadata_size;
+                }
+                return offset + tuple_size < PAGE_SIZE;
+            }
+        }
+        return false;
     }
 
     void deleteTuple(size_t index)
@@ -448,25 +886,29 @@ class StorageManager
 {
 public:
     std::fstream fileStream;
-    size_t num_pages = 0;
+    std::atomic<size_t> num_pages = 0;
+    const std::string filename;
+
+private:
+    std::mutex io_latch; // Serializes seeks and transfers on fileStream
 
 public:
-    StorageManager()
+    explicit StorageManager(const std::string &filename = database_filename) : filename(filename)
     {
-        fileStream.open(database_filename, std::ios::in | std::ios::out);
+        fileStream.open(filename, std::ios::in | std::ios::out);
         if (!fileStream)
         {
             // If file does not exist, create it
             fileStream.clear(); // Reset the state
-            fileStream.open(database_filename, std::ios::out);
+            fileStream.open(filename, std::ios::out);
         }
         fileStream.close();
-        fileStream.open(database_filename, std::ios::in | std::ios::out);
+        fileStream.open(filename, std::ios::in | std::ios::out);
 
         fileStream.seekg(0, std::ios::end);
         num_pages = fileStream.tellg() / PAGE_SIZE;
 
-        std::cout << "Storage Manager :: Num pages: " << num_pages << "\n";
+        std::cout << "Storage Manager :: " << filename << " Num pages: " << num_pages << "\n";
         if (num_pages == 0)
         {
             extend();
@@ -481,68 +923,88 @@ public:
         }
     }
 
-    // Read a page from disk
-    std::unique_ptr<SlottedPage> load(uint16_t page_id)
+    // Read a page from disk into the given frame
+    void load(uint32_t page_id, SlottedPage &page)
     {
-        fileStream.seekg(page_id * PAGE_SIZE, std::ios::beg);
-        auto page = std::make_unique<SlottedPage>();
+        std::unique_lock<std::mutex> lock(io_latch);
+        auto read_start = std::chrono::steady_clock::now();
+        fileStream.seekg(static_cast<std::streamoff>(page_id) * PAGE_SIZE, std::ios::beg);
         // Read the content of the file into the page
-        if (fileStream.read(page->page_data.get(), PAGE_SIZE))
+        if (fileStream.read(page.page_data.get(), PAGE_SIZE))
         {
-            std::cout << "Page read successfully from file." << std::endl;
-
-            std::string encrypted_data(page->page_data.get(), PAGE_SIZE);
-            std::string decrypted_data = decrypt(encrypted_data, key);
-            memset(page->page_data.get(), '\0', PAGE_SIZE);
-            memcpy(page->page_data.get(), decrypted_data.data(), decrypted_data.size());
-            memcpy(page->page_data.get(), encrypted_data.data(), encrypted_data.size());
+            engineStats().read_latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                  std::chrono::steady_clock::now() - read_start)
+                                                  .count());
+            // Decrypt outside the latch so other readers can use the file
+            lock.unlock();
+            BUZZDB_TRACE_LOG("Page " << page_id << " read successfully from file.");
+
+            std::string encrypted_data(page.page_data.get(), PAGE_SIZE);
+            cryptPage(page_id, encrypted_data.data(), page.page_data.get(), PAGE_SIZE, false);
         }
         else
         {
             std::cerr << "Error: Unable to read data from the file. \n";
             exit(-1);
         }
-        return page;
     }
 
     // Write a page to disk
-    void flush(uint16_t page_id, const std::unique_ptr<SlottedPage> &page)
+    void flush(uint32_t page_id, const std::unique_ptr<SlottedPage> &page)
     {
-        size_t page_offset = page_id * PAGE_SIZE;
+        size_t page_offset = static_cast<size_t>(page_id) * PAGE_SIZE;
 
-        std::string plain(page->page_data.get(), PAGE_SIZE);
-        std::string encrypted_data = encrypt(plain, key);
         char encrypted_data_char[PAGE_SIZE];
-        memset(encrypted_data_char, '\0', PAGE_SIZE);
-        memcpy(encrypted_data_char, encrypted_data.data(), encrypted_data.size());
+        cryptPage(page_id, page->page_data.get(), encrypted_data_char, PAGE_SIZE, true);
         // Move the write pointer
-        memcpy(encrypted_data_char, page->page_data.get(), PAGE_SIZE);
+        std::lock_guard<std::mutex> lock(io_latch);
+        ScopedLatency latency(engineStats().write_latency);
         fileStream.seekp(page_offset, std::ios::beg);
         fileStream.write(encrypted_data_char, PAGE_SIZE);
         fileStream.flush();
     }
 
-    // Extend database file by one page
-    void extend()
+    // Extend database file by one page; returns the new page's number
+    uint32_t extend()
     {
-        std::cout << "Extending database file \n";
+        BUZZDB_TRACE_LOG("Extending database file");
 
         // Create a slotted page
         auto empty_slotted_page = std::make_unique<SlottedPage>();
+        char encrypted_data_char[PAGE_SIZE];
 
         // Move the write pointer
+        std::lock_guard<std::mutex> lock(io_latch);
         fileStream.seekp(0, std::ios::end);
 
         // Write the page to the file, extending it
-        fileStream.write(empty_slotted_page->page_data.get(), PAGE_SIZE);
+        cryptPage(static_cast<uint32_t>(num_pages), empty_slotted_page->page_data.get(), encrypted_data_char, PAGE_SIZE, true);
+        fileStream.write(encrypted_data_char, PAGE_SIZE);
         fileStream.flush();
 
         // Update number of pages
-        num_pages += 1;
+        return static_cast<uint32_t>(num_pages++);
     }
 };
 
-using PageID = uint16_t;
+// A page id names a page of one segment: the heap file or an index file.
+// The segment sits in the top bits, so heap page ids are plain page numbers.
+using PageID = uint32_t;
+using SegmentID = uint32_t;
+
+constexpr PageID INVALID_PAGE_ID = std::numeric_limits<PageID>::max();
+constexpr unsigned SEGMENT_SHIFT = 24;
+constexpr uint32_t PAGE_NUMBER_MASK = (1u << SEGMENT_SHIFT) - 1;
+constexpr size_t MAX_SEGMENTS = 255; // The last segment would contain INVALID_PAGE_ID
+constexpr SegmentID HEAP_SEGMENT = 0;
+
+inline PageID makePageId(SegmentID segment, uint32_t page_number)
+{
+    return (segment << SEGMENT_SHIFT) | page_number;
+}
+
+inline SegmentID segmentOf(PageID page_id) { return page_id >> SEGMENT_SHIFT; }
+inline uint32_t pageNumberOf(PageID page_id) { return page_id & PAGE_NUMBER_MASK; }
 
 class Policy
 {
@@ -608,7 +1070,7 @@ public:
     PageID evict() override
     {
         // Evict the least recently used page
-        PageID evictedPageId = INVALID_VALUE;
+        PageID evictedPageId = INVALID_PAGE_ID;
         if (lruList.size() != 0)
         {
             evictedPageId = lruList.back();
@@ -619,590 +1081,11164 @@ public:
     }
 };
 
-constexpr size_t MAX_PAGES_IN_MEMORY = 10;
+// Pool size used when BUZZDB_BUFFER_POOL is not set
+constexpr size_t DEFAULT_PAGES_IN_MEMORY = 10;
+constexpr size_t MIN_PAGES_IN_MEMORY = 2;
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+constexpr size_t FRAMES_PER_PARTITION = 128;
+constexpr size_t MAX_BUFFER_PARTITIONS = 64;
+
+// Largest ring handed out for bulk reads: 256 KB worth of pages, as in
+// PostgreSQL's BAS_BULKREAD strategy.
+constexpr size_t BULK_READ_RING_BYTES = 256 * 1024;
+
+// Buffer pool settings, fixed at startup.
+//   BUZZDB_BUFFER_POOL  pool size in bytes ("65536", "64K", "256MB", "1GiB")
+//                       or as a share of physical memory ("25%")
+//   BUZZDB_HUGE_PAGES   "1" to back the frame arena with MAP_HUGETLB pages
+//   BUZZDB_BUFFER_PARTITIONS  number of independently latched page table
+//                       partitions
+//   BUZZDB_SECONDARY_CACHE  memory budget of the encrypted second cache tier,
+//                       in the same format as the pool size (off by default)
+//   BUZZDB_SECONDARY_CACHE_COMPRESS  "1" to compress pages in that tier
+struct BufferPoolConfig
+{
+    size_t num_frames = DEFAULT_PAGES_IN_MEMORY;
+    bool use_huge_pages = false;
+    size_t num_partitions = 0; // 0 derives the count from the pool size
+    size_t secondary_cache_bytes = 0;  // 0 disables the encrypted second tier
+    bool compress_secondary_cache = false;
+
+    // Page table partitions: one per FRAMES_PER_PARTITION frames unless set
+    // explicitly, between 1 and MAX_BUFFER_PARTITIONS.
+    size_t numPartitions() const
+    {
+        size_t partitions = num_partitions != 0 ? num_partitions : num_frames / FRAMES_PER_PARTITION;
+        return std::clamp<size_t>(partitions, 1, MAX_BUFFER_PARTITIONS);
+    }
+
+    static BufferPoolConfig fromEnvironment()
+    {
+        BufferPoolConfig config;
+        if (const char *pool_size = std::getenv("BUZZDB_BUFFER_POOL"))
+        {
+            config.num_frames = std::max(MIN_PAGES_IN_MEMORY, parseSize(pool_size) / PAGE_SIZE);
+        }
+        if (const char *huge_pages = std::getenv("BUZZDB_HUGE_PAGES"))
+        {
+            config.use_huge_pages = std::string(huge_pages) == "1";
+        }
+        if (const char *partitions = std::getenv("BUZZDB_BUFFER_PARTITIONS"))
+        {
+            config.num_partitions = std::stoul(partitions);
+        }
+        if (const char *secondary_size = std::getenv("BUZZDB_SECONDARY_CACHE"))
+        {
+            config.secondary_cache_bytes = parseSize(secondary_size);
+        }
+        if (const char *compress = std::getenv("BUZZDB_SECONDARY_CACHE_COMPRESS"))
+        {
+            config.compress_secondary_cache = std::string(compress) == "1";
+        }
+        return config;
+    }
 
-class BufferManager
+    // Parses a byte count with an optional K/M/G suffix, or a percentage of
+    // physical memory.
+    static size_t parseSize(const std::string &value)
+    {
+        size_t end = 0;
+        double amount = 0;
+        try
+        {
+            amount = std::stod(value, &end);
+        }
+        catch (const std::exception &)
+        {
+            throw std::runtime_error("Invalid buffer pool size: " + value);
+        }
+        std::string unit = value.substr(end);
+        if (amount < 0)
+        {
+            throw std::runtime_error("Invalid buffer pool size: " + value);
+        }
+        if (unit == "%")
+        {
+            double physical_memory = static_cast<double>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE);
+            return static_cast<size_t>(physical_memory * amount / 100.0);
+        }
+
+        static const std::map<std::string, double> multipliers = {
+            {"", 1}, {"B", 1}, {"K", 1024.0}, {"KB", 1024.0}, {"KiB", 1024.0}, {"M", 1024.0 * 1024}, {"MB", 1024.0 * 1024}, {"MiB", 1024.0 * 1024}, {"G", 1024.0 * 1024 * 1024}, {"GB", 1024.0 * 1024 * 1024}, {"GiB", 1024.0 * 1024 * 1024}};
+        auto multiplier = multipliers.find(unit);
+        if (multiplier == multipliers.end())
+        {
+            throw std::runtime_error("Invalid buffer pool size unit: " + unit);
+        }
+        return static_cast<size_t>(amount * multiplier->second);
+    }
+};
+
+// One contiguous, page-aligned allocation holding every frame of the pool.
+// Huge pages are used when requested and available; otherwise the arena
+// falls back to regular pages and asks for transparent huge pages.
+class FrameArena
 {
 private:
-    using PageMap = std::unordered_map<PageID, std::unique_ptr<SlottedPage>>;
-
-    StorageManager storage_manager;
-    PageMap pageMap;
-    std::unique_ptr<Policy> policy;
+    char *base = nullptr;
+    size_t num_frames;
+    size_t mapped_bytes;
+    bool huge_pages = false;
 
 public:
-    BufferManager() : policy(std::make_unique<LruPolicy>(MAX_PAGES_IN_MEMORY)) {}
-
-    std::unique_ptr<SlottedPage> &getPage(int page_id)
+    FrameArena(size_t num_frames, bool use_huge_pages) : num_frames(num_frames)
     {
-        auto it = pageMap.find(page_id);
-        if (it != pageMap.end())
+        size_t bytes = num_frames * PAGE_SIZE;
+        void *memory = MAP_FAILED;
+        if (use_huge_pages)
         {
-            policy->touch(page_id);
-            return pageMap.find(page_id)->second;
+            mapped_bytes = (bytes + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+            memory = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            huge_pages = memory != MAP_FAILED;
         }
-
-        if (pageMap.size() >= MAX_PAGES_IN_MEMORY)
+        if (memory == MAP_FAILED)
         {
-            auto evictedPageId = policy->evict();
-            if (evictedPageId != INVALID_VALUE)
+            mapped_bytes = bytes;
+            memory = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED)
             {
-                std::cout << "Evicting page " << evictedPageId << "\n";
-                storage_manager.flush(evictedPageId,
-                                      pageMap[evictedPageId]);
+                throw std::runtime_error("Unable to allocate buffer pool arena.");
             }
+#ifdef MADV_HUGEPAGE
+            madvise(memory, mapped_bytes, MADV_HUGEPAGE);
+#endif
         }
-
-        auto page = storage_manager.load(page_id);
-        policy->touch(page_id);
-        std::cout << "Loading page: " << page_id << "\n";
-        pageMap[page_id] = std::move(page);
-        return pageMap[page_id];
+        base = static_cast<char *>(memory);
     }
 
-    void flushPage(int page_id)
+    ~FrameArena()
     {
-        // std::cout << "Flush page " << page_id << "\n";
-        storage_manager.flush(page_id, pageMap[page_id]);
+        munmap(base, mapped_bytes);
     }
 
-    void extend()
-    {
-        storage_manager.extend();
-    }
+    FrameArena(const FrameArena &) = delete;
+    FrameArena &operator=(const FrameArena &) = delete;
 
-    size_t getNumPages()
-    {
-        return storage_manager.num_pages;
-    }
+    char *frame(size_t frame_id) const { return base + frame_id * PAGE_SIZE; }
+    size_t size() const { return num_frames; }
+    size_t bytes() const { return mapped_bytes; }
+    bool usesHugePages() const { return huge_pages; }
 };
 
-class HashIndex
+// Second cache tier between the buffer pool and the data file. Pages evicted
+// from the pool are kept here encrypted (and, optionally, compressed before
+// encryption) under a separate memory budget, so a pool miss that hits this
+// tier costs one decryption instead of a file read plus decryption, and no
+// plaintext outlives its pool frame. The tier is exclusive: a page taken
+// back into the pool leaves it, so the two tiers never hold diverging
+// copies of a page. Every entry is encrypted under a random nonce of its
+// own, so no two entries share a keystream.
+class EncryptedPageCache
 {
 private:
-    struct HashEntry
+    struct Entry
     {
-        int key;
-        int value;
-        int position; // Final position within the array
-        bool exists;  // Flag to check if entry exists
-
-        // Default constructor
-        HashEntry() : key(0), value(0), position(-1), exists(false) {}
-
-        // Constructor for initializing with key, value, and exists flag
-        HashEntry(int k, int v, int pos) : key(k), value(v), position(pos), exists(true) {}
+        Nonce nonce;
+        std::string ciphertext;
+        bool compressed;
+        std::list<PageID>::iterator lru_position;
     };
 
-    static const size_t capacity = 100; // Hard-coded capacity
-    HashEntry hashTable[capacity];      // Static-sized array
+    size_t budget_bytes;
+    bool compress;
 
-    size_t hashFunction(int key) const
-    {
-        return key % capacity; // Simple modulo hash function
-    }
+    std::mutex latch;
+    std::list<PageID> lru; // Most recently inserted first
+    std::unordered_map<PageID, Entry> entries;
+    size_t used_bytes = 0;
 
 public:
-    HashIndex()
+    EncryptedPageCache(size_t budget_bytes, bool compress)
+        : budget_bytes(budget_bytes), compress(compress) {}
+
+    // Stores an encrypted copy of a page that is leaving the pool
+    void put(PageID page_id, const char *page_data)
     {
-        // Initialize all entries as non-existing by default
-        for (size_t i = 0; i < capacity; ++i)
+        std::string plain(page_data, PAGE_SIZE);
+        bool compressed = false;
+        if (compress)
         {
-            hashTable[i] = HashEntry();
+            uLongf compressed_size = compressBound(PAGE_SIZE);
+            std::string buffer(compressed_size, '\0');
+            if (compress2(reinterpret_cast<Bytef *>(buffer.data()), &compressed_size,
+                          reinterpret_cast<const Bytef *>(page_data), PAGE_SIZE, Z_BEST_SPEED) == Z_OK &&
+                compressed_size < PAGE_SIZE)
+            {
+                buffer.resize(compressed_size);
+                plain.swap(buffer);
+                compressed = true;
+            }
+        }
+        Nonce nonce = randomNonce();
+        std::string ciphertext = encrypt(plain, key, nonce);
+
+        std::lock_guard<std::mutex> lock(latch);
+        erase(page_id);
+        if (ciphertext.size() > budget_bytes)
+        {
+            return;
+        }
+        used_bytes += ciphertext.size();
+        lru.push_front(page_id);
+        entries.emplace(page_id, Entry{nonce, std::move(ciphertext), compressed, lru.begin()});
+        engineStats().secondary_insertions.add();
+        while (used_bytes > budget_bytes)
+        {
+            erase(lru.back());
+            engineStats().secondary_evictions.add();
         }
     }
 
-    void insertOrUpdate(int key, int value)
+    // Decrypts the page into `page_data` and drops it from the tier.
+    // Returns false when the page is not cached.
+    bool take(PageID page_id, char *page_data)
     {
-        size_t index = hashFunction(key);
-        size_t originalIndex = index;
-        bool inserted = false;
-        int i = 0; // Attempt counter
+        Entry entry;
+        {
+            std::lock_guard<std::mutex> lock(latch);
+            auto it = entries.find(page_id);
+            if (it == entries.end())
+            {
+                engineStats().secondary_misses.add();
+                return false;
+            }
+            entry = std::move(it->second);
+            used_bytes -= entry.ciphertext.size();
+            lru.erase(entry.lru_position);
+            entries.erase(it);
+        }
+        engineStats().secondary_hits.add();
 
-        do
+        std::string plain = decrypt(entry.ciphertext, key, entry.nonce);
+        if (entry.compressed)
         {
-            if (!hashTable[index].exists)
+            uLongf page_size = PAGE_SIZE;
+            if (uncompress(reinterpret_cast<Bytef *>(page_data), &page_size,
+                           reinterpret_cast<const Bytef *>(plain.data()), plain.size()) != Z_OK ||
+                page_size != PAGE_SIZE)
             {
-                hashTable[index] = HashEntry(key, value, true);
-                hashTable[index].position = index;
-                inserted = true;
-                break;
-            }
-            else if (hashTable[index].key == key)
-            {
-                hashTable[index].value += value;
-                hashTable[index].position = index;
-                inserted = true;
-                break;
+                throw std::runtime_error("Corrupt page in secondary cache.");
             }
-            i++;
-            index = (originalIndex + i * i) % capacity; // Quadratic probing
-        } while (index != originalIndex && !inserted);
-
-        if (!inserted)
+        }
+        else
         {
-            std::cerr << "HashTable is full or cannot insert key: " << key << std::endl;
+            memcpy(page_data, plain.data(), PAGE_SIZE);
         }
+        return true;
     }
 
-    int getValue(int key) const
+    size_t usedBytes()
     {
-        size_t index = hashFunction(key);
-        size_t originalIndex = index;
-
-        do
-        {
-            if (hashTable[index].exists && hashTable[index].key == key)
-            {
-                return hashTable[index].value;
-            }
-            if (!hashTable[index].exists)
-            {
-                break; // Stop if we find a slot that has never been used
-            }
-            index = (index + 1) % capacity;
-        } while (index != originalIndex);
-
-        return -1; // Key not found
+        std::lock_guard<std::mutex> lock(latch);
+        return used_bytes;
     }
 
-    // This method is not efficient for range queries
-    // as this is an unordered index
-    // but is included for comparison
-    std::vector<int> rangeQuery(int lowerBound, int upperBound) const
+private:
+    void erase(PageID page_id)
     {
-        std::vector<int> values;
-        for (size_t i = 0; i < capacity; ++i)
+        auto it = entries.find(page_id);
+        if (it != entries.end())
         {
-            if (hashTable[i].exists && hashTable[i].key >= lowerBound && hashTable[i].key <= upperBound)
-            {
-                std::cout << "Key: " << hashTable[i].key << ", Value: " << hashTable[i].value << std::endl;
-                values.push_back(hashTable[i].value);
-            }
+            used_bytes -= it->second.ciphertext.size();
+            lru.erase(it->second.lru_position);
+            entries.erase(it);
         }
-        return values;
     }
+};
 
-    void print() const
-    {
-        for (size_t i = 0; i < capacity; ++i)
-        {
-            if (hashTable[i].exists)
-            {
-                std::cout << "Position: " << hashTable[i].position << ", Key: " << hashTable[i].key << ", Value: " << hashTable[i].value << std::endl;
-            }
-        }
-    }
+enum class BufferAccessStrategyType
+{
+    NORMAL,  // Pages go through the shared replacement policy
+    BULKREAD // Pages are recycled through a small private ring
 };
 
-class Operator
+// A buffer access strategy lets a large sequential reader (e.g., a full-table
+// scan) keep its pages in a small private ring of frames instead of the
+// shared LRU list. Once the ring is full, the oldest ring page is evicted and
+// its frame is reused for the next page, so a scan never displaces more than
+// `ring_size` pages of the hot working set.
+class BufferAccessStrategy
 {
 public:
-    virtual ~Operator() = default;
-
-    /// Initializes the operator.
-    virtual void open() = 0;
-
-    /// Tries to generate the next tuple. Return true when a new tuple is
-    /// available.
-    virtual bool next() = 0;
-
-    /// Destroys the operator.
-    virtual void close() = 0;
+    BufferAccessStrategyType type;
+    size_t ring_size;
+    std::list<PageID> ring; // Pages currently owned by the ring, oldest first
+    size_t loading = 0;     // Pages being read into the ring
+    std::mutex latch;       // Guards `ring` and `loading`; never held while taking a partition latch
+
+    BufferAccessStrategy(BufferAccessStrategyType type, size_t ring_size)
+        : type(type), ring_size(ring_size) {}
+};
 
-    /// This returns the pointers to the Fields of the generated tuple. When
-    /// `next()` returns true, the Fields will contain the values for the
-    /// next tuple. Each `Field` pointer in the vector stands for one attribute of the tuple.
-    virtual std::vector<std::unique_ptr<Field>> getOutput() = 0;
+// Descriptor of one arena frame. `page` is a SlottedPage view over the frame
+// that lives as long as the pool, so references to it stay valid.
+struct BufferFrame
+{
+    std::atomic<PageID> page_id = INVALID_PAGE_ID;
+    bool dirty = false;
+    size_t pin_count = 0;                       // Pinned frames are never evicted
+    BufferAccessStrategy *ring_owner = nullptr; // Set while a ring owns the frame
+    bool prefetched = false;                    // Read ahead and not fixed since; rings do not recycle it
+
+    // Optimistic latch. The version is odd while a writer holds the page
+    // exclusively and while the frame holds no page (it is free or being
+    // loaded); every change makes it move on. A reader that sees the same
+    // even version before and after reading knows its read was consistent.
+    std::atomic<uint64_t> version = 1;
+
+    // Set by optimistic readers instead of moving the page in the LRU list;
+    // eviction gives referenced pages a second chance.
+    std::atomic<bool> referenced = false;
+
+    std::unique_ptr<SlottedPage> page;
 };
 
-class UnaryOperator : public Operator
+// Reference to a page that is swizzled into a direct frame reference while
+// the page is resident, as in LeanStore. The frame is only a hint: it is
+// checked against the frame's page id and version on every use, so swips
+// never need to be unswizzled when their page is evicted, and a swip read
+// back from disk with a stale hint is still safe to follow.
+class Swip
 {
-protected:
-    Operator *input;
+private:
+    // Page id in the low 32 bits, frame + 1 in the high 32 bits (0 when
+    // unswizzled). Atomic because readers swizzle shared swips.
+    std::atomic<uint64_t> word;
 
 public:
-    explicit UnaryOperator(Operator &input) : input(&input) {}
+    explicit Swip(PageID page_id = INVALID_PAGE_ID) : word(page_id) {}
+    Swip(const Swip &other) : word(other.word.load(std::memory_order_relaxed)) {}
+    Swip &operator=(const Swip &other)
+    {
+        word.store(other.word.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        return *this;
+    }
 
-    ~UnaryOperator() override = default;
+    static Swip fromRaw(uint64_t raw)
+    {
+        Swip swip;
+        swip.word.store(raw, std::memory_order_relaxed);
+        return swip;
+    }
+    uint64_t raw() const { return word.load(std::memory_order_relaxed); }
+
+    PageID pageId() const { return static_cast<PageID>(raw() & 0xFFFFFFFF); }
+    bool isSwizzled() const { return (raw() >> 32) != 0; }
+    size_t frame() const { return (raw() >> 32) - 1; }
+
+    void swizzle(size_t frame_id)
+    {
+        word.store(pageId() | (static_cast<uint64_t>(frame_id + 1) << 32), std::memory_order_relaxed);
+    }
 };
 
-class BinaryOperator : public Operator
+class BufferManager;
+
+// Keeps a page pinned in its frame for as long as the guard is alive. Code
+// that shares the pool with other threads (e.g., the read-ahead prefetcher)
+// must access pages through a guard rather than a bare getPage reference.
+// An exclusive guard also holds the frame's optimistic latch, so optimistic
+// readers of the page retry until it is released.
+class PageGuard
 {
-protected:
-    Operator *input_left;
-    Operator *input_right;
+private:
+    BufferManager *buffer_manager = nullptr;
+    size_t frame_id = 0;
+    SlottedPage *page = nullptr;
+    bool exclusive = false;
 
 public:
-    explicit BinaryOperator(Operator &input_left, Operator &input_right)
-        : input_left(&input_left), input_right(&input_right) {}
+    PageGuard() = default;
+    PageGuard(BufferManager *buffer_manager, size_t frame_id, SlottedPage *page, bool exclusive = false)
+        : buffer_manager(buffer_manager), frame_id(frame_id), page(page), exclusive(exclusive) {}
 
-    ~BinaryOperator() override = default;
+    PageGuard(PageGuard &&other) noexcept
+        : buffer_manager(std::exchange(other.buffer_manager, nullptr)),
+          frame_id(other.frame_id), page(std::exchange(other.page, nullptr)),
+          exclusive(other.exclusive) {}
+
+    PageGuard &operator=(PageGuard &&other) noexcept
+    {
+        if (&other != this)
+        {
+            release();
+            buffer_manager = std::exchange(other.buffer_manager, nullptr);
+            frame_id = other.frame_id;
+            page = std::exchange(other.page, nullptr);
+            exclusive = other.exclusive;
+        }
+        return *this;
+    }
+
+    PageGuard(const PageGuard &) = delete;
+    PageGuard &operator=(const PageGuard &) = delete;
+
+    ~PageGuard() { release(); }
+
+    void release();
+
+    size_t frameId() const { return frame_id; }
+    SlottedPage *operator->() const { return page; }
+    SlottedPage &operator*() const { return *page; }
+    explicit operator bool() const { return page != nullptr; }
 };
 
-class ScanOperator : public Operator
+class BufferManager
 {
 private:
-    BufferManager &bufferManager;
-    size_t currentPageIndex = 0;
-    size_t currentSlotIndex = 0;
-    std::unique_ptr<Tuple> currentTuple;
-    size_t tuple_count = 0;
+    using PageTable = std::unordered_map<PageID, size_t>;
 
-public:
-    ScanOperator(BufferManager &manager) : bufferManager(manager) {}
+    // One slice of the page table. A page always maps to the same partition
+    // (by hash of its id); the partition latch guards its page table, its
+    // replacement policy, and the descriptors of the frames holding its
+    // pages. Threads never hold two partition latches at once.
+    struct Partition
+    {
+        std::mutex latch;
+        PageTable pageTable;
+        std::unique_ptr<Policy> policy;
+        std::unordered_set<PageID> in_flight; // Pages being read from disk
+        std::condition_variable load_finished;
+    };
 
-    void open() override
+    // One storage manager per segment. Segments are only opened, never
+    // closed, so a page id's storage manager stays valid once it is handed out.
+    std::array<std::unique_ptr<StorageManager>, MAX_SEGMENTS> segments;
+    std::atomic<size_t> num_segments = 0;
+    std::mutex segment_latch; // Serializes openSegment
+    FrameArena arena;
+    std::vector<BufferFrame> frames;
+    std::vector<std::unique_ptr<Partition>> partitions;
+    std::unique_ptr<EncryptedPageCache> secondary_cache; // Null when disabled
+
+    // Frames that hold no page. Taken outside any partition latch.
+    std::mutex free_latch;
+    std::vector<size_t> free_frames;
+
+    // Partition the next eviction starts at, so victims spread evenly
+    std::atomic<size_t> victim_hand = 0;
+
+public:
+    explicit BufferManager(const BufferPoolConfig &config = BufferPoolConfig::fromEnvironment())
+        : arena(config.num_frames, config.use_huge_pages),
+          frames(config.num_frames)
     {
-        currentPageIndex = 0;
-        currentSlotIndex = 0;
-        currentTuple.reset(); // Ensure currentTuple is reset
-        loadNextTuple();
+        openSegment(database_filename);
+        for (size_t frame_id = 0; frame_id < frames.size(); frame_id++)
+        {
+            frames[frame_id].page = std::make_unique<SlottedPage>(arena.frame(frame_id));
+            free_frames.push_back(frames.size() - 1 - frame_id);
+        }
+        for (size_t i = 0; i < config.numPartitions(); i++)
+        {
+            auto partition = std::make_unique<Partition>();
+            // Frames are shared, so any partition may end up holding all of them
+            partition->policy = std::make_unique<LruPolicy>(frames.size());
+            partitions.push_back(std::move(partition));
+        }
+        if (config.secondary_cache_bytes > 0)
+        {
+            secondary_cache = std::make_unique<EncryptedPageCache>(config.secondary_cache_bytes,
+                                                                   config.compress_secondary_cache);
+        }
+        std::cout << "Buffer Manager :: Frames: " << frames.size()
+                  << " Partitions: " << partitions.size()
+                  << " Arena bytes: " << arena.bytes()
+                  << " Huge pages: " << (arena.usesHugePages() ? "yes" : "no")
+                  << " Secondary cache bytes: " << config.secondary_cache_bytes << "\n";
     }
 
-    bool next() override
+    // Returns the page without pinning it. Only safe while no other thread
+    // can evict pages; concurrent callers should use fixPage.
+    std::unique_ptr<SlottedPage> &getPage(PageID page_id, BufferAccessStrategy *strategy = nullptr)
     {
-        if (!currentTuple)
-            return false; // No more tuples available
-
-        loadNextTuple();
-        return currentTuple != nullptr;
+        return frames[fixFrame(page_id, strategy, false)].page;
     }
 
-    void close() override
+    // Returns the page pinned in its frame until the guard is released
+    PageGuard fixPage(PageID page_id, BufferAccessStrategy *strategy = nullptr)
     {
-        std::cout << "Scan Operator tuple_count: " << tuple_count << "\n";
-        currentPageIndex = 0;
-        currentSlotIndex = 0;
-        currentTuple.reset();
+        size_t frame_id = fixFrame(page_id, strategy, true);
+        return PageGuard(this, frame_id, frames[frame_id].page.get());
     }
 
-    std::vector<std::unique_ptr<Field>> getOutput() override
+    // Returns the page pinned and exclusively latched: optimistic readers of
+    // the page fail validation until the guard is released. Anyone changing
+    // a page that others may read concurrently must hold this guard.
+    PageGuard fixPageExclusive(PageID page_id)
     {
-        if (currentTuple)
+        size_t frame_id = fixFrame(page_id, nullptr, true);
+        std::atomic<uint64_t> &version = frames[frame_id].version;
+        uint64_t current = version.load(std::memory_order_relaxed);
+        while ((current & 1) != 0 ||
+               !version.compare_exchange_weak(current, current + 1, std::memory_order_acquire))
         {
-            return std::move(currentTuple->fields);
+            std::this_thread::yield();
+            current = version.load(std::memory_order_relaxed);
         }
-        return {}; // Return an empty vector if no tuple is available
+        return PageGuard(this, frame_id, frames[frame_id].page.get(), true);
     }
 
-private:
-    void loadNextTuple()
+    void unlatchExclusive(size_t frame_id)
+    {
+        frames[frame_id].version.fetch_add(1, std::memory_order_release);
+    }
+
+    // Runs `read` on the page through the swip. When the swip points at the
+    // frame holding the page, this takes no latch, does no page table lookup
+    // and leaves the LRU list alone; the read is validated afterwards with
+    // the frame's version. Otherwise the page is fixed the normal way and the
+    // swip is swizzled for next time. `read` may see a page in the middle of
+    // a change: it must only look inside the page and must not act on what
+    // it sees other than by returning it, since it may be run again.
+    template <typename ReadFn>
+    auto readOptimistic(Swip &swip, ReadFn &&read)
     {
-        while (currentPageIndex < bufferManager.getNumPages())
+        if (swip.isSwizzled() && swip.frame() < frames.size())
         {
-            auto &currentPage = bufferManager.getPage(currentPageIndex);
-            if (!currentPage || currentSlotIndex >= MAX_SLOTS)
+            BufferFrame &frame = frames[swip.frame()];
+            uint64_t version = frame.version.load(std::memory_order_acquire);
+            if ((version & 1) == 0 && frame.page_id.load(std::memory_order_relaxed) == swip.pageId())
             {
-                currentSlotIndex = 0; // Reset slot index when moving to a new page
+                auto result = read(static_cast<const SlottedPage &>(*frame.page));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (frame.version.load(std::memory_order_relaxed) == version)
+                {
+                    if (!frame.referenced.load(std::memory_order_relaxed))
+                    {
+                        frame.referenced.store(true, std::memory_order_relaxed);
+                    }
+                    engineStats().buffer_hits.add();
+                    return result;
+                }
             }
+        }
 
-            char *page_buffer = currentPage->page_data.get();
-            Slot *slot_array = reinterpret_cast<Slot *>(page_buffer);
-
-            while (currentSlotIndex < MAX_SLOTS)
+        // Slow path: pin the page, then read it as soon as no writer holds it
+        PageGuard guard = fixPage(swip.pageId());
+        swip.swizzle(guard.frameId());
+        BufferFrame &frame = frames[guard.frameId()];
+        while (true)
+        {
+            uint64_t version = frame.version.load(std::memory_order_acquire);
+            if ((version & 1) == 0)
             {
-                if (!slot_array[currentSlotIndex].empty)
+                auto result = read(static_cast<const SlottedPage &>(*guard));
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (frame.version.load(std::memory_order_relaxed) == version)
                 {
-                    assert(slot_array[currentSlotIndex].offset != INVALID_VALUE);
-                    const char *tuple_data = page_buffer + slot_array[currentSlotIndex].offset;
-                    std::istringstream iss(std::string(tuple_data, slot_array[currentSlotIndex].length));
-                    currentTuple = Tuple::deserialize(iss);
-                    currentSlotIndex++; // Move to the next slot for the next call
-                    tuple_count++;
-                    return; // Tuple loaded successfully
+                    return result;
                 }
-                currentSlotIndex++;
             }
-
-            // Increment page index after exhausting current page
-            currentPageIndex++;
+            std::this_thread::yield();
         }
-
-        // No more tuples are available
-        currentTuple.reset();
     }
-};
-
-class IPredicate
-{
-public:
-    virtual ~IPredicate() = default;
-    virtual bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const = 0;
-};
 
-void printTuple(const std::vector<std::unique_ptr<Field>> &tupleFields)
-{
-    std::cout << "Tuple: [";
-    for (const auto &field : tupleFields)
+    void unfixFrame(size_t frame_id)
     {
-        field->print(); // Assuming `print()` is a method that prints field content
-        std::cout << " ";
+        // A pinned frame keeps its page, so page_id is stable here
+        Partition &partition = partitionOf(frames[frame_id].page_id);
+        std::lock_guard<std::mutex> lock(partition.latch);
+        assert(frames[frame_id].pin_count > 0);
+        frames[frame_id].pin_count--;
     }
-    std::cout << "]";
-}
-
-class SimplePredicate : public IPredicate
-{
-public:
-    enum OperandType
-    {
-        DIRECT,
-        INDIRECT
-    };
-    enum ComparisonOperator
-    {
-        EQ,
-        NE,
-        GT,
-        GE,
-        LT,
-        LE
-    }; // Renamed from PredicateType
 
-    struct Operand
+    // Loads the page into the strategy's ring (or the shared pool) ahead of
+    // its use. Returns false when the page could not be loaded without
+    // evicting pinned or not yet consumed pages; the caller may retry later.
+    bool prefetchPage(PageID page_id, BufferAccessStrategy *strategy)
     {
-        std::unique_ptr<Field> directValue;
-        size_t index;
-        OperandType type;
-
-        Operand(std::unique_ptr<Field> value) : directValue(std::move(value)), type(DIRECT) {}
-        Operand(size_t idx) : index(idx), type(INDIRECT) {}
-    };
-
-    Operand left_operand;
-    Operand right_operand;
-    ComparisonOperator comparison_operator;
+        Partition &partition = partitionOf(page_id);
+        {
+            std::lock_guard<std::mutex> lock(partition.latch);
+            if (partition.pageTable.count(page_id) || partition.in_flight.count(page_id))
+            {
+                return true;
+            }
+            partition.in_flight.insert(page_id);
+        }
 
-    SimplePredicate(Operand left, Operand right, ComparisonOperator op)
-        : left_operand(std::move(left)), right_operand(std::move(right)), comparison_operator(op) {}
+        std::optional<size_t> frame_id;
+        bool bulk_read = isBulkRead(strategy);
+        if (bulk_read && reserveRingSlot(*strategy))
+        {
+            frame_id = recycleRingFrame(*strategy);
+        }
+        else
+        {
+            frame_id = allocateFrame();
+        }
+        if (!frame_id)
+        {
+            if (bulk_read)
+            {
+                cancelRingSlot(*strategy);
+            }
+            std::lock_guard<std::mutex> lock(partition.latch);
+            partition.in_flight.erase(page_id);
+            partition.load_finished.notify_all();
+            return false;
+        }
+        engineStats().buffer_misses.add();
+        engineStats().buffer_prefetches.add();
+        loadIntoFrame(partition, page_id, *frame_id, strategy, false, true);
+        return true;
+    }
 
-    bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const
+    // Returns a strategy for the given access pattern. The ring normally takes
+    // at most an eighth of the pool; a reader that prefetches needs one frame
+    // per page it reads ahead plus the page it is on, up to half of the pool,
+    // so normal accesses always find evictable pages.
+    std::unique_ptr<BufferAccessStrategy> getAccessStrategy(BufferAccessStrategyType type,
+                                                            size_t read_ahead_pages = 0)
     {
-        const Field *leftField = nullptr;
-        const Field *rightField = nullptr;
-
-        if (left_operand.type == DIRECT)
+        size_t ring_size = 0;
+        if (type == BufferAccessStrategyType::BULKREAD)
         {
-            leftField = left_operand.directValue.get();
+            ring_size = std::max(frames.size() / 8, read_ahead_pages + 1);
+            ring_size = std::min({ring_size, BULK_READ_RING_BYTES / PAGE_SIZE, frames.size() / 2});
+            ring_size = std::max<size_t>(1, ring_size);
         }
-        else if (left_operand.type == INDIRECT)
+        return std::make_unique<BufferAccessStrategy>(type, ring_size);
+    }
+
+    // Evicts the pages still owned by the strategy's ring; pages someone
+    // still has pinned are handed over to the shared pool. Must be called
+    // before the strategy is destroyed, once it loads no more pages.
+    void freeAccessStrategy(BufferAccessStrategy &strategy)
+    {
+        std::list<PageID> ring;
         {
-            leftField = tupleFields[left_operand.index].get();
+            std::lock_guard<std::mutex> lock(strategy.latch);
+            ring.swap(strategy.ring);
         }
+        for (auto page_id : ring)
+        {
+            Partition &partition = partitionOf(page_id);
+            std::optional<size_t> frame_id;
+            {
+                std::lock_guard<std::mutex> lock(partition.latch);
+                frame_id = evictRingPage(partition, page_id, strategy);
+                auto it = partition.pageTable.find(page_id);
+                if (!frame_id && it != partition.pageTable.end() && frames[it->second].ring_owner == &strategy)
+                {
+                    frames[it->second].ring_owner = nullptr;
+                    partition.policy->touch(page_id);
+                }
+            }
+            if (frame_id)
+            {
+                releaseFrame(*frame_id);
+            }
+        }
+    }
+
+    // Records that a resident page was modified and must be written back
+    // before its frame is reused.
+    void markDirty(PageID page_id)
+    {
+        Partition &partition = partitionOf(page_id);
+        std::lock_guard<std::mutex> lock(partition.latch);
+        auto it = partition.pageTable.find(page_id);
+        if (it != partition.pageTable.end())
+        {
+            frames[it->second].dirty = true;
+        }
+    }
+
+    void flushPage(PageID page_id)
+    {
+        // std::cout << "Flush page " << page_id << "\n";
+        Partition &partition = partitionOf(page_id);
+        std::lock_guard<std::mutex> lock(partition.latch);
+        BufferFrame &frame = frames[partition.pageTable.at(page_id)];
+        storageOf(page_id).flush(pageNumberOf(page_id), frame.page);
+        frame.dirty = false;
+        engineStats().buffer_flushes.add();
+    }
+
+    // Writes back every dirty resident page of the segment. Pages that are
+    // written through (heap pages) are never dirty; index pages are written
+    // back here or on eviction.
+    void flushSegment(SegmentID segment)
+    {
+        for (auto &partition : partitions)
+        {
+            std::lock_guard<std::mutex> lock(partition->latch);
+            for (auto &[page_id, frame_id] : partition->pageTable)
+            {
+                BufferFrame &frame = frames[frame_id];
+                if (segmentOf(page_id) == segment && frame.dirty)
+                {
+                    storageOf(page_id).flush(pageNumberOf(page_id), frame.page);
+                    frame.dirty = false;
+                    engineStats().buffer_flushes.add();
+                }
+            }
+        }
+    }
+
+    // Opens the file as a segment of its own, or returns the segment that
+    // already holds it. The heap file is always HEAP_SEGMENT.
+    SegmentID openSegment(const std::string &filename)
+    {
+        std::lock_guard<std::mutex> lock(segment_latch);
+        for (SegmentID segment = 0; segment < num_segments; segment++)
+        {
+            if (segments[segment]->filename == filename)
+            {
+                return segment;
+            }
+        }
+        if (num_segments == MAX_SEGMENTS)
+        {
+            throw std::runtime_error("Too many segments open: " + filename);
+        }
+        segments[num_segments] = std::make_unique<StorageManager>(filename);
+        return static_cast<SegmentID>(num_segments++);
+    }
+
+    // Appends a page to the segment and returns its id
+    PageID extend(SegmentID segment = HEAP_SEGMENT)
+    {
+        return makePageId(segment, segments[segment]->extend());
+    }
+
+    size_t getNumPages(SegmentID segment = HEAP_SEGMENT)
+    {
+        return segments[segment]->num_pages;
+    }
+
+    size_t getPoolSize() const { return frames.size(); }
+    size_t getNumPartitions() const { return partitions.size(); }
+
+private:
+    static bool isBulkRead(const BufferAccessStrategy *strategy)
+    {
+        return strategy != nullptr && strategy->type == BufferAccessStrategyType::BULKREAD;
+    }
+
+    StorageManager &storageOf(PageID page_id)
+    {
+        return *segments[segmentOf(page_id)];
+    }
+
+    Partition &partitionOf(PageID page_id)
+    {
+        // Fibonacci hashing spreads consecutive page ids across partitions
+        uint64_t hash = static_cast<uint64_t>(page_id) * 0x9E3779B97F4A7C15ull;
+        return *partitions[(hash >> 32) % partitions.size()];
+    }
+
+    // Counts a page the strategy is about to load towards its ring and tells
+    // whether the ring is already full, i.e., a ring frame must be recycled.
+    bool reserveRingSlot(BufferAccessStrategy &strategy)
+    {
+        std::lock_guard<std::mutex> lock(strategy.latch);
+        return strategy.ring.size() + strategy.loading++ >= strategy.ring_size;
+    }
+
+    void cancelRingSlot(BufferAccessStrategy &strategy)
+    {
+        std::lock_guard<std::mutex> lock(strategy.latch);
+        strategy.loading--;
+    }
+
+    // Makes the page resident and returns its frame, pinned if requested.
+    // No latch is held while a frame is found or the page is read.
+    size_t fixFrame(PageID page_id, BufferAccessStrategy *strategy, bool pin)
+    {
+        Partition &partition = partitionOf(page_id);
+        {
+            std::unique_lock<std::mutex> lock(partition.latch);
+            partition.load_finished.wait(lock, [&]
+                                         { return !partition.in_flight.count(page_id); });
+
+            auto it = partition.pageTable.find(page_id);
+            if (it != partition.pageTable.end())
+            {
+                engineStats().buffer_hits.add();
+                BufferFrame &frame = frames[it->second];
+                frame.prefetched = false;
+                if (frame.ring_owner == nullptr)
+                {
+                    partition.policy->touch(page_id);
+                }
+                else if (strategy == nullptr)
+                {
+                    // A normal access to a ring page adopts it into the shared
+                    // pool so the ring does not recycle a page others are
+                    // using. The ring drops its stale entry when it gets to it.
+                    frame.ring_owner = nullptr;
+                    partition.policy->touch(page_id);
+                }
+                if (pin)
+                {
+                    frame.pin_count++;
+                }
+                return it->second;
+            }
+            partition.in_flight.insert(page_id);
+        }
+
+        engineStats().buffer_misses.add();
+        std::optional<size_t> frame_id;
+        bool bulk_read = isBulkRead(strategy);
+        if (bulk_read && reserveRingSlot(*strategy))
+        {
+            // Recycle a ring frame instead of evicting a shared page
+            frame_id = recycleRingFrame(*strategy);
+        }
+        if (!frame_id)
+        {
+            // Growing the ring takes one frame from the shared pool
+            frame_id = allocateFrame();
+        }
+        if (!frame_id)
+        {
+            if (bulk_read)
+            {
+                cancelRingSlot(*strategy);
+            }
+            std::lock_guard<std::mutex> lock(partition.latch);
+            partition.in_flight.erase(page_id);
+            partition.load_finished.notify_all();
+            throw std::runtime_error("Buffer pool exhausted: every frame is pinned or owned by a ring.");
+        }
+
+        loadIntoFrame(partition, page_id, *frame_id, strategy, pin);
+        BUZZDB_TRACE_LOG("Loading page: " << page_id);
+        return *frame_id;
+    }
+
+    // Reads the page into a frame nobody else can see yet, then publishes it
+    void loadIntoFrame(Partition &partition, PageID page_id, size_t frame_id,
+                       BufferAccessStrategy *strategy, bool pin, bool prefetched = false)
+    {
+        BufferFrame &frame = frames[frame_id];
+        if (!secondary_cache || !secondary_cache->take(page_id, frame.page->page_data.get()))
+        {
+            storageOf(page_id).load(pageNumberOf(page_id), *frame.page);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(partition.latch);
+            frame.page_id = page_id;
+            frame.dirty = false;
+            frame.pin_count = pin ? 1 : 0;
+            frame.prefetched = prefetched;
+            frame.ring_owner = isBulkRead(strategy) ? strategy : nullptr;
+            if (frame.ring_owner == nullptr)
+            {
+                partition.policy->touch(page_id);
+            }
+            partition.pageTable[page_id] = frame_id;
+            frame.version.fetch_add(1, std::memory_order_release);
+            partition.in_flight.erase(page_id);
+            partition.load_finished.notify_all();
+        }
+
+        // Only published pages enter the ring, or a recycler would take the
+        // entry for a stale one
+        if (isBulkRead(strategy))
+        {
+            std::lock_guard<std::mutex> lock(strategy->latch);
+            strategy->loading--;
+            strategy->ring.push_back(page_id);
+        }
+    }
+
+    void releaseFrame(size_t frame_id)
+    {
+        std::lock_guard<std::mutex> lock(free_latch);
+        free_frames.push_back(frame_id);
+    }
+
+    // Takes a free frame, evicting an unpinned page when there is none
+    std::optional<size_t> allocateFrame()
+    {
+        {
+            std::lock_guard<std::mutex> lock(free_latch);
+            if (!free_frames.empty())
+            {
+                size_t frame_id = free_frames.back();
+                free_frames.pop_back();
+                return frame_id;
+            }
+        }
+        size_t start = victim_hand++;
+        for (size_t i = 0; i < partitions.size(); i++)
+        {
+            Partition &partition = *partitions[(start + i) % partitions.size()];
+            std::lock_guard<std::mutex> lock(partition.latch);
+            if (auto frame_id = evictFromPolicy(partition))
+            {
+                return frame_id;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // Writes the page back if needed and detaches it from its frame. Called
+    // with the partition latch held; returns the now unused frame.
+    size_t evictPage(Partition &partition, PageID page_id)
+    {
+        size_t frame_id = partition.pageTable.at(page_id);
+        BufferFrame &frame = frames[frame_id];
+        assert(frame.pin_count == 0);
+        if (frame.dirty)
+        {
+            storageOf(page_id).flush(pageNumberOf(page_id), frame.page);
+            engineStats().buffer_dirty_writes.add();
+        }
+        if (secondary_cache)
+        {
+            secondary_cache->put(page_id, frame.page->page_data.get());
+        }
+        engineStats().buffer_evictions.add();
+        frame.version.fetch_add(1, std::memory_order_release); // Odd until the frame holds a page again
+        frame.page_id = INVALID_PAGE_ID;
+        frame.dirty = false;
+        frame.ring_owner = nullptr;
+        frame.prefetched = false;
+        frame.referenced = false;
+        partition.pageTable.erase(page_id);
+        return frame_id;
+    }
+
+    // Evicts the least recently used unpinned page of the partition
+    std::optional<size_t> evictFromPolicy(Partition &partition)
+    {
+        // Every page may need a second look: once to clear its referenced bit
+        for (size_t attempt = 0; attempt < 2 * partition.pageTable.size(); attempt++)
+        {
+            auto evictedPageId = partition.policy->evict();
+            if (evictedPageId == INVALID_PAGE_ID)
+            {
+                return std::nullopt;
+            }
+            BufferFrame &frame = frames[partition.pageTable.at(evictedPageId)];
+            if (frame.pin_count > 0 || frame.referenced.exchange(false))
+            {
+                // Give pinned pages and pages read optimistically another round
+                partition.policy->touch(evictedPageId);
+                continue;
+            }
+            BUZZDB_TRACE_LOG("Evicting page " << evictedPageId);
+            return evictPage(partition, evictedPageId);
+        }
+        return std::nullopt;
+    }
+
+    // Evicts the page if it is still an unpinned member of the ring
+    std::optional<size_t> evictRingPage(Partition &partition, PageID page_id, BufferAccessStrategy &strategy)
+    {
+        auto it = partition.pageTable.find(page_id);
+        if (it == partition.pageTable.end() || frames[it->second].ring_owner != &strategy ||
+            frames[it->second].pin_count > 0)
+        {
+            return std::nullopt;
+        }
+        return evictPage(partition, page_id);
+    }
+
+    // Evicts the oldest unpinned page of the ring to make room for the next.
+    // Entries for pages that were adopted into the shared pool are dropped.
+    // Pages read ahead that the reader has not got to yet are kept, or read-
+    // ahead would evict its own pages and the reader would load them again.
+    std::optional<size_t> recycleRingFrame(BufferAccessStrategy &strategy)
+    {
+        // The oldest page can almost always go, so candidates are taken off
+        // the ring one at a time instead of copying it
+        for (size_t position = 0;;)
+        {
+            PageID page_id;
+            {
+                std::lock_guard<std::mutex> lock(strategy.latch);
+                if (position >= strategy.ring.size())
+                {
+                    return std::nullopt;
+                }
+                page_id = *std::next(strategy.ring.begin(), position);
+            }
+            Partition &partition = partitionOf(page_id);
+            std::optional<size_t> frame_id;
+            bool stale = false;
+            {
+                std::lock_guard<std::mutex> lock(partition.latch);
+                auto it = partition.pageTable.find(page_id);
+                stale = it == partition.pageTable.end() || frames[it->second].ring_owner != &strategy;
+                if (!stale && !frames[it->second].prefetched)
+                {
+                    frame_id = evictRingPage(partition, page_id, strategy);
+                }
+            }
+            if (stale || frame_id)
+            {
+                std::lock_guard<std::mutex> lock(strategy.latch);
+                auto entry = std::find(strategy.ring.begin(), strategy.ring.end(), page_id);
+                if (entry != strategy.ring.end())
+                {
+                    strategy.ring.erase(entry);
+                }
+            }
+            else
+            {
+                position++;
+            }
+            if (frame_id)
+            {
+                engineStats().buffer_ring_recycles.add();
+                return frame_id;
+            }
+        }
+    }
+};
+
+void PageGuard::release()
+{
+    if (buffer_manager != nullptr)
+    {
+        if (exclusive)
+        {
+            buffer_manager->unlatchExclusive(frame_id);
+        }
+        buffer_manager->unfixFrame(frame_id);
+        buffer_manager = nullptr;
+        page = nullptr;
+    }
+}
+
+// Default number of pages a sequential scan reads ahead of itself, and the
+// environment variable that overrides it (0 disables read-ahead). With a
+// single hardware thread the prefetcher cannot overlap with the scan and
+// only adds hand-offs, so read-ahead is off by default there.
+constexpr size_t DEFAULT_READ_AHEAD_PAGES = 8;
+const char *READ_AHEAD_ENV = "BUZZDB_READ_AHEAD";
+
+size_t readAheadPagesFromEnvironment()
+{
+    if (const char *pages = std::getenv(READ_AHEAD_ENV))
+    {
+        return std::stoul(pages);
+    }
+    return std::thread::hardware_concurrency() > 1 ? DEFAULT_READ_AHEAD_PAGES : 0;
+}
+
+// Reads pages ahead of a sequential reader on a background thread, so the
+// read and decryption of upcoming pages overlap with tuple processing. The
+// reader either announces the range it is going to scan, or read-ahead kicks
+// in once it has touched a few consecutive pages. The window then grows from
+// one page up to `max_distance` pages, as in the Linux page cache.
+class ReadAheadPrefetcher
+{
+private:
+    static constexpr size_t SEQUENTIAL_TRIGGER = 2; // Consecutive pages before detection kicks in
+
+    BufferManager &bufferManager;
+    BufferAccessStrategy *strategy;
+    size_t max_distance;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    size_t current_page = 0;         // Page the reader is on
+    size_t next_to_load = 0;         // First page not requested yet
+    size_t end_page = 0;             // Read-ahead never goes past this page
+    bool hinted = false;             // end_page came from hintSequential()
+    size_t window = 0;               // Current read-ahead distance
+    size_t sequential_run = 0;       // Consecutive sequential accesses seen
+    std::optional<size_t> last_page; // Page of the previous access
+    std::function<bool(size_t)> page_filter; // Pages it rejects are not read
+    std::thread worker;
+
+public:
+    ReadAheadPrefetcher(BufferManager &manager, BufferAccessStrategy *strategy, size_t max_distance)
+        : bufferManager(manager), strategy(strategy), max_distance(max_distance),
+          worker([this]
+                 { run(); }) {}
+
+    ~ReadAheadPrefetcher()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        worker.join();
+    }
+
+    ReadAheadPrefetcher(const ReadAheadPrefetcher &) = delete;
+    ReadAheadPrefetcher &operator=(const ReadAheadPrefetcher &) = delete;
+
+    // Pages the filter rejects are passed over instead of read; the reader
+    // reports them to onAccess() all the same. Set before the first hint.
+    void setPageFilter(std::function<bool(size_t)> filter)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        page_filter = std::move(filter);
+    }
+
+    // Explicit hint: the reader will visit [first_page, last_page) in order.
+    // A later hint moves read-ahead on to another range.
+    void hintSequential(size_t first_page, size_t end)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        end_page = end;
+        hinted = true;
+        current_page = first_page;
+        last_page.reset();
+        next_to_load = first_page;
+        window = max_distance;
+        sequential_run = SEQUENTIAL_TRIGGER;
+    }
+
+    // Called by the reader whenever it moves to a new page
+    void onAccess(size_t page_id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (last_page && page_id == *last_page + 1)
+            {
+                sequential_run++;
+            }
+            else if (last_page && page_id != *last_page)
+            {
+                // Random access: stop reading ahead until a new run starts
+                sequential_run = 0;
+                window = 0;
+                next_to_load = page_id + 1;
+            }
+            last_page = page_id;
+            current_page = page_id;
+            if (sequential_run >= SEQUENTIAL_TRIGGER)
+            {
+                if (!hinted)
+                {
+                    end_page = bufferManager.getNumPages();
+                }
+                window = std::clamp<size_t>(window * 2, 1, max_distance);
+                next_to_load = std::max(next_to_load, page_id + 1);
+            }
+        }
+        wake.notify_one();
+    }
+
+private:
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wake.wait(lock, [this]
+                      { return stopping || hasWork(); });
+            if (stopping)
+            {
+                return;
+            }
+            size_t page_id = next_to_load;
+            lock.unlock();
+            bool skipped = page_filter && !page_filter(page_id);
+            bool loaded = skipped || bufferManager.prefetchPage(page_id, strategy);
+            lock.lock();
+            if (loaded)
+            {
+                next_to_load = std::max(next_to_load, page_id + 1);
+            }
+            else
+            {
+                // No frame can be recycled yet; wait for the reader to advance
+                size_t reader_page = current_page;
+                wake.wait(lock, [this, reader_page]
+                          { return stopping || current_page != reader_page; });
+            }
+        }
+    }
+
+    bool hasWork() const
+    {
+        return window > 0 && next_to_load < end_page && next_to_load <= current_page + window;
+    }
+};
+
+// Environment variable with the number of worker threads of the task
+// scheduler; defaults to one per hardware thread
+const char *THREADS_ENV = "BUZZDB_THREADS";
+
+size_t schedulerThreadsFromEnvironment()
+{
+    if (const char *threads = std::getenv(THREADS_ENV))
+    {
+        return std::max<size_t>(1, std::stoul(threads));
+    }
+    return std::max<unsigned>(1, std::thread::hardware_concurrency());
+}
+
+// Runs jobs of independent tasks on a fixed set of worker threads. A job's
+// tasks are dealt out in contiguous blocks, one block per worker deque, so
+// neighbouring tasks (e.g., adjacent page ranges) tend to run on the same
+// worker. A worker takes tasks from the front of its own deque and, once it
+// runs dry, steals from the back of the others'. Tasks must not block on
+// one another; a worker that waits for a job runs tasks in the meantime.
+class TaskScheduler
+{
+public:
+    using Task = std::function<void(size_t worker, size_t task)>;
+
+    // Completion of the tasks of one submit()
+    class Job
+    {
+    private:
+        friend class TaskScheduler;
+
+        TaskScheduler &scheduler;
+        Task task;
+        size_t max_workers;
+        std::atomic<size_t> remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+        std::exception_ptr error; // First exception a task threw
+        std::atomic<bool> failed{false};
+
+    public:
+        Job(TaskScheduler &scheduler, Task task, size_t num_tasks, size_t max_workers)
+            : scheduler(scheduler), task(std::move(task)), max_workers(max_workers), remaining(num_tasks) {}
+
+        bool finished() const { return remaining.load() == 0; }
+
+        // Blocks until every task has run, then rethrows the first exception
+        // a task threw. Tasks still queued after a failure are skipped.
+        void wait()
+        {
+            if (std::optional<size_t> worker = currentWorker())
+            {
+                while (!finished())
+                {
+                    if (!scheduler.runOne(*worker))
+                    {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+            else
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.wait(lock, [this]
+                          { return finished(); });
+            }
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+
+    private:
+        void run(size_t worker, size_t index)
+        {
+            if (!failed.load())
+            {
+                try
+                {
+                    task(worker, index);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                    failed = true;
+                }
+            }
+            if (remaining.fetch_sub(1) == 1)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                done.notify_all();
+            }
+        }
+    };
+
+private:
+    struct WorkItem
+    {
+        std::shared_ptr<Job> job;
+        size_t task;
+    };
+
+    struct Worker
+    {
+        std::mutex latch;
+        std::deque<WorkItem> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    uint64_t generation = 0; // Counts submits, so sleeping workers see new tasks
+    bool stopping = false;
+
+    static size_t &workerSlot()
+    {
+        thread_local size_t worker = std::numeric_limits<size_t>::max();
+        return worker;
+    }
+
+public:
+    explicit TaskScheduler(size_t num_workers)
+    {
+        for (size_t w = 0; w < num_workers; w++)
+        {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t w = 0; w < num_workers; w++)
+        {
+            threads.emplace_back([this, w]
+                                 { work(w); });
+        }
+    }
+
+    ~TaskScheduler()
+    {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+    }
+
+    TaskScheduler(const TaskScheduler &) = delete;
+    TaskScheduler &operator=(const TaskScheduler &) = delete;
+
+    size_t numWorkers() const { return workers.size(); }
+
+    // Index of the worker running the calling thread, if it is one
+    static std::optional<size_t> currentWorker()
+    {
+        size_t worker = workerSlot();
+        if (worker == std::numeric_limits<size_t>::max())
+        {
+            return std::nullopt;
+        }
+        return worker;
+    }
+
+    // Queues task(worker, i) for every i < num_tasks. Only workers below
+    // `max_workers` run them, so a job that keeps per-worker state (such as
+    // a bulk-read ring) can bound how many copies of it exist.
+    std::shared_ptr<Job> submit(size_t num_tasks, Task task, size_t max_workers = std::numeric_limits<size_t>::max())
+    {
+        max_workers = std::clamp<size_t>(max_workers, 1, workers.size());
+        auto job = std::make_shared<Job>(*this, std::move(task), num_tasks, max_workers);
+        for (size_t w = 0; w < max_workers; w++)
+        {
+            size_t first = num_tasks * w / max_workers;
+            size_t end = num_tasks * (w + 1) / max_workers;
+            if (first == end)
+            {
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(workers[w]->latch);
+            for (size_t t = first; t < end; t++)
+            {
+                workers[w]->tasks.push_back(WorkItem{job, t});
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex);
+            generation++;
+        }
+        wake.notify_all();
+        return job;
+    }
+
+    // Runs the tasks and waits for them
+    void parallelFor(size_t num_tasks, Task task, size_t max_workers = std::numeric_limits<size_t>::max())
+    {
+        submit(num_tasks, std::move(task), max_workers)->wait();
+    }
+
+private:
+    void work(size_t worker)
+    {
+        workerSlot() = worker;
+        while (true)
+        {
+            uint64_t seen;
+            {
+                std::lock_guard<std::mutex> lock(sleep_mutex);
+                seen = generation;
+            }
+            while (runOne(worker))
+            {
+            }
+            // Nothing this worker may run: sleep until the next submit, or
+            // look again at once if one came in since `seen` was read
+            std::unique_lock<std::mutex> lock(sleep_mutex);
+            wake.wait(lock, [this, seen]
+                      { return stopping || generation != seen; });
+            if (stopping)
+            {
+                return;
+            }
+        }
+    }
+
+    // Runs one task of the worker's own deque or, failing that, one stolen
+    // from another worker. Returns false when there was none it may run.
+    bool runOne(size_t worker)
+    {
+        std::optional<WorkItem> item = popFront(worker);
+        for (size_t i = 1; !item && i < workers.size(); i++)
+        {
+            item = stealBack((worker + i) % workers.size(), worker);
+        }
+        if (!item)
+        {
+            return false;
+        }
+        item->job->run(worker, item->task);
+        return true;
+    }
+
+    std::optional<WorkItem> popFront(size_t worker)
+    {
+        std::lock_guard<std::mutex> lock(workers[worker]->latch);
+        auto &tasks = workers[worker]->tasks;
+        if (tasks.empty())
+        {
+            return std::nullopt;
+        }
+        WorkItem item = std::move(tasks.front());
+        tasks.pop_front();
+        return item;
+    }
+
+    std::optional<WorkItem> stealBack(size_t victim, size_t thief)
+    {
+        std::lock_guard<std::mutex> lock(workers[victim]->latch);
+        auto &tasks = workers[victim]->tasks;
+        if (tasks.empty() || thief >= tasks.back().job->max_workers)
+        {
+            return std::nullopt;
+        }
+        WorkItem item = std::move(tasks.back());
+        tasks.pop_back();
+        return item;
+    }
+};
+
+// The engine's scheduler, started on first use
+TaskScheduler &taskScheduler()
+{
+    static TaskScheduler scheduler(schedulerThreadsFromEnvironment());
+    return scheduler;
+}
+
+// Open-addressing hash index in the style of SwissTable. Slots are arranged
+// in groups of 16 with one control byte each: EMPTY, DELETED, or the low 7
+// bits of the key's hash. A lookup compares all 16 control bytes of a group
+// at once with SSE2 and only touches the slots whose byte matches, probing
+// whole groups in triangular order. The table doubles once it is 7/8 full
+// (counting tombstones); entries move to the new table a few groups at a
+// time on later writes, so no single insert pays for the whole rehash.
+class HashIndex
+{
+private:
+    static constexpr size_t GROUP_SIZE = 16;
+    static constexpr size_t MIN_GROUPS = 1;
+    static constexpr size_t MIGRATE_GROUPS_PER_WRITE = 4;
+    static constexpr int8_t EMPTY = -128; // 0b10000000
+    static constexpr int8_t DELETED = -2; // 0b11111110
+
+    struct Slot
+    {
+        int64_t key;
+        int64_t value;
+    };
+
+    struct Table
+    {
+        size_t num_groups = 0;
+        size_t size = 0;       // Full slots
+        size_t tombstones = 0; // Deleted slots
+        std::unique_ptr<int8_t[]> control;
+        std::unique_ptr<Slot[]> slots;
+
+        explicit Table(size_t num_groups)
+            : num_groups(num_groups),
+              control(new int8_t[num_groups * GROUP_SIZE]),
+              slots(new Slot[num_groups * GROUP_SIZE])
+        {
+            std::memset(control.get(), EMPTY, num_groups * GROUP_SIZE);
+        }
+
+        size_t capacity() const { return num_groups * GROUP_SIZE; }
+        bool needsRehash() const { return (size + tombstones + 1) * 8 > capacity() * 7; }
+    };
+
+    // Bit i is set when control byte i of the group equals `value`
+    static uint32_t matchByte(const int8_t *group, int8_t value)
+    {
+#ifdef __SSE2__
+        __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(value))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; i++)
+        {
+            mask |= static_cast<uint32_t>(group[i] == value) << i;
+        }
+        return mask;
+#endif
+    }
+
+    static uint64_t hashKey(int64_t key)
+    {
+        // MurmurHash3 finalizer
+        uint64_t hash = static_cast<uint64_t>(key);
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        hash *= 0xc4ceb9fe1a85ec53ull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    static int8_t h2(uint64_t hash) { return static_cast<int8_t>(hash & 0x7F); }
+
+    // Calls `visit(group_index)` along the key's probe sequence until it
+    // returns true or every group was visited
+    template <typename Visit>
+    static void probe(const Table &table, uint64_t hash, Visit &&visit)
+    {
+        size_t mask = table.num_groups - 1;
+        size_t group = (hash >> 7) & mask;
+        for (size_t step = 1; step <= table.num_groups; step++)
+        {
+            if (visit(group))
+            {
+                return;
+            }
+            group = (group + step) & mask; // Triangular numbers visit every group
+        }
+    }
+
+    // Index of the key's slot in the table, if present
+    static std::optional<size_t> findSlot(const Table &table, int64_t key, uint64_t hash)
+    {
+        std::optional<size_t> found;
+        if (table.num_groups == 0)
+        {
+            return found;
+        }
+        probe(table, hash, [&](size_t group)
+              {
+            const int8_t *control = table.control.get() + group * GROUP_SIZE;
+            for (uint32_t match = matchByte(control, h2(hash)); match != 0; match &= match - 1)
+            {
+                size_t index = group * GROUP_SIZE + __builtin_ctz(match);
+                if (table.slots[index].key == key)
+                {
+                    found = index;
+                    return true;
+                }
+            }
+            // An empty slot ends the probe sequence: the key was never placed further
+            return matchByte(control, EMPTY) != 0; });
+        return found;
+    }
+
+    // Places a key known to be absent into the first empty or deleted slot
+    static void placeNew(Table &table, int64_t key, int64_t value, uint64_t hash)
+    {
+        probe(table, hash, [&](size_t group)
+              {
+            int8_t *control = table.control.get() + group * GROUP_SIZE;
+            uint32_t available = matchByte(control, EMPTY) | matchByte(control, DELETED);
+            if (available == 0)
+            {
+                return false;
+            }
+            size_t offset = __builtin_ctz(available);
+            if (control[offset] == DELETED)
+            {
+                table.tombstones--;
+            }
+            control[offset] = h2(hash);
+            table.slots[group * GROUP_SIZE + offset] = Slot{key, value};
+            table.size++;
+            return true; });
+    }
+
+    static void eraseSlot(Table &table, size_t index)
+    {
+        table.control[index] = DELETED;
+        table.size--;
+        table.tombstones++;
+    }
+
+    Table current{MIN_GROUPS};
+    std::unique_ptr<Table> old; // Table being migrated from, if any
+    size_t migrate_group = 0;   // Next group of `old` to migrate
+
+    void migrateSome(size_t max_groups)
+    {
+        if (!old)
+        {
+            return;
+        }
+        for (size_t n = 0; n < max_groups && migrate_group < old->num_groups; n++, migrate_group++)
+        {
+            for (size_t offset = 0; offset < GROUP_SIZE; offset++)
+            {
+                size_t index = migrate_group * GROUP_SIZE + offset;
+                if (old->control[index] >= 0)
+                {
+                    const Slot &slot = old->slots[index];
+                    placeNew(current, slot.key, slot.value, hashKey(slot.key));
+                    eraseSlot(*old, index);
+                }
+            }
+        }
+        if (migrate_group == old->num_groups)
+        {
+            old.reset();
+        }
+    }
+
+    // Starts moving entries into a fresh table: twice as large when the
+    // table is mostly full, the same size when it is mostly tombstones
+    void growIfNeeded()
+    {
+        if (!current.needsRehash())
+        {
+            return;
+        }
+        migrateSome(std::numeric_limits<size_t>::max()); // Finish any migration in progress
+        size_t num_groups = current.size * 2 >= current.capacity() ? current.num_groups * 2 : current.num_groups;
+        old = std::make_unique<Table>(std::move(current));
+        current = Table(num_groups);
+        migrate_group = 0;
+        migrateSome(MIGRATE_GROUPS_PER_WRITE);
+    }
+
+    // Slot holding the key, moving it out of the old table if it lives there
+    std::optional<size_t> findForWrite(int64_t key, uint64_t hash)
+    {
+        if (auto index = findSlot(current, key, hash))
+        {
+            return index;
+        }
+        if (old)
+        {
+            if (auto index = findSlot(*old, key, hash))
+            {
+                Slot slot = old->slots[*index];
+                eraseSlot(*old, *index);
+                growIfNeeded();
+                placeNew(current, slot.key, slot.value, hash);
+                return findSlot(current, key, hash);
+            }
+        }
+        return std::nullopt;
+    }
+
+public:
+    HashIndex() = default;
+
+    // Adds `value` to the key's value, inserting the key if it is new
+    void insertOrUpdate(int64_t key, int64_t value)
+    {
+        uint64_t hash = hashKey(key);
+        migrateSome(MIGRATE_GROUPS_PER_WRITE);
+        if (auto index = findForWrite(key, hash))
+        {
+            current.slots[*index].value += value;
+            return;
+        }
+        growIfNeeded();
+        placeNew(current, key, value, hash);
+    }
+
+    // Sets the key's value, inserting the key if it is new
+    void insert(int64_t key, int64_t value)
+    {
+        uint64_t hash = hashKey(key);
+        migrateSome(MIGRATE_GROUPS_PER_WRITE);
+        if (auto index = findForWrite(key, hash))
+        {
+            current.slots[*index].value = value;
+            return;
+        }
+        growIfNeeded();
+        placeNew(current, key, value, hash);
+    }
+
+    // Removes the key; returns false when it was not present
+    bool erase(int64_t key)
+    {
+        uint64_t hash = hashKey(key);
+        migrateSome(MIGRATE_GROUPS_PER_WRITE);
+        if (auto index = findSlot(current, key, hash))
+        {
+            eraseSlot(current, *index);
+            return true;
+        }
+        if (old)
+        {
+            if (auto index = findSlot(*old, key, hash))
+            {
+                eraseSlot(*old, *index);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::optional<int64_t> find(int64_t key) const
+    {
+        uint64_t hash = hashKey(key);
+        if (auto index = findSlot(current, key, hash))
+        {
+            return current.slots[*index].value;
+        }
+        if (old)
+        {
+            if (auto index = findSlot(*old, key, hash))
+            {
+                return old->slots[*index].value;
+            }
+        }
+        return std::nullopt;
+    }
+
+    int64_t getValue(int64_t key) const
+    {
+        return find(key).value_or(-1); // -1 when the key is not found
+    }
+
+    size_t size() const
+    {
+        return current.size + (old ? old->size : 0);
+    }
+
+    // Calls `visit(key, value)` for every entry, in no particular order
+    template <typename Visit>
+    void forEach(Visit &&visit) const
+    {
+        for (const Table *table : std::array<const Table *, 2>{&current, old.get()})
+        {
+            if (table == nullptr)
+            {
+                continue;
+            }
+            for (size_t index = 0; index < table->capacity(); index++)
+            {
+                if (table->control[index] >= 0)
+                {
+                    visit(table->slots[index].key, table->slots[index].value);
+                }
+            }
+        }
+    }
+
+    // This method is not efficient for range queries
+    // as this is an unordered index
+    // but is included for comparison
+    std::vector<int64_t> rangeQuery(int64_t lowerBound, int64_t upperBound) const
+    {
+        std::vector<int64_t> values;
+        forEach([&](int64_t key, int64_t value)
+                {
+            if (key >= lowerBound && key <= upperBound)
+            {
+                values.push_back(value);
+            } });
+        return values;
+    }
+
+    void print() const
+    {
+        forEach([](int64_t key, int64_t value)
+                { std::cout << "Key: " << key << ", Value: " << value << std::endl; });
+    }
+};
+
+// Scratch file for data that does not fit in memory (sort runs, spilled
+// partitions). Every block is encrypted before it reaches the disk, like a
+// page, so spilling never writes plaintext. A block is stored as its size,
+// the random nonce it was encrypted under, and the ciphertext. The file is
+// deleted when the object goes away.
+class EncryptedSpillFile
+{
+private:
+    static inline std::atomic<size_t> next_file_id = 0;
+
+    std::string path;
+    std::fstream file;
+    size_t bytes_written = 0;
+
+public:
+    EncryptedSpillFile()
+        : path((std::filesystem::temp_directory_path() /
+                ("buzzdb-spill-" + std::to_string(getpid()) + "-" + std::to_string(next_file_id++)))
+                   .string())
+    {
+        file.open(path, std::ios::in | std::ios::out | std::ios::trunc | std::ios::binary);
+        if (!file)
+        {
+            throw std::runtime_error("Unable to create spill file " + path);
+        }
+        engineStats().spill_files.add();
+    }
+
+    ~EncryptedSpillFile()
+    {
+        file.close();
+        std::remove(path.c_str());
+    }
+
+    EncryptedSpillFile(const EncryptedSpillFile &) = delete;
+    EncryptedSpillFile &operator=(const EncryptedSpillFile &) = delete;
+
+    void append(const std::string &block)
+    {
+        Nonce nonce = randomNonce();
+        std::string ciphertext = encrypt(block, key, nonce);
+        uint64_t size = ciphertext.size();
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(reinterpret_cast<const char *>(nonce.data()), nonce.size());
+        file.write(ciphertext.data(), ciphertext.size());
+        if (!file)
+        {
+            throw std::runtime_error("Unable to write spill file " + path);
+        }
+        size_t written = sizeof(size) + nonce.size() + ciphertext.size();
+        bytes_written += written;
+        engineStats().spill_bytes.add(written);
+    }
+
+    // Goes back to the first block; append() must not be called afterwards
+    void rewind()
+    {
+        file.flush();
+        file.clear();
+        file.seekg(0, std::ios::beg);
+    }
+
+    // Reads the next block; returns false at the end of the file
+    bool read(std::string &block)
+    {
+        uint64_t size;
+        if (!file.read(reinterpret_cast<char *>(&size), sizeof(size)))
+        {
+            return false;
+        }
+        Nonce nonce;
+        std::string ciphertext(size, '\0');
+        if (!file.read(reinterpret_cast<char *>(nonce.data()), nonce.size()) || !file.read(ciphertext.data(), size))
+        {
+            throw std::runtime_error("Truncated spill file " + path);
+        }
+        block = decrypt(ciphertext, key, nonce);
+        return true;
+    }
+
+    size_t bytes() const { return bytes_written; }
+};
+
+// Memory budget of one sort or spilling operator unless set otherwise
+constexpr size_t DEFAULT_OPERATOR_MEMORY = 64 * 1024 * 1024;
+
+// Memory an operator may use before spilling, from BUZZDB_OPERATOR_MEMORY
+// in the format of BUZZDB_BUFFER_POOL
+size_t operatorMemoryFromEnvironment()
+{
+    if (const char *memory = std::getenv("BUZZDB_OPERATOR_MEMORY"))
+    {
+        return BufferPoolConfig::parseSize(memory);
+    }
+    return DEFAULT_OPERATOR_MEMORY;
+}
+
+// Sorts more records than fit in memory. Records are collected until the
+// memory budget is used up, then sorted and written out as an encrypted
+// run; finish() merges the runs (or sorts in place when nothing spilled)
+// and next() hands out the records in order. Records must be trivially
+// copyable.
+template <typename T, typename Less = std::less<T>>
+class ExternalSorter
+{
+private:
+    static_assert(std::is_trivially_copyable_v<T>);
+    static constexpr size_t RECORDS_PER_BLOCK = 64 * 1024 / sizeof(T);
+
+    // Sequential reader over one spilled run
+    struct Run
+    {
+        std::unique_ptr<EncryptedSpillFile> file;
+        std::vector<T> block;
+        size_t position = 0;
+
+        bool advance()
+        {
+            if (++position < block.size())
+            {
+                return true;
+            }
+            std::string bytes;
+            if (!file->read(bytes))
+            {
+                return false;
+            }
+            block.resize(bytes.size() / sizeof(T));
+            std::memcpy(block.data(), bytes.data(), block.size() * sizeof(T));
+            position = 0;
+            return !block.empty();
+        }
+
+        const T &current() const { return block[position]; }
+    };
+
+    size_t max_records;
+    Less less;
+    std::vector<T> buffer;
+    std::vector<Run> runs;
+    size_t total = 0;
+    size_t position = 0; // Next record of `buffer` when nothing spilled
+
+    // Heap of run indexes ordered by their current record, smallest on top
+    std::vector<size_t> heap;
+
+public:
+    explicit ExternalSorter(size_t memory_bytes = operatorMemoryFromEnvironment(), Less less = Less())
+        : max_records(std::max<size_t>(RECORDS_PER_BLOCK, memory_bytes / sizeof(T))), less(less) {}
+
+    void add(const T &record)
+    {
+        if (buffer.size() == max_records)
+        {
+            spill();
+        }
+        buffer.push_back(record);
+        total++;
+    }
+
+    // Number of records added
+    size_t size() const { return total; }
+    size_t numRuns() const { return runs.size(); }
+
+    void finish()
+    {
+        std::sort(buffer.begin(), buffer.end(), less);
+        position = 0;
+        if (runs.empty())
+        {
+            return;
+        }
+        if (!buffer.empty())
+        {
+            spill();
+        }
+        heap.clear();
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            runs[i].file->rewind();
+            runs[i].position = runs[i].block.size(); // Forces the first block to be read
+            if (runs[i].advance())
+            {
+                heap.push_back(i);
+            }
+        }
+        std::make_heap(heap.begin(), heap.end(), heapOrder());
+    }
+
+    bool next(T &record)
+    {
+        if (runs.empty())
+        {
+            if (position == buffer.size())
+            {
+                return false;
+            }
+            record = buffer[position++];
+            return true;
+        }
+        if (heap.empty())
+        {
+            return false;
+        }
+        std::pop_heap(heap.begin(), heap.end(), heapOrder());
+        Run &run = runs[heap.back()];
+        record = run.current();
+        if (run.advance())
+        {
+            std::push_heap(heap.begin(), heap.end(), heapOrder());
+        }
+        else
+        {
+            heap.pop_back();
+        }
+        return true;
+    }
+
+private:
+    auto heapOrder()
+    {
+        return [this](size_t a, size_t b)
+        { return less(runs[b].current(), runs[a].current()); };
+    }
+
+    void spill()
+    {
+        std::sort(buffer.begin(), buffer.end(), less);
+        Run run;
+        run.file = std::make_unique<EncryptedSpillFile>();
+        for (size_t start = 0; start < buffer.size(); start += RECORDS_PER_BLOCK)
+        {
+            size_t count = std::min(RECORDS_PER_BLOCK, buffer.size() - start);
+            run.file->append(std::string(reinterpret_cast<const char *>(buffer.data() + start), count * sizeof(T)));
+        }
+        runs.push_back(std::move(run));
+        buffer.clear();
+    }
+};
+
+// Location of a tuple in the heap file
+struct RecordId
+{
+    PageID page_id = INVALID_PAGE_ID;
+    uint16_t slot = 0;
+
+    uint64_t pack() const { return (static_cast<uint64_t>(page_id) << 16) | slot; }
+    static RecordId unpack(uint64_t packed)
+    {
+        return RecordId{static_cast<PageID>(packed >> 16), static_cast<uint16_t>(packed & 0xFFFF)};
+    }
+
+    bool operator==(const RecordId &other) const = default;
+};
+
+// B+tree entries are ordered by key, then by record id, so every entry is
+// unique even when many tuples share a key.
+struct BTreeEntry
+{
+    int64_t key;
+    uint64_t rid; // Packed RecordId
+
+    bool operator<(const BTreeEntry &other) const
+    {
+        return key < other.key || (key == other.key && rid < other.rid);
+    }
+    bool operator==(const BTreeEntry &other) const = default;
+};
+
+struct BTreeNodeHeader
+{
+    uint16_t is_leaf;
+    uint16_t count;     // Entries of a leaf, separators of an inner node
+    uint32_t next_leaf; // Right sibling of a leaf (next free page of a free page); 0 for none
+};
+
+constexpr size_t BTREE_LEAF_CAPACITY = (PAGE_SIZE - sizeof(BTreeNodeHeader)) / sizeof(BTreeEntry);
+constexpr size_t BTREE_INNER_CAPACITY =
+    (PAGE_SIZE - sizeof(BTreeNodeHeader) - sizeof(Swip)) / (sizeof(BTreeEntry) + sizeof(Swip));
+
+struct BTreeLeaf
+{
+    BTreeNodeHeader header;
+    BTreeEntry entries[BTREE_LEAF_CAPACITY];
+};
+
+// children[i] holds the entries below separators[i]; children[i + 1] those
+// at or above it. Children are swips, so a descent that finds a child
+// resident follows its frame hint instead of looking it up in the page table.
+struct BTreeInner
+{
+    BTreeNodeHeader header;
+    BTreeEntry separators[BTREE_INNER_CAPACITY];
+    Swip children[BTREE_INNER_CAPACITY + 1];
+};
+
+// Page 0 of an index file
+struct BTreeMeta
+{
+    uint64_t magic;
+    uint32_t root;
+    uint32_t height;    // Levels including the leaves
+    uint32_t free_head; // First page of the free list; 0 for none
+    uint32_t segment;   // Segment the child page ids were written for
+    uint64_t size;      // Number of entries
+};
+
+static_assert(sizeof(Swip) == sizeof(uint64_t));
+static_assert(sizeof(BTreeLeaf) <= PAGE_SIZE && sizeof(BTreeInner) <= PAGE_SIZE);
+
+constexpr uint64_t BTREE_MAGIC = 0x3245455254425A42ull; // "BZBTREE2"
+
+// Share of a node a bulk load fills, leaving the rest for later inserts.
+// BUZZDB_INDEX_FILL_FACTOR overrides it (between 0.5 and 1).
+constexpr double DEFAULT_INDEX_FILL_FACTOR = 0.9;
+
+double indexFillFactorFromEnvironment()
+{
+    if (const char *fill_factor = std::getenv("BUZZDB_INDEX_FILL_FACTOR"))
+    {
+        return std::stod(fill_factor);
+    }
+    return DEFAULT_INDEX_FILL_FACTOR;
+}
+
+// B+tree on (key, record id) entries whose nodes are pages of their own
+// index file, read and written through the buffer pool like heap pages and
+// so encrypted the same way on disk. Leaves are chained left to right for
+// range scans. Readers hold the tree latch shared, read inner nodes
+// optimistically through the swips of their parents and pin only leaves;
+// writers hold it exclusively and change nodes under exclusive page guards.
+// Dirty nodes are written back on eviction and by flush().
+class BPlusTree
+{
+private:
+    static constexpr size_t LEAF_MIN = BTREE_LEAF_CAPACITY / 2;
+    static constexpr size_t INNER_MIN = BTREE_INNER_CAPACITY / 2;
+
+    BufferManager &bufferManager;
+    SegmentID segment;
+    BTreeMeta meta{};
+    Swip root_swip; // Swip of meta.root
+    std::shared_mutex latch;
+
+    using Split = std::optional<std::pair<BTreeEntry, uint32_t>>; // Separator and new right node
+
+public:
+    // Reads range results out of the tree a leaf at a time. Each refill
+    // descends from the root again, so a cursor stays valid while the tree
+    // changes between calls to next().
+    class RangeCursor
+    {
+    private:
+        BPlusTree &tree;
+        BTreeEntry lower;
+        int64_t upper;
+        bool started = false;
+        bool exhausted = false;
+        std::vector<BTreeEntry> batch;
+        size_t position = 0;
+
+    public:
+        RangeCursor(BPlusTree &tree, int64_t lower, int64_t upper)
+            : tree(tree), lower{lower, 0}, upper(upper) {}
+
+        // Moves to the next entry with lower <= key <= upper
+        bool next(BTreeEntry &entry)
+        {
+            if (position == batch.size())
+            {
+                if (exhausted)
+                {
+                    return false;
+                }
+                batch.clear();
+                position = 0;
+                exhausted = tree.readLeaves(lower, started, upper, batch);
+                if (batch.empty())
+                {
+                    exhausted = true;
+                    return false;
+                }
+                lower = batch.back();
+                started = true; // Resume strictly after the last entry returned
+            }
+            entry = batch[position++];
+            return true;
+        }
+    };
+
+    BPlusTree(BufferManager &manager, const std::string &filename)
+        : bufferManager(manager), segment(manager.openSegment(filename))
+    {
+        {
+            PageGuard page = bufferManager.fixPage(pageId(0));
+            std::memcpy(&meta, page->page_data.get(), sizeof(meta));
+        }
+        if (meta.magic != BTREE_MAGIC)
+        {
+            meta = BTreeMeta{BTREE_MAGIC, 0, 1, 0, segment, 0};
+            auto [root, guard] = allocateNode(true);
+            meta.root = root;
+            writeMeta();
+        }
+        else if (meta.segment != segment)
+        {
+            // Segment ids follow the order files are opened in, so the
+            // children may have been written for another one
+            relocate(meta.root, meta.height);
+            meta.segment = segment;
+            writeMeta();
+        }
+        root_swip = Swip(pageId(meta.root));
+    }
+
+    ~BPlusTree()
+    {
+        flush();
+    }
+
+    BPlusTree(const BPlusTree &) = delete;
+    BPlusTree &operator=(const BPlusTree &) = delete;
+
+    // Adds the entry; returns false when it is already present
+    bool insert(int64_t key, RecordId rid)
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        return insertLocked(BTreeEntry{key, rid.pack()});
+    }
+
+    // Removes the entry; returns false when it was not present
+    bool erase(int64_t key, RecordId rid)
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        return eraseLocked(BTreeEntry{key, rid.pack()});
+    }
+
+    // Builds the tree bottom-up from `count` entries that `next(entry)`
+    // hands out sorted by (key, rid), without duplicates. Nodes are filled
+    // to `fill_factor` of their capacity, with the entries spread evenly so
+    // the last node is not left underfull, and every node is written out as
+    // soon as it is complete: leaves left to right, then each inner level,
+    // so the index file is written front to back. The tree must be empty.
+    template <typename NextFn>
+    void bulkLoad(size_t count, NextFn &&next, double fill_factor = indexFillFactorFromEnvironment())
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        if (meta.size != 0)
+        {
+            throw std::runtime_error("Bulk load needs an empty index.");
+        }
+        if (count == 0)
+        {
+            return;
+        }
+        fill_factor = std::clamp(fill_factor, 0.5, 1.0);
+
+        // First entry and page of every node of the level just built
+        std::vector<std::pair<BTreeEntry, uint32_t>> level;
+
+        size_t per_leaf = static_cast<size_t>(BTREE_LEAF_CAPACITY * fill_factor);
+        size_t num_leaves = (count + per_leaf - 1) / per_leaf;
+        uint32_t page_number = meta.root; // The empty root leaf becomes the first leaf
+        PageGuard guard = bufferManager.fixPageExclusive(pageId(page_number));
+        for (size_t i = 0; i < num_leaves; i++)
+        {
+            BTreeLeaf &node = leaf(guard);
+            node.header.count = count * (i + 1) / num_leaves - count * i / num_leaves;
+            for (size_t j = 0; j < node.header.count; j++)
+            {
+                if (!next(node.entries[j]))
+                {
+                    throw std::runtime_error("Bulk load input ended early.");
+                }
+                assert(j == 0 || node.entries[j - 1] < node.entries[j]);
+            }
+            level.emplace_back(node.entries[0], page_number);
+
+            uint32_t next_page = 0;
+            PageGuard next_guard;
+            if (i + 1 < num_leaves)
+            {
+                std::tie(next_page, next_guard) = allocateNode(true);
+            }
+            node.header.next_leaf = next_page;
+            bufferManager.flushPage(pageId(page_number));
+            page_number = next_page;
+            guard = std::move(next_guard);
+        }
+
+        uint32_t height = 1;
+        size_t children_per_node = static_cast<size_t>((BTREE_INNER_CAPACITY + 1) * fill_factor);
+        while (level.size() > 1)
+        {
+            size_t num_nodes = (level.size() + children_per_node - 1) / children_per_node;
+            std::vector<std::pair<BTreeEntry, uint32_t>> parents;
+            for (size_t i = 0; i < num_nodes; i++)
+            {
+                size_t begin = level.size() * i / num_nodes;
+                size_t end = level.size() * (i + 1) / num_nodes;
+                auto [parent_page, parent_guard] = allocateNode(false);
+                BTreeInner &node = inner(parent_guard);
+                node.header.count = end - begin - 1;
+                for (size_t j = begin; j < end; j++)
+                {
+                    node.children[j - begin] = Swip(pageId(level[j].second));
+                    if (j > begin)
+                    {
+                        node.separators[j - begin - 1] = level[j].first;
+                    }
+                }
+                parents.emplace_back(level[begin].first, parent_page);
+                bufferManager.flushPage(pageId(parent_page));
+            }
+            level = std::move(parents);
+            height++;
+        }
+
+        setRoot(level[0].second);
+        meta.height = height;
+        meta.size = count;
+        writeMeta();
+        bufferManager.flushPage(pageId(0));
+    }
+
+    std::vector<RecordId> lookup(int64_t key)
+    {
+        std::vector<RecordId> rids;
+        RangeCursor cursor(*this, key, key);
+        BTreeEntry entry;
+        while (cursor.next(entry))
+        {
+            rids.push_back(RecordId::unpack(entry.rid));
+        }
+        return rids;
+    }
+
+    RangeCursor range(int64_t lower, int64_t upper)
+    {
+        return RangeCursor(*this, lower, upper);
+    }
+
+    size_t size()
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        return meta.size;
+    }
+
+    size_t height()
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        return meta.height;
+    }
+
+    // Pages of the index file, including the meta page and free pages
+    size_t numPages()
+    {
+        return bufferManager.getNumPages(segment);
+    }
+
+    // Writes every dirty node back to the index file
+    void flush()
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        bufferManager.flushSegment(segment);
+    }
+
+private:
+    PageID pageId(uint32_t page_number) const { return makePageId(segment, page_number); }
+
+    bool insertLocked(const BTreeEntry &entry)
+    {
+        bool inserted = false;
+        if (Split split = insertInto(root_swip, meta.height, entry, inserted))
+        {
+            auto [new_root, guard] = allocateNode(false);
+            BTreeInner &node = inner(guard);
+            node.header.count = 1;
+            node.separators[0] = split->first;
+            node.children[0] = root_swip;
+            node.children[1] = Swip(pageId(split->second));
+            setRoot(new_root);
+            meta.height++;
+        }
+        if (inserted)
+        {
+            meta.size++;
+            writeMeta();
+        }
+        return inserted;
+    }
+
+    bool eraseLocked(const BTreeEntry &entry)
+    {
+        bool erased = false;
+        eraseFrom(root_swip, meta.height, entry, erased);
+        if (!erased)
+        {
+            return false;
+        }
+        meta.size--;
+        if (meta.height > 1)
+        {
+            // An inner root left with a single child hands the root over to it
+            PageGuard guard = bufferManager.fixPageExclusive(pageId(meta.root));
+            if (inner(guard).header.count == 0)
+            {
+                uint32_t old_root = meta.root;
+                setRoot(pageNumberOf(inner(guard).children[0].pageId()));
+                meta.height--;
+                freeNode(old_root, guard);
+            }
+        }
+        writeMeta();
+        return true;
+    }
+
+    static BTreeLeaf &leaf(const PageGuard &guard) { return *reinterpret_cast<BTreeLeaf *>(guard->page_data.get()); }
+    static BTreeInner &inner(const PageGuard &guard) { return *reinterpret_cast<BTreeInner *>(guard->page_data.get()); }
+
+    // Index of the child whose subtree holds `entry`. The count is clamped
+    // because optimistic reads may see a frame that is being reused.
+    static size_t childIndex(const BTreeInner &node, const BTreeEntry &entry)
+    {
+        size_t count = std::min<size_t>(node.header.count, BTREE_INNER_CAPACITY);
+        return std::upper_bound(node.separators, node.separators + count, entry) - node.separators;
+    }
+
+    void setRoot(uint32_t page_number)
+    {
+        meta.root = page_number;
+        root_swip = Swip(pageId(page_number));
+    }
+
+    // Index and swip of the child of the inner node behind `swip` whose
+    // subtree holds `entry`. The node is neither latched nor pinned when
+    // the swip finds it resident.
+    std::pair<size_t, Swip> readChild(Swip &swip, const BTreeEntry &entry)
+    {
+        auto [index, child] = bufferManager.readOptimistic(swip, [&entry](const SlottedPage &page)
+        {
+            const BTreeInner &node = *reinterpret_cast<const BTreeInner *>(page.page_data.get());
+            size_t index = childIndex(node, entry);
+            return std::make_pair(index, node.children[index].raw());
+        });
+        return {index, Swip::fromRaw(child)};
+    }
+
+    // Stores the frame a descent found `child` in into slot `index` of the
+    // inner node behind `swip`, when the slot's hint (`hint` before the
+    // descent) was missing or stale. Only a hint changes, so the node is
+    // pinned but not latched exclusively or marked dirty.
+    void keepSwizzled(const Swip &swip, size_t index, const Swip &child, uint64_t hint)
+    {
+        if (child.raw() == hint)
+        {
+            return;
+        }
+        PageGuard guard = bufferManager.fixPage(swip.pageId());
+        Swip &slot = inner(guard).children[index];
+        if (slot.pageId() == child.pageId())
+        {
+            slot.swizzle(child.frame());
+        }
+    }
+
+    // Rewrites the children below the node for the segment the tree is open in
+    void relocate(uint32_t page_number, uint32_t level)
+    {
+        if (level == 1)
+        {
+            return;
+        }
+        std::vector<uint32_t> children;
+        {
+            PageGuard guard = bufferManager.fixPageExclusive(pageId(page_number));
+            BTreeInner &node = inner(guard);
+            for (size_t i = 0; i <= node.header.count; i++)
+            {
+                children.push_back(pageNumberOf(node.children[i].pageId()));
+                node.children[i] = Swip(pageId(children.back()));
+            }
+            bufferManager.markDirty(pageId(page_number));
+        }
+        for (uint32_t child : children)
+        {
+            relocate(child, level - 1);
+        }
+    }
+
+    void writeMeta()
+    {
+        PageGuard page = bufferManager.fixPageExclusive(pageId(0));
+        std::memcpy(page->page_data.get(), &meta, sizeof(meta));
+        bufferManager.markDirty(pageId(0));
+    }
+
+    // Returns an empty node, exclusively latched, reusing a freed page if any
+    std::pair<uint32_t, PageGuard> allocateNode(bool is_leaf)
+    {
+        uint32_t page_number;
+        PageGuard guard;
+        if (meta.free_head != 0)
+        {
+            page_number = meta.free_head;
+            guard = bufferManager.fixPageExclusive(pageId(page_number));
+            meta.free_head = leaf(guard).header.next_leaf;
+        }
+        else
+        {
+            page_number = pageNumberOf(bufferManager.extend(segment));
+            guard = bufferManager.fixPageExclusive(pageId(page_number));
+        }
+        std::memset(guard->page_data.get(), 0, PAGE_SIZE);
+        leaf(guard).header.is_leaf = is_leaf;
+        bufferManager.markDirty(pageId(page_number));
+        return {page_number, std::move(guard)};
+    }
+
+    // Puts the node, exclusively latched by `guard`, on the free list
+    void freeNode(uint32_t page_number, PageGuard &guard)
+    {
+        std::memset(guard->page_data.get(), 0, PAGE_SIZE);
+        leaf(guard).header.next_leaf = meta.free_head;
+        meta.free_head = page_number;
+        bufferManager.markDirty(pageId(page_number));
+        guard.release();
+    }
+
+    // Copies the entries of the leaf holding `from` (those above it when
+    // `after` is set, else those at or above it), following sibling links
+    // past leaves with nothing to return. Returns true once no entry with a
+    // key up to `upper` is left after the batch.
+    bool readLeaves(const BTreeEntry &from, bool after, int64_t upper, std::vector<BTreeEntry> &batch)
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        PageGuard guard = findLeaf(root_swip, meta.height, from);
+        while (true)
+        {
+            const BTreeLeaf &node = leaf(guard);
+            const BTreeEntry *end = node.entries + node.header.count;
+            const BTreeEntry *it = after ? std::upper_bound(node.entries, end, from)
+                                         : std::lower_bound(node.entries, end, from);
+            for (; it != end; ++it)
+            {
+                if (it->key > upper)
+                {
+                    return true;
+                }
+                batch.push_back(*it);
+            }
+            uint32_t next_leaf = node.header.next_leaf;
+            if (next_leaf == 0)
+            {
+                return true;
+            }
+            if (!batch.empty())
+            {
+                return false;
+            }
+            guard = bufferManager.fixPage(pageId(next_leaf));
+        }
+    }
+
+    // Returns the leaf below the node behind `swip` whose range holds
+    // `entry`, pinned
+    PageGuard findLeaf(Swip &swip, uint32_t level, const BTreeEntry &entry)
+    {
+        if (level == 1)
+        {
+            PageGuard guard = bufferManager.fixPage(swip.pageId());
+            swip.swizzle(guard.frameId());
+            return guard;
+        }
+        auto [index, child] = readChild(swip, entry);
+        uint64_t hint = child.raw();
+        PageGuard guard = findLeaf(child, level - 1, entry);
+        keepSwizzled(swip, index, child, hint);
+        return guard;
+    }
+
+    Split insertInto(Swip &swip, uint32_t level, const BTreeEntry &entry, bool &inserted)
+    {
+        if (level == 1)
+        {
+            return insertIntoLeaf(swip, entry, inserted);
+        }
+
+        auto [index, child] = readChild(swip, entry);
+        uint64_t hint = child.raw();
+        Split child_split = insertInto(child, level - 1, entry, inserted);
+        keepSwizzled(swip, index, child, hint);
+        if (!child_split)
+        {
+            return std::nullopt;
+        }
+
+        PageGuard guard = bufferManager.fixPageExclusive(swip.pageId());
+        BTreeInner &node = inner(guard);
+        bufferManager.markDirty(swip.pageId());
+        size_t count = node.header.count;
+        if (count < BTREE_INNER_CAPACITY)
+        {
+            std::copy_backward(node.separators + index, node.separators + count, node.separators + count + 1);
+            std::copy_backward(node.children + index + 1, node.children + count + 1, node.children + count + 2);
+            node.separators[index] = child_split->first;
+            node.children[index + 1] = Swip(pageId(child_split->second));
+            node.header.count++;
+            return std::nullopt;
+        }
+
+        // Full: lay out all separators and children in order, keep the lower
+        // half, push the middle separator up and move the rest to a new node
+        std::vector<BTreeEntry> separators(node.separators, node.separators + count);
+        std::vector<Swip> children(node.children, node.children + count + 1);
+        separators.insert(separators.begin() + index, child_split->first);
+        children.insert(children.begin() + index + 1, Swip(pageId(child_split->second)));
+
+        size_t left_count = separators.size() / 2;
+        auto [right_page, right_guard] = allocateNode(false);
+        BTreeInner &right = inner(right_guard);
+        node.header.count = left_count;
+        std::copy(separators.begin(), separators.begin() + left_count, node.separators);
+        std::copy(children.begin(), children.begin() + left_count + 1, node.children);
+        right.header.count = separators.size() - left_count - 1;
+        std::copy(separators.begin() + left_count + 1, separators.end(), right.separators);
+        std::copy(children.begin() + left_count + 1, children.end(), right.children);
+        return std::make_pair(separators[left_count], right_page);
+    }
+
+    Split insertIntoLeaf(Swip &swip, const BTreeEntry &entry, bool &inserted)
+    {
+        PageGuard guard = bufferManager.fixPageExclusive(swip.pageId());
+        swip.swizzle(guard.frameId());
+        BTreeLeaf &node = leaf(guard);
+        size_t count = node.header.count;
+        BTreeEntry *position = std::lower_bound(node.entries, node.entries + count, entry);
+        if (position != node.entries + count && *position == entry)
+        {
+            return std::nullopt;
+        }
+        inserted = true;
+        bufferManager.markDirty(swip.pageId());
+        if (count < BTREE_LEAF_CAPACITY)
+        {
+            std::copy_backward(position, node.entries + count, node.entries + count + 1);
+            *position = entry;
+            node.header.count++;
+            return std::nullopt;
+        }
+
+        std::vector<BTreeEntry> entries(node.entries, node.entries + count);
+        entries.insert(entries.begin() + (position - node.entries), entry);
+        size_t left_count = entries.size() / 2;
+        auto [right_page, right_guard] = allocateNode(true);
+        BTreeLeaf &right = leaf(right_guard);
+        node.header.count = left_count;
+        std::copy(entries.begin(), entries.begin() + left_count, node.entries);
+        right.header.count = entries.size() - left_count;
+        std::copy(entries.begin() + left_count, entries.end(), right.entries);
+        right.header.next_leaf = node.header.next_leaf;
+        node.header.next_leaf = right_page;
+        return std::make_pair(right.entries[0], right_page);
+    }
+
+    // Returns true when the node was left with fewer entries than allowed
+    bool eraseFrom(Swip &swip, uint32_t level, const BTreeEntry &entry, bool &erased)
+    {
+        if (level == 1)
+        {
+            PageGuard guard = bufferManager.fixPageExclusive(swip.pageId());
+            swip.swizzle(guard.frameId());
+            BTreeLeaf &node = leaf(guard);
+            BTreeEntry *end = node.entries + node.header.count;
+            BTreeEntry *position = std::lower_bound(node.entries, end, entry);
+            if (position == end || !(*position == entry))
+            {
+                return false;
+            }
+            erased = true;
+            std::copy(position + 1, end, position);
+            node.header.count--;
+            bufferManager.markDirty(swip.pageId());
+            return node.header.count < LEAF_MIN;
+        }
+
+        auto [index, child] = readChild(swip, entry);
+        uint64_t hint = child.raw();
+        bool underfull = eraseFrom(child, level - 1, entry, erased);
+        keepSwizzled(swip, index, child, hint);
+        if (!underfull)
+        {
+            return false;
+        }
+        return rebalance(pageNumberOf(swip.pageId()), index, level - 1);
+    }
+
+    // Refills the underfull child `index` of the node from a sibling, or
+    // merges the two when they fit into one node. Returns true when the
+    // node itself became underfull.
+    bool rebalance(uint32_t page_number, size_t index, uint32_t child_level)
+    {
+        PageGuard guard = bufferManager.fixPageExclusive(pageId(page_number));
+        BTreeInner &node = inner(guard);
+        size_t left_index = index > 0 ? index - 1 : index;
+        PageID left_page = node.children[left_index].pageId();
+        PageID right_page = node.children[left_index + 1].pageId();
+        PageGuard left_guard = bufferManager.fixPageExclusive(left_page);
+        PageGuard right_guard = bufferManager.fixPageExclusive(right_page);
+        bufferManager.markDirty(pageId(page_number));
+        bufferManager.markDirty(left_page);
+        bufferManager.markDirty(right_page);
+
+        bool merged;
+        if (child_level == 1)
+        {
+            BTreeLeaf &left = leaf(left_guard);
+            BTreeLeaf &right = leaf(right_guard);
+            std::vector<BTreeEntry> entries(left.entries, left.entries + left.header.count);
+            entries.insert(entries.end(), right.entries, right.entries + right.header.count);
+            merged = entries.size() <= BTREE_LEAF_CAPACITY;
+            size_t left_count = merged ? entries.size() : entries.size() / 2;
+            left.header.count = left_count;
+            std::copy(entries.begin(), entries.begin() + left_count, left.entries);
+            if (merged)
+            {
+                left.header.next_leaf = right.header.next_leaf;
+            }
+            else
+            {
+                right.header.count = entries.size() - left_count;
+                std::copy(entries.begin() + left_count, entries.end(), right.entries);
+                node.separators[left_index] = right.entries[0];
+            }
+        }
+        else
+        {
+            // Same as for leaves, but the separator between the two nodes
+            // moves down into the combined node, and back up when splitting
+            BTreeInner &left = inner(left_guard);
+            BTreeInner &right = inner(right_guard);
+            std::vector<BTreeEntry> separators(left.separators, left.separators + left.header.count);
+            separators.push_back(node.separators[left_index]);
+            separators.insert(separators.end(), right.separators, right.separators + right.header.count);
+            std::vector<Swip> children(left.children, left.children + left.header.count + 1);
+            children.insert(children.end(), right.children, right.children + right.header.count + 1);
+            merged = separators.size() <= BTREE_INNER_CAPACITY;
+            size_t left_count = merged ? separators.size() : separators.size() / 2;
+            left.header.count = left_count;
+            std::copy(separators.begin(), separators.begin() + left_count, left.separators);
+            std::copy(children.begin(), children.begin() + left_count + 1, left.children);
+            if (!merged)
+            {
+                right.header.count = separators.size() - left_count - 1;
+                std::copy(separators.begin() + left_count + 1, separators.end(), right.separators);
+                std::copy(children.begin() + left_count + 1, children.end(), right.children);
+                node.separators[left_index] = separators[left_count];
+            }
+        }
+
+        if (!merged)
+        {
+            return false;
+        }
+        size_t count = node.header.count;
+        std::copy(node.separators + left_index + 1, node.separators + count, node.separators + left_index);
+        std::copy(node.children + left_index + 2, node.children + count + 1, node.children + left_index + 1);
+        node.header.count--;
+        freeNode(pageNumberOf(right_page), right_guard);
+        return node.header.count < INNER_MIN;
+    }
+};
+
+// Inclusive range of values a predicate allows for one integer column
+struct ColumnRange
+{
+    size_t column;
+    int64_t lower = std::numeric_limits<int64_t>::min();
+    int64_t upper = std::numeric_limits<int64_t>::max();
+};
+
+// Per-page summaries of integer columns, like PostgreSQL's BRIN indexes:
+// the smallest and largest value on each heap page and, optionally, a
+// 256-bit Bloom filter of its values. A scan consults them before fixing
+// a page, so pages that cannot hold a match are neither read nor
+// decrypted. Summaries only ever cover the page's values: inserts widen
+// them and deletes recompute them from the page. Pages the maps have not
+// seen yet are never skipped.
+class ZoneMaps
+{
+private:
+    static constexpr size_t BLOOM_WORDS = 4;
+
+    struct PageZone
+    {
+        bool known = false; // Unknown pages are never skipped
+        int64_t min = std::numeric_limits<int64_t>::max();
+        int64_t max = std::numeric_limits<int64_t>::min();
+        std::array<uint64_t, BLOOM_WORDS> bloom{};
+    };
+
+    struct ColumnZones
+    {
+        size_t column;
+        bool use_bloom;
+        std::vector<PageZone> pages;
+    };
+
+    mutable std::shared_mutex latch;
+    std::vector<ColumnZones> columns;
+
+public:
+    // Starts summarizing the column over a table of `num_pages` pages, all
+    // taken as empty until their tuples are passed to include()
+    void addColumn(size_t column, bool use_bloom, size_t num_pages)
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        if (findColumn(column) == nullptr)
+        {
+            PageZone empty_page;
+            empty_page.known = true;
+            columns.push_back(ColumnZones{column, use_bloom, std::vector<PageZone>(num_pages, empty_page)});
+        }
+    }
+
+    // Drops the column's summaries, e.g. when filling them failed partway:
+    // pages that were never filled would look empty and be skipped
+    void removeColumn(size_t column)
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        std::erase_if(columns, [column](const ColumnZones &zones)
+                      { return zones.column == column; });
+    }
+
+    bool covers(size_t column) const
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        return findColumn(column) != nullptr;
+    }
+
+    bool empty() const
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        return columns.empty();
+    }
+
+    // Widens the page's summaries by a tuple stored on it
+    void include(PageID page_id, const std::vector<std::unique_ptr<Field>> &fields)
+    {
+        std::unique_lock<std::shared_mutex> lock(latch);
+        for (ColumnZones &zones : columns)
+        {
+            PageZone &zone = zoneOf(zones, page_id);
+            zone.known = true;
+            widen(zone, zones, fields);
+        }
+    }
+
+    // Called once a tuple is removed from the page. Summaries stay valid
+    // as they are, but are recomputed when the tuple held a column's
+    // smallest or largest value, so they keep narrowing as data goes.
+    void onDelete(PageID page_id, const std::vector<std::unique_ptr<Field>> &fields, const SlottedPage &page)
+    {
+        bool on_bound = false;
+        {
+            std::shared_lock<std::shared_mutex> lock(latch);
+            for (const ColumnZones &zones : columns)
+            {
+                if (page_id < zones.pages.size() && zones.column < fields.size() && fields[zones.column]->getType() == INT)
+                {
+                    int64_t value = fields[zones.column]->asInt();
+                    on_bound |= value == zones.pages[page_id].min || value == zones.pages[page_id].max;
+                }
+            }
+        }
+        if (on_bound)
+        {
+            summarize(page_id, page);
+        }
+    }
+
+    // Recomputes the page's summaries from the tuples on it
+    void summarize(PageID page_id, const SlottedPage &page)
+    {
+        std::vector<std::unique_ptr<Tuple>> tuples;
+        const Slot *slot_array = reinterpret_cast<const Slot *>(page.page_data.get());
+        for (size_t slot = 0; slot < MAX_SLOTS; slot++)
+        {
+            if (!slot_array[slot].empty)
+            {
+                std::istringstream iss(std::string(page.page_data.get() + slot_array[slot].offset, slot_array[slot].length));
+                tuples.push_back(Tuple::deserialize(iss));
+            }
+        }
+
+        std::unique_lock<std::shared_mutex> lock(latch);
+        for (ColumnZones &zones : columns)
+        {
+            PageZone &zone = zoneOf(zones, page_id);
+            zone = PageZone();
+            zone.known = true;
+            for (const auto &tuple : tuples)
+            {
+                widen(zone, zones, tuple->fields);
+            }
+        }
+    }
+
+    // Tells whether a tuple on the page may satisfy all ranges
+    bool mayMatch(PageID page_id, const std::vector<ColumnRange> &ranges) const
+    {
+        std::shared_lock<std::shared_mutex> lock(latch);
+        for (const ColumnRange &range : ranges)
+        {
+            const ColumnZones *zones = findColumn(range.column);
+            if (zones == nullptr || page_id >= zones->pages.size())
+            {
+                continue;
+            }
+            const PageZone &zone = zones->pages[page_id];
+            if (!zone.known)
+            {
+                continue;
+            }
+            if (range.upper < zone.min || range.lower > zone.max)
+            {
+                return false;
+            }
+            if (zones->use_bloom && range.lower == range.upper && !bloomContains(zone, range.lower))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    const ColumnZones *findColumn(size_t column) const
+    {
+        for (const ColumnZones &zones : columns)
+        {
+            if (zones.column == column)
+            {
+                return &zones;
+            }
+        }
+        return nullptr;
+    }
+
+    static PageZone &zoneOf(ColumnZones &zones, PageID page_id)
+    {
+        if (zones.pages.size() <= page_id)
+        {
+            zones.pages.resize(page_id + 1);
+        }
+        return zones.pages[page_id];
+    }
+
+    static void widen(PageZone &zone, const ColumnZones &zones, const std::vector<std::unique_ptr<Field>> &fields)
+    {
+        if (zones.column >= fields.size() || fields[zones.column]->getType() != INT)
+        {
+            // Not an integer: the page can never be ruled out
+            zone.min = std::numeric_limits<int64_t>::min();
+            zone.max = std::numeric_limits<int64_t>::max();
+            zone.bloom.fill(~0ull);
+            return;
+        }
+        int64_t value = fields[zones.column]->asInt();
+        zone.min = std::min(zone.min, value);
+        zone.max = std::max(zone.max, value);
+        if (zones.use_bloom)
+        {
+            auto [first, second] = bloomBits(value);
+            zone.bloom[first / 64] |= 1ull << (first % 64);
+            zone.bloom[second / 64] |= 1ull << (second % 64);
+        }
+    }
+
+    // Two bit positions of the value, from halves of one 64-bit hash
+    static std::pair<size_t, size_t> bloomBits(int64_t value)
+    {
+        uint64_t hash = static_cast<uint64_t>(value) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+        return {hash % (BLOOM_WORDS * 64), (hash >> 32) % (BLOOM_WORDS * 64)};
+    }
+
+    static bool bloomContains(const PageZone &zone, int64_t value)
+    {
+        auto [first, second] = bloomBits(value);
+        return (zone.bloom[first / 64] >> (first % 64) & 1) && (zone.bloom[second / 64] >> (second % 64) & 1);
+    }
+};
+
+// Whether zone maps also keep a Bloom filter per page, which rules out
+// pages for equality predicates on values within their min/max range
+bool zoneMapBloomFromEnvironment()
+{
+    const char *bloom = std::getenv("BUZZDB_ZONE_MAP_BLOOM");
+    return bloom != nullptr && std::string(bloom) != "0";
+}
+
+// Rows an operator hands over per nextBatch() call
+constexpr size_t BATCH_CAPACITY = 1024;
+
+// The values of one attribute for the rows of a batch, kept in the vector
+// of the attribute's type
+struct ColumnVector
+{
+    FieldType type = INT;
+    bool materialized = true; // False for a column a scan left out; it then holds no values
+    std::vector<int> ints;
+    std::vector<float> floats;
+    std::vector<std::string> strings;
+
+    size_t size() const
+    {
+        return type == INT ? ints.size() : type == FLOAT ? floats.size() : strings.size();
+    }
+
+    void clear()
+    {
+        ints.clear();
+        floats.clear();
+        strings.clear();
+    }
+
+    void truncate(size_t rows)
+    {
+        ints.resize(std::min(ints.size(), rows));
+        floats.resize(std::min(floats.size(), rows));
+        strings.resize(std::min(strings.size(), rows));
+    }
+
+    // Appends value `row` of a column of the same type
+    void appendFrom(const ColumnVector &source, size_t row)
+    {
+        switch (type)
+        {
+        case INT:
+            ints.push_back(source.ints[row]);
+            break;
+        case FLOAT:
+            floats.push_back(source.floats[row]);
+            break;
+        case STRING:
+            strings.push_back(source.strings[row]);
+            break;
+        }
+    }
+
+    void append(const Field &field)
+    {
+        switch (field.getType())
+        {
+        case INT:
+            ints.push_back(field.asInt());
+            break;
+        case FLOAT:
+            floats.push_back(field.asFloat());
+            break;
+        case STRING:
+            strings.push_back(field.asString());
+            break;
+        }
+    }
+
+    Field fieldAt(size_t row) const
+    {
+        switch (type)
+        {
+        case INT:
+            return Field(ints[row]);
+        case FLOAT:
+            return Field(floats[row]);
+        default:
+            return Field(strings[row]);
+        }
+    }
+};
+
+// Up to BATCH_CAPACITY rows, stored column by column. The selection vector
+// lists, in ascending order, the rows that belong to the output; filters
+// narrow it instead of moving values around. Column types are taken from
+// the first row and must not change within the batch.
+struct Batch
+{
+    size_t num_rows = 0;
+    std::vector<ColumnVector> columns;
+    std::vector<uint16_t> selection;
+    std::vector<RecordId> record_ids; // Heap location of each row, when a scan left columns out
+
+    // Drops the rows, keeping the column storage for the next batch
+    void clear()
+    {
+        num_rows = 0;
+        for (ColumnVector &column : columns)
+        {
+            column.clear();
+            column.materialized = true;
+        }
+        selection.clear();
+        record_ids.clear();
+    }
+
+    bool full() const { return num_rows == BATCH_CAPACITY; }
+
+    void appendRow(const std::vector<std::unique_ptr<Field>> &fields)
+    {
+        startRow(fields.size());
+        for (size_t i = 0; i < fields.size(); i++)
+        {
+            ColumnVector &column = columns[i];
+            if (num_rows == 0)
+            {
+                column.type = fields[i]->getType();
+            }
+            else if (column.type != fields[i]->getType())
+            {
+                truncate();
+                throw std::runtime_error("Column " + std::to_string(i + 1) + " changes type within a batch.");
+            }
+            column.append(*fields[i]);
+        }
+        selection.push_back(static_cast<uint16_t>(num_rows++));
+    }
+
+    // Appends a tuple in the format Tuple::serialize() writes, parsing the
+    // values straight into the columns instead of building Fields. With
+    // `decoded`, only the columns it marks are parsed; the others are
+    // skipped over and left unmaterialized.
+    void appendSerialized(const char *data, size_t length, const std::vector<bool> *decoded = nullptr)
+    {
+        const char *position = data;
+        const char *end = data + length;
+        auto token = [&position, end]() -> std::string_view
+        {
+            while (position < end && *position == ' ')
+            {
+                position++;
+            }
+            const char *start = position;
+            while (position < end && *position != ' ')
+            {
+                position++;
+            }
+            return std::string_view(start, position - start);
+        };
+        auto number = [](std::string_view text, auto &value)
+        {
+            return std::from_chars(text.data(), text.data() + text.size(), value).ec == std::errc();
+        };
+
+        size_t field_count = 0;
+        if (!number(token(), field_count))
+        {
+            throw std::runtime_error("Malformed tuple.");
+        }
+        startRow(field_count);
+        for (size_t i = 0; i < field_count; i++)
+        {
+            int type = 0;
+            size_t data_length = 0;
+            std::string_view value;
+            bool parsed = number(token(), type) && number(token(), data_length) && !(value = token()).empty();
+            ColumnVector &column = columns[i];
+            if (parsed && num_rows == 0)
+            {
+                column.type = static_cast<FieldType>(type);
+                column.materialized = decoded == nullptr || (i < decoded->size() && (*decoded)[i]);
+            }
+            if (!parsed || column.type != type)
+            {
+                truncate();
+                throw std::runtime_error(parsed ? "Column " + std::to_string(i + 1) + " changes type within a batch."
+                                                : "Malformed tuple.");
+            }
+            if (!column.materialized)
+            {
+                continue;
+            }
+            if (type == INT)
+            {
+                parsed = number(value, column.ints.emplace_back());
+            }
+            else if (type == FLOAT)
+            {
+                parsed = number(value, column.floats.emplace_back());
+            }
+            else
+            {
+                column.strings.emplace_back(value);
+            }
+            if (!parsed)
+            {
+                truncate();
+                throw std::runtime_error("Malformed tuple.");
+            }
+        }
+        selection.push_back(static_cast<uint16_t>(num_rows++));
+    }
+
+    // The row's Fields; an unmaterialized column gives the empty value of
+    // its type, which is fine for predicates that do not read it
+    std::vector<std::unique_ptr<Field>> row(size_t row) const
+    {
+        std::vector<std::unique_ptr<Field>> fields;
+        for (const ColumnVector &column : columns)
+        {
+            if (!column.materialized)
+            {
+                fields.push_back(std::make_unique<Field>(column.type == INT     ? Field(0)
+                                                         : column.type == FLOAT ? Field(0.0f)
+                                                                                : Field(std::string())));
+                continue;
+            }
+            fields.push_back(std::make_unique<Field>(column.fieldAt(row)));
+        }
+        return fields;
+    }
+
+private:
+    void startRow(size_t field_count)
+    {
+        if (num_rows == 0)
+        {
+            columns.resize(field_count);
+        }
+        else if (columns.size() != field_count)
+        {
+            throw std::runtime_error("Rows of one batch differ in their number of fields.");
+        }
+    }
+
+    // Takes back the values a row that failed half-way appended
+    void truncate()
+    {
+        for (ColumnVector &column : columns)
+        {
+            column.truncate(num_rows);
+        }
+    }
+};
+
+class Operator
+{
+public:
+    virtual ~Operator() = default;
+
+    /// Initializes the operator.
+    virtual void open() = 0;
+
+    /// Tries to generate the next tuple. Return true when a new tuple is
+    /// available.
+    virtual bool next() = 0;
+
+    /// Destroys the operator.
+    virtual void close() = 0;
+
+    /// This returns the pointers to the Fields of the generated tuple. When
+    /// `next()` returns true, the Fields will contain the values for the
+    /// next tuple. Each `Field` pointer in the vector stands for one attribute of the tuple.
+    virtual std::vector<std::unique_ptr<Field>> getOutput() = 0;
+
+    /// Replaces the contents of `batch` with the next rows of the operator.
+    /// Returns false once there are none left. A consumer reads an opened
+    /// operator either through `next()` or through `nextBatch()`, not both.
+    /// This default adapts tuple-at-a-time operators by collecting the
+    /// tuples `next()` produces; operators override it to skip the Fields.
+    virtual bool nextBatch(Batch &batch)
+    {
+        batch.clear();
+        while (!batch.full() && next())
+        {
+            auto fields = getOutput();
+            if (fields.empty())
+            {
+                break;
+            }
+            batch.appendRow(fields);
+        }
+        return batch.num_rows > 0;
+    }
+};
+
+class UnaryOperator : public Operator
+{
+protected:
+    Operator *input;
+
+public:
+    explicit UnaryOperator(Operator &input) : input(&input) {}
+
+    ~UnaryOperator() override = default;
+};
+
+class BinaryOperator : public Operator
+{
+protected:
+    Operator *input_left;
+    Operator *input_right;
+
+public:
+    explicit BinaryOperator(Operator &input_left, Operator &input_right)
+        : input_left(&input_left), input_right(&input_right) {}
+
+    ~BinaryOperator() override = default;
+};
+
+// Passes its input on through next() and getOutput() only, so batch
+// consumers read it like an operator that has no nextBatch() of its own
+class TupleAtATimeAdapter : public UnaryOperator
+{
+public:
+    explicit TupleAtATimeAdapter(Operator &input) : UnaryOperator(input) {}
+
+    void open() override { input->open(); }
+    bool next() override { return input->next(); }
+    void close() override { input->close(); }
+    std::vector<std::unique_ptr<Field>> getOutput() override { return input->getOutput(); }
+};
+
+class ScanOperator : public Operator
+{
+private:
+    BufferManager &bufferManager;
+    size_t firstPage = 0;
+    size_t endPage = std::numeric_limits<size_t>::max(); // Exclusive; clamped to the table size
+    size_t currentPageIndex = 0;
+    size_t currentSlotIndex = 0;
+    std::unique_ptr<Tuple> currentTuple;
+    size_t tuple_count = 0;
+    bool use_bulk_read;
+    std::unique_ptr<BufferAccessStrategy> strategy;
+    std::unique_ptr<ReadAheadPrefetcher> prefetcher;
+    PageGuard currentPage;
+    const ZoneMaps *zoneMaps = nullptr;
+    std::vector<ColumnRange> zoneRanges;
+    std::optional<std::vector<bool>> decodedColumns; // All columns when unset
+
+public:
+    ScanOperator(BufferManager &manager, bool use_bulk_read = true)
+        : bufferManager(manager), use_bulk_read(use_bulk_read) {}
+
+    // Scans only the heap pages [first_page, end_page), e.g., one share of a
+    // table that several threads scan in parallel
+    ScanOperator(BufferManager &manager, size_t first_page, size_t end_page, bool use_bulk_read = true)
+        : bufferManager(manager), firstPage(first_page), endPage(end_page), use_bulk_read(use_bulk_read) {}
+
+    ~ScanOperator() override
+    {
+        releaseStrategy();
+    }
+
+    // Skips, without reading them, the pages whose zone maps show that none
+    // of their tuples fall into the ranges. Tuples on the pages read are not
+    // filtered. Takes effect from the next open().
+    void pruneWith(const ZoneMaps &zone_maps, std::vector<ColumnRange> ranges)
+    {
+        zoneMaps = &zone_maps;
+        zoneRanges = std::move(ranges);
+    }
+
+    // Makes nextBatch() parse only these columns of each tuple and record
+    // where every row is, so that the operators above can fetch the other
+    // columns for the rows that survive (see ProjectionOperator). next()
+    // still produces every column.
+    void decodeOnly(const std::vector<size_t> &columns)
+    {
+        decodedColumns.emplace();
+        for (size_t column : columns)
+        {
+            if (column >= decodedColumns->size())
+            {
+                decodedColumns->resize(column + 1, false);
+            }
+            (*decodedColumns)[column] = true;
+        }
+    }
+
+    // Restricts the scan to the heap pages [first_page, end_page) from the
+    // next open() on, e.g., to the morsels of a parallel scan in turn
+    void setPageRange(size_t first_page, size_t end_page)
+    {
+        firstPage = first_page;
+        endPage = end_page;
+    }
+
+    // Moves an open scan on to the heap pages [first_page, end_page) for
+    // nextBatch(), keeping its bulk-read ring and read-ahead thread, e.g.,
+    // for the next morsel of a parallel scan
+    void scanRange(size_t first_page, size_t end_page)
+    {
+        setPageRange(first_page, end_page);
+        currentPage.release();
+        currentPageIndex = firstPage;
+        currentSlotIndex = 0;
+        currentTuple.reset();
+        if (prefetcher)
+        {
+            prefetcher->hintSequential(firstPage, lastPage());
+        }
+    }
+
+    // Tuples produced since the operator was created
+    size_t tupleCount() const { return tuple_count; }
+
+    void open() override
+    {
+        currentPageIndex = firstPage;
+        currentSlotIndex = 0;
+        currentTuple.reset(); // Ensure currentTuple is reset
+        releaseStrategy();
+        if (use_bulk_read)
+        {
+            size_t read_ahead = readAheadPagesFromEnvironment();
+            strategy = bufferManager.getAccessStrategy(BufferAccessStrategyType::BULKREAD, read_ahead);
+            // Leave ring frames for the page being scanned and the one the
+            // next read recycles; a smaller ring cannot read ahead
+            size_t distance = std::min(read_ahead, std::max<size_t>(strategy->ring_size, 2) - 2);
+            if (distance > 0)
+            {
+                prefetcher = std::make_unique<ReadAheadPrefetcher>(bufferManager, strategy.get(), distance);
+                if (zoneMaps != nullptr && !zoneRanges.empty())
+                {
+                    prefetcher->setPageFilter([this](size_t page_id)
+                                              { return zoneMaps->mayMatch(static_cast<PageID>(page_id), zoneRanges); });
+                }
+                prefetcher->hintSequential(firstPage, lastPage());
+            }
+        }
+        loadNextTuple();
+    }
+
+    bool next() override
+    {
+        if (!currentTuple)
+            return false; // No more tuples available
+
+        loadNextTuple();
+        return currentTuple != nullptr;
+    }
+
+    // Parses the tuples straight from the pages into the batch. The first
+    // batch starts with the tuple open() loaded, parsed again from its slot.
+    bool nextBatch(Batch &batch) override
+    {
+        batch.clear();
+        if (currentTuple && !currentTuple->fields.empty())
+        {
+            currentSlotIndex--; // open() left its page fixed
+            tuple_count--;
+        }
+        currentTuple.reset();
+        const std::vector<bool> *decoded = decodedColumns ? &*decodedColumns : nullptr;
+        while (!batch.full() && currentPageIndex < lastPage())
+        {
+            if (!currentPage && !fixCurrentPage())
+            {
+                continue;
+            }
+            const char *page_buffer = currentPage->page_data.get();
+            const Slot *slot_array = reinterpret_cast<const Slot *>(page_buffer);
+            for (; currentSlotIndex < MAX_SLOTS && !batch.full(); currentSlotIndex++)
+            {
+                if (!slot_array[currentSlotIndex].empty)
+                {
+                    batch.appendSerialized(page_buffer + slot_array[currentSlotIndex].offset,
+                                           slot_array[currentSlotIndex].length, decoded);
+                    if (decoded)
+                    {
+                        batch.record_ids.push_back(
+                            RecordId{static_cast<PageID>(currentPageIndex), static_cast<uint16_t>(currentSlotIndex)});
+                    }
+                    tuple_count++;
+                }
+            }
+            if (currentSlotIndex == MAX_SLOTS)
+            {
+                currentPage.release();
+                currentPageIndex++;
+            }
+        }
+        return batch.num_rows > 0;
+    }
+
+    void close() override
+    {
+        std::cout << "Scan Operator tuple_count: " << tuple_count << "\n";
+        currentPageIndex = firstPage;
+        currentSlotIndex = 0;
+        currentTuple.reset();
+        releaseStrategy();
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        if (currentTuple)
+        {
+            return std::move(currentTuple->fields);
+        }
+        return {}; // Return an empty vector if no tuple is available
+    }
+
+    // Location of the tuple the last successful next() (or open()) produced
+    RecordId getRecordId() const
+    {
+        return RecordId{static_cast<PageID>(currentPageIndex), static_cast<uint16_t>(currentSlotIndex - 1)};
+    }
+
+private:
+    size_t lastPage()
+    {
+        return std::min(endPage, bufferManager.getNumPages());
+    }
+
+    void releaseStrategy()
+    {
+        prefetcher.reset(); // Stop reading ahead before the ring goes away
+        currentPage.release();
+        if (strategy)
+        {
+            bufferManager.freeAccessStrategy(*strategy);
+            strategy.reset();
+        }
+    }
+
+    // Fixes the page at currentPageIndex, or moves past it and returns
+    // false when the zone maps rule it out
+    bool fixCurrentPage()
+    {
+        if (prefetcher)
+        {
+            prefetcher->onAccess(currentPageIndex);
+        }
+        if (zoneMaps != nullptr && !zoneMaps->mayMatch(static_cast<PageID>(currentPageIndex), zoneRanges))
+        {
+            engineStats().scan_pages_skipped.add();
+            currentPageIndex++;
+            return false;
+        }
+        currentPage = bufferManager.fixPage(currentPageIndex, strategy.get());
+        if (currentSlotIndex >= MAX_SLOTS)
+        {
+            currentSlotIndex = 0; // Reset slot index when moving to a new page
+        }
+        return true;
+    }
+
+    void loadNextTuple()
+    {
+        while (currentPageIndex < lastPage())
+        {
+            if (!currentPage && !fixCurrentPage())
+            {
+                continue;
+            }
+
+            char *page_buffer = currentPage->page_data.get();
+            Slot *slot_array = reinterpret_cast<Slot *>(page_buffer);
+
+            while (currentSlotIndex < MAX_SLOTS)
+            {
+                if (!slot_array[currentSlotIndex].empty)
+                {
+                    assert(slot_array[currentSlotIndex].offset != INVALID_VALUE);
+                    const char *tuple_data = page_buffer + slot_array[currentSlotIndex].offset;
+                    std::istringstream iss(std::string(tuple_data, slot_array[currentSlotIndex].length));
+                    currentTuple = Tuple::deserialize(iss);
+                    currentSlotIndex++; // Move to the next slot for the next call
+                    tuple_count++;
+                    return; // Tuple loaded successfully
+                }
+                currentSlotIndex++;
+            }
+
+            // Increment page index after exhausting current page
+            currentPage.release();
+            currentPageIndex++;
+        }
+
+        // No more tuples are available
+        currentTuple.reset();
+    }
+};
+
+// Bitmap over the rows of a batch, bit i standing for row i
+using SelectionBitmap = std::array<uint64_t, BATCH_CAPACITY / 64>;
+
+// Comparison of the predicate kernels, in the order of
+// SimplePredicate::ComparisonOperator
+enum class CompareOp
+{
+    EQ,
+    NE,
+    GT,
+    GE,
+    LT,
+    LE
+};
+
+template <CompareOp OP, typename T>
+inline bool compareValues(T value, T constant)
+{
+    if constexpr (OP == CompareOp::EQ)
+        return value == constant;
+    else if constexpr (OP == CompareOp::NE)
+        return value != constant;
+    else if constexpr (OP == CompareOp::GT)
+        return value > constant;
+    else if constexpr (OP == CompareOp::GE)
+        return value >= constant;
+    else if constexpr (OP == CompareOp::LT)
+        return value < constant;
+    else
+        return value <= constant;
+}
+
+// Scalar kernel, also used for the values after the last full 64-row word.
+// Sets bit i of `bits` when values[i] OP constant, for first <= i < count,
+// and clears the rest of the last word.
+template <CompareOp OP, typename T>
+void compareScalar(const T *values, size_t first, size_t count, T constant, uint64_t *bits)
+{
+    for (size_t word = first / 64; word * 64 < count; word++)
+    {
+        uint64_t result = 0;
+        size_t end = std::min(count, word * 64 + 64);
+        for (size_t i = word * 64; i < end; i++)
+        {
+            result |= static_cast<uint64_t>(compareValues<OP>(values[i], constant)) << (i % 64);
+        }
+        bits[word] = result;
+    }
+}
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#define BUZZDB_X86_KERNELS
+
+// 8 (AVX2) or 4 (SSE2) lanes of a comparison with the constant, as bits.
+// Integers only have == and > instructions; the other comparisons flip
+// their operands or invert the result.
+template <CompareOp OP>
+__attribute__((target("avx2"))) inline uint32_t compareLanes(__m256i values, __m256i constant)
+{
+    __m256i mask;
+    if constexpr (OP == CompareOp::EQ || OP == CompareOp::NE)
+        mask = _mm256_cmpeq_epi32(values, constant);
+    else if constexpr (OP == CompareOp::GT || OP == CompareOp::LE)
+        mask = _mm256_cmpgt_epi32(values, constant);
+    else
+        mask = _mm256_cmpgt_epi32(constant, values);
+    uint32_t lanes = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(mask)));
+    return (OP == CompareOp::NE || OP == CompareOp::LE || OP == CompareOp::GE) ? lanes ^ 0xFF : lanes;
+}
+
+// Floats compare with the ordered predicates and != with the unordered
+// one, so NaN behaves as it does in C++
+template <CompareOp OP>
+__attribute__((target("avx2"))) inline uint32_t compareLanes(__m256 values, __m256 constant)
+{
+    __m256 mask;
+    if constexpr (OP == CompareOp::EQ)
+        mask = _mm256_cmp_ps(values, constant, _CMP_EQ_OQ);
+    else if constexpr (OP == CompareOp::NE)
+        mask = _mm256_cmp_ps(values, constant, _CMP_NEQ_UQ);
+    else if constexpr (OP == CompareOp::GT)
+        mask = _mm256_cmp_ps(values, constant, _CMP_GT_OQ);
+    else if constexpr (OP == CompareOp::GE)
+        mask = _mm256_cmp_ps(values, constant, _CMP_GE_OQ);
+    else if constexpr (OP == CompareOp::LT)
+        mask = _mm256_cmp_ps(values, constant, _CMP_LT_OQ);
+    else
+        mask = _mm256_cmp_ps(values, constant, _CMP_LE_OQ);
+    return static_cast<uint32_t>(_mm256_movemask_ps(mask));
+}
+
+template <CompareOp OP>
+inline uint32_t compareLanes(__m128i values, __m128i constant)
+{
+    __m128i mask;
+    if constexpr (OP == CompareOp::EQ || OP == CompareOp::NE)
+        mask = _mm_cmpeq_epi32(values, constant);
+    else if constexpr (OP == CompareOp::GT || OP == CompareOp::LE)
+        mask = _mm_cmpgt_epi32(values, constant);
+    else
+        mask = _mm_cmplt_epi32(values, constant);
+    uint32_t lanes = static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(mask)));
+    return (OP == CompareOp::NE || OP == CompareOp::LE || OP == CompareOp::GE) ? lanes ^ 0xF : lanes;
+}
+
+template <CompareOp OP>
+inline uint32_t compareLanes(__m128 values, __m128 constant)
+{
+    __m128 mask;
+    if constexpr (OP == CompareOp::EQ)
+        mask = _mm_cmpeq_ps(values, constant);
+    else if constexpr (OP == CompareOp::NE)
+        mask = _mm_cmpneq_ps(values, constant);
+    else if constexpr (OP == CompareOp::GT)
+        mask = _mm_cmpgt_ps(values, constant);
+    else if constexpr (OP == CompareOp::GE)
+        mask = _mm_cmpge_ps(values, constant);
+    else if constexpr (OP == CompareOp::LT)
+        mask = _mm_cmplt_ps(values, constant);
+    else
+        mask = _mm_cmple_ps(values, constant);
+    return static_cast<uint32_t>(_mm_movemask_ps(mask));
+}
+
+template <CompareOp OP>
+__attribute__((target("avx2"))) void compareInt32Avx2(const int *values, size_t count, int constant, uint64_t *bits)
+{
+    const __m256i broadcast = _mm256_set1_epi32(constant);
+    for (size_t word = 0; word < count / 64; word++)
+    {
+        uint64_t result = 0;
+        for (size_t lane = 0; lane < 64; lane += 8)
+        {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(values + word * 64 + lane));
+            result |= static_cast<uint64_t>(compareLanes<OP>(block, broadcast)) << lane;
+        }
+        bits[word] = result;
+    }
+    compareScalar<OP>(values, count / 64 * 64, count, constant, bits);
+}
+
+template <CompareOp OP>
+__attribute__((target("avx2"))) void compareFloatAvx2(const float *values, size_t count, float constant, uint64_t *bits)
+{
+    const __m256 broadcast = _mm256_set1_ps(constant);
+    for (size_t word = 0; word < count / 64; word++)
+    {
+        uint64_t result = 0;
+        for (size_t lane = 0; lane < 64; lane += 8)
+        {
+            __m256 block = _mm256_loadu_ps(values + word * 64 + lane);
+            result |= static_cast<uint64_t>(compareLanes<OP>(block, broadcast)) << lane;
+        }
+        bits[word] = result;
+    }
+    compareScalar<OP>(values, count / 64 * 64, count, constant, bits);
+}
+
+template <CompareOp OP>
+void compareInt32Sse2(const int *values, size_t count, int constant, uint64_t *bits)
+{
+    const __m128i broadcast = _mm_set1_epi32(constant);
+    for (size_t word = 0; word < count / 64; word++)
+    {
+        uint64_t result = 0;
+        for (size_t lane = 0; lane < 64; lane += 4)
+        {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(values + word * 64 + lane));
+            result |= static_cast<uint64_t>(compareLanes<OP>(block, broadcast)) << lane;
+        }
+        bits[word] = result;
+    }
+    compareScalar<OP>(values, count / 64 * 64, count, constant, bits);
+}
+
+template <CompareOp OP>
+void compareFloatSse2(const float *values, size_t count, float constant, uint64_t *bits)
+{
+    const __m128 broadcast = _mm_set1_ps(constant);
+    for (size_t word = 0; word < count / 64; word++)
+    {
+        uint64_t result = 0;
+        for (size_t lane = 0; lane < 64; lane += 4)
+        {
+            __m128 block = _mm_loadu_ps(values + word * 64 + lane);
+            result |= static_cast<uint64_t>(compareLanes<OP>(block, broadcast)) << lane;
+        }
+        bits[word] = result;
+    }
+    compareScalar<OP>(values, count / 64 * 64, count, constant, bits);
+}
+#endif
+
+// Instantiates KERNEL<OP> for the comparison given at run time
+#define BUZZDB_DISPATCH_COMPARE(KERNEL, op, ...)          \
+    switch (op)                                           \
+    {                                                     \
+    case CompareOp::EQ:                                   \
+        return KERNEL<CompareOp::EQ>(__VA_ARGS__);        \
+    case CompareOp::NE:                                   \
+        return KERNEL<CompareOp::NE>(__VA_ARGS__);        \
+    case CompareOp::GT:                                   \
+        return KERNEL<CompareOp::GT>(__VA_ARGS__);        \
+    case CompareOp::GE:                                   \
+        return KERNEL<CompareOp::GE>(__VA_ARGS__);        \
+    case CompareOp::LT:                                   \
+        return KERNEL<CompareOp::LT>(__VA_ARGS__);        \
+    case CompareOp::LE:                                   \
+        return KERNEL<CompareOp::LE>(__VA_ARGS__);        \
+    }
+
+// Kernels comparing a column of a batch with a constant into a bitmap,
+// for one instruction set
+struct PredicateKernels
+{
+    const char *name;
+    void (*compare_int32)(const int *values, size_t count, int constant, CompareOp op, uint64_t *bits);
+    void (*compare_float)(const float *values, size_t count, float constant, CompareOp op, uint64_t *bits);
+};
+
+const PredicateKernels SCALAR_KERNELS{
+    "scalar",
+    [](const int *values, size_t count, int constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareScalar, op, values, 0, count, constant, bits) },
+    [](const float *values, size_t count, float constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareScalar, op, values, 0, count, constant, bits) }};
+
+#ifdef BUZZDB_X86_KERNELS
+const PredicateKernels SSE2_KERNELS{
+    "sse2",
+    [](const int *values, size_t count, int constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareInt32Sse2, op, values, count, constant, bits) },
+    [](const float *values, size_t count, float constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareFloatSse2, op, values, count, constant, bits) }};
+
+const PredicateKernels AVX2_KERNELS{
+    "avx2",
+    [](const int *values, size_t count, int constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareInt32Avx2, op, values, count, constant, bits) },
+    [](const float *values, size_t count, float constant, CompareOp op, uint64_t *bits)
+    { BUZZDB_DISPATCH_COMPARE(compareFloatAvx2, op, values, count, constant, bits) }};
+#endif
+
+// The kernels of each instruction set the CPU supports, widest first
+std::vector<const PredicateKernels *> supportedPredicateKernels()
+{
+    std::vector<const PredicateKernels *> kernels;
+#ifdef BUZZDB_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back(&AVX2_KERNELS);
+    }
+    kernels.push_back(&SSE2_KERNELS);
+#endif
+    kernels.push_back(&SCALAR_KERNELS);
+    return kernels;
+}
+
+// The widest kernels the CPU supports, detected once. BUZZDB_SIMD names a
+// narrower set to use instead ("sse2" or "scalar").
+const PredicateKernels &predicateKernels()
+{
+    static const PredicateKernels *selected = []
+    {
+        std::vector<const PredicateKernels *> kernels = supportedPredicateKernels();
+        if (const char *name = std::getenv("BUZZDB_SIMD"))
+        {
+            for (const PredicateKernels *candidate : kernels)
+            {
+                if (name == std::string(candidate->name))
+                {
+                    return candidate;
+                }
+            }
+        }
+        return kernels.front();
+    }();
+    return *selected;
+}
+
+class IPredicate
+{
+public:
+    virtual ~IPredicate() = default;
+    virtual bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const = 0;
+
+    // Sets the bit of every row of the batch that passes and clears the
+    // others. This default builds the Fields of each row and calls check().
+    virtual void evaluate(const Batch &batch, SelectionBitmap &bits) const
+    {
+        bits.fill(0);
+        for (size_t row = 0; row < batch.num_rows; row++)
+        {
+            if (check(batch.row(row)))
+            {
+                bits[row / 64] |= 1ull << (row % 64);
+            }
+        }
+    }
+
+    // Narrows `selection`, a list of rows of the batch, to the rows that pass
+    void filter(const Batch &batch, std::vector<uint16_t> &selection) const
+    {
+        SelectionBitmap bits;
+        evaluate(batch, bits);
+        if (selection.size() == batch.num_rows)
+        {
+            // Every row is selected: read the rows off the bitmap
+            selection.clear();
+            for (size_t word = 0; word * 64 < batch.num_rows; word++)
+            {
+                for (uint64_t remaining = bits[word]; remaining != 0; remaining &= remaining - 1)
+                {
+                    selection.push_back(static_cast<uint16_t>(word * 64 + __builtin_ctzll(remaining)));
+                }
+            }
+            return;
+        }
+        size_t kept = 0;
+        for (uint16_t row : selection)
+        {
+            if (bits[row / 64] >> (row % 64) & 1)
+            {
+                selection[kept++] = row;
+            }
+        }
+        selection.resize(kept);
+    }
+};
+
+void printTuple(const std::vector<std::unique_ptr<Field>> &tupleFields)
+{
+    std::cout << "Tuple: [";
+    for (const auto &field : tupleFields)
+    {
+        field->print(); // Assuming `print()` is a method that prints field content
+        std::cout << " ";
+    }
+    std::cout << "]";
+}
+
+class SimplePredicate : public IPredicate
+{
+public:
+    enum OperandType
+    {
+        DIRECT,
+        INDIRECT
+    };
+    enum ComparisonOperator
+    {
+        EQ,
+        NE,
+        GT,
+        GE,
+        LT,
+        LE
+    }; // Renamed from PredicateType
+
+    struct Operand
+    {
+        std::unique_ptr<Field> directValue;
+        size_t index;
+        OperandType type;
+
+        Operand(std::unique_ptr<Field> value) : directValue(std::move(value)), type(DIRECT) {}
+        Operand(size_t idx) : index(idx), type(INDIRECT) {}
+    };
+
+    Operand left_operand;
+    Operand right_operand;
+    ComparisonOperator comparison_operator;
+
+    SimplePredicate(Operand left, Operand right, ComparisonOperator op)
+        : left_operand(std::move(left)), right_operand(std::move(right)), comparison_operator(op) {}
+
+    bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const
+    {
+        const Field *leftField = nullptr;
+        const Field *rightField = nullptr;
+
+        if (left_operand.type == DIRECT)
+        {
+            leftField = left_operand.directValue.get();
+        }
+        else if (left_operand.type == INDIRECT)
+        {
+            leftField = fieldOf(tupleFields, left_operand.index);
+        }
+
+        if (right_operand.type == DIRECT)
+        {
+            rightField = right_operand.directValue.get();
+        }
+        else if (right_operand.type == INDIRECT)
+        {
+            rightField = fieldOf(tupleFields, right_operand.index);
+        }
+
+        if (leftField == nullptr || rightField == nullptr)
+        {
+            std::cerr << "Error: Invalid field reference.\n";
+            return false;
+        }
+
+        if (leftField->getType() != rightField->getType())
+        {
+            std::cerr << "Error: Comparing fields of different types.\n";
+            return false;
+        }
+
+        // Perform comparison based on field type
+        switch (leftField->getType())
+        {
+        case FieldType::INT:
+        {
+            int left_val = leftField->asInt();
+            int right_val = rightField->asInt();
+            return compare(left_val, right_val);
+        }
+        case FieldType::FLOAT:
+        {
+            float left_val = leftField->asFloat();
+            float right_val = rightField->asFloat();
+            return compare(left_val, right_val);
+        }
+        case FieldType::STRING:
+        {
+            // Compare in place instead of copying both strings
+            std::string_view left_val(leftField->data.get(), leftField->data_length - 1);
+            std::string_view right_val(rightField->data.get(), rightField->data_length - 1);
+            return compare(left_val, right_val);
+        }
+        default:
+            std::cerr << "Invalid field type\n";
+            return false;
+        }
+    }
+
+    static const Field *fieldOf(const std::vector<std::unique_ptr<Field>> &tupleFields, size_t index)
+    {
+        if (index >= tupleFields.size())
+        {
+            throw std::runtime_error("Column " + std::to_string(index + 1) + " does not exist.");
+        }
+        return tupleFields[index].get();
+    }
+
+    // `value op column` is `column mirrored(op) value`
+    static ComparisonOperator mirrored(ComparisonOperator op)
+    {
+        static constexpr ComparisonOperator mirror[] = {EQ, NE, LT, LE, GT, GE};
+        return mirror[op];
+    }
+
+    // A column of int or float values compared with a constant goes
+    // through the SIMD kernels. Other operands of one type are compared in
+    // a typed loop, with the comparison chosen once per batch; operands of
+    // different types take the path of check(). A column the batch lacks
+    // is an error.
+    void evaluate(const Batch &batch, SelectionBitmap &bits) const override
+    {
+        if (batch.num_rows == 0)
+        {
+            bits.fill(0);
+            return;
+        }
+        auto typeOf = [&batch](const Operand &operand)
+        {
+            if (operand.type == DIRECT)
+            {
+                return operand.directValue->getType();
+            }
+            if (operand.index >= batch.columns.size())
+            {
+                throw std::runtime_error("Column " + std::to_string(operand.index + 1) + " does not exist.");
+            }
+            return batch.columns[operand.index].type;
+        };
+        FieldType type = typeOf(left_operand);
+        if (type != typeOf(right_operand))
+        {
+            IPredicate::evaluate(batch, bits);
+            return;
+        }
+
+        const Operand *column = nullptr;
+        const Field *constant = nullptr;
+        ComparisonOperator op = comparison_operator;
+        if (left_operand.type == INDIRECT && right_operand.type == DIRECT)
+        {
+            column = &left_operand;
+            constant = right_operand.directValue.get();
+        }
+        else if (left_operand.type == DIRECT && right_operand.type == INDIRECT)
+        {
+            column = &right_operand;
+            constant = left_operand.directValue.get();
+            op = mirrored(op);
+        }
+        if (column != nullptr && type == FieldType::INT)
+        {
+            predicateKernels().compare_int32(batch.columns[column->index].ints.data(), batch.num_rows,
+                                             constant->asInt(), static_cast<CompareOp>(op), bits.data());
+            return;
+        }
+        if (column != nullptr && type == FieldType::FLOAT)
+        {
+            predicateKernels().compare_float(batch.columns[column->index].floats.data(), batch.num_rows,
+                                             constant->asFloat(), static_cast<CompareOp>(op), bits.data());
+            return;
+        }
+
+        switch (type)
+        {
+        case FieldType::INT:
+            evaluateValues(batch, bits, valuesOf(batch, left_operand, &ColumnVector::ints, &Field::asInt),
+                           valuesOf(batch, right_operand, &ColumnVector::ints, &Field::asInt));
+            break;
+        case FieldType::FLOAT:
+            evaluateValues(batch, bits, valuesOf(batch, left_operand, &ColumnVector::floats, &Field::asFloat),
+                           valuesOf(batch, right_operand, &ColumnVector::floats, &Field::asFloat));
+            break;
+        case FieldType::STRING:
+            evaluateValues(batch, bits, valuesOf(batch, left_operand, &ColumnVector::strings, &Field::asString),
+                           valuesOf(batch, right_operand, &ColumnVector::strings, &Field::asString));
+            break;
+        }
+    }
+
+private:
+    // The values of an operand: a column of the batch, or a constant that
+    // stands for every row
+    template <typename T>
+    struct OperandValues
+    {
+        const std::vector<T> *column;
+        T constant;
+
+        const T &operator[](size_t row) const { return column ? (*column)[row] : constant; }
+    };
+
+    template <typename T, typename Read>
+    static OperandValues<T> valuesOf(const Batch &batch, const Operand &operand,
+                                     std::vector<T> ColumnVector::*values, Read read)
+    {
+        if (operand.type == DIRECT)
+        {
+            return OperandValues<T>{nullptr, (operand.directValue.get()->*read)()};
+        }
+        return OperandValues<T>{&(batch.columns[operand.index].*values), T()};
+    }
+
+    template <typename T>
+    void evaluateValues(const Batch &batch, SelectionBitmap &bits, const OperandValues<T> &left, const OperandValues<T> &right) const
+    {
+        auto set = [&batch, &bits](auto &&passes)
+        {
+            bits.fill(0);
+            for (size_t row = 0; row < batch.num_rows; row++)
+            {
+                bits[row / 64] |= static_cast<uint64_t>(passes(row)) << (row % 64);
+            }
+        };
+        switch (comparison_operator)
+        {
+        case ComparisonOperator::EQ:
+            set([&](size_t row)
+                { return left[row] == right[row]; });
+            break;
+        case ComparisonOperator::NE:
+            set([&](size_t row)
+                { return left[row] != right[row]; });
+            break;
+        case ComparisonOperator::GT:
+            set([&](size_t row)
+                { return left[row] > right[row]; });
+            break;
+        case ComparisonOperator::GE:
+            set([&](size_t row)
+                { return left[row] >= right[row]; });
+            break;
+        case ComparisonOperator::LT:
+            set([&](size_t row)
+                { return left[row] < right[row]; });
+            break;
+        case ComparisonOperator::LE:
+            set([&](size_t row)
+                { return left[row] <= right[row]; });
+            break;
+        }
+    }
+
+    // Compares two values of the same type
+    template <typename T>
+    bool compare(const T &left_val, const T &right_val) const
+    {
+        switch (comparison_operator)
+        {
+        case ComparisonOperator::EQ:
+            return left_val == right_val;
+        case ComparisonOperator::NE:
+            return left_val != right_val;
+        case ComparisonOperator::GT:
+            return left_val > right_val;
+        case ComparisonOperator::GE:
+            return left_val >= right_val;
+        case ComparisonOperator::LT:
+            return left_val < right_val;
+        case ComparisonOperator::LE:
+            return left_val <= right_val;
+        default:
+            std::cerr << "Invalid predicate type\n";
+            return false;
+        }
+    }
+};
+
+static_assert(static_cast<int>(CompareOp::LE) == SimplePredicate::LE, "Kernel comparisons follow SimplePredicate's");
+
+class ComplexPredicate : public IPredicate
+{
+public:
+    enum LogicOperator
+    {
+        AND,
+        OR
+    };
+
+private:
+    std::vector<std::unique_ptr<IPredicate>> predicates;
+    LogicOperator logic_operator;
+
+public:
+    ComplexPredicate(LogicOperator op) : logic_operator(op) {}
+
+    void addPredicate(std::unique_ptr<IPredicate> predicate)
+    {
+        predicates.push_back(std::move(predicate));
+    }
+
+    LogicOperator getLogicOperator() const { return logic_operator; }
+
+    const std::vector<std::unique_ptr<IPredicate>> &getPredicates() const { return predicates; }
+
+    bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const
+    {
+
+        if (logic_operator == AND)
+        {
+            for (const auto &pred : predicates)
+            {
+                if (!pred->check(tupleFields))
+                {
+                    return false; // If any predicate fails, the AND condition fails
+                }
+            }
+            return true; // All predicates passed
+        }
+        else if (logic_operator == OR)
+        {
+            for (const auto &pred : predicates)
+            {
+                if (pred->check(tupleFields))
+                {
+                    return true; // If any predicate passes, the OR condition passes
+                }
+            }
+            return false; // No predicates passed
+        }
+        return false;
+    }
+
+    // Combines the bitmaps of the children 64 rows at a time. AND stops
+    // once no row is left.
+    void evaluate(const Batch &batch, SelectionBitmap &bits) const override
+    {
+        const size_t words = (batch.num_rows + 63) / 64;
+        bits.fill(0);
+        if (logic_operator == AND)
+        {
+            for (size_t word = 0; word < words; word++)
+            {
+                size_t rows = std::min<size_t>(64, batch.num_rows - word * 64);
+                bits[word] = rows == 64 ? ~0ull : (1ull << rows) - 1;
+            }
+        }
+        SelectionBitmap child_bits;
+        for (const auto &pred : predicates)
+        {
+            pred->evaluate(batch, child_bits);
+            uint64_t any = 0;
+            for (size_t word = 0; word < words; word++)
+            {
+                bits[word] = logic_operator == AND ? bits[word] & child_bits[word] : bits[word] | child_bits[word];
+                any |= bits[word];
+            }
+            if (logic_operator == AND && any == 0)
+            {
+                return;
+            }
+        }
+    }
+};
+
+// A predicate tree compiled for one query into a tree of closures. Each
+// comparison gets a function instantiated for its value type, comparison
+// and operand kinds, so testing a row makes no virtual calls and no
+// switches on types or operators. Comparisons of two constants are folded,
+// and nested ANDs and ORs are flattened. The column types are taken from a
+// sample row; a row whose types differ falls back to the interpreted
+// predicate.
+class CompiledPredicate
+{
+private:
+    using Fields = std::vector<std::unique_ptr<Field>>;
+    struct Node;
+    using Eval = bool (*)(const Node &, const Fields &);
+
+    struct Node
+    {
+        Eval eval;
+        const IPredicate *source = nullptr; // Interpreted fallback
+        size_t left_index = 0;
+        size_t right_index = 0;
+        FieldType type = INT;
+        int int_constant = 0;
+        float float_constant = 0;
+        std::string string_constant;
+        std::vector<Node> children;
+
+        explicit Node(Eval eval, const IPredicate *source = nullptr) : eval(eval), source(source) {}
+    };
+
+    Node root;
+
+public:
+    CompiledPredicate(const IPredicate &predicate, const Fields &sample) : root(compile(predicate, sample)) {}
+
+    bool operator()(const Fields &fields) const
+    {
+        return root.eval(root, fields);
+    }
+
+private:
+    static Node compile(const IPredicate &predicate, const Fields &sample)
+    {
+        if (const auto *simple = dynamic_cast<const SimplePredicate *>(&predicate))
+        {
+            return compileComparison(*simple, sample);
+        }
+        const auto *complex = dynamic_cast<const ComplexPredicate *>(&predicate);
+        if (complex == nullptr)
+        {
+            return interpreted(predicate);
+        }
+
+        bool is_and = complex->getLogicOperator() == ComplexPredicate::AND;
+        Node node(is_and ? &combine<true> : &combine<false>);
+        for (const auto &child : complex->getPredicates())
+        {
+            Node compiled = compile(*child, sample);
+            if (compiled.eval == node.eval)
+            {
+                // (a AND b) AND c is a AND b AND c
+                std::move(compiled.children.begin(), compiled.children.end(), std::back_inserter(node.children));
+            }
+            else
+            {
+                node.children.push_back(std::move(compiled));
+            }
+        }
+        if (node.children.size() == 1)
+        {
+            return std::move(node.children.front());
+        }
+        bool interprets = std::any_of(node.children.begin(), node.children.end(), [](const Node &child)
+                                      { return child.eval == &check || child.eval == &combineShortCircuit<true> ||
+                                               child.eval == &combineShortCircuit<false>; });
+        if (interprets)
+        {
+            node.eval = is_and ? &combineShortCircuit<true> : &combineShortCircuit<false>;
+        }
+        return node;
+    }
+
+    static Node compileComparison(const SimplePredicate &predicate, const Fields &sample)
+    {
+        using Operand = SimplePredicate::Operand;
+        auto typeOf = [&sample](const Operand &operand) -> std::optional<FieldType>
+        {
+            if (operand.type == SimplePredicate::DIRECT)
+            {
+                return operand.directValue->getType();
+            }
+            if (operand.index < sample.size())
+            {
+                return sample[operand.index]->getType();
+            }
+            return std::nullopt;
+        };
+        std::optional<FieldType> type = typeOf(predicate.left_operand);
+        if (!type || type != typeOf(predicate.right_operand))
+        {
+            return interpreted(predicate);
+        }
+
+        const Operand *left = &predicate.left_operand;
+        const Operand *right = &predicate.right_operand;
+        SimplePredicate::ComparisonOperator op = predicate.comparison_operator;
+        if (left->type == SimplePredicate::DIRECT && right->type == SimplePredicate::DIRECT)
+        {
+            return constant(predicate.check({}));
+        }
+        if (left->type == SimplePredicate::DIRECT)
+        {
+            std::swap(left, right);
+            op = SimplePredicate::mirrored(op);
+        }
+
+        bool both_columns = right->type == SimplePredicate::INDIRECT;
+        Node node(nullptr, &predicate);
+        node.left_index = left->index;
+        node.right_index = both_columns ? right->index : 0;
+        node.type = *type;
+        switch (*type)
+        {
+        case FieldType::INT:
+            node.eval = both_columns ? comparisonFor<int, true>(static_cast<CompareOp>(op))
+                                     : comparisonFor<int, false>(static_cast<CompareOp>(op));
+            if (!both_columns)
+                node.int_constant = right->directValue->asInt();
+            break;
+        case FieldType::FLOAT:
+            node.eval = both_columns ? comparisonFor<float, true>(static_cast<CompareOp>(op))
+                                     : comparisonFor<float, false>(static_cast<CompareOp>(op));
+            if (!both_columns)
+                node.float_constant = right->directValue->asFloat();
+            break;
+        case FieldType::STRING:
+            node.eval = both_columns ? comparisonFor<std::string_view, true>(static_cast<CompareOp>(op))
+                                     : comparisonFor<std::string_view, false>(static_cast<CompareOp>(op));
+            if (!both_columns)
+                node.string_constant = right->directValue->asString();
+            break;
+        }
+        return node;
+    }
+
+    static Node interpreted(const IPredicate &predicate)
+    {
+        return Node(&check, &predicate);
+    }
+
+    static bool check(const Node &node, const Fields &fields)
+    {
+        return node.source->check(fields);
+    }
+
+    static Node constant(bool value)
+    {
+        return Node(value ? &always<true> : &always<false>);
+    }
+
+    template <bool VALUE>
+    static bool always(const Node &, const Fields &)
+    {
+        return VALUE;
+    }
+
+    // Evaluates every child and combines the results without branching:
+    // compiled comparisons are cheap, while short-circuit branches on data
+    // that passes at random are mispredicted half the time
+    template <bool IS_AND>
+    static bool combine(const Node &node, const Fields &fields)
+    {
+        bool result = IS_AND;
+        for (const Node &child : node.children)
+        {
+            if constexpr (IS_AND)
+                result &= child.eval(child, fields);
+            else
+                result |= child.eval(child, fields);
+        }
+        return result;
+    }
+
+    // Short-circuits, for children that fall back to the interpreter
+    template <bool IS_AND>
+    static bool combineShortCircuit(const Node &node, const Fields &fields)
+    {
+        for (const Node &child : node.children)
+        {
+            if (child.eval(child, fields) != IS_AND)
+            {
+                return !IS_AND;
+            }
+        }
+        return IS_AND;
+    }
+
+    template <typename T>
+    static T read(const Field &field)
+    {
+        if constexpr (std::is_same_v<T, int>)
+            return *reinterpret_cast<const int *>(field.data.get());
+        else if constexpr (std::is_same_v<T, float>)
+            return *reinterpret_cast<const float *>(field.data.get());
+        else
+            return std::string_view(field.data.get(), field.data_length - 1);
+    }
+
+    template <typename T>
+    static T constantOf(const Node &node)
+    {
+        if constexpr (std::is_same_v<T, int>)
+            return node.int_constant;
+        else if constexpr (std::is_same_v<T, float>)
+            return node.float_constant;
+        else
+            return node.string_constant;
+    }
+
+    template <typename T, CompareOp OP, bool BOTH_COLUMNS>
+    static bool compareOperands(const Node &node, const Fields &fields)
+    {
+        const Field &left = *fields[node.left_index];
+        if (left.type != node.type || (BOTH_COLUMNS && fields[node.right_index]->type != node.type))
+        {
+            return node.source->check(fields);
+        }
+        if constexpr (BOTH_COLUMNS)
+            return compareValues<OP>(read<T>(left), read<T>(*fields[node.right_index]));
+        else
+            return compareValues<OP>(read<T>(left), constantOf<T>(node));
+    }
+
+    template <typename T, bool BOTH_COLUMNS>
+    static Eval comparisonFor(CompareOp op)
+    {
+        switch (op)
+        {
+        case CompareOp::EQ:
+            return &compareOperands<T, CompareOp::EQ, BOTH_COLUMNS>;
+        case CompareOp::NE:
+            return &compareOperands<T, CompareOp::NE, BOTH_COLUMNS>;
+        case CompareOp::GT:
+            return &compareOperands<T, CompareOp::GT, BOTH_COLUMNS>;
+        case CompareOp::GE:
+            return &compareOperands<T, CompareOp::GE, BOTH_COLUMNS>;
+        case CompareOp::LT:
+            return &compareOperands<T, CompareOp::LT, BOTH_COLUMNS>;
+        case CompareOp::LE:
+            return &compareOperands<T, CompareOp::LE, BOTH_COLUMNS>;
+        }
+        return nullptr;
+    }
+};
+
+// Narrows `range` to the values `op value` admits
+void boundColumnRange(ColumnRange &range, SimplePredicate::ComparisonOperator op, int64_t value)
+{
+    switch (op)
+    {
+    case SimplePredicate::EQ:
+        range.lower = std::max(range.lower, value);
+        range.upper = std::min(range.upper, value);
+        break;
+    case SimplePredicate::GT:
+        range.lower = std::max(range.lower, value + 1);
+        break;
+    case SimplePredicate::GE:
+        range.lower = std::max(range.lower, value);
+        break;
+    case SimplePredicate::LT:
+        range.upper = std::min(range.upper, value - 1);
+        break;
+    case SimplePredicate::LE:
+        range.upper = std::min(range.upper, value);
+        break;
+    case SimplePredicate::NE:
+        break;
+    }
+}
+
+// The ranges of integer columns that every tuple passing the predicate lies
+// in, at most one per column. Only comparisons of a column with an integer
+// constant bound a column; anything else bounds none.
+std::vector<ColumnRange> extractColumnRanges(const IPredicate &predicate)
+{
+    std::vector<ColumnRange> ranges;
+    auto rangeOf = [&ranges](size_t column) -> ColumnRange &
+    {
+        for (ColumnRange &range : ranges)
+        {
+            if (range.column == column)
+            {
+                return range;
+            }
+        }
+        return ranges.emplace_back(ColumnRange{column});
+    };
+
+    if (const auto *simple = dynamic_cast<const SimplePredicate *>(&predicate))
+    {
+        const auto &left = simple->left_operand;
+        const auto &right = simple->right_operand;
+        auto op = simple->comparison_operator;
+        if (left.type == SimplePredicate::INDIRECT && right.type == SimplePredicate::DIRECT &&
+            right.directValue->getType() == INT)
+        {
+            boundColumnRange(rangeOf(left.index), op, right.directValue->asInt());
+        }
+        else if (left.type == SimplePredicate::DIRECT && right.type == SimplePredicate::INDIRECT &&
+                 left.directValue->getType() == INT)
+        {
+            boundColumnRange(rangeOf(right.index), SimplePredicate::mirrored(op), left.directValue->asInt());
+        }
+    }
+    else if (const auto *complex = dynamic_cast<const ComplexPredicate *>(&predicate))
+    {
+        const auto &children = complex->getPredicates();
+        if (complex->getLogicOperator() == ComplexPredicate::AND)
+        {
+            for (const auto &child : children)
+            {
+                for (const ColumnRange &bound : extractColumnRanges(*child))
+                {
+                    ColumnRange &range = rangeOf(bound.column);
+                    range.lower = std::max(range.lower, bound.lower);
+                    range.upper = std::min(range.upper, bound.upper);
+                }
+            }
+        }
+        else if (!children.empty())
+        {
+            // A column is bounded by a disjunction only if every branch bounds it
+            ranges = extractColumnRanges(*children.front());
+            for (size_t i = 1; i < children.size(); i++)
+            {
+                std::vector<ColumnRange> branch = extractColumnRanges(*children[i]);
+                std::vector<ColumnRange> hull;
+                for (const ColumnRange &range : ranges)
+                {
+                    for (const ColumnRange &other : branch)
+                    {
+                        if (other.column == range.column)
+                        {
+                            hull.push_back(ColumnRange{range.column, std::min(range.lower, other.lower),
+                                                       std::max(range.upper, other.upper)});
+                        }
+                    }
+                }
+                ranges = std::move(hull);
+            }
+        }
+    }
+    return ranges;
+}
+
+class SelectOperator : public UnaryOperator
+{
+private:
+    std::unique_ptr<IPredicate> predicate;
+    std::optional<CompiledPredicate> compiled; // Compiled from the first tuple
+    bool has_next;
+    std::vector<std::unique_ptr<Field>> currentOutput; // Store the current output here
+
+public:
+    SelectOperator(Operator &input, std::unique_ptr<IPredicate> predicate)
+        : UnaryOperator(input), predicate(std::move(predicate)), has_next(false) {}
+
+    void open() override
+    {
+        input->open();
+        compiled.reset();
+        has_next = false;
+        currentOutput.clear(); // Ensure currentOutput is cleared at the beginning
+    }
+
+    bool next() override
+    {
+        while (input->next())
+        {
+            const auto &output = input->getOutput(); // Temporarily hold the output
+            if (!compiled)
+            {
+                compiled.emplace(*predicate, output);
+            }
+            if ((*compiled)(output))
+            {
+                // If the predicate is satisfied, store the output in the member variable
+                currentOutput.clear(); // Clear previous output
+                for (const auto &field : output)
+                {
+                    // Assuming Field class has a clone method or copy constructor to duplicate fields
+                    currentOutput.push_back(field->clone());
+                }
+                has_next = true;
+                return true;
+            }
+        }
+        has_next = false;
+        currentOutput.clear(); // Clear output if no more tuples satisfy the predicate
+        return false;
+    }
+
+    void close() override
+    {
+        input->close();
+        currentOutput.clear(); // Ensure currentOutput is cleared at the end
+    }
+
+    // Filters whole batches of the input by narrowing their selection
+    bool nextBatch(Batch &batch) override
+    {
+        while (input->nextBatch(batch))
+        {
+            predicate->filter(batch, batch.selection);
+            if (!batch.selection.empty())
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        if (has_next)
+        {
+            // Since currentOutput already holds the desired output, simply return it
+            // Need to create a deep copy to return since we're returning by value
+            std::vector<std::unique_ptr<Field>> outputCopy;
+            for (const auto &field : currentOutput)
+            {
+                outputCopy.push_back(field->clone()); // Clone each field
+            }
+            return outputCopy;
+        }
+        else
+        {
+            return {}; // Return an empty vector if no matching tuple is found
+        }
+    }
+};
+
+// Produces the given columns of its input, in the given order. Columns a
+// late-materializing scan left out (see ScanOperator::decodeOnly()) are
+// fetched from the heap for the rows still selected, so a filtered query
+// decodes and copies the columns it prints only for the rows it prints.
+// Each heap page is fixed once per batch.
+class ProjectionOperator : public UnaryOperator
+{
+private:
+    BufferManager &bufferManager;
+    std::vector<size_t> attrs;
+    Batch input_batch;
+    Batch fetched; // Values of the left-out columns, one row per selected row
+
+public:
+    ProjectionOperator(Operator &input, std::vector<size_t> attrs, BufferManager &manager)
+        : UnaryOperator(input), bufferManager(manager), attrs(std::move(attrs)) {}
+
+    void open() override { input->open(); }
+    bool next() override { return input->next(); }
+    void close() override { input->close(); }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        auto fields = input->getOutput();
+        if (fields.empty())
+        {
+            return {};
+        }
+        std::vector<std::unique_ptr<Field>> projected;
+        for (size_t attr : attrs)
+        {
+            if (attr >= fields.size())
+            {
+                throw std::runtime_error("Column " + std::to_string(attr + 1) + " does not exist.");
+            }
+            projected.push_back(fields[attr]->clone());
+        }
+        return projected;
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        batch.clear();
+        if (!input->nextBatch(input_batch))
+        {
+            return false;
+        }
+        for (size_t attr : attrs)
+        {
+            if (attr >= input_batch.columns.size())
+            {
+                throw std::runtime_error("Column " + std::to_string(attr + 1) + " does not exist.");
+            }
+        }
+        bool fetch = std::any_of(attrs.begin(), attrs.end(), [this](size_t attr)
+                                 { return !input_batch.columns[attr].materialized; });
+        if (fetch)
+        {
+            fetchMissing();
+        }
+
+        batch.columns.resize(attrs.size());
+        for (size_t i = 0; i < attrs.size(); i++)
+        {
+            const ColumnVector &source = input_batch.columns[attrs[i]];
+            ColumnVector &column = batch.columns[i];
+            column.type = source.type;
+            if (source.materialized)
+            {
+                for (uint16_t row : input_batch.selection)
+                {
+                    column.appendFrom(source, row);
+                }
+            }
+            else if (fetched.num_rows > 0)
+            {
+                column = fetched.columns[attrs[i]];
+            }
+        }
+        batch.num_rows = input_batch.selection.size();
+        for (size_t row = 0; row < batch.num_rows; row++)
+        {
+            batch.selection.push_back(static_cast<uint16_t>(row));
+        }
+        return batch.num_rows > 0;
+    }
+
+private:
+    // Parses the left-out columns of the selected rows from their slots
+    void fetchMissing()
+    {
+        if (input_batch.record_ids.size() != input_batch.num_rows)
+        {
+            throw std::runtime_error("Columns were left out of rows without record ids.");
+        }
+        std::vector<bool> missing(input_batch.columns.size());
+        for (size_t attr : attrs)
+        {
+            missing[attr] = !input_batch.columns[attr].materialized;
+        }
+        fetched.clear();
+        PageGuard page;
+        PageID fixed_page = INVALID_PAGE_ID;
+        for (uint16_t row : input_batch.selection)
+        {
+            const RecordId &rid = input_batch.record_ids[row];
+            if (rid.page_id != fixed_page)
+            {
+                page.release();
+                page = bufferManager.fixPage(rid.page_id);
+                fixed_page = rid.page_id;
+            }
+            const Slot &slot = reinterpret_cast<const Slot *>(page->page_data.get())[rid.slot];
+            if (slot.empty)
+            {
+                throw std::runtime_error("The tuple of a scanned row was deleted.");
+            }
+            fetched.appendSerialized(page->page_data.get() + slot.offset, slot.length, &missing);
+        }
+    }
+};
+
+// Number of heap pages in a morsel, the unit of work of a parallel scan
+constexpr size_t MORSEL_PAGES = 32;
+
+// Scans the table on the workers of the task scheduler. The heap is cut
+// into morsels of MORSEL_PAGES pages, one task each. Every worker keeps its
+// own pipeline state, a ScanOperator with its bulk-read ring and a batch,
+// and runs the morsels it is given or steals through it and the shared
+// predicate. run() hands the surviving batches to a consumer on the worker
+// that produced them; the Operator interface gathers the batches of all
+// workers into one stream, in no particular order. Only `degree` workers
+// take part, as each may hold a bulk-read ring.
+class ParallelScanOperator : public Operator
+{
+public:
+    using Consumer = std::function<void(size_t worker, Batch &batch)>;
+    // Per-batch work of the operator above, run on the worker, which passes
+    // its own output batches on through `emit`
+    using Stage = std::function<void(size_t worker, Batch &batch, const Consumer &emit)>;
+
+private:
+    struct WorkerState
+    {
+        std::unique_ptr<ScanOperator> scan;
+        Batch batch;
+    };
+
+    BufferManager &bufferManager;
+    size_t degree;
+    std::unique_ptr<IPredicate> predicate; // No filter when null
+    const ZoneMaps *zoneMaps = nullptr;
+    std::vector<ColumnRange> zoneRanges;
+    std::optional<std::vector<size_t>> decodedColumns;
+    std::vector<WorkerState> workers;
+    std::shared_ptr<TaskScheduler::Job> job;
+    size_t tuple_count = 0;
+
+    // Batches gathered for the Operator interface
+    std::mutex gather_mutex;
+    std::condition_variable gather_changed;
+    std::deque<Batch> gathered;
+    size_t morsels_left = 0;
+    bool cancelled = false;
+    std::exception_ptr error;
+    Batch current; // Batch next() is walking through
+    size_t current_row = 0;
+
+public:
+    ParallelScanOperator(BufferManager &manager, size_t degree, std::unique_ptr<IPredicate> predicate = nullptr)
+        : bufferManager(manager), degree(std::max<size_t>(1, degree)), predicate(std::move(predicate)) {}
+
+    ~ParallelScanOperator() override
+    {
+        stop();
+    }
+
+    // Number of workers a parallel scan of the table gets: one per worker
+    // thread, as long as every one of them can take a bulk-read ring and
+    // half of the pool stays free. Below 2, scan on the calling thread.
+    static size_t degreeFor(BufferManager &manager)
+    {
+        size_t max_rings = manager.getPoolSize() / (2 * BULK_READ_RING_BYTES / PAGE_SIZE);
+        size_t num_morsels = (manager.getNumPages() + MORSEL_PAGES - 1) / MORSEL_PAGES;
+        if (max_rings < 2 || num_morsels < 2)
+        {
+            return 1; // Leaves the scheduler's threads unstarted
+        }
+        return std::min({max_rings, num_morsels, taskScheduler().numWorkers()});
+    }
+
+    // Skips the pages whose zone maps rule the ranges out, like
+    // ScanOperator::pruneWith(). Takes effect from the next scan.
+    void pruneWith(const ZoneMaps &zone_maps, std::vector<ColumnRange> ranges)
+    {
+        zoneMaps = &zone_maps;
+        zoneRanges = std::move(ranges);
+    }
+
+    // Like ScanOperator::decodeOnly(), for the batches of every worker.
+    // Takes effect from the next scan.
+    void decodeOnly(std::vector<size_t> columns)
+    {
+        decodedColumns = std::move(columns);
+    }
+
+    // Scans the whole table, passing each batch that has rows left after
+    // the filter to `consumer` on the worker that produced it. The worker
+    // index is below degree(), so consumers can keep per-worker state
+    // without locking. Returns when every morsel is done.
+    void run(const Consumer &consumer)
+    {
+        start(consumer);
+        finish();
+    }
+
+    size_t getDegree() const { return degree; }
+
+    void open() override
+    {
+        openWith(nullptr);
+    }
+
+    // Like open(), but every batch first goes through `stage` on its
+    // worker, and the batches the stage emits are gathered instead. This
+    // runs the operator above (e.g., a join probe) inside the pipelines.
+    void openWith(Stage stage)
+    {
+        stop();
+        current.clear();
+        current_row = 0;
+        // Workers wait while the consumer is this many batches behind
+        const size_t max_gathered = 2 * degree;
+        Consumer gather = [this, max_gathered](size_t, Batch &batch)
+        {
+            std::unique_lock<std::mutex> lock(gather_mutex);
+            gather_changed.wait(lock, [this, max_gathered]
+                                { return cancelled || gathered.size() < max_gathered; });
+            if (!cancelled)
+            {
+                gathered.push_back(std::move(batch));
+                batch = Batch();
+                gather_changed.notify_all();
+            }
+        };
+        if (stage)
+        {
+            start([stage = std::move(stage), gather](size_t worker, Batch &batch)
+                  { stage(worker, batch, gather); });
+        }
+        else
+        {
+            start(gather);
+        }
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        std::unique_lock<std::mutex> lock(gather_mutex);
+        gather_changed.wait(lock, [this]
+                            { return !gathered.empty() || morsels_left == 0; });
+        if (gathered.empty())
+        {
+            lock.unlock();
+            finish();
+            batch.clear();
+            return false;
+        }
+        batch = std::move(gathered.front());
+        gathered.pop_front();
+        gather_changed.notify_all();
+        return true;
+    }
+
+    bool next() override
+    {
+        current_row++;
+        while (current_row >= current.selection.size())
+        {
+            if (!nextBatch(current))
+            {
+                return false;
+            }
+            current_row = 0;
+        }
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        if (current_row >= current.selection.size())
+        {
+            return {};
+        }
+        std::vector<std::unique_ptr<Field>> fields;
+        for (const ColumnVector &column : current.columns)
+        {
+            fields.push_back(std::make_unique<Field>(column.fieldAt(current.selection[current_row])));
+        }
+        return fields;
+    }
+
+    void close() override
+    {
+        stop();
+        std::cout << "Scan Operator tuple_count: " << tuple_count << "\n";
+    }
+
+private:
+    void start(const Consumer &consumer)
+    {
+        size_t num_pages = bufferManager.getNumPages();
+        size_t num_morsels = (num_pages + MORSEL_PAGES - 1) / MORSEL_PAGES;
+        workers.clear();
+        workers.resize(degree);
+        {
+            std::lock_guard<std::mutex> lock(gather_mutex);
+            gathered.clear();
+            morsels_left = num_morsels;
+            cancelled = false;
+            error = nullptr;
+        }
+        job = taskScheduler().submit(num_morsels, [this, consumer, num_pages](size_t worker, size_t morsel)
+                                     { runMorsel(worker, morsel * MORSEL_PAGES, std::min(num_pages, (morsel + 1) * MORSEL_PAGES), consumer); }, degree);
+    }
+
+    void runMorsel(size_t worker, size_t first_page, size_t end_page, const Consumer &consumer)
+    {
+        try
+        {
+            if (!isCancelled())
+            {
+                // One scan per worker, opened for its first morsel and moved
+                // on to the next ones, so its ring and read-ahead thread are
+                // set up once
+                WorkerState &state = workers[worker];
+                if (!state.scan)
+                {
+                    state.scan = std::make_unique<ScanOperator>(bufferManager, first_page, end_page);
+                    if (zoneMaps != nullptr)
+                    {
+                        state.scan->pruneWith(*zoneMaps, zoneRanges);
+                    }
+                    if (decodedColumns)
+                    {
+                        state.scan->decodeOnly(*decodedColumns);
+                    }
+                    state.scan->open();
+                }
+                else
+                {
+                    state.scan->scanRange(first_page, end_page);
+                }
+                while (!isCancelled() && state.scan->nextBatch(state.batch))
+                {
+                    if (predicate)
+                    {
+                        predicate->filter(state.batch, state.batch.selection);
+                    }
+                    if (!state.batch.selection.empty())
+                    {
+                        consumer(worker, state.batch);
+                    }
+                }
+            }
+        }
+        catch (...)
+        {
+            std::lock_guard<std::mutex> lock(gather_mutex);
+            if (!error)
+            {
+                error = std::current_exception();
+            }
+            cancelled = true;
+        }
+        std::lock_guard<std::mutex> lock(gather_mutex);
+        morsels_left--;
+        gather_changed.notify_all();
+    }
+
+    bool isCancelled()
+    {
+        std::lock_guard<std::mutex> lock(gather_mutex);
+        return cancelled;
+    }
+
+    // Waits for the morsels, releases the workers' scans and rethrows the
+    // first error a morsel ran into
+    void finish()
+    {
+        if (!job)
+        {
+            return;
+        }
+        job->wait();
+        job.reset();
+        for (WorkerState &state : workers)
+        {
+            if (state.scan)
+            {
+                tuple_count += state.scan->tupleCount();
+            }
+        }
+        workers.clear();
+        std::exception_ptr failure;
+        {
+            std::lock_guard<std::mutex> lock(gather_mutex);
+            std::swap(failure, error);
+        }
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+    }
+
+    // Skips the morsels not started yet, for a consumer that stops early.
+    // Errors of the skipped scan are of no interest to it.
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(gather_mutex);
+            cancelled = true;
+            gathered.clear();
+        }
+        gather_changed.notify_all();
+        try
+        {
+            finish();
+        }
+        catch (...)
+        {
+        }
+    }
+};
+
+// Produces the tuples whose indexed column lies in [lower, upper] by walking
+// the index and fetching only the slots it references. Record ids are taken
+// from the index a batch at a time and sorted by page, so each heap page is
+// fixed once per batch however many of its tuples match. An entry may point
+// at a slot that was deleted or reused since it was indexed, so every
+// fetched tuple is checked against the range and the predicate again.
+class IndexScanOperator : public Operator
+{
+private:
+    static constexpr size_t BATCH_SIZE = 1024;
+
+    BufferManager &bufferManager;
+    BPlusTree &index;
+    size_t column;
+    int64_t lower;
+    int64_t upper;
+    std::unique_ptr<IPredicate> predicate;
+    std::optional<CompiledPredicate> compiled; // Compiled from the first tuple
+    std::optional<BPlusTree::RangeCursor> cursor;
+    std::vector<std::unique_ptr<Tuple>> batch;
+    size_t position = 0;
+    std::unique_ptr<Tuple> currentTuple;
+    size_t tuple_count = 0;
+
+public:
+    IndexScanOperator(BufferManager &manager, BPlusTree &index, size_t column, int64_t lower, int64_t upper,
+                      std::unique_ptr<IPredicate> predicate = nullptr)
+        : bufferManager(manager), index(index), column(column), lower(lower), upper(upper),
+          predicate(std::move(predicate)) {}
+
+    void open() override
+    {
+        cursor.emplace(index.range(lower, upper));
+        compiled.reset();
+        batch.clear();
+        position = 0;
+        currentTuple.reset();
+    }
+
+    bool next() override
+    {
+        while (position == batch.size())
+        {
+            if (!fetchBatch())
+            {
+                currentTuple.reset();
+                return false;
+            }
+        }
+        currentTuple = std::move(batch[position++]);
+        tuple_count++;
+        return true;
+    }
+
+    void close() override
+    {
+        std::cout << "Index Scan Operator tuple_count: " << tuple_count << "\n";
+        cursor.reset();
+        batch.clear();
+        position = 0;
+        currentTuple.reset();
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        if (currentTuple)
+        {
+            return std::move(currentTuple->fields);
+        }
+        return {}; // Return an empty vector if no tuple is available
+    }
+
+private:
+    // Fetches the tuples of the next batch of index entries; returns false
+    // once the index has no entries left in the range
+    bool fetchBatch()
+    {
+        std::vector<RecordId> rids;
+        BTreeEntry entry;
+        while (rids.size() < BATCH_SIZE && cursor->next(entry))
+        {
+            rids.push_back(RecordId::unpack(entry.rid));
+        }
+        if (rids.empty())
+        {
+            return false;
+        }
+        std::sort(rids.begin(), rids.end(), [](const RecordId &a, const RecordId &b)
+                  { return a.pack() < b.pack(); });
+
+        batch.clear();
+        position = 0;
+        PageGuard page;
+        PageID fixed_page = INVALID_PAGE_ID;
+        for (const RecordId &rid : rids)
+        {
+            if (rid.slot >= MAX_SLOTS || rid.page_id >= bufferManager.getNumPages())
+            {
+                continue;
+            }
+            if (rid.page_id != fixed_page)
+            {
+                page.release();
+                page = bufferManager.fixPage(rid.page_id);
+                fixed_page = rid.page_id;
+            }
+            const Slot &slot = reinterpret_cast<const Slot *>(page->page_data.get())[rid.slot];
+            if (slot.empty)
+            {
+                continue;
+            }
+            std::istringstream iss(std::string(page->page_data.get() + slot.offset, slot.length));
+            auto tuple = Tuple::deserialize(iss);
+            if (column >= tuple->fields.size() || tuple->fields[column]->getType() != INT)
+            {
+                continue;
+            }
+            int64_t key = tuple->fields[column]->asInt();
+            if (key < lower || key > upper)
+            {
+                continue;
+            }
+            if (predicate && !compiled)
+            {
+                compiled.emplace(*predicate, tuple->fields);
+            }
+            if (predicate && !(*compiled)(tuple->fields))
+            {
+                continue;
+            }
+            batch.push_back(std::move(tuple));
+        }
+        return true;
+    }
+};
+
+enum class AggrFuncType
+{
+    COUNT,
+    MAX,
+    MIN,
+    SUM,
+    AVG,       // Float average of the column
+    COUNT_STAR // Rows of the group; attr_index is not used
+};
+
+struct AggrFunc
+{
+    AggrFuncType func;
+    size_t attr_index; // Index of the attribute to aggregate
+};
+
+// Group-by table of HashAggregationOperator, laid out for its group key.
+// Groups are numbered in the order they are first seen; each holds its
+// aggregate states inline, next to those of its neighbours. Lookups map a
+// key to its group number through the first layout that fits:
+// - no key: a single group;
+// - one int key in [0, 65536): an array indexed by the key, grown as
+//   larger keys come in;
+// - one int key: open addressing on the key;
+// - anything else: open addressing on the key packed into bytes, ints and
+//   floats at fixed width and strings with their length.
+// A single int key that does not fit the array moves to open addressing.
+// Tables filled on different threads combine group by group (mergeGroup),
+// which is how the parallel aggregation merges its thread-local partials.
+// Groups also travel as bytes (serializeGroup, mergeSerialized), which is
+// how a spilling aggregation writes partials out and folds them back in.
+class AggregationTable
+{
+private:
+    static constexpr uint32_t NO_GROUP = std::numeric_limits<uint32_t>::max();
+    static constexpr size_t DIRECT_MAX_DOMAIN = size_t(1) << 16;
+    static constexpr size_t MIN_CAPACITY = 1024;
+
+    enum class Layout
+    {
+        UNDECIDED,
+        SINGLE,
+        DIRECT,
+        HASH_INT,
+        PACKED
+    };
+
+    union AggregateState
+    {
+        int64_t int_value;
+        double float_value;
+    };
+
+    struct IntSlot
+    {
+        int64_t key;
+        uint32_t group;
+    };
+
+    struct PackedSlot
+    {
+        uint64_t hash;
+        uint32_t group;
+    };
+
+    std::vector<size_t> group_by_attrs;
+    std::vector<AggrFunc> aggr_funcs;
+    Layout layout = Layout::UNDECIDED;
+    std::vector<FieldType> key_types;
+    std::vector<FieldType> value_types;
+    std::vector<size_t> state_offsets; // First state of each aggregate within a group
+    size_t states_per_group = 0;       // AVG keeps a sum and a count
+
+    size_t num_groups = 0;
+    size_t expected_groups = 0;         // Groups to size the lookup structures for up front
+    std::vector<AggregateState> states; // num_groups x states_per_group
+    std::vector<int> int_keys;          // Key of each group (DIRECT, HASH_INT)
+    std::vector<uint32_t> direct;       // Key -> group (DIRECT)
+    std::vector<IntSlot> int_slots;     // HASH_INT
+    std::vector<PackedSlot> packed_slots;
+    std::vector<char> packed_keys;          // Packed keys of the groups, back to back (PACKED)
+    std::vector<size_t> packed_offsets{0};  // Group g's key is [offsets[g], offsets[g + 1])
+    std::vector<uint32_t> row_groups;       // Group of each selected row of a batch
+    std::string packed_key;                 // Key being looked up
+    std::vector<AggregateState> merged_states; // States read by mergeSerialized()
+
+public:
+    AggregationTable(std::vector<size_t> group_by_attrs, std::vector<AggrFunc> aggr_funcs, size_t expected_groups = 0)
+        : group_by_attrs(std::move(group_by_attrs)), aggr_funcs(std::move(aggr_funcs)), expected_groups(expected_groups)
+    {
+        for (const AggrFunc &aggr : this->aggr_funcs)
+        {
+            state_offsets.push_back(states_per_group);
+            states_per_group += aggr.func == AggrFuncType::AVG ? 2 : 1;
+        }
+    }
+
+    size_t size() const { return num_groups; }
+
+    // Bytes held by the groups and lookup structures
+    size_t memoryBytes() const
+    {
+        return states.capacity() * sizeof(AggregateState) + int_keys.capacity() * sizeof(int) +
+               direct.capacity() * sizeof(uint32_t) + int_slots.capacity() * sizeof(IntSlot) +
+               packed_slots.capacity() * sizeof(PackedSlot) + packed_keys.capacity() +
+               packed_offsets.capacity() * sizeof(size_t);
+    }
+
+    // A table without groups for the same group-by and aggregates, with the
+    // column types this one has seen
+    AggregationTable emptyCopy() const
+    {
+        AggregationTable copy(group_by_attrs, aggr_funcs);
+        if (layout != Layout::UNDECIDED)
+        {
+            copy.key_types = key_types;
+            copy.value_types = value_types;
+            copy.decideLayout();
+        }
+        return copy;
+    }
+
+    // Adds the selected rows of the batch. The rows are first mapped to
+    // their groups; then each aggregate runs over them in one typed loop.
+    void add(const Batch &batch)
+    {
+        if (batch.selection.empty())
+        {
+            return;
+        }
+        if (layout == Layout::UNDECIDED)
+        {
+            chooseLayout(batch);
+        }
+        checkTypes(batch);
+
+        row_groups.resize(batch.selection.size());
+        for (size_t i = 0; i < batch.selection.size(); i++)
+        {
+            row_groups[i] = findOrCreateGroup(batch, batch.selection[i]);
+        }
+        for (size_t a = 0; a < aggr_funcs.size(); a++)
+        {
+            accumulate(batch, a);
+        }
+    }
+
+    // The group keys followed by the aggregates
+    Tuple groupTuple(size_t group) const
+    {
+        Tuple tuple;
+        if (layout == Layout::DIRECT || layout == Layout::HASH_INT)
+        {
+            tuple.addField(std::make_unique<Field>(int_keys[group]));
+        }
+        else if (layout == Layout::PACKED)
+        {
+            unpackKey(group, tuple);
+        }
+        for (size_t a = 0; a < aggr_funcs.size(); a++)
+        {
+            const AggregateState &state = states[group * states_per_group + state_offsets[a]];
+            if (aggr_funcs[a].func == AggrFuncType::AVG)
+            {
+                double sum = value_types[a] == INT ? static_cast<double>(state.int_value) : state.float_value;
+                tuple.addField(std::make_unique<Field>(static_cast<float>(sum / (&state)[1].int_value)));
+            }
+            else if (countsRows(a) || value_types[a] == INT)
+            {
+                tuple.addField(std::make_unique<Field>(static_cast<int>(state.int_value)));
+            }
+            else
+            {
+                tuple.addField(std::make_unique<Field>(static_cast<float>(state.float_value)));
+            }
+        }
+        return tuple;
+    }
+
+    // Partition in [0, num_partitions) of the group's key. Equal keys land
+    // in the same partition whichever table they are in. Each level splits
+    // by other bits, so the keys of one partition spread over the
+    // partitions of the next level.
+    size_t partitionOf(size_t group, size_t num_partitions, size_t level = 0) const
+    {
+        uint64_t hash = 0;
+        if (layout == Layout::DIRECT || layout == Layout::HASH_INT)
+        {
+            hash = mix(static_cast<uint64_t>(static_cast<int64_t>(int_keys[group])));
+        }
+        else if (layout == Layout::PACKED)
+        {
+            hash = mix(std::hash<std::string_view>()(packedKeyOf(group)));
+        }
+        if (level > 0)
+        {
+            hash = mix(hash ^ (level * 0x9e3779b97f4a7c15ull));
+        }
+        // The low bits pick the slot within a table; keep them varied
+        // among the keys of one partition
+        return (hash >> 32) % num_partitions;
+    }
+
+    // Appends the group's key and aggregate states to `out`
+    void serializeGroup(size_t group, std::string &out) const
+    {
+        std::string_view key = keyBytesOf(group);
+        uint32_t length = static_cast<uint32_t>(key.size());
+        out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+        out.append(key);
+        out.append(reinterpret_cast<const char *>(states.data() + group * states_per_group),
+                   states_per_group * sizeof(AggregateState));
+    }
+
+    // Folds the group serializeGroup() wrote at the front of `in` into the
+    // group with the same key here, and moves `in` past it. The table must
+    // know its column types, i.e. come from emptyCopy() of the writer.
+    void mergeSerialized(std::string_view &in)
+    {
+        if (layout == Layout::UNDECIDED)
+        {
+            throw std::logic_error("Aggregation table without column types.");
+        }
+        uint32_t length;
+        std::memcpy(&length, in.data(), sizeof(length));
+        uint32_t target = groupForKey(in.substr(sizeof(length), length));
+        merged_states.resize(states_per_group);
+        std::memcpy(merged_states.data(), in.data() + sizeof(length) + length, states_per_group * sizeof(AggregateState));
+        mergeStates(target, merged_states.data());
+        in.remove_prefix(sizeof(length) + length + states_per_group * sizeof(AggregateState));
+    }
+
+    // Folds group `group` of `other`, a table with the same group-by and
+    // aggregates, into the group with the same key here
+    void mergeGroup(const AggregationTable &other, size_t group)
+    {
+        if (layout == Layout::UNDECIDED)
+        {
+            key_types = other.key_types;
+            value_types = other.value_types;
+            decideLayout();
+        }
+        mergeStates(groupForKey(other.keyBytesOf(group)), other.states.data() + group * states_per_group);
+    }
+
+private:
+    // The key in the form serializeGroup() writes: the int of a single int
+    // key, the packed bytes of other keys, nothing without a key
+    std::string_view keyBytesOf(size_t group) const
+    {
+        if (layout == Layout::DIRECT || layout == Layout::HASH_INT)
+        {
+            return std::string_view(reinterpret_cast<const char *>(&int_keys[group]), sizeof(int));
+        }
+        if (layout == Layout::PACKED)
+        {
+            return packedKeyOf(group);
+        }
+        return {};
+    }
+
+    uint32_t groupForKey(std::string_view key)
+    {
+        if (layout == Layout::SINGLE)
+        {
+            return num_groups == 0 ? newGroup() : 0;
+        }
+        if (layout == Layout::PACKED)
+        {
+            return findOrCreatePackedGroup(key, std::hash<std::string_view>()(key));
+        }
+        int value;
+        std::memcpy(&value, key.data(), sizeof(value));
+        return findOrCreateIntGroup(value);
+    }
+
+    // Combines the states of a group of another table into `target`
+    void mergeStates(uint32_t target, const AggregateState *from)
+    {
+        AggregateState *into = states.data() + target * states_per_group;
+        for (size_t a = 0; a < aggr_funcs.size(); a++)
+        {
+            const AggregateState &source = from[state_offsets[a]];
+            AggregateState &state = into[state_offsets[a]];
+            bool is_int = countsRows(a) || value_types[a] == INT;
+            switch (aggr_funcs[a].func)
+            {
+            case AggrFuncType::MIN:
+                is_int ? state.int_value = std::min(state.int_value, source.int_value)
+                       : state.float_value = std::min(state.float_value, source.float_value);
+                break;
+            case AggrFuncType::MAX:
+                is_int ? state.int_value = std::max(state.int_value, source.int_value)
+                       : state.float_value = std::max(state.float_value, source.float_value);
+                break;
+            case AggrFuncType::AVG:
+                (&state)[1].int_value += (&source)[1].int_value;
+                [[fallthrough]];
+            default: // Sums and counts
+                is_int ? state.int_value += source.int_value
+                       : state.float_value += source.float_value;
+            }
+        }
+    }
+
+    // COUNT counts rows whatever the column holds; COUNT(*) has no column
+    bool countsRows(size_t a) const
+    {
+        return aggr_funcs[a].func == AggrFuncType::COUNT || aggr_funcs[a].func == AggrFuncType::COUNT_STAR;
+    }
+
+    void chooseLayout(const Batch &batch)
+    {
+        for (size_t attr : group_by_attrs)
+        {
+            key_types.push_back(columnOf(batch, attr).type);
+        }
+        for (const AggrFunc &aggr : aggr_funcs)
+        {
+            if (aggr.func == AggrFuncType::COUNT_STAR)
+            {
+                value_types.push_back(INT);
+                continue;
+            }
+            value_types.push_back(columnOf(batch, aggr.attr_index).type);
+            if (value_types.back() == STRING && aggr.func != AggrFuncType::COUNT)
+            {
+                throw std::runtime_error("Only COUNT aggregates string columns.");
+            }
+        }
+        decideLayout();
+    }
+
+    void decideLayout()
+    {
+        if (group_by_attrs.empty())
+        {
+            layout = Layout::SINGLE;
+        }
+        else if (group_by_attrs.size() == 1 && key_types[0] == INT)
+        {
+            layout = Layout::DIRECT;
+            direct.assign(MIN_CAPACITY, NO_GROUP);
+            int_keys.reserve(expected_groups);
+        }
+        else
+        {
+            layout = Layout::PACKED;
+            packed_slots.assign(std::max(MIN_CAPACITY, std::bit_ceil(expected_groups * 2)), PackedSlot{0, NO_GROUP});
+            packed_offsets.reserve(expected_groups + 1);
+        }
+        states.reserve(expected_groups * states_per_group);
+    }
+
+    void checkTypes(const Batch &batch) const
+    {
+        for (size_t i = 0; i < group_by_attrs.size(); i++)
+        {
+            if (columnOf(batch, group_by_attrs[i]).type != key_types[i])
+            {
+                throw std::runtime_error("Group-by column " + std::to_string(group_by_attrs[i] + 1) + " changes type.");
+            }
+        }
+        for (size_t a = 0; a < aggr_funcs.size(); a++)
+        {
+            if (aggr_funcs[a].func != AggrFuncType::COUNT_STAR &&
+                columnOf(batch, aggr_funcs[a].attr_index).type != value_types[a])
+            {
+                throw std::runtime_error("Aggregated column " + std::to_string(aggr_funcs[a].attr_index + 1) + " changes type.");
+            }
+        }
+    }
+
+    static const ColumnVector &columnOf(const Batch &batch, size_t attr)
+    {
+        if (attr >= batch.columns.size())
+        {
+            throw std::runtime_error("Column " + std::to_string(attr + 1) + " does not exist.");
+        }
+        return batch.columns[attr];
+    }
+
+    static uint64_t mix(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        return value;
+    }
+
+    uint32_t findOrCreateGroup(const Batch &batch, uint16_t row)
+    {
+        switch (layout)
+        {
+        case Layout::SINGLE:
+            return num_groups == 0 ? newGroup() : 0;
+        case Layout::DIRECT:
+        case Layout::HASH_INT:
+            return findOrCreateIntGroup(batch.columns[group_by_attrs[0]].ints[row]);
+        default:
+            packKey(batch, row);
+            return findOrCreatePackedGroup(packed_key, std::hash<std::string_view>()(packed_key));
+        }
+    }
+
+    uint32_t newGroup()
+    {
+        for (size_t a = 0; a < aggr_funcs.size(); a++)
+        {
+            const AggrFunc &aggr = aggr_funcs[a];
+            AggregateState state{};
+            bool is_int = countsRows(a) || value_types[a] == INT;
+            if (aggr.func == AggrFuncType::MIN)
+            {
+                is_int ? state.int_value = std::numeric_limits<int64_t>::max()
+                       : state.float_value = std::numeric_limits<double>::infinity();
+            }
+            else if (aggr.func == AggrFuncType::MAX)
+            {
+                is_int ? state.int_value = std::numeric_limits<int64_t>::min()
+                       : state.float_value = -std::numeric_limits<double>::infinity();
+            }
+            else if (!is_int)
+            {
+                state.float_value = 0;
+            }
+            states.push_back(state);
+            if (aggr.func == AggrFuncType::AVG)
+            {
+                states.push_back(AggregateState{}); // Count
+            }
+        }
+        return static_cast<uint32_t>(num_groups++);
+    }
+
+    void moveToHashInt()
+    {
+        layout = Layout::HASH_INT;
+        direct.clear();
+        direct.shrink_to_fit();
+        int_slots.assign(std::max(MIN_CAPACITY, std::bit_ceil(std::max(num_groups, expected_groups) * 2)), IntSlot{0, NO_GROUP});
+        for (size_t group = 0; group < num_groups; group++)
+        {
+            insertIntSlot(int_keys[group], static_cast<uint32_t>(group));
+        }
+    }
+
+    void insertIntSlot(int64_t key, uint32_t group)
+    {
+        size_t mask = int_slots.size() - 1;
+        size_t slot = mix(static_cast<uint64_t>(key)) & mask;
+        while (int_slots[slot].group != NO_GROUP)
+        {
+            slot = (slot + 1) & mask;
+        }
+        int_slots[slot] = IntSlot{key, group};
+    }
+
+    uint32_t findOrCreateIntGroup(int key)
+    {
+        if (layout == Layout::DIRECT)
+        {
+            if (key >= 0 && static_cast<size_t>(key) < DIRECT_MAX_DOMAIN)
+            {
+                if (static_cast<size_t>(key) >= direct.size())
+                {
+                    direct.resize(std::bit_ceil(static_cast<size_t>(key) + 1), NO_GROUP);
+                }
+                uint32_t &group = direct[key];
+                if (group == NO_GROUP)
+                {
+                    group = newGroup();
+                    int_keys.push_back(key);
+                }
+                return group;
+            }
+            moveToHashInt();
+        }
+        size_t mask = int_slots.size() - 1;
+        for (size_t slot = mix(static_cast<uint64_t>(key)) & mask;; slot = (slot + 1) & mask)
+        {
+            if (int_slots[slot].group == NO_GROUP)
+            {
+                uint32_t group = newGroup();
+                int_keys.push_back(key);
+                int_slots[slot] = IntSlot{key, group};
+                if (num_groups * 2 > int_slots.size())
+                {
+                    std::vector<IntSlot> old = std::exchange(int_slots, std::vector<IntSlot>(int_slots.size() * 2, IntSlot{0, NO_GROUP}));
+                    for (const IntSlot &entry : old)
+                    {
+                        if (entry.group != NO_GROUP)
+                        {
+                            insertIntSlot(entry.key, entry.group);
+                        }
+                    }
+                }
+                return group;
+            }
+            if (int_slots[slot].key == key)
+            {
+                return int_slots[slot].group;
+            }
+        }
+    }
+
+    // Packs the key columns of the row into packed_key
+    void packKey(const Batch &batch, uint16_t row)
+    {
+        packed_key.clear();
+        for (size_t i = 0; i < group_by_attrs.size(); i++)
+        {
+            const ColumnVector &column = batch.columns[group_by_attrs[i]];
+            if (key_types[i] == INT)
+            {
+                packed_key.append(reinterpret_cast<const char *>(&column.ints[row]), sizeof(int));
+            }
+            else if (key_types[i] == FLOAT)
+            {
+                packed_key.append(reinterpret_cast<const char *>(&column.floats[row]), sizeof(float));
+            }
+            else
+            {
+                uint32_t length = static_cast<uint32_t>(column.strings[row].size());
+                packed_key.append(reinterpret_cast<const char *>(&length), sizeof(length));
+                packed_key.append(column.strings[row]);
+            }
+        }
+    }
+
+    std::string_view packedKeyOf(size_t group) const
+    {
+        return std::string_view(packed_keys.data() + packed_offsets[group], packed_offsets[group + 1] - packed_offsets[group]);
+    }
+
+    uint32_t findOrCreatePackedGroup(std::string_view key, uint64_t hash)
+    {
+        size_t mask = packed_slots.size() - 1;
+        for (size_t slot = mix(hash) & mask;; slot = (slot + 1) & mask)
+        {
+            const PackedSlot &entry = packed_slots[slot];
+            if (entry.group == NO_GROUP)
+            {
+                uint32_t group = newGroup();
+                packed_keys.insert(packed_keys.end(), key.begin(), key.end());
+                packed_offsets.push_back(packed_keys.size());
+                packed_slots[slot] = PackedSlot{hash, group};
+                if (num_groups * 2 > packed_slots.size())
+                {
+                    growPacked();
+                }
+                return group;
+            }
+            if (entry.hash == hash && packedKeyOf(entry.group) == key)
+            {
+                return entry.group;
+            }
+        }
+    }
+
+    void growPacked()
+    {
+        std::vector<PackedSlot> old = std::exchange(packed_slots, std::vector<PackedSlot>(packed_slots.size() * 2, PackedSlot{0, NO_GROUP}));
+        size_t mask = packed_slots.size() - 1;
+        for (const PackedSlot &entry : old)
+        {
+            if (entry.group == NO_GROUP)
+            {
+                continue;
+            }
+            size_t slot = mix(entry.hash) & mask;
+            while (packed_slots[slot].group != NO_GROUP)
+            {
+                slot = (slot + 1) & mask;
+            }
+            packed_slots[slot] = entry;
+        }
+    }
+
+    void unpackKey(size_t group, Tuple &tuple) const
+    {
+        const char *position = packed_keys.data() + packed_offsets[group];
+        for (FieldType type : key_types)
+        {
+            if (type == INT)
+            {
+                int value;
+                std::memcpy(&value, position, sizeof(value));
+                tuple.addField(std::make_unique<Field>(value));
+                position += sizeof(value);
+            }
+            else if (type == FLOAT)
+            {
+                float value;
+                std::memcpy(&value, position, sizeof(value));
+                tuple.addField(std::make_unique<Field>(value));
+                position += sizeof(value);
+            }
+            else
+            {
+                uint32_t length;
+                std::memcpy(&length, position, sizeof(length));
+                position += sizeof(length);
+                tuple.addField(std::make_unique<Field>(std::string(position, length)));
+                position += length;
+            }
+        }
+    }
+
+    // Applies aggregate `a` to the rows of the batch, with the function and
+    // value type chosen once for the whole batch
+    void accumulate(const Batch &batch, size_t a)
+    {
+        const AggrFunc &aggr = aggr_funcs[a];
+        const size_t stride = states_per_group;
+        AggregateState *base = states.data() + state_offsets[a];
+        if (countsRows(a) || aggr.func == AggrFuncType::AVG)
+        {
+            AggregateState *counts = aggr.func == AggrFuncType::AVG ? base + 1 : base;
+            for (uint32_t group : row_groups)
+            {
+                counts[group * stride].int_value++;
+            }
+            if (aggr.func != AggrFuncType::AVG)
+            {
+                return;
+            }
+        }
+        const ColumnVector &column = batch.columns[aggr.attr_index];
+        if (value_types[a] == INT)
+        {
+            updateAll(batch, aggr.func, column.ints.data(), [base, stride](uint32_t group) -> int64_t &
+                      { return base[group * stride].int_value; });
+        }
+        else
+        {
+            updateAll(batch, aggr.func, column.floats.data(), [base, stride](uint32_t group) -> double &
+                      { return base[group * stride].float_value; });
+        }
+    }
+
+    template <typename T, typename StateOf>
+    void updateAll(const Batch &batch, AggrFuncType func, const T *values, StateOf stateOf)
+    {
+        auto update = [&](auto &&combine)
+        {
+            for (size_t i = 0; i < row_groups.size(); i++)
+            {
+                auto &state = stateOf(row_groups[i]);
+                state = combine(state, values[batch.selection[i]]);
+            }
+        };
+        switch (func)
+        {
+        case AggrFuncType::SUM:
+        case AggrFuncType::AVG: // Its sum; accumulate() counts the rows
+            update([](auto state, T value)
+                   { return state + value; });
+            break;
+        case AggrFuncType::MIN:
+            update([](auto state, T value)
+                   { return std::min<decltype(state)>(state, value); });
+            break;
+        case AggrFuncType::MAX:
+            update([](auto state, T value)
+                   { return std::max<decltype(state)>(state, value); });
+            break;
+        default:
+            throw std::runtime_error("Unsupported aggregation function.");
+        }
+    }
+};
+
+// Fan-out of a spilling aggregation at each level, and the deepest level
+// it splits to; a partition at that level is aggregated in memory however
+// large it is
+constexpr size_t AGGREGATION_SPILL_PARTITIONS = 16;
+constexpr size_t AGGREGATION_MAX_SPILL_LEVEL = 4;
+
+// Partial groups a spilling aggregation wrote out, split into partitions
+// by key hash, one encrypted spill file per partition. A table can be
+// written several times; a key then has several partial groups in its
+// partition, which are merged when the partition is read back.
+class AggregationSpill
+{
+private:
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+    size_t level;
+    std::vector<std::unique_ptr<EncryptedSpillFile>> files;
+    std::vector<std::string> blocks; // Unwritten groups of each partition
+
+public:
+    explicit AggregationSpill(size_t level)
+        : level(level), files(AGGREGATION_SPILL_PARTITIONS), blocks(AGGREGATION_SPILL_PARTITIONS) {}
+
+    size_t getLevel() const { return level; }
+
+    void write(const AggregationTable &table)
+    {
+        for (size_t group = 0; group < table.size(); group++)
+        {
+            size_t partition = table.partitionOf(group, AGGREGATION_SPILL_PARTITIONS, level);
+            table.serializeGroup(group, blocks[partition]);
+            if (blocks[partition].size() >= BLOCK_BYTES)
+            {
+                flush(partition);
+            }
+        }
+    }
+
+    // The files of the partitions, rewound for reading; null for the
+    // partitions no group went to
+    std::vector<std::unique_ptr<EncryptedSpillFile>> finish()
+    {
+        for (size_t partition = 0; partition < files.size(); partition++)
+        {
+            flush(partition);
+            if (files[partition])
+            {
+                files[partition]->rewind();
+            }
+        }
+        return std::move(files);
+    }
+
+private:
+    void flush(size_t partition)
+    {
+        if (blocks[partition].empty())
+        {
+            return;
+        }
+        if (!files[partition])
+        {
+            files[partition] = std::make_unique<EncryptedSpillFile>();
+        }
+        files[partition]->append(blocks[partition]);
+        blocks[partition].clear();
+    }
+};
+
+// Groups its input and computes the aggregates of every group. Groups are
+// kept in AggregationTables within a memory budget: when a table outgrows
+// it, its partial groups are written to encrypted spill files, split into
+// partitions by key hash, and the table starts over. Each partition is
+// then aggregated on its own as the output is read, and split again, by
+// other hash bits, if it still does not fit. Over a parallel scan, the
+// workers aggregate in two phases and share the budget.
+class HashAggregationOperator : public UnaryOperator
+{
+private:
+    // The spill files of one partition and the level that wrote them
+    struct SpilledPartition
+    {
+        std::vector<std::unique_ptr<EncryptedSpillFile>> files;
+        size_t level;
+    };
+
+    // Bytes a group takes in a table sized for it up front, leaving out its key
+    static constexpr size_t PRESIZED_GROUP_BYTES = 48;
+
+    std::vector<size_t> group_by_attrs;
+    std::vector<AggrFunc> aggr_funcs;
+    size_t memory_budget;
+    size_t expected_groups = 0;
+    std::optional<AggregationTable> prototype; // Column types for reading spilled groups back
+    std::deque<AggregationTable> tables;       // Aggregated groups not output yet
+    std::vector<SpilledPartition> pending;     // Partitions still to aggregate
+    size_t output_group = 0;                   // Next group of tables.front()
+    std::optional<Tuple> current_tuple;        // Group the last next() produced
+
+    // Groups to size a table for within `budget`: no more than fill half of
+    // it, so an estimate that is too high does not make the table spill
+    static size_t presizedGroups(size_t groups, size_t budget)
+    {
+        return std::min(groups, budget / (2 * PRESIZED_GROUP_BYTES));
+    }
+
+public:
+    HashAggregationOperator(Operator &input, std::vector<size_t> group_by_attrs, std::vector<AggrFunc> aggr_funcs,
+                            size_t memory_budget = operatorMemoryFromEnvironment())
+        : UnaryOperator(input), group_by_attrs(group_by_attrs), aggr_funcs(aggr_funcs), memory_budget(memory_budget) {}
+
+    // Sizes the tables for about this many groups, so they do not grow
+    // and rehash as the groups come in
+    void expectGroups(size_t groups) { expected_groups = groups; }
+
+    void open() override
+    {
+        reset();
+        if (auto *parallel_scan = dynamic_cast<ParallelScanOperator *>(input))
+        {
+            aggregateInParallel(*parallel_scan);
+            return;
+        }
+        input->open(); // Ensure the input operator is opened
+
+        // The input is consumed a batch at a time, straight from its columns
+        AggregationTable table(group_by_attrs, aggr_funcs, presizedGroups(expected_groups, memory_budget));
+        std::optional<AggregationSpill> spill;
+        Batch batch;
+        while (input->nextBatch(batch))
+        {
+            table.add(batch);
+            if (table.memoryBytes() > memory_budget)
+            {
+                spillTable(spill, 1, table);
+            }
+        }
+        prototype = table.emptyCopy();
+        if (spill)
+        {
+            spill->write(table);
+            addPending(spill->finish(), spill->getLevel());
+        }
+        else
+        {
+            // Groups come out in the order they were first seen
+            tables.push_back(std::move(table));
+        }
+    }
+
+    bool next() override
+    {
+        if (!advance())
+        {
+            current_tuple.reset();
+            return false;
+        }
+        current_tuple = tables.front().groupTuple(output_group++);
+        return true;
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        batch.clear();
+        while (!batch.full() && advance())
+        {
+            batch.appendRow(tables.front().groupTuple(output_group++).fields);
+        }
+        return batch.num_rows > 0;
+    }
+
+    void close() override
+    {
+        input->close();
+        reset();
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        std::vector<std::unique_ptr<Field>> outputCopy;
+        if (current_tuple)
+        {
+            for (const auto &field : current_tuple->fields)
+            {
+                outputCopy.push_back(field->clone()); // Use the clone method to create a deep copy of each field
+            }
+        }
+        return outputCopy;
+    }
+
+private:
+    void reset()
+    {
+        tables.clear();
+        pending.clear(); // Deletes the spill files
+        prototype.reset();
+        output_group = 0;
+        current_tuple.reset();
+    }
+
+    // Writes the table's groups out and empties it
+    static void spillTable(std::optional<AggregationSpill> &spill, size_t level, AggregationTable &table)
+    {
+        if (!spill)
+        {
+            spill.emplace(level);
+        }
+        spill->write(table);
+        table = table.emptyCopy();
+    }
+
+    void addPending(std::vector<std::unique_ptr<EncryptedSpillFile>> files, size_t level)
+    {
+        for (auto &file : files)
+        {
+            if (file)
+            {
+                SpilledPartition partition{{}, level};
+                partition.files.push_back(std::move(file));
+                pending.push_back(std::move(partition));
+            }
+        }
+    }
+
+    // Makes tables.front() have a group left to output, aggregating
+    // spilled partitions as needed; false once all groups are out
+    bool advance()
+    {
+        while (true)
+        {
+            if (!tables.empty() && output_group < tables.front().size())
+            {
+                return true;
+            }
+            if (!tables.empty())
+            {
+                tables.pop_front();
+                output_group = 0;
+                continue;
+            }
+            if (pending.empty())
+            {
+                return false;
+            }
+            SpilledPartition partition = std::move(pending.back());
+            pending.pop_back();
+            aggregatePartition(partition);
+        }
+    }
+
+    // Merges the partial groups of a spilled partition. A partition that
+    // outgrows the budget is split again, one level down.
+    void aggregatePartition(SpilledPartition &partition)
+    {
+        AggregationTable table = prototype->emptyCopy();
+        std::optional<AggregationSpill> spill;
+        bool may_split = partition.level < AGGREGATION_MAX_SPILL_LEVEL;
+        std::string block;
+        for (auto &file : partition.files)
+        {
+            while (file->read(block))
+            {
+                std::string_view groups = block;
+                while (!groups.empty())
+                {
+                    table.mergeSerialized(groups);
+                }
+                if (may_split && table.memoryBytes() > memory_budget)
+                {
+                    spillTable(spill, partition.level + 1, table);
+                }
+            }
+            file.reset(); // Read in full: delete it now
+        }
+        if (spill)
+        {
+            spill->write(table);
+            addPending(spill->finish(), spill->getLevel());
+        }
+        else
+        {
+            tables.push_back(std::move(table));
+        }
+    }
+
+    // Two-phase aggregation over a scan that runs on the task scheduler.
+    // Every worker first aggregates the batches it scans into a table of
+    // its own, within its share of the budget. If no worker had to spill,
+    // the groups of each table are routed to partitions by key hash, and
+    // every partition is merged from all tables as a task of its own; no
+    // table is ever shared between threads. The groups come out partition
+    // by partition. Otherwise the workers write out what they hold as
+    // well, and the spilled partitions are merged one at a time as the
+    // output is read.
+    void aggregateInParallel(ParallelScanOperator &scan)
+    {
+        const size_t degree = scan.getDegree();
+        const size_t num_partitions = 2 * degree;
+        const size_t worker_budget = memory_budget / degree;
+        std::vector<AggregationTable> partials(
+            degree, AggregationTable(group_by_attrs, aggr_funcs, presizedGroups(expected_groups, worker_budget)));
+        std::vector<std::optional<AggregationSpill>> spills(degree);
+        scan.run([&](size_t worker, Batch &batch)
+                 {
+            partials[worker].add(batch);
+            if (partials[worker].memoryBytes() > worker_budget)
+            {
+                spillTable(spills[worker], 1, partials[worker]);
+            } });
+
+        if (std::any_of(spills.begin(), spills.end(), [](const auto &spill)
+                        { return spill.has_value(); }))
+        {
+            taskScheduler().parallelFor(degree, [&](size_t, size_t w)
+                                        {
+                if (partials[w].size() > 0)
+                {
+                    spillTable(spills[w], 1, partials[w]);
+                } });
+            std::vector<SpilledPartition> partitions(AGGREGATION_SPILL_PARTITIONS);
+            for (size_t w = 0; w < degree; w++)
+            {
+                if (!spills[w])
+                {
+                    continue;
+                }
+                prototype = partials[w].emptyCopy();
+                auto files = spills[w]->finish();
+                for (size_t p = 0; p < files.size(); p++)
+                {
+                    partitions[p].level = 1;
+                    if (files[p])
+                    {
+                        partitions[p].files.push_back(std::move(files[p]));
+                    }
+                }
+            }
+            for (SpilledPartition &partition : partitions)
+            {
+                if (!partition.files.empty())
+                {
+                    pending.push_back(std::move(partition));
+                }
+            }
+            return;
+        }
+
+        // routes[w][p]: the groups of partials[w] that belong to partition p
+        std::vector<std::vector<std::vector<uint32_t>>> routes(degree, std::vector<std::vector<uint32_t>>(num_partitions));
+        taskScheduler().parallelFor(degree, [&](size_t, size_t w)
+                                    {
+            for (size_t group = 0; group < partials[w].size(); group++)
+            {
+                routes[w][partials[w].partitionOf(group, num_partitions)].push_back(static_cast<uint32_t>(group));
+            } });
+
+        std::vector<AggregationTable> partitions(
+            num_partitions, AggregationTable(group_by_attrs, aggr_funcs,
+                                             presizedGroups(expected_groups / num_partitions, memory_budget / num_partitions)));
+        taskScheduler().parallelFor(num_partitions, [&](size_t, size_t p)
+                                    {
+            for (size_t w = 0; w < degree; w++)
+            {
+                for (uint32_t group : routes[w][p])
+                {
+                    partitions[p].mergeGroup(partials[w], group);
+                }
+            } });
+        for (AggregationTable &partition : partitions)
+        {
+            tables.push_back(std::move(partition));
+        }
+    }
+};
+
+enum class JoinType
+{
+    INNER, // Every pair of matching rows
+    LEFT,  // Also the probe rows without a match, padded (see HashJoinOperator)
+    SEMI,  // The probe rows with a match, once each
+    ANTI   // The probe rows without a match
+};
+
+class JoinSpill;
+
+// Build side of a hash join. Rows are collected column by column with the
+// hash of their key. finish() then scatters them into 2^radix_bits
+// partitions by the top bits of the hash, each sized to fit in the CPU
+// cache, and chains the rows of each partition into buckets by the low
+// bits, so that probing a row touches one small partition.
+class JoinHashTable
+{
+public:
+    static constexpr uint32_t NO_ROW = std::numeric_limits<uint32_t>::max();
+
+    struct Partition
+    {
+        std::vector<ColumnVector> columns;
+        std::vector<uint64_t> hashes;
+        std::vector<uint32_t> buckets; // First row of each bucket
+        std::vector<uint32_t> next;    // Next row of the same bucket
+    };
+
+private:
+    static constexpr size_t PARTITION_BYTES = 256 * 1024;
+    static constexpr unsigned MAX_RADIX_BITS = 10;
+
+    std::vector<size_t> key_attrs;
+    std::vector<FieldType> types; // Of the build rows' columns
+    std::vector<ColumnVector> staged;
+    std::vector<uint64_t> staged_hashes;
+    size_t staged_bytes = 0;
+    unsigned radix_bits = 0;
+    std::vector<Partition> partitions;
+
+public:
+    explicit JoinHashTable(std::vector<size_t> key_attrs) : key_attrs(std::move(key_attrs)) {}
+
+    // Hash of the row's values in the key columns
+    static uint64_t hashKey(const Batch &batch, const std::vector<size_t> &key_attrs, uint16_t row)
+    {
+        uint64_t hash = 0;
+        for (size_t attr : key_attrs)
+        {
+            const ColumnVector &column = batch.columns[attr];
+            uint64_t value;
+            if (column.type == INT)
+            {
+                value = static_cast<uint64_t>(static_cast<int64_t>(column.ints[row]));
+            }
+            else if (column.type == FLOAT)
+            {
+                float number = column.floats[row] == 0 ? 0.0f : column.floats[row]; // -0 == 0
+                uint32_t bits;
+                std::memcpy(&bits, &number, sizeof(bits));
+                value = bits;
+            }
+            else
+            {
+                value = std::hash<std::string>()(column.strings[row]);
+            }
+            hash = mix(hash ^ (value + 0x9e3779b97f4a7c15ull + (hash << 6) + (hash >> 2)));
+        }
+        return hash;
+    }
+
+    static uint64_t mix(uint64_t value)
+    {
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        value *= 0xc4ceb9fe1a85ec53ull;
+        value ^= value >> 33;
+        return value;
+    }
+
+    // Collects the selected rows of the batch
+    void add(const Batch &batch)
+    {
+        if (types.empty() && !batch.selection.empty())
+        {
+            checkKeys(batch);
+            staged.resize(batch.columns.size());
+            for (size_t i = 0; i < batch.columns.size(); i++)
+            {
+                types.push_back(batch.columns[i].type);
+                staged[i].type = types[i];
+            }
+        }
+        for (uint16_t row : batch.selection)
+        {
+            if (batch.columns.size() != types.size())
+            {
+                throw std::runtime_error("Build rows of a join differ in their number of columns.");
+            }
+            for (size_t i = 0; i < types.size(); i++)
+            {
+                if (batch.columns[i].type != types[i])
+                {
+                    throw std::runtime_error("Column " + std::to_string(i + 1) + " of a join's build side changes type.");
+                }
+                staged[i].appendFrom(batch.columns[i], row);
+                staged_bytes += types[i] == STRING ? sizeof(std::string) + batch.columns[i].strings[row].size() : sizeof(int);
+            }
+            staged_hashes.push_back(hashKey(batch, key_attrs, row));
+            staged_bytes += sizeof(uint64_t) + 2 * sizeof(uint32_t);
+        }
+    }
+
+    // Moves the collected rows to the spill; the column types stay
+    void spillTo(JoinSpill &spill);
+
+    // Bytes the collected rows take, about as much as the finished table
+    size_t memoryBytes() const { return staged_bytes; }
+
+    size_t size() const
+    {
+        size_t rows = staged_hashes.size();
+        for (const Partition &partition : partitions)
+        {
+            rows += partition.hashes.size();
+        }
+        return rows;
+    }
+
+    // Column types of the build rows; empty when there are none
+    const std::vector<FieldType> &columnTypes() const { return types; }
+
+    // Partitions the collected rows and builds the bucket chains, one task
+    // per partition when there are several
+    void finish()
+    {
+        size_t num_partitions = std::bit_ceil(std::max<size_t>(1, staged_bytes / PARTITION_BYTES));
+        num_partitions = std::min<size_t>(num_partitions, size_t(1) << MAX_RADIX_BITS);
+        radix_bits = static_cast<unsigned>(std::countr_zero(num_partitions));
+        partitions.assign(num_partitions, Partition());
+
+        std::vector<size_t> counts(num_partitions);
+        for (uint64_t hash : staged_hashes)
+        {
+            counts[partitionIndex(hash)]++;
+        }
+        for (size_t p = 0; p < num_partitions; p++)
+        {
+            partitions[p].columns.resize(types.size());
+            for (size_t i = 0; i < types.size(); i++)
+            {
+                partitions[p].columns[i].type = types[i];
+            }
+            partitions[p].hashes.reserve(counts[p]);
+        }
+        for (size_t row = 0; row < staged_hashes.size(); row++)
+        {
+            Partition &partition = partitions[partitionIndex(staged_hashes[row])];
+            for (size_t i = 0; i < types.size(); i++)
+            {
+                partition.columns[i].appendFrom(staged[i], row);
+            }
+            partition.hashes.push_back(staged_hashes[row]);
+        }
+        staged.assign(types.size(), ColumnVector());
+        staged_hashes = {};
+
+        auto chain = [this](size_t, size_t p)
+        {
+            Partition &partition = partitions[p];
+            partition.buckets.assign(std::bit_ceil(std::max<size_t>(1, partition.hashes.size())), NO_ROW);
+            partition.next.assign(partition.hashes.size(), NO_ROW);
+            size_t mask = partition.buckets.size() - 1;
+            // Insert back to front so that chains list rows in build order
+            for (size_t row = partition.hashes.size(); row-- > 0;)
+            {
+                uint32_t &head = partition.buckets[partition.hashes[row] & mask];
+                partition.next[row] = head;
+                head = static_cast<uint32_t>(row);
+            }
+        };
+        if (num_partitions > 1)
+        {
+            taskScheduler().parallelFor(num_partitions, chain);
+        }
+        else
+        {
+            chain(0, 0);
+        }
+    }
+
+    const Partition &partitionFor(uint64_t hash) const { return partitions[partitionIndex(hash)]; }
+
+    // First row of the partition in the bucket of `hash`; the rest of the
+    // bucket follows through Partition::next
+    static uint32_t firstCandidate(const Partition &partition, uint64_t hash)
+    {
+        return partition.buckets[hash & (partition.buckets.size() - 1)];
+    }
+
+    // Whether build row `build_row` has the key of probe row `row`
+    bool keysEqual(const Partition &partition, uint32_t build_row, const Batch &probe,
+                   const std::vector<size_t> &probe_keys, uint16_t row) const
+    {
+        for (size_t k = 0; k < key_attrs.size(); k++)
+        {
+            const ColumnVector &build = partition.columns[key_attrs[k]];
+            const ColumnVector &column = probe.columns[probe_keys[k]];
+            if (build.type == INT ? build.ints[build_row] != column.ints[row]
+                : build.type == FLOAT ? build.floats[build_row] != column.floats[row]
+                                      : build.strings[build_row] != column.strings[row])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Throws unless the probe batch's key columns exist and have the types
+    // of the build side's
+    void checkProbeKeys(const Batch &probe, const std::vector<size_t> &probe_keys) const
+    {
+        for (size_t k = 0; k < probe_keys.size(); k++)
+        {
+            if (probe_keys[k] >= probe.columns.size())
+            {
+                throw std::runtime_error("Join column " + std::to_string(probe_keys[k] + 1) + " does not exist.");
+            }
+            if (!types.empty() && probe.columns[probe_keys[k]].type != types[key_attrs[k]])
+            {
+                throw std::runtime_error("Join columns " + std::to_string(probe_keys[k] + 1) + " and " +
+                                         std::to_string(key_attrs[k] + 1) + " differ in type.");
+            }
+        }
+    }
+
+private:
+    size_t partitionIndex(uint64_t hash) const
+    {
+        return radix_bits == 0 ? 0 : hash >> (64 - radix_bits);
+    }
+
+    void checkKeys(const Batch &batch) const
+    {
+        for (size_t attr : key_attrs)
+        {
+            if (attr >= batch.columns.size())
+            {
+                throw std::runtime_error("Join column " + std::to_string(attr + 1) + " does not exist.");
+            }
+        }
+    }
+};
+
+// Spilled rows are stored value after value: INT and FLOAT values as 4
+// bytes, strings as their length (4 bytes) followed by their bytes
+void serializeRow(const std::vector<ColumnVector> &columns, size_t row, std::string &out)
+{
+    for (const ColumnVector &column : columns)
+    {
+        if (column.type == INT)
+        {
+            out.append(reinterpret_cast<const char *>(&column.ints[row]), sizeof(int));
+        }
+        else if (column.type == FLOAT)
+        {
+            out.append(reinterpret_cast<const char *>(&column.floats[row]), sizeof(float));
+        }
+        else
+        {
+            uint32_t length = static_cast<uint32_t>(column.strings[row].size());
+            out.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            out.append(column.strings[row]);
+        }
+    }
+}
+
+// Appends the row at the start of `in` to the columns, which have the
+// row's types, and moves `in` past it
+void deserializeRow(std::string_view &in, std::vector<ColumnVector> &columns)
+{
+    auto read = [&in](auto &value)
+    {
+        std::memcpy(&value, in.data(), sizeof(value));
+        in.remove_prefix(sizeof(value));
+    };
+    for (ColumnVector &column : columns)
+    {
+        if (column.type == INT)
+        {
+            read(column.ints.emplace_back());
+        }
+        else if (column.type == FLOAT)
+        {
+            read(column.floats.emplace_back());
+        }
+        else
+        {
+            uint32_t length;
+            read(length);
+            column.strings.emplace_back(in.substr(0, length));
+            in.remove_prefix(length);
+        }
+    }
+}
+
+// Fan-out of a spilling hash join at each level, and the deepest level it
+// splits to; a partition at that level is joined in memory however large
+// its build side is
+constexpr size_t JOIN_SPILL_PARTITIONS = 16;
+constexpr size_t JOIN_MAX_SPILL_LEVEL = 4;
+
+// Rows of one side of a hash join that does not fit in memory, written to
+// one encrypted spill file per partition. Both sides are split by the same
+// key hash, so matching rows end up in partitions with the same number.
+class JoinSpill
+{
+private:
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+
+    size_t level;
+    std::vector<size_t> key_attrs;
+    std::vector<FieldType> types;
+    std::vector<std::unique_ptr<EncryptedSpillFile>> files;
+    std::vector<std::string> blocks;
+
+public:
+    JoinSpill(size_t level, std::vector<size_t> key_attrs)
+        : level(level), key_attrs(std::move(key_attrs)), files(JOIN_SPILL_PARTITIONS), blocks(JOIN_SPILL_PARTITIONS) {}
+
+    size_t getLevel() const { return level; }
+    const std::vector<FieldType> &columnTypes() const { return types; }
+
+    // Each level splits by other bits than the level above and than the
+    // radix partitions of JoinHashTable
+    static size_t partitionOf(uint64_t hash, size_t level)
+    {
+        return (JoinHashTable::mix(hash ^ (level * 0x9e3779b97f4a7c15ull)) >> 32) % JOIN_SPILL_PARTITIONS;
+    }
+
+    void add(const Batch &batch)
+    {
+        for (uint16_t row : batch.selection)
+        {
+            addRow(batch.columns, row, JoinHashTable::hashKey(batch, key_attrs, row));
+        }
+    }
+
+    // Writes row `row` of the columns, whose key hashes to `hash`
+    void addRow(const std::vector<ColumnVector> &columns, size_t row, uint64_t hash)
+    {
+        if (types.empty())
+        {
+            for (const ColumnVector &column : columns)
+            {
+                types.push_back(column.type);
+            }
+        }
+        size_t partition = partitionOf(hash, level);
+        std::string &block = blocks[partition];
+        serializeRow(columns, row, block);
+        if (block.size() >= BLOCK_BYTES)
+        {
+            flush(partition);
+        }
+    }
+
+    // The files of the partitions, rewound for reading; null for the
+    // partitions no row went to
+    std::vector<std::unique_ptr<EncryptedSpillFile>> finish()
+    {
+        for (size_t partition = 0; partition < files.size(); partition++)
+        {
+            flush(partition);
+            if (files[partition])
+            {
+                files[partition]->rewind();
+            }
+        }
+        return std::move(files);
+    }
+
+private:
+    void flush(size_t partition)
+    {
+        if (blocks[partition].empty())
+        {
+            return;
+        }
+        if (!files[partition])
+        {
+            files[partition] = std::make_unique<EncryptedSpillFile>();
+        }
+        files[partition]->append(blocks[partition]);
+        blocks[partition].clear();
+    }
+};
+
+void JoinHashTable::spillTo(JoinSpill &spill)
+{
+    for (size_t row = 0; row < staged_hashes.size(); row++)
+    {
+        spill.addRow(staged, row, staged_hashes[row]);
+    }
+    for (ColumnVector &column : staged)
+    {
+        column.clear();
+    }
+    staged_hashes.clear();
+    staged_bytes = 0;
+}
+
+// Reads the rows of a JoinSpill partition back, a batch at a time
+class JoinSpillReader
+{
+private:
+    std::unique_ptr<EncryptedSpillFile> file; // Null for an empty partition
+    std::vector<FieldType> types;
+    std::string block;
+    std::string_view unread; // Rows of `block` not read yet
+
+public:
+    JoinSpillReader(std::unique_ptr<EncryptedSpillFile> file, std::vector<FieldType> types)
+        : file(std::move(file)), types(std::move(types)) {}
+
+    bool nextBatch(Batch &batch)
+    {
+        batch.clear();
+        batch.columns.resize(types.size());
+        for (size_t i = 0; i < types.size(); i++)
+        {
+            batch.columns[i].type = types[i];
+        }
+        while (!batch.full())
+        {
+            if (unread.empty())
+            {
+                if (!file || !file->read(block))
+                {
+                    break;
+                }
+                unread = block;
+            }
+            deserializeRow(unread, batch.columns);
+            batch.selection.push_back(static_cast<uint16_t>(batch.num_rows++));
+        }
+        return batch.num_rows > 0;
+    }
+};
+
+// Equi-join of its left input (the probe side) with its right input (the
+// build side), which is collected into a radix-partitioned JoinHashTable.
+// Output rows hold the probe row's columns followed, for inner and left
+// joins, by the build row's. The engine has no NULL, so a left join pads
+// probe rows without a match with 0, 0.0 or "" in the build columns.
+//
+// When the probe side is a parallel scan, probing runs inside the scan's
+// pipelines on the scheduler's workers. When the build side outgrows the
+// memory budget, both sides are split into encrypted spill files by key
+// hash and the partitions are joined one pair at a time, split again if a
+// build partition still does not fit.
+class HashJoinOperator : public BinaryOperator
+{
+private:
+    // Where probing of a probe batch stands, so that it can stop when the
+    // output batch is full and go on into the next one
+    struct ProbeCursor
+    {
+        size_t index = 0; // Into the probe batch's selection
+        bool started = false;
+        uint64_t hash = 0;
+        const JoinHashTable::Partition *partition = nullptr;
+        uint32_t match = JoinHashTable::NO_ROW; // Next build row to look at
+        bool matched = false;
+    };
+
+    // The spill files of one partition of both sides
+    struct SpilledPair
+    {
+        std::unique_ptr<EncryptedSpillFile> build; // Null if no build row went there
+        std::unique_ptr<EncryptedSpillFile> probe;
+        size_t level;
+    };
+
+    std::vector<size_t> probe_keys;
+    std::vector<size_t> build_keys;
+    JoinType type;
+    size_t memory_budget;
+    std::optional<JoinHashTable> table;
+    std::vector<FieldType> build_types;
+    ParallelScanOperator *parallel_probe = nullptr; // Set while probing in parallel
+    std::vector<Batch> worker_outputs;
+
+    Batch probe_batch;
+    ProbeCursor cursor;
+    bool probe_batch_done = true;
+
+    // Once spilled, probe rows come from the files of the pair being joined
+    bool spilled = false;
+    std::vector<FieldType> probe_types;
+    std::vector<SpilledPair> pending; // Pairs still to join
+    std::optional<JoinSpillReader> probe_reader;
+
+    Batch current; // Batch next() walks through
+    size_t current_row = 0;
+    bool has_current = false;
+
+public:
+    HashJoinOperator(Operator &probe, Operator &build, std::vector<size_t> probe_keys, std::vector<size_t> build_keys,
+                     JoinType type = JoinType::INNER, size_t memory_budget = operatorMemoryFromEnvironment())
+        : BinaryOperator(probe, build), probe_keys(std::move(probe_keys)), build_keys(std::move(build_keys)),
+          type(type), memory_budget(memory_budget)
+    {
+        if (this->probe_keys.empty() || this->probe_keys.size() != this->build_keys.size())
+        {
+            throw std::invalid_argument("A hash join needs as many probe as build key columns, at least one.");
+        }
+    }
+
+    void open() override
+    {
+        reset();
+        input_right->open();
+        table.emplace(build_keys);
+        std::optional<JoinSpill> build_spill;
+        Batch batch;
+        while (input_right->nextBatch(batch))
+        {
+            if (build_spill)
+            {
+                build_spill->add(batch);
+                continue;
+            }
+            table->add(batch);
+            if (table->memoryBytes() > memory_budget)
+            {
+                build_spill.emplace(1, build_keys);
+                table->spillTo(*build_spill);
+            }
+        }
+        build_types = table->columnTypes();
+
+        if (build_spill)
+        {
+            spilled = true;
+            input_left->open();
+            JoinSpill probe_spill(1, probe_keys);
+            while (input_left->nextBatch(batch))
+            {
+                table->checkProbeKeys(batch, probe_keys);
+                probe_spill.add(batch);
+            }
+            probe_types = probe_spill.columnTypes();
+            addPending(*build_spill, probe_spill);
+            table.reset();
+            return;
+        }
+        table->finish();
+
+        parallel_probe = dynamic_cast<ParallelScanOperator *>(input_left);
+        if (!parallel_probe)
+        {
+            input_left->open();
+            return;
+        }
+        // The probe runs on the scan's workers
+        worker_outputs.assign(parallel_probe->getDegree(), Batch());
+        parallel_probe->openWith([this](size_t worker, Batch &batch, const ParallelScanOperator::Consumer &emit)
+                                 {
+            Batch &output = worker_outputs[worker];
+            ProbeCursor at;
+            while (!probe(batch, at, output))
+            {
+                emit(worker, output);
+                output.clear();
+            }
+            if (output.num_rows > 0)
+            {
+                emit(worker, output);
+                output.clear();
+            } });
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        if (parallel_probe)
+        {
+            return parallel_probe->nextBatch(batch);
+        }
+        batch.clear();
+        while (!batch.full())
+        {
+            if (probe_batch_done)
+            {
+                if (!nextProbeBatch(probe_batch))
+                {
+                    break;
+                }
+                cursor = ProbeCursor();
+            }
+            probe_batch_done = probe(probe_batch, cursor, batch);
+        }
+        return batch.num_rows > 0;
+    }
+
+    bool next() override
+    {
+        if (has_current)
+        {
+            current_row++;
+        }
+        while (current_row >= current.selection.size())
+        {
+            if (!nextBatch(current))
+            {
+                has_current = false;
+                return false;
+            }
+            current_row = 0;
+        }
+        has_current = true;
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        std::vector<std::unique_ptr<Field>> fields;
+        if (has_current)
+        {
+            for (const ColumnVector &column : current.columns)
+            {
+                fields.push_back(std::make_unique<Field>(column.fieldAt(current.selection[current_row])));
+            }
+        }
+        return fields;
+    }
+
+    void close() override
+    {
+        input_left->close();
+        input_right->close();
+        reset();
+    }
+
+private:
+    void reset()
+    {
+        table.reset();
+        build_types.clear();
+        parallel_probe = nullptr;
+        worker_outputs.clear();
+        probe_batch.clear();
+        cursor = ProbeCursor();
+        probe_batch_done = true;
+        spilled = false;
+        probe_types.clear();
+        pending.clear(); // Deletes the spill files
+        probe_reader.reset();
+        current.clear();
+        current_row = 0;
+        has_current = false;
+    }
+
+    // Queues the partitions of the two spills that can produce output
+    void addPending(JoinSpill &build_spill, JoinSpill &probe_spill)
+    {
+        auto build_files = build_spill.finish();
+        auto probe_files = probe_spill.finish();
+        bool needs_match = type == JoinType::INNER || type == JoinType::SEMI;
+        for (size_t p = 0; p < JOIN_SPILL_PARTITIONS; p++)
+        {
+            if (probe_files[p] && (build_files[p] || !needs_match))
+            {
+                pending.push_back({std::move(build_files[p]), std::move(probe_files[p]), build_spill.getLevel()});
+            }
+        }
+    }
+
+    bool nextProbeBatch(Batch &batch)
+    {
+        if (!spilled)
+        {
+            return input_left->nextBatch(batch);
+        }
+        while (!probe_reader || !probe_reader->nextBatch(batch))
+        {
+            probe_reader.reset();
+            if (pending.empty())
+            {
+                return false;
+            }
+            SpilledPair pair = std::move(pending.back());
+            pending.pop_back();
+            joinPartition(pair);
+        }
+        return true;
+    }
+
+    // Builds the table of a spilled pair and starts reading its probe rows.
+    // A build partition that outgrows the budget is split again, one level
+    // down, together with its probe partition.
+    void joinPartition(SpilledPair &pair)
+    {
+        table.emplace(build_keys);
+        std::optional<JoinSpill> build_spill;
+        bool may_split = pair.level < JOIN_MAX_SPILL_LEVEL;
+        JoinSpillReader build_reader(std::move(pair.build), build_types);
+        Batch batch;
+        while (build_reader.nextBatch(batch))
+        {
+            if (build_spill)
+            {
+                build_spill->add(batch);
+                continue;
+            }
+            table->add(batch);
+            if (may_split && table->memoryBytes() > memory_budget)
+            {
+                build_spill.emplace(pair.level + 1, build_keys);
+                table->spillTo(*build_spill);
+            }
+        }
+        if (build_spill)
+        {
+            JoinSpill probe_spill(pair.level + 1, probe_keys);
+            JoinSpillReader reader(std::move(pair.probe), probe_types);
+            while (reader.nextBatch(batch))
+            {
+                probe_spill.add(batch);
+            }
+            addPending(*build_spill, probe_spill);
+            table.reset();
+            return;
+        }
+        table->finish();
+        probe_reader.emplace(std::move(pair.probe), probe_types);
+    }
+
+    // Joins the probe batch's rows from the cursor on into `output`.
+    // Returns true once every row of the batch is done, false when the
+    // output batch filled up first.
+    bool probe(const Batch &input, ProbeCursor &at, Batch &output) const
+    {
+        if (at.index == 0 && !at.started)
+        {
+            table->checkProbeKeys(input, probe_keys);
+        }
+        bool with_build_row = type == JoinType::INNER || type == JoinType::LEFT;
+        for (; at.index < input.selection.size(); at.index++, at.started = false)
+        {
+            uint16_t row = input.selection[at.index];
+            if (!at.started)
+            {
+                if (!with_build_row && output.full())
+                {
+                    return false; // Semi and anti joins emit at most one row per probe row
+                }
+                at.hash = JoinHashTable::hashKey(input, probe_keys, row);
+                at.partition = &table->partitionFor(at.hash);
+                at.match = JoinHashTable::firstCandidate(*at.partition, at.hash);
+                at.matched = false;
+                at.started = true;
+            }
+            const JoinHashTable::Partition &partition = *at.partition;
+            for (; at.match != JoinHashTable::NO_ROW; at.match = partition.next[at.match])
+            {
+                if (partition.hashes[at.match] != at.hash ||
+                    !table->keysEqual(partition, at.match, input, probe_keys, row))
+                {
+                    continue;
+                }
+                at.matched = true;
+                if (!with_build_row)
+                {
+                    break;
+                }
+                if (output.full())
+                {
+                    return false;
+                }
+                emitRow(input, row, &partition, at.match, output);
+            }
+            bool emit_alone = type == JoinType::SEMI ? at.matched : type != JoinType::INNER && !at.matched;
+            if (emit_alone)
+            {
+                if (output.full())
+                {
+                    return false;
+                }
+                emitRow(input, row, nullptr, 0, output);
+            }
+        }
+        return true;
+    }
+
+    // Appends the probe row to the output batch, followed for inner and
+    // left joins by the build row, or by padding when there is none
+    void emitRow(const Batch &input, uint16_t row, const JoinHashTable::Partition *partition, uint32_t build_row,
+                 Batch &output) const
+    {
+        bool with_build_row = type == JoinType::INNER || type == JoinType::LEFT;
+        size_t probe_columns = input.columns.size();
+        if (output.num_rows == 0)
+        {
+            output.columns.resize(probe_columns + (with_build_row ? build_types.size() : 0));
+            for (size_t i = 0; i < output.columns.size(); i++)
+            {
+                output.columns[i].type = i < probe_columns ? input.columns[i].type : build_types[i - probe_columns];
+            }
+        }
+        for (size_t i = 0; i < probe_columns; i++)
+        {
+            output.columns[i].appendFrom(input.columns[i], row);
+        }
+        if (with_build_row)
+        {
+            for (size_t i = 0; i < build_types.size(); i++)
+            {
+                ColumnVector &column = output.columns[probe_columns + i];
+                if (partition != nullptr)
+                {
+                    column.appendFrom(partition->columns[i], build_row);
+                }
+                else if (column.type == INT)
+                {
+                    column.ints.push_back(0);
+                }
+                else if (column.type == FLOAT)
+                {
+                    column.floats.push_back(0);
+                }
+                else
+                {
+                    column.strings.emplace_back();
+                }
+            }
+        }
+        output.selection.push_back(static_cast<uint16_t>(output.num_rows++));
+    }
+};
+
+// Column a sort orders by, numbered from 0
+struct SortKey
+{
+    size_t attr;
+    bool descending = false;
+};
+
+// Sorts its input by the sort keys; rows with equal keys keep their input
+// order. Each row is reduced to a normalized key, a byte string that
+// compares with memcmp in the requested order, so sorting and merging
+// never look at Fields or column types. Rows are collected within the
+// memory budget; when they outgrow it, they are sorted and written out as
+// an encrypted run, and the runs are merged k ways as the output is read.
+//
+// With a limit, only the first `limit` rows come out. The rows collected
+// then form a bounded heap that keeps the `limit` smallest keys seen, so
+// ORDER BY ... LIMIT n holds n rows however large the input is (and a run
+// never holds more than n rows).
+class SortOperator : public UnaryOperator
+{
+private:
+    static constexpr size_t BLOCK_BYTES = 64 * 1024;
+    // Most runs merged at once; more are first merged in groups of this many
+    static constexpr size_t SORT_MERGE_FAN_IN = 64;
+
+    // A collected row, stored in `arena` as its normalized key (followed
+    // by the row's input position) and then its values in the format of
+    // serializeRow()
+    struct SortEntry
+    {
+        uint64_t prefix; // First 8 bytes of the key, to compare without touching the arena
+        size_t offset;
+        uint32_t key_length;
+        uint32_t values_length;
+    };
+
+    struct RowView
+    {
+        uint64_t prefix = 0;
+        std::string_view key;
+        std::string_view values;
+    };
+
+    // Sequential reader over one spilled run; `current` points into `block`
+    struct Run
+    {
+        std::unique_ptr<EncryptedSpillFile> file;
+        std::string block;
+        std::string_view unread;
+        RowView current;
+
+        bool advance()
+        {
+            if (unread.empty())
+            {
+                if (!file->read(block))
+                {
+                    return false;
+                }
+                unread = block;
+            }
+            current.key = readPart();
+            current.values = readPart();
+            current.prefix = keyPrefix(current.key);
+            return true;
+        }
+
+        std::string_view readPart()
+        {
+            uint32_t length;
+            std::memcpy(&length, unread.data(), sizeof(length));
+            std::string_view part = unread.substr(sizeof(length), length);
+            unread.remove_prefix(sizeof(length) + length);
+            return part;
+        }
+    };
+
+    std::vector<SortKey> sort_keys;
+    size_t memory_budget;
+    std::optional<size_t> limit;
+    std::vector<FieldType> types;
+    std::string arena;
+    std::vector<SortEntry> rows; // Collected rows; a max-heap by key while a limit applies
+    size_t live_bytes = 0;       // Of `arena`, held by `rows`
+    std::string key;             // Key of the row being added
+    uint64_t input_rows = 0;
+    std::vector<Run> runs;
+    std::vector<size_t> merge_heap; // Runs by their current row, smallest on top
+    size_t position = 0;            // Next of `rows` when nothing spilled
+    size_t emitted = 0;
+
+    Batch current; // Batch next() walks through
+    size_t current_row = 0;
+    bool has_current = false;
+
+public:
+    SortOperator(Operator &input, std::vector<SortKey> sort_keys, std::optional<size_t> limit = std::nullopt,
+                 size_t memory_budget = operatorMemoryFromEnvironment())
+        : UnaryOperator(input), sort_keys(std::move(sort_keys)), memory_budget(memory_budget), limit(limit) {}
+
+    // Appends the normalized form of the value to `key`: integers and
+    // floats become big-endian unsigned bit patterns, strings escape their
+    // zero bytes and end in two zero bytes, so that no encoded string is a
+    // prefix of another. A descending key inverts every byte.
+    static void appendNormalized(std::string &key, const ColumnVector &column, size_t row, bool descending)
+    {
+        size_t start = key.size();
+        if (column.type == STRING)
+        {
+            for (char c : column.strings[row])
+            {
+                key.push_back(c);
+                if (c == '\0')
+                {
+                    key.push_back('\xff');
+                }
+            }
+            key.append(2, '\0');
+        }
+        else
+        {
+            uint32_t bits;
+            if (column.type == INT)
+            {
+                bits = static_cast<uint32_t>(column.ints[row]) ^ 0x80000000u;
+            }
+            else
+            {
+                float value = column.floats[row] == 0 ? 0.0f : column.floats[row]; // -0 == 0
+                std::memcpy(&bits, &value, sizeof(bits));
+                bits = (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+            }
+            appendBigEndian(key, bits);
+        }
+        if (descending)
+        {
+            for (size_t i = start; i < key.size(); i++)
+            {
+                key[i] = static_cast<char>(~key[i]);
+            }
+        }
+    }
+
+    void open() override
+    {
+        reset();
+        input->open();
+        Batch batch;
+        while ((!limit || *limit > 0) && input->nextBatch(batch))
+        {
+            add(batch);
+        }
+        finish();
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        batch.clear();
+        batch.columns.resize(types.size());
+        for (size_t i = 0; i < types.size(); i++)
+        {
+            batch.columns[i].type = types[i];
+        }
+        while (!batch.full() && (!limit || emitted < *limit) && appendNextRow(batch.columns))
+        {
+            batch.selection.push_back(static_cast<uint16_t>(batch.num_rows++));
+            emitted++;
+        }
+        return batch.num_rows > 0;
+    }
+
+    bool next() override
+    {
+        if (has_current)
+        {
+            current_row++;
+        }
+        while (current_row >= current.selection.size())
+        {
+            if (!nextBatch(current))
+            {
+                has_current = false;
+                return false;
+            }
+            current_row = 0;
+        }
+        has_current = true;
+        return true;
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        std::vector<std::unique_ptr<Field>> fields;
+        if (has_current)
+        {
+            for (const ColumnVector &column : current.columns)
+            {
+                fields.push_back(std::make_unique<Field>(column.fieldAt(current.selection[current_row])));
+            }
+        }
+        return fields;
+    }
+
+    void close() override
+    {
+        input->close();
+        reset();
+    }
+
+    // Runs the output of the last open() is merged from
+    size_t numRuns() const { return runs.size(); }
+
+private:
+    static void appendBigEndian(std::string &key, uint64_t value, size_t bytes = 4)
+    {
+        for (size_t i = bytes; i-- > 0;)
+        {
+            key.push_back(static_cast<char>(value >> (8 * i)));
+        }
+    }
+
+    static uint64_t keyPrefix(std::string_view key)
+    {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < sizeof(prefix); i++)
+        {
+            prefix = (prefix << 8) | (i < key.size() ? static_cast<unsigned char>(key[i]) : 0);
+        }
+        return prefix;
+    }
+
+    static bool rowLess(const RowView &a, const RowView &b)
+    {
+        return a.prefix != b.prefix ? a.prefix < b.prefix : a.key < b.key;
+    }
+
+    RowView view(const SortEntry &entry) const
+    {
+        return {entry.prefix, std::string_view(arena).substr(entry.offset, entry.key_length),
+                std::string_view(arena).substr(entry.offset + entry.key_length, entry.values_length)};
+    }
+
+    auto entryOrder() const
+    {
+        return [this](const SortEntry &a, const SortEntry &b)
+        { return rowLess(view(a), view(b)); };
+    }
+
+    auto mergeOrder()
+    {
+        return [this](size_t a, size_t b)
+        { return rowLess(runs[b].current, runs[a].current); };
+    }
+
+    size_t memoryBytes() const { return arena.size() + rows.capacity() * sizeof(SortEntry); }
+
+    void reset()
+    {
+        types.clear();
+        arena.clear();
+        rows.clear();
+        live_bytes = 0;
+        input_rows = 0;
+        runs.clear(); // Deletes the spill files
+        merge_heap.clear();
+        position = 0;
+        emitted = 0;
+        current.clear();
+        current_row = 0;
+        has_current = false;
+    }
+
+    void add(const Batch &batch)
+    {
+        if (types.empty() && !batch.selection.empty())
+        {
+            for (const ColumnVector &column : batch.columns)
+            {
+                types.push_back(column.type);
+            }
+            for (const SortKey &sort_key : sort_keys)
+            {
+                if (sort_key.attr >= types.size())
+                {
+                    throw std::runtime_error("Sort column " + std::to_string(sort_key.attr + 1) + " does not exist.");
+                }
+            }
+        }
+        for (uint16_t row : batch.selection)
+        {
+            if (batch.columns.size() != types.size())
+            {
+                throw std::runtime_error("Rows to sort differ in their number of columns.");
+            }
+            for (size_t i = 0; i < types.size(); i++)
+            {
+                if (batch.columns[i].type != types[i])
+                {
+                    throw std::runtime_error("Column " + std::to_string(i + 1) + " of the rows to sort changes type.");
+                }
+            }
+            key.clear();
+            for (const SortKey &sort_key : sort_keys)
+            {
+                appendNormalized(key, batch.columns[sort_key.attr], row, sort_key.descending);
+            }
+            appendBigEndian(key, input_rows++, sizeof(uint64_t)); // Ties keep input order
+            uint64_t prefix = keyPrefix(key);
+            bool bounded = limit && rows.size() == *limit;
+            if (bounded && !rowLess({prefix, key, {}}, view(rows.front())))
+            {
+                continue; // Not among the `limit` smallest: dropped before its values are copied
+            }
+
+            SortEntry entry{prefix, arena.size(), static_cast<uint32_t>(key.size()), 0};
+            arena.append(key);
+            serializeRow(batch.columns, row, arena);
+            entry.values_length = static_cast<uint32_t>(arena.size() - entry.offset - entry.key_length);
+            live_bytes += entry.key_length + entry.values_length;
+            if (bounded)
+            {
+                std::pop_heap(rows.begin(), rows.end(), entryOrder());
+                live_bytes -= rows.back().key_length + rows.back().values_length;
+                rows.back() = entry;
+            }
+            else
+            {
+                rows.push_back(entry);
+            }
+            if (limit)
+            {
+                std::push_heap(rows.begin(), rows.end(), entryOrder());
+            }
+
+            if (memoryBytes() > memory_budget && live_bytes <= arena.size() / 2)
+            {
+                compact(); // Most of the arena holds rows the heap dropped
+            }
+            if (memoryBytes() > memory_budget)
+            {
+                spill();
+            }
+        }
+    }
+
+    // Copies the rows still held into a new arena
+    void compact()
+    {
+        std::string compacted;
+        compacted.reserve(live_bytes);
+        for (SortEntry &entry : rows)
+        {
+            size_t offset = compacted.size();
+            compacted.append(arena, entry.offset, entry.key_length + entry.values_length);
+            entry.offset = offset;
+        }
+        arena = std::move(compacted);
+    }
+
+    // Sorts the collected rows, keeping `limit` of them at most
+    void sortRows()
+    {
+        if (limit)
+        {
+            std::sort_heap(rows.begin(), rows.end(), entryOrder());
+            rows.resize(std::min(rows.size(), *limit));
+        }
+        else
+        {
+            std::sort(rows.begin(), rows.end(), entryOrder());
+        }
+    }
+
+    static void appendRecord(std::string &block, const RowView &row)
+    {
+        for (std::string_view part : {row.key, row.values})
+        {
+            uint32_t length = static_cast<uint32_t>(part.size());
+            block.append(reinterpret_cast<const char *>(&length), sizeof(length));
+            block.append(part);
+        }
+    }
+
+    void spill()
+    {
+        sortRows();
+        Run run;
+        run.file = std::make_unique<EncryptedSpillFile>();
+        std::string block;
+        for (const SortEntry &entry : rows)
+        {
+            appendRecord(block, view(entry));
+            if (block.size() >= BLOCK_BYTES)
+            {
+                run.file->append(block);
+                block.clear();
+            }
+        }
+        if (!block.empty())
+        {
+            run.file->append(block);
+        }
+        runs.push_back(std::move(run));
+        rows.clear();
+        arena.clear();
+        live_bytes = 0;
+    }
+
+    // Merges the runs into one, which holds `limit` rows at most
+    Run mergeRuns(std::vector<Run> inputs)
+    {
+        std::vector<size_t> heap;
+        for (size_t i = 0; i < inputs.size(); i++)
+        {
+            inputs[i].file->rewind();
+            if (inputs[i].advance())
+            {
+                heap.push_back(i);
+            }
+        }
+        auto order = [&inputs](size_t a, size_t b)
+        { return rowLess(inputs[b].current, inputs[a].current); };
+        std::make_heap(heap.begin(), heap.end(), order);
+        Run output;
+        output.file = std::make_unique<EncryptedSpillFile>();
+        std::string block;
+        for (size_t written = 0; !heap.empty() && (!limit || written < *limit); written++)
+        {
+            std::pop_heap(heap.begin(), heap.end(), order);
+            Run &run = inputs[heap.back()];
+            appendRecord(block, run.current);
+            if (block.size() >= BLOCK_BYTES)
+            {
+                output.file->append(block);
+                block.clear();
+            }
+            if (run.advance())
+            {
+                std::push_heap(heap.begin(), heap.end(), order);
+            }
+            else
+            {
+                heap.pop_back();
+            }
+        }
+        if (!block.empty())
+        {
+            output.file->append(block);
+        }
+        return output;
+    }
+
+    void finish()
+    {
+        if (runs.empty())
+        {
+            sortRows();
+            return;
+        }
+        if (!rows.empty())
+        {
+            spill();
+        }
+        // Keeps the number of files read at once bounded
+        while (runs.size() > SORT_MERGE_FAN_IN)
+        {
+            std::vector<Run> group(std::make_move_iterator(runs.begin()),
+                                   std::make_move_iterator(runs.begin() + SORT_MERGE_FAN_IN));
+            runs.erase(runs.begin(), runs.begin() + SORT_MERGE_FAN_IN);
+            runs.push_back(mergeRuns(std::move(group)));
+        }
+        for (size_t i = 0; i < runs.size(); i++)
+        {
+            runs[i].file->rewind();
+            if (runs[i].advance())
+            {
+                merge_heap.push_back(i);
+            }
+        }
+        std::make_heap(merge_heap.begin(), merge_heap.end(), mergeOrder());
+    }
+
+    // Appends the next row in sorted order to the columns
+    bool appendNextRow(std::vector<ColumnVector> &columns)
+    {
+        std::string_view values;
+        if (runs.empty())
+        {
+            if (position == rows.size())
+            {
+                return false;
+            }
+            values = view(rows[position++]).values;
+            deserializeRow(values, columns);
+            return true;
+        }
+        if (merge_heap.empty())
+        {
+            return false;
+        }
+        std::pop_heap(merge_heap.begin(), merge_heap.end(), mergeOrder());
+        Run &run = runs[merge_heap.back()];
+        values = run.current.values;
+        deserializeRow(values, columns); // Before advance() reads the next block over it
+        if (run.advance())
+        {
+            std::push_heap(merge_heap.begin(), merge_heap.end(), mergeOrder());
+        }
+        else
+        {
+            merge_heap.pop_back();
+        }
+        return true;
+    }
+};
+
+// Passes on the first `limit` rows of its input and stops pulling from it
+// once they are out
+class LimitOperator : public UnaryOperator
+{
+private:
+    size_t limit;
+    size_t emitted = 0;
+
+public:
+    LimitOperator(Operator &input, size_t limit) : UnaryOperator(input), limit(limit) {}
+
+    void open() override
+    {
+        input->open();
+        emitted = 0;
+    }
+
+    bool next() override
+    {
+        if (emitted == limit || !input->next())
+        {
+            return false;
+        }
+        emitted++;
+        return true;
+    }
+
+    bool nextBatch(Batch &batch) override
+    {
+        if (emitted == limit || !input->nextBatch(batch))
+        {
+            batch.clear();
+            return false;
+        }
+        if (batch.selection.size() > limit - emitted)
+        {
+            batch.selection.resize(limit - emitted);
+        }
+        emitted += batch.selection.size();
+        return true;
+    }
+
+    void close() override { input->close(); }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override { return input->getOutput(); }
+};
+
+// A WHERE clause as parsed: comparisons of a column with a query parameter,
+// combined with AND and OR. Constants in the query text become parameters
+// too, so queries that differ only in their constants share one tree.
+struct WhereNode
+{
+    enum Kind
+    {
+        COMPARISON,
+        AND,
+        OR
+    };
+
+    Kind kind = COMPARISON;
+    size_t column = 0;
+    SimplePredicate::ComparisonOperator op = SimplePredicate::EQ;
+    size_t parameter = 0; // Index into QueryComponents::parameters
+    std::vector<WhereNode> children;
+};
+
+struct QueryComponents
+{
+    std::vector<int> selectAttributes;
+    bool sumOperation = false;
+    int sumAttributeIndex = -1;
+    bool groupBy = false;
+    int groupByAttributeIndex = -1;
+    bool whereCondition = false;
+    // A range {whereAttributeIndex} > lowerBound and < upperBound, for
+    // queries built without the parser; parsed queries fill `where`
+    int whereAttributeIndex = -1;
+    int lowerBound = std::numeric_limits<int>::min();
+    int upperBound = std::numeric_limits<int>::max();
+    std::shared_ptr<const WhereNode> where;
+    std::vector<Field> parameters;
+    std::vector<SortKey> orderBy; // Numbered like the output columns
+    int limit = -1;
+    bool analyze = false; // ANALYZE: gather statistics instead of running a query
+};
+
+enum class QueryTokenType
+{
+    COLUMN,    // {n}
+    INTEGER,
+    FLOAT,
+    STRING,    // 'text' or "text"
+    PARAMETER, // ?
+    KEYWORD,   // Case-insensitive; `text` holds the upper-case spelling
+    COMPARISON,
+    COMMA,
+    LPAREN,
+    RPAREN,
+    END
+};
+
+struct QueryToken
+{
+    QueryTokenType type;
+    std::string_view text; // For COLUMN the digits, for STRING the contents without quotes
+    size_t position;
+};
+
+constexpr std::string_view QUERY_KEYWORDS[] = {"SUM", "WHERE", "GROUP", "ORDER", "BY", "ASC",
+                                               "DESC", "LIMIT", "AND", "OR", "ANALYZE"};
+
+[[noreturn]] void throwQueryError(const std::string &message, size_t position)
+{
+    throw std::runtime_error(message + " at position " + std::to_string(position) + " of query.");
+}
+
+// Splits a query into tokens. The tokens point into `query`, which has to
+// outlive them.
+std::vector<QueryToken> tokenizeQuery(std::string_view query)
+{
+    std::vector<QueryToken> tokens;
+    auto isDigit = [](char c)
+    { return c >= '0' && c <= '9'; };
+    size_t i = 0;
+    while (i < query.size())
+    {
+        char c = query[i];
+        size_t start = i;
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        {
+            i++;
+        }
+        else if (c == '{')
+        {
+            while (++i < query.size() && isDigit(query[i]))
+            {
+            }
+            if (i == start + 1 || i == query.size() || query[i] != '}')
+            {
+                throwQueryError("Malformed column reference", start);
+            }
+            tokens.push_back({QueryTokenType::COLUMN, query.substr(start + 1, i - start - 1), start});
+            i++;
+        }
+        else if (isDigit(c) || ((c == '-' || c == '.') && i + 1 < query.size() && isDigit(query[i + 1])))
+        {
+            bool real = false;
+            i++;
+            while (i < query.size() && (isDigit(query[i]) || (query[i] == '.' && !real && i + 1 < query.size() && isDigit(query[i + 1]))))
+            {
+                real |= query[i] == '.';
+                i++;
+            }
+            real |= c == '.';
+            tokens.push_back({real ? QueryTokenType::FLOAT : QueryTokenType::INTEGER, query.substr(start, i - start), start});
+        }
+        else if (c == '\'' || c == '"')
+        {
+            size_t end = query.find(c, i + 1);
+            if (end == std::string_view::npos)
+            {
+                throwQueryError("Unterminated string", start);
+            }
+            tokens.push_back({QueryTokenType::STRING, query.substr(start + 1, end - start - 1), start});
+            i = end + 1;
+        }
+        else if (c == '<' || c == '>' || c == '=' || c == '!')
+        {
+            i++;
+            if (i < query.size() && (query[i] == '=' || (c == '<' && query[i] == '>')))
+            {
+                i++;
+            }
+            if (query.substr(start, i - start) == "!")
+            {
+                throwQueryError("Unexpected character '!'", start);
+            }
+            tokens.push_back({QueryTokenType::COMPARISON, query.substr(start, i - start), start});
+        }
+        else if (c == ',' || c == '(' || c == ')' || c == '?')
+        {
+            QueryTokenType type = c == ',' ? QueryTokenType::COMMA : c == '(' ? QueryTokenType::LPAREN
+                                                                 : c == ')'   ? QueryTokenType::RPAREN
+                                                                              : QueryTokenType::PARAMETER;
+            tokens.push_back({type, query.substr(start, 1), start});
+            i++;
+        }
+        else if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
+        {
+            while (i < query.size() && ((query[i] >= 'A' && query[i] <= 'Z') || (query[i] >= 'a' && query[i] <= 'z')))
+            {
+                i++;
+            }
+            std::string_view word = query.substr(start, i - start);
+            const std::string_view *keyword = std::find_if(
+                std::begin(QUERY_KEYWORDS), std::end(QUERY_KEYWORDS), [word](std::string_view keyword)
+                { return std::equal(word.begin(), word.end(), keyword.begin(), keyword.end(), [](char a, char b)
+                                    { return (a & ~0x20) == b; }); });
+            if (keyword == std::end(QUERY_KEYWORDS))
+            {
+                throwQueryError("Unknown word '" + std::string(word) + "'", start);
+            }
+            tokens.push_back({QueryTokenType::KEYWORD, *keyword, start});
+        }
+        else
+        {
+            throwQueryError(std::string("Unexpected character '") + c + "'", start);
+        }
+    }
+    tokens.push_back({QueryTokenType::END, {}, query.size()});
+    return tokens;
+}
+
+// Turns the constants of a tokenized query into parameters, in the order
+// they appear, and builds the key the plan cache knows the query by: the
+// tokens in a canonical spelling, with every parameter replaced by a
+// placeholder that names its type. A `?` takes the next of `arguments`.
+// The row count of LIMIT is kept in the key, as it shapes the plan.
+std::string extractQueryParameters(const std::vector<QueryToken> &tokens, std::vector<Field> arguments,
+                                   std::vector<Field> &parameters)
+{
+    std::string key;
+    size_t next_argument = 0;
+    auto parseNumber = [](const QueryToken &token, auto &value)
+    {
+        auto [end, error] = std::from_chars(token.text.data(), token.text.data() + token.text.size(), value);
+        if (error != std::errc() || end != token.text.data() + token.text.size())
+        {
+            throwQueryError("Number out of range", token.position);
+        }
+    };
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        const QueryToken &token = tokens[i];
+        bool limit_count = i > 0 && tokens[i - 1].type == QueryTokenType::KEYWORD && tokens[i - 1].text == "LIMIT";
+        switch (token.type)
+        {
+        case QueryTokenType::INTEGER:
+            if (limit_count)
+            {
+                key += token.text;
+                break;
+            }
+            {
+                int value;
+                parseNumber(token, value);
+                parameters.emplace_back(value);
+            }
+            key += "?i";
+            break;
+        case QueryTokenType::FLOAT:
+        {
+            float value;
+            parseNumber(token, value);
+            parameters.emplace_back(value);
+            key += "?f";
+            break;
+        }
+        case QueryTokenType::STRING:
+            parameters.emplace_back(std::string(token.text));
+            key += "?s";
+            break;
+        case QueryTokenType::PARAMETER:
+            if (next_argument == arguments.size())
+            {
+                throwQueryError("Missing argument for '?'", token.position);
+            }
+            parameters.push_back(std::move(arguments[next_argument++]));
+            key += parameters.back().getType() == INT ? "?i" : parameters.back().getType() == FLOAT ? "?f"
+                                                                                                      : "?s";
+            break;
+        case QueryTokenType::COLUMN:
+            key += '{';
+            key += token.text;
+            key += '}';
+            break;
+        case QueryTokenType::END:
+            break;
+        default:
+            key += token.text;
+        }
+        key += ' ';
+    }
+    if (next_argument != arguments.size())
+    {
+        throw std::runtime_error("Query has fewer '?' than arguments.");
+    }
+    return key;
+}
+
+// Recursive-descent parser of the query language:
+//
+//   statement  := ANALYZE | query
+//   query      := [item {',' item}] {clause}
+//   item       := column | SUM column
+//   clause     := WHERE or | GROUP BY column | ORDER BY key {',' key} | LIMIT integer
+//   or         := and {OR and}
+//   and        := comparison {AND comparison}
+//   comparison := column op value | value op column | '(' or ')'
+//   key        := column [ASC | DESC]
+//   value      := integer | float | string | '?'
+//
+// Each clause may appear once, in any order. Values become parameters,
+// numbered in the order they appear, as extractQueryParameters numbers them.
+class QueryParser
+{
+private:
+    const std::vector<QueryToken> &tokens;
+    size_t pos = 0;
+    size_t next_parameter = 0;
+
+    const QueryToken &peek() const { return tokens[pos]; }
+
+    bool acceptKeyword(std::string_view keyword)
+    {
+        if (peek().type == QueryTokenType::KEYWORD && peek().text == keyword)
+        {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    void expectKeyword(std::string_view keyword)
+    {
+        if (!acceptKeyword(keyword))
+        {
+            throwQueryError("Expected " + std::string(keyword), peek().position);
+        }
+    }
+
+    // Column numbers start at 1 in the query and at 0 everywhere else
+    size_t column()
+    {
+        const QueryToken &token = peek();
+        size_t number = 0;
+        auto [end, error] = std::from_chars(token.text.data(), token.text.data() + token.text.size(), number);
+        if (token.type != QueryTokenType::COLUMN || error != std::errc() || number == 0 ||
+            number > static_cast<size_t>(std::numeric_limits<int>::max()))
+        {
+            throwQueryError("Expected a column {1}, {2}, ...", token.position);
+        }
+        pos++;
+        return number - 1;
+    }
+
+    static bool isValue(const QueryToken &token)
+    {
+        return token.type == QueryTokenType::INTEGER || token.type == QueryTokenType::FLOAT ||
+               token.type == QueryTokenType::STRING || token.type == QueryTokenType::PARAMETER;
+    }
+
+    SimplePredicate::ComparisonOperator comparisonOperator()
+    {
+        const QueryToken &token = peek();
+        if (token.type != QueryTokenType::COMPARISON)
+        {
+            throwQueryError("Expected a comparison", token.position);
+        }
+        pos++;
+        if (token.text == "=" || token.text == "==")
+        {
+            return SimplePredicate::EQ;
+        }
+        if (token.text == "!=" || token.text == "<>")
+        {
+            return SimplePredicate::NE;
+        }
+        if (token.text == ">")
+        {
+            return SimplePredicate::GT;
+        }
+        if (token.text == ">=")
+        {
+            return SimplePredicate::GE;
+        }
+        if (token.text == "<")
+        {
+            return SimplePredicate::LT;
+        }
+        if (token.text == "<=")
+        {
+            return SimplePredicate::LE;
+        }
+        throwQueryError("Unknown comparison '" + std::string(token.text) + "'", token.position);
+    }
+
+    WhereNode comparison()
+    {
+        if (peek().type == QueryTokenType::LPAREN)
+        {
+            pos++;
+            WhereNode node = disjunction();
+            if (peek().type != QueryTokenType::RPAREN)
+            {
+                throwQueryError("Expected ')'", peek().position);
+            }
+            pos++;
+            return node;
+        }
+        WhereNode node;
+        if (isValue(peek()))
+        {
+            pos++;
+            node.parameter = next_parameter++;
+            node.op = SimplePredicate::mirrored(comparisonOperator());
+            node.column = column();
+            return node;
+        }
+        node.column = column();
+        node.op = comparisonOperator();
+        if (!isValue(peek()))
+        {
+            throwQueryError("Expected a constant or '?'", peek().position);
+        }
+        pos++;
+        node.parameter = next_parameter++;
+        return node;
+    }
+
+    template <typename Operand>
+    WhereNode chain(WhereNode::Kind kind, std::string_view keyword, Operand &&operand)
+    {
+        WhereNode first = operand();
+        if (peek().type != QueryTokenType::KEYWORD || peek().text != keyword)
+        {
+            return first;
+        }
+        WhereNode node;
+        node.kind = kind;
+        node.children.push_back(std::move(first));
+        while (acceptKeyword(keyword))
+        {
+            node.children.push_back(operand());
+        }
+        return node;
+    }
+
+    WhereNode conjunction()
+    {
+        return chain(WhereNode::AND, "AND", [this]
+                     { return comparison(); });
+    }
+
+    WhereNode disjunction()
+    {
+        return chain(WhereNode::OR, "OR", [this]
+                     { return conjunction(); });
+    }
+
+    void selectList(QueryComponents &components)
+    {
+        if (peek().type == QueryTokenType::KEYWORD && peek().text != "SUM")
+        {
+            return; // No select list: every column
+        }
+        do
+        {
+            size_t position = peek().position;
+            if (acceptKeyword("SUM"))
+            {
+                if (components.sumOperation)
+                {
+                    throwQueryError("Only one SUM per query is supported", position);
+                }
+                components.sumOperation = true;
+                components.sumAttributeIndex = static_cast<int>(column());
+            }
+            else
+            {
+                components.selectAttributes.push_back(static_cast<int>(column()));
+            }
+            if (peek().type != QueryTokenType::COMMA)
+            {
+                break;
+            }
+            pos++;
+        } while (true);
+    }
+
+public:
+    explicit QueryParser(const std::vector<QueryToken> &tokens) : tokens(tokens) {}
+
+    // Fills everything but the parameters
+    QueryComponents parse()
+    {
+        QueryComponents components;
+        if (acceptKeyword("ANALYZE"))
+        {
+            components.analyze = true;
+            if (peek().type != QueryTokenType::END)
+            {
+                throwQueryError("ANALYZE takes no arguments", peek().position);
+            }
+            return components;
+        }
+        selectList(components);
+        while (peek().type != QueryTokenType::END)
+        {
+            size_t position = peek().position;
+            auto once = [position](bool seen, const char *clause)
+            {
+                if (seen)
+                {
+                    throwQueryError(std::string("Second ") + clause + " clause", position);
+                }
+            };
+            if (acceptKeyword("WHERE"))
+            {
+                once(components.whereCondition, "WHERE");
+                components.whereCondition = true;
+                components.where = std::make_shared<const WhereNode>(disjunction());
+            }
+            else if (acceptKeyword("GROUP"))
+            {
+                once(components.groupBy, "GROUP BY");
+                expectKeyword("BY");
+                components.groupBy = true;
+                components.groupByAttributeIndex = static_cast<int>(column());
+            }
+            else if (acceptKeyword("ORDER"))
+            {
+                once(!components.orderBy.empty(), "ORDER BY");
+                expectKeyword("BY");
+                do
+                {
+                    SortKey key{column()};
+                    key.descending = acceptKeyword("DESC");
+                    if (!key.descending)
+                    {
+                        acceptKeyword("ASC");
+                    }
+                    components.orderBy.push_back(key);
+                    if (peek().type != QueryTokenType::COMMA)
+                    {
+                        break;
+                    }
+                    pos++;
+                } while (true);
+            }
+            else if (acceptKeyword("LIMIT"))
+            {
+                once(components.limit >= 0, "LIMIT");
+                const QueryToken &token = peek();
+                auto [end, error] = std::from_chars(token.text.data(), token.text.data() + token.text.size(), components.limit);
+                if (token.type != QueryTokenType::INTEGER || error != std::errc() || components.limit < 0)
+                {
+                    throwQueryError("Expected a row count", token.position);
+                }
+                pos++;
+            }
+            else
+            {
+                throwQueryError("Unexpected '" + std::string(peek().text) + "'", position);
+            }
+        }
+        return components;
+    }
+};
+
+// Parses a query such as
+//   {1}, {4} WHERE {1} > 2 and ({4} = 'buzzdb' or {3} <= 132.5) ORDER BY {2} DESC LIMIT 10
+// or SUM{2} GROUP BY {1}. `?` stands for the next of `arguments`. Throws a
+// std::runtime_error naming the position of a syntax error.
+QueryComponents parseQuery(std::string_view query, std::vector<Field> arguments = {})
+{
+    std::vector<QueryToken> tokens = tokenizeQuery(query);
+    std::vector<Field> parameters;
+    extractQueryParameters(tokens, std::move(arguments), parameters);
+    QueryComponents components = QueryParser(tokens).parse();
+    components.parameters = std::move(parameters);
+    return components;
+}
+
+// A constant compared with column `column`, converted to the type of the
+// column when `column_types` knows it: an int compares with a float column
+// as a float, and a whole float with an int column as an int. Other
+// mismatches would never match, so the query is rejected.
+Field bindLiteral(const Field &value, size_t column, const std::vector<FieldType> &column_types)
+{
+    if (column >= column_types.size() || value.getType() == column_types[column])
+    {
+        return value;
+    }
+    FieldType type = column_types[column];
+    if (type == FLOAT && value.getType() == INT)
+    {
+        return Field(static_cast<float>(value.asInt()));
+    }
+    if (type == INT && value.getType() == FLOAT)
+    {
+        float number = value.asFloat();
+        if (number == std::trunc(number) && std::abs(number) <= static_cast<float>(std::numeric_limits<int>::max() / 2))
+        {
+            return Field(static_cast<int>(number));
+        }
+    }
+    static constexpr const char *type_names[] = {"int", "float", "string"};
+    std::ostringstream literal;
+    if (value.getType() == INT)
+        literal << value.asInt();
+    else if (value.getType() == FLOAT)
+        literal << value.asFloat();
+    else
+        literal << "'" << value.asString() << "'";
+    throw std::runtime_error("Column " + std::to_string(column + 1) + " holds " + type_names[type] +
+                             " values and cannot be compared with " + literal.str() + ".");
+}
+
+// Builds the predicate of a WHERE tree with its parameters filled in and
+// converted to the types of the columns they are compared with
+std::unique_ptr<IPredicate> bindWhere(const WhereNode &node,
+                                      const std::vector<Field> &parameters,
+                                      const std::vector<FieldType> &column_types = {})
+{
+    if (node.kind == WhereNode::COMPARISON)
+    {
+        return std::make_unique<SimplePredicate>(
+            SimplePredicate::Operand(node.column),
+            SimplePredicate::Operand(std::make_unique<Field>(bindLiteral(parameters.at(node.parameter), node.column, column_types))),
+            node.op);
+    }
+    auto predicate = std::make_unique<ComplexPredicate>(node.kind == WhereNode::AND ? ComplexPredicate::AND
+                                                                                    : ComplexPredicate::OR);
+    for (const WhereNode &child : node.children)
+    {
+        predicate->addPredicate(bindWhere(child, parameters, column_types));
+    }
+    return predicate;
+}
+
+// The WHERE clause of a query as a predicate, or null without one
+std::unique_ptr<IPredicate> wherePredicate(const QueryComponents &components,
+                                           const std::vector<FieldType> &column_types = {})
+{
+    if (components.where)
+    {
+        return bindWhere(*components.where, components.parameters, column_types);
+    }
+    if (components.whereAttributeIndex == -1)
+    {
+        return nullptr;
+    }
+    size_t column = static_cast<size_t>(components.whereAttributeIndex);
+    // Create simple predicates with comparison operators
+    auto predicate1 = std::make_unique<SimplePredicate>(
+        SimplePredicate::Operand(column),
+        SimplePredicate::Operand(std::make_unique<Field>(bindLiteral(Field(components.lowerBound), column, column_types))),
+        SimplePredicate::ComparisonOperator::GT);
+
+    auto predicate2 = std::make_unique<SimplePredicate>(
+        SimplePredicate::Operand(column),
+        SimplePredicate::Operand(std::make_unique<Field>(bindLiteral(Field(components.upperBound), column, column_types))),
+        SimplePredicate::ComparisonOperator::LT);
+
+    // Combine simple predicates into a complex predicate with logical AND operator
+    auto complexPredicate = std::make_unique<ComplexPredicate>(ComplexPredicate::LogicOperator::AND);
+    complexPredicate->addPredicate(std::move(predicate1));
+    complexPredicate->addPredicate(std::move(predicate2));
+    return complexPredicate;
+}
+
+void printWhere(const WhereNode &node, const std::vector<Field> &parameters)
+{
+    if (node.kind == WhereNode::COMPARISON)
+    {
+        static constexpr const char *symbols[] = {"=", "!=", ">", ">=", "<", "<="};
+        std::cout << "{" << node.column + 1 << "} " << symbols[node.op] << " ";
+        if (node.parameter < parameters.size())
+        {
+            parameters[node.parameter].print();
+        }
+        else
+        {
+            std::cout << "?";
+        }
+        return;
+    }
+    std::cout << "(";
+    for (size_t i = 0; i < node.children.size(); i++)
+    {
+        std::cout << (i > 0 ? (node.kind == WhereNode::AND ? " and " : " or ") : "");
+        printWhere(node.children[i], parameters);
+    }
+    std::cout << ")";
+}
+
+void prettyPrint(const QueryComponents &components)
+{
+    std::cout << "Query Components:\n";
+    if (components.analyze)
+    {
+        std::cout << "  ANALYZE" << std::endl;
+        return;
+    }
+    std::cout << "  Selected Attributes: ";
+    for (auto attr : components.selectAttributes)
+    {
+        std::cout << "{" << attr + 1 << "} "; // Convert back to 1-based indexing for display
+    }
+    std::cout << "\n  SUM Operation: " << (components.sumOperation ? "Yes" : "No");
+    if (components.sumOperation)
+    {
+        std::cout << " on {" << components.sumAttributeIndex + 1 << "}";
+    }
+    std::cout << "\n  GROUP BY: " << (components.groupBy ? "Yes" : "No");
+    if (components.groupBy)
+    {
+        std::cout << " on {" << components.groupByAttributeIndex + 1 << "}";
+    }
+    std::cout << "\n  WHERE Condition: " << (components.whereCondition ? "Yes" : "No");
+    if (components.where)
+    {
+        std::cout << " ";
+        printWhere(*components.where, components.parameters);
+    }
+    else if (components.whereCondition)
+    {
+        std::cout << " on {" << components.whereAttributeIndex + 1 << "} > " << components.lowerBound << " and < " << components.upperBound;
+    }
+    std::cout << "\n  ORDER BY: " << (components.orderBy.empty() ? "No" : "Yes");
+    for (const SortKey &key : components.orderBy)
+    {
+        std::cout << " {" << key.attr + 1 << "}" << (key.descending ? " DESC" : "");
+    }
+    std::cout << "\n  LIMIT: ";
+    if (components.limit >= 0)
+    {
+        std::cout << components.limit;
+    }
+    else
+    {
+        std::cout << "No";
+    }
+    std::cout << std::endl;
+}
+
+// How executeQuery runs a query, decided from the query's shape alone, so
+// that one plan serves every query that differs only in its constants. The
+// one choice that depends on them, an index scan over a full scan, is made
+// when the plan runs.
+struct QueryPlan
+{
+    bool late_materialization = false;  // The scan decodes only decoded_attrs
+    std::vector<size_t> decoded_attrs;  // Columns the WHERE clause and the aggregates read
+    bool aggregate = false;
+    std::vector<size_t> group_by_attrs;
+    std::vector<AggrFunc> aggr_funcs;
+    std::vector<size_t> projected_attrs; // Empty outputs every column
+    bool project_before_sort = false;    // ORDER BY numbers the projected columns
+    std::vector<SortKey> sort_keys;
+    std::optional<size_t> limit;
+    std::vector<FieldType> column_types; // Of the table's tuples when planned; empty while it has none
+};
+
+void collectWhereColumns(const WhereNode &node, std::vector<size_t> &columns)
+{
+    if (node.kind == WhereNode::COMPARISON)
+    {
+        columns.push_back(node.column);
+    }
+    for (const WhereNode &child : node.children)
+    {
+        collectWhereColumns(child, columns);
+    }
+}
+
+// Types of the columns of the first tuple of the table, which every tuple
+// shares; empty when the table has none
+std::vector<FieldType> tableColumnTypes(BufferManager &buffer_manager)
+{
+    Batch batch;
+    for (PageID page_id = 0; page_id < buffer_manager.getNumPages() && batch.num_rows == 0; page_id++)
+    {
+        PageGuard page = buffer_manager.fixPage(page_id);
+        const Slot *slot_array = reinterpret_cast<const Slot *>(page->page_data.get());
+        for (size_t slot = 0; slot < MAX_SLOTS; slot++)
+        {
+            if (!slot_array[slot].empty)
+            {
+                batch.appendSerialized(page->page_data.get() + slot_array[slot].offset, slot_array[slot].length);
+                break;
+            }
+        }
+    }
+    std::vector<FieldType> types;
+    for (size_t c = 0; c < batch.columns.size() && batch.num_rows > 0; c++)
+    {
+        types.push_back(batch.columns[c].type);
+    }
+    return types;
+}
+
+QueryPlan planQuery(const QueryComponents &components, BufferManager &buffer_manager)
+{
+    QueryPlan plan;
+    plan.column_types = tableColumnTypes(buffer_manager);
+
+    // Columns the scan has to decode when late materialization applies.
+    // Aggregates read those columns only. A projection fetches the others
+    // row by row, which only pays off when a WHERE clause or a LIMIT
+    // without ORDER BY drops rows before it; otherwise the scan decodes
+    // everything it reads.
+    plan.aggregate = components.sumOperation || components.groupBy;
+    bool project = !plan.aggregate && !components.selectAttributes.empty();
+    bool drops_rows = components.where || components.whereAttributeIndex != -1 ||
+                      (components.limit >= 0 && components.orderBy.empty());
+    plan.late_materialization = plan.aggregate || (project && drops_rows);
+    if (components.where)
+    {
+        collectWhereColumns(*components.where, plan.decoded_attrs);
+    }
+    else if (components.whereAttributeIndex != -1)
+    {
+        plan.decoded_attrs.push_back(static_cast<size_t>(components.whereAttributeIndex));
+    }
+    for (size_t attr : plan.decoded_attrs)
+    {
+        if (!plan.column_types.empty() && attr >= plan.column_types.size())
+        {
+            throw std::runtime_error("Column " + std::to_string(attr + 1) + " does not exist.");
+        }
+    }
+
+    if (components.groupBy)
+    {
+        plan.decoded_attrs.push_back(static_cast<size_t>(components.groupByAttributeIndex));
+        plan.group_by_attrs.push_back(static_cast<size_t>(components.groupByAttributeIndex));
+    }
+    if (components.sumOperation)
+    {
+        plan.decoded_attrs.push_back(static_cast<size_t>(components.sumAttributeIndex));
+        plan.aggr_funcs.push_back({AggrFuncType::SUM, static_cast<size_t>(components.sumAttributeIndex)});
+    }
+
+    if (project)
+    {
+        plan.projected_attrs.assign(components.selectAttributes.begin(), components.selectAttributes.end());
+        plan.project_before_sort = !components.orderBy.empty();
+    }
+    plan.sort_keys = components.orderBy;
+    if (components.limit >= 0)
+    {
+        plan.limit = static_cast<size_t>(components.limit);
+    }
+    return plan;
+}
+
+// Largest share of the indexed entries a WHERE range may select for
+// executeQuery to answer it through the index instead of a full scan
+constexpr double INDEX_SCAN_MAX_SELECTIVITY = 0.05;
+
+// Index entries with a key in [lower, upper], counting no further than
+// `limit`, so a range too wide to be worth it reads only a few leaves
+size_t countIndexEntries(BPlusTree &index, int64_t lower, int64_t upper, size_t limit)
+{
+    auto cursor = index.range(lower, upper);
+    BTreeEntry entry;
+    size_t matches = 0;
+    while (matches < limit && cursor.next(entry))
+    {
+        matches++;
+    }
+    return matches;
+}
+
+// Tells whether [lower, upper] selects few enough index entries that
+// fetching their slots beats scanning and decrypting the whole table
+bool preferIndexScan(BPlusTree &index, int64_t lower, int64_t upper)
+{
+    size_t limit = static_cast<size_t>(index.size() * INDEX_SCAN_MAX_SELECTIVITY);
+    return countIndexEntries(index, lower, upper, limit + 1) <= limit;
+}
+
+// Heap pages ANALYZE reads, picked at random; smaller tables are read whole
+constexpr size_t ANALYZE_SAMPLE_PAGES = 300;
+// Buckets of the equi-depth histograms ANALYZE builds for numeric columns
+constexpr size_t HISTOGRAM_BUCKETS = 32;
+// Most common values ANALYZE keeps per numeric column
+constexpr size_t MAX_COMMON_VALUES = 16;
+// Share of the rows a comparison passes when statistics cannot tell
+constexpr double DEFAULT_SELECTIVITY = 1.0 / 3;
+
+// What ANALYZE learned about a column from its sample
+struct ColumnStatistics
+{
+    FieldType type = INT;
+    double distinct = 1; // Estimated number of distinct values in the table
+    // Equi-depth histogram of an int or float column: HISTOGRAM_BUCKETS + 1
+    // bounds, with an equal share of the rows between neighbours. Bucket i
+    // holds the values in [bounds[i], bounds[i + 1]); an int v stands for
+    // [v, v + 1), so the last bound is the largest value plus one.
+    std::vector<double> bounds;
+    // Values of an int or float column that are much more common than the
+    // others, with their share of the rows, by value
+    std::vector<std::pair<double, double>> common_values;
+
+    // Share of the rows below `value`, interpolating within a bucket
+    double fractionBelow(double value) const
+    {
+        if (bounds.empty() || value <= bounds.front())
+        {
+            return 0;
+        }
+        if (value >= bounds.back())
+        {
+            return 1;
+        }
+        size_t bucket = std::upper_bound(bounds.begin(), bounds.end(), value) - bounds.begin() - 1;
+        double within = (value - bounds[bucket]) / (bounds[bucket + 1] - bounds[bucket]);
+        return (bucket + within) / (bounds.size() - 1);
+    }
+
+    // Share of the rows with a value in [lower, upper]
+    double rangeSelectivity(double lower, double upper) const
+    {
+        if (bounds.empty())
+        {
+            return DEFAULT_SELECTIVITY;
+        }
+        if (type == INT)
+        {
+            upper += 1;
+        }
+        return std::max(0.0, fractionBelow(upper) - fractionBelow(lower));
+    }
+
+    double equalSelectivity(const Field &value) const
+    {
+        if (value.getType() != type)
+        {
+            return 0; // Comparing across types never matches
+        }
+        if (type == STRING)
+        {
+            return 1 / distinct;
+        }
+        double v = type == INT ? value.asInt() : value.asFloat();
+        if (bounds.empty() || v < bounds.front() || v > bounds.back())
+        {
+            return 0;
+        }
+        // A common value has its own share; the others split what is left
+        double common_share = 0;
+        for (const auto &[common, share] : common_values)
+        {
+            if (common == v)
+            {
+                return share;
+            }
+            common_share += share;
+        }
+        return (1 - common_share) / std::max(1.0, distinct - common_values.size());
+    }
+};
+
+// Statistics of the table, gathered by ANALYZE from a sample of its pages
+struct TableStatistics
+{
+    size_t num_pages = 0; // Heap pages when analyzed
+    size_t sampled_pages = 0;
+    double tuples_per_page = 0;
+    std::vector<ColumnStatistics> columns;
+
+    // Tuples in a table of `pages` pages, assuming they still fill pages
+    // as they did when sampled
+    double rows(size_t pages) const { return tuples_per_page * pages; }
+
+    // Share of the rows passing the predicate. The bounds a conjunction
+    // puts on one int column, equalities included, make up one range; other
+    // conjuncts are taken as independent of each other.
+    double selectivity(const IPredicate &predicate) const
+    {
+        if (const auto *complex = dynamic_cast<const ComplexPredicate *>(&predicate))
+        {
+            if (complex->getLogicOperator() == ComplexPredicate::OR)
+            {
+                double passing = 0;
+                for (const auto &child : complex->getPredicates())
+                {
+                    double s = selectivity(*child);
+                    passing += s - passing * s;
+                }
+                return passing;
+            }
+            double passing = 1;
+            std::vector<ColumnRange> ranges;
+            for (const auto &child : complex->getPredicates())
+            {
+                const auto *simple = dynamic_cast<const SimplePredicate *>(child.get());
+                if (simple == nullptr || simple->comparison_operator == SimplePredicate::NE ||
+                    extractColumnRanges(*simple).empty())
+                {
+                    passing *= selectivity(*child);
+                    continue;
+                }
+                ColumnRange bound = extractColumnRanges(*simple).front();
+                auto range = std::find_if(ranges.begin(), ranges.end(), [&bound](const ColumnRange &range)
+                                          { return range.column == bound.column; });
+                if (range == ranges.end())
+                {
+                    ranges.push_back(bound);
+                    continue;
+                }
+                range->lower = std::max(range->lower, bound.lower);
+                range->upper = std::min(range->upper, bound.upper);
+            }
+            for (const ColumnRange &range : ranges)
+            {
+                passing *= rangeSelectivity(range);
+            }
+            return passing;
+        }
+        const auto *simple = dynamic_cast<const SimplePredicate *>(&predicate);
+        if (simple == nullptr)
+        {
+            return DEFAULT_SELECTIVITY;
+        }
+        const auto &left = simple->left_operand;
+        const auto &right = simple->right_operand;
+        auto op = simple->comparison_operator;
+        if (left.type == SimplePredicate::DIRECT && right.type == SimplePredicate::INDIRECT)
+        {
+            return comparisonSelectivity(right.index, SimplePredicate::mirrored(op), *left.directValue);
+        }
+        if (left.type == SimplePredicate::INDIRECT && right.type == SimplePredicate::DIRECT)
+        {
+            return comparisonSelectivity(left.index, op, *right.directValue);
+        }
+        return DEFAULT_SELECTIVITY;
+    }
+
+    double rangeSelectivity(const ColumnRange &range) const
+    {
+        if (range.column >= columns.size() || columns[range.column].type != INT)
+        {
+            return DEFAULT_SELECTIVITY;
+        }
+        if (range.lower > range.upper)
+        {
+            return 0;
+        }
+        if (range.lower == range.upper)
+        {
+            return columns[range.column].equalSelectivity(Field(static_cast<int>(range.lower)));
+        }
+        return columns[range.column].rangeSelectivity(static_cast<double>(range.lower),
+                                                      static_cast<double>(range.upper));
+    }
+
+private:
+    double comparisonSelectivity(size_t column, SimplePredicate::ComparisonOperator op, const Field &value) const
+    {
+        if (column >= columns.size())
+        {
+            return DEFAULT_SELECTIVITY;
+        }
+        const ColumnStatistics &stats = columns[column];
+        if (op == SimplePredicate::EQ || op == SimplePredicate::NE)
+        {
+            double equal = stats.equalSelectivity(value);
+            return op == SimplePredicate::EQ ? equal : 1 - equal;
+        }
+        if (stats.type == STRING || value.getType() != stats.type)
+        {
+            return value.getType() != stats.type ? 0 : DEFAULT_SELECTIVITY;
+        }
+        double v = stats.type == INT ? value.asInt() : value.asFloat();
+        double step = stats.type == INT ? 1 : 0; // Ints: > v is >= v + 1
+        double lowest = -std::numeric_limits<double>::infinity();
+        double highest = std::numeric_limits<double>::infinity();
+        switch (op)
+        {
+        case SimplePredicate::GT:
+            return stats.rangeSelectivity(v + step, highest);
+        case SimplePredicate::GE:
+            return stats.rangeSelectivity(v, highest);
+        case SimplePredicate::LT:
+            return stats.rangeSelectivity(lowest, v - step);
+        default:
+            return stats.rangeSelectivity(lowest, v);
+        }
+    }
+};
+
+// Builds statistics from a random sample of ANALYZE_SAMPLE_PAGES heap
+// pages, reading every tuple on them. Histograms take the quantiles of the
+// sampled values. The number of distinct values is scaled up from the
+// sample with the Duj1 estimator of Haas and Stokes, as PostgreSQL does:
+// n * d / (n - f1 + f1 * n / N) for d distinct values among n sampled rows
+// of N, f1 of them seen once. A sample of values all seen once gives N, one
+// without such values gives d. Values sampled at least twice and more than
+// 1.25 times as often as the values not taken yet average become common
+// values, as in PostgreSQL's most common values lists. Comparing with what
+// is left keeps a rare value that still stands out from a tail of values
+// sampled once.
+TableStatistics analyzeTable(BufferManager &buffer_manager)
+{
+    TableStatistics statistics;
+    statistics.num_pages = buffer_manager.getNumPages();
+    std::vector<PageID> pages(statistics.num_pages);
+    std::iota(pages.begin(), pages.end(), 0);
+    if (pages.size() > ANALYZE_SAMPLE_PAGES)
+    {
+        std::mt19937_64 rng(std::random_device{}());
+        for (size_t i = 0; i < ANALYZE_SAMPLE_PAGES; i++)
+        {
+            std::swap(pages[i], pages[i + rng() % (pages.size() - i)]);
+        }
+        pages.resize(ANALYZE_SAMPLE_PAGES);
+        std::sort(pages.begin(), pages.end());
+    }
+    statistics.sampled_pages = pages.size();
+
+    // Sampled values of each column, as numbers or as strings
+    std::vector<std::vector<double>> numbers;
+    std::vector<std::vector<std::string>> strings;
+    size_t sampled_rows = 0;
+    Batch batch;
+    for (PageID page_id : pages)
+    {
+        batch.clear();
+        {
+            PageGuard page = buffer_manager.fixPage(page_id);
+            const Slot *slot_array = reinterpret_cast<const Slot *>(page->page_data.get());
+            for (size_t slot = 0; slot < MAX_SLOTS; slot++)
+            {
+                if (!slot_array[slot].empty)
+                {
+                    batch.appendSerialized(page->page_data.get() + slot_array[slot].offset, slot_array[slot].length);
+                }
+            }
+        }
+        if (batch.num_rows == 0)
+        {
+            continue;
+        }
+        sampled_rows += batch.num_rows;
+        if (statistics.columns.size() < batch.columns.size())
+        {
+            statistics.columns.resize(batch.columns.size());
+            numbers.resize(batch.columns.size());
+            strings.resize(batch.columns.size());
+        }
+        for (size_t c = 0; c < batch.columns.size(); c++)
+        {
+            const ColumnVector &column = batch.columns[c];
+            statistics.columns[c].type = column.type;
+            if (column.type == INT)
+            {
+                numbers[c].insert(numbers[c].end(), column.ints.begin(), column.ints.end());
+            }
+            else if (column.type == FLOAT)
+            {
+                numbers[c].insert(numbers[c].end(), column.floats.begin(), column.floats.end());
+            }
+            else
+            {
+                strings[c].insert(strings[c].end(), column.strings.begin(), column.strings.end());
+            }
+        }
+    }
+    if (sampled_rows == 0)
+    {
+        return statistics;
+    }
+    statistics.tuples_per_page = static_cast<double>(sampled_rows) / pages.size();
+    double table_rows = statistics.rows(statistics.num_pages);
+
+    // Counts the runs of equal values in a sorted sample, passing each
+    // value and its count to `run`
+    auto estimateDistinct = [&](const auto &sorted, auto &&run)
+    {
+        double n = static_cast<double>(sorted.size());
+        double distinct = 0;
+        double once = 0;
+        for (size_t i = 0; i < sorted.size();)
+        {
+            size_t j = i + 1;
+            while (j < sorted.size() && sorted[j] == sorted[i])
+            {
+                j++;
+            }
+            distinct += 1;
+            once += j - i == 1;
+            run(sorted[i], j - i);
+            i = j;
+        }
+        return std::clamp(n * distinct / (n - once + once * n / table_rows), 1.0, std::max(table_rows, 1.0));
+    };
+    for (size_t c = 0; c < statistics.columns.size(); c++)
+    {
+        ColumnStatistics &column = statistics.columns[c];
+        if (column.type == STRING)
+        {
+            std::sort(strings[c].begin(), strings[c].end());
+            column.distinct = estimateDistinct(strings[c], [](const std::string &, size_t) {});
+            continue;
+        }
+        std::vector<double> &values = numbers[c];
+        std::sort(values.begin(), values.end());
+        std::vector<std::pair<double, size_t>> runs;
+        column.distinct = estimateDistinct(values, [&runs](double value, size_t count)
+                                           { runs.emplace_back(value, count); });
+        std::stable_sort(runs.begin(), runs.end(), [](const auto &a, const auto &b)
+                         { return a.second > b.second; });
+        double rows_left = static_cast<double>(values.size());
+        double values_left = static_cast<double>(runs.size());
+        for (const auto &[value, count] : runs)
+        {
+            if (column.common_values.size() == MAX_COMMON_VALUES || count < 2 || count <= 1.25 * rows_left / values_left)
+            {
+                break;
+            }
+            column.common_values.emplace_back(value, static_cast<double>(count) / values.size());
+            rows_left -= count;
+            values_left -= 1;
+        }
+        if (runs.size() <= MAX_COMMON_VALUES && column.distinct <= runs.size())
+        {
+            // Every value was sampled more than once: keep them all
+            column.common_values.clear();
+            for (const auto &[value, count] : runs)
+            {
+                column.common_values.emplace_back(value, static_cast<double>(count) / values.size());
+            }
+        }
+        std::sort(column.common_values.begin(), column.common_values.end());
+        for (size_t b = 0; b < HISTOGRAM_BUCKETS; b++)
+        {
+            column.bounds.push_back(values[b * values.size() / HISTOGRAM_BUCKETS]);
+        }
+        column.bounds.push_back(values.back() + (column.type == INT ? 1 : 0));
+    }
+    return statistics;
+}
+
+// Statistics the optimizer plans with, as ANALYZE last left them. Queries
+// keep the statistics they started with while ANALYZE replaces them.
+class Catalog
+{
+private:
+    mutable std::mutex latch;
+    std::shared_ptr<const TableStatistics> table_statistics;
+
+public:
+    std::shared_ptr<const TableStatistics> statistics() const
+    {
+        std::lock_guard<std::mutex> lock(latch);
+        return table_statistics;
+    }
+
+    void setStatistics(TableStatistics statistics)
+    {
+        auto replacement = std::make_shared<const TableStatistics>(std::move(statistics));
+        std::lock_guard<std::mutex> lock(latch);
+        table_statistics = std::move(replacement);
+    }
+};
+
+// Costs the optimizer weighs, in units of reading and decrypting one heap
+// page during a sequential scan. --bench optimizer shows where they put the
+// break-even points.
+constexpr double CPU_TUPLE_COST = 0.01;  // Parsing and filtering a row
+constexpr double INDEX_FETCH_COST = 0.8; // Fetching a row through the index: leaf entry, page fix and slot parse
+constexpr double ZONE_CHECK_COST = 0.004; // Ruling a page in or out by its zone maps
+
+enum class AccessPath
+{
+    FULL_SCAN,
+    ZONE_MAP_SCAN,
+    INDEX_SCAN
+};
+
+struct AccessPathChoice
+{
+    AccessPath path = AccessPath::FULL_SCAN;
+    BPlusTree *index = nullptr; // INDEX_SCAN: the index and the range read from it
+    ColumnRange range{0};
+    double rows = -1; // Estimated rows passing the predicate; -1 without statistics
+};
+
+// Picks how to read the rows passing `predicate`, whose column ranges are
+// `ranges`. With statistics the cheapest path wins: a full scan, a scan
+// passing over the pages the zone maps rule out, or an index scan over the
+// range with the fewest index entries. Candidate pages and index entries
+// are counted exactly rather than estimated, since a rare value's share of
+// a sample is too noisy to choose between the two; entries are counted only
+// up to where the index scan would lose. Without statistics, an index scan
+// is taken when preferIndexScan() finds the range selective enough, and
+// zone maps are consulted whenever there are any.
+AccessPathChoice chooseAccessPath(const IPredicate *predicate,
+                                  const std::vector<ColumnRange> &ranges,
+                                  const std::map<size_t, BPlusTree *> &indexes,
+                                  const ZoneMaps *zone_maps,
+                                  const TableStatistics *statistics,
+                                  BufferManager &buffer_manager)
+{
+    AccessPathChoice choice;
+    if (statistics == nullptr || statistics->sampled_pages == 0)
+    {
+        for (const ColumnRange &range : ranges)
+        {
+            auto index = indexes.find(range.column);
+            if (index != indexes.end() && preferIndexScan(*index->second, range.lower, range.upper))
+            {
+                choice.path = AccessPath::INDEX_SCAN;
+                choice.index = index->second;
+                choice.range = range;
+                return choice;
+            }
+        }
+        if (zone_maps != nullptr && !ranges.empty())
+        {
+            choice.path = AccessPath::ZONE_MAP_SCAN;
+        }
+        return choice;
+    }
+
+    size_t pages = buffer_manager.getNumPages();
+    double rows = statistics->rows(pages);
+    choice.rows = rows * (predicate != nullptr ? statistics->selectivity(*predicate) : 1);
+    double best = pages + rows * CPU_TUPLE_COST;
+
+    bool prunable = false;
+    for (const ColumnRange &range : ranges)
+    {
+        prunable |= zone_maps != nullptr && zone_maps->covers(range.column);
+    }
+    if (prunable)
+    {
+        size_t candidates = 0;
+        for (PageID page_id = 0; page_id < pages; page_id++)
+        {
+            candidates += zone_maps->mayMatch(page_id, ranges);
+        }
+        double cost = candidates * (1 + statistics->tuples_per_page * CPU_TUPLE_COST) + pages * ZONE_CHECK_COST;
+        if (cost < best)
+        {
+            best = cost;
+            choice.path = AccessPath::ZONE_MAP_SCAN;
+        }
+    }
+    for (const ColumnRange &range : ranges)
+    {
+        auto index = indexes.find(range.column);
+        if (index == indexes.end())
+        {
+            continue;
+        }
+        size_t limit = static_cast<size_t>(best / (INDEX_FETCH_COST + CPU_TUPLE_COST)) + 1;
+        size_t entries = countIndexEntries(*index->second, range.lower, range.upper, limit);
+        double cost = entries * (INDEX_FETCH_COST + CPU_TUPLE_COST);
+        if (cost < best)
+        {
+            best = cost;
+            choice.path = AccessPath::INDEX_SCAN;
+            choice.index = index->second;
+            choice.range = range;
+        }
+    }
+    return choice;
+}
+
+// Largest share of the rows a WHERE clause may keep, by the statistics, for
+// a projection to fetch the selected columns of the rows that pass instead
+// of having the scan decode them. Above it, the rows that pass lie on most
+// pages, which a small pool has evicted again by the time they are fetched
+// (see benchmarkProjection).
+constexpr double LATE_MATERIALIZATION_MAX_SELECTIVITY = 0.02;
+
+// Runs a plan with the WHERE clause `predicate`, which may be null.
+// `indexes` maps a column to the B+tree indexing it, and `zone_maps` holds
+// the zone maps of the table; chooseAccessPath() decides whether to read
+// through an index, scan passing over the pages the zone maps rule out, or
+// scan everything. A scan decodes only the columns the WHERE clause and the
+// aggregates read; with late materialization, the selected columns of a
+// query without aggregates are fetched for the rows that pass. With
+// `statistics`, an aggregation sizes its table for the groups they predict,
+// and a projection without a LIMIT is decoded in the scan when they predict
+// that most rows pass.
+void executePlan(const QueryPlan &plan,
+                 std::unique_ptr<IPredicate> predicate,
+                 BufferManager &buffer_manager,
+                 const std::map<size_t, BPlusTree *> &indexes = {},
+                 const ZoneMaps *zone_maps = nullptr,
+                 const TableStatistics *statistics = nullptr)
+{
+    // Stack allocation of ScanOperator
+    ScanOperator scanOp(buffer_manager);
+
+    // Using a pointer to Operator to handle polymorphism
+    Operator *rootOp = &scanOp;
+
+    // Buffer for optional operators to ensure lifetime
+    std::optional<IndexScanOperator> indexScanOpBuffer;
+    std::optional<SelectOperator> selectOpBuffer;
+    std::optional<HashAggregationOperator> hashAggOpBuffer;
+    std::optional<ParallelScanOperator> parallelScanOpBuffer;
+    std::optional<SortOperator> sortOpBuffer;
+    std::optional<LimitOperator> limitOpBuffer;
+    std::optional<ProjectionOperator> projectionOpBuffer;
+
+    // Apply WHERE conditions
+    std::vector<ColumnRange> ranges;
+    if (predicate)
+    {
+        ranges = extractColumnRanges(*predicate);
+    }
+    AccessPathChoice access = chooseAccessPath(predicate.get(), ranges, indexes, zone_maps, statistics, buffer_manager);
+    BUZZDB_TRACE_LOG("Access path: " << static_cast<int>(access.path) << " Estimated rows: " << access.rows);
+    bool prune = access.path == AccessPath::ZONE_MAP_SCAN;
+    bool late_materialization = plan.late_materialization;
+    if (late_materialization && !plan.aggregate && !plan.limit && statistics != nullptr && access.rows >= 0 &&
+        access.rows > LATE_MATERIALIZATION_MAX_SELECTIVITY * statistics->rows(buffer_manager.getNumPages()))
+    {
+        late_materialization = false;
+    }
+    if (access.path == AccessPath::INDEX_SCAN)
+    {
+        indexScanOpBuffer.emplace(buffer_manager, *access.index, access.range.column, access.range.lower,
+                                  access.range.upper, std::move(predicate));
+        rootOp = &*indexScanOpBuffer;
+    }
+    else if (size_t scan_degree = ParallelScanOperator::degreeFor(buffer_manager); scan_degree > 1)
+    {
+        // Full scans are split into morsels for the scheduler's workers when
+        // the buffer pool has room for their bulk-read rings
+        parallelScanOpBuffer.emplace(buffer_manager, scan_degree, std::move(predicate));
+        if (late_materialization)
+        {
+            parallelScanOpBuffer->decodeOnly(plan.decoded_attrs);
+        }
+        if (prune)
+        {
+            parallelScanOpBuffer->pruneWith(*zone_maps, std::move(ranges));
+        }
+        rootOp = &*parallelScanOpBuffer;
+    }
+    else
+    {
+        if (prune)
+        {
+            scanOp.pruneWith(*zone_maps, std::move(ranges));
+        }
+        if (late_materialization)
+        {
+            scanOp.decodeOnly(plan.decoded_attrs);
+        }
+        if (predicate)
+        {
+            // Using std::optional to manage the lifetime of SelectOperator
+            selectOpBuffer.emplace(*rootOp, std::move(predicate));
+            rootOp = &*selectOpBuffer;
+        }
+    }
+
+    // Apply SUM or GROUP BY operation
+    if (plan.aggregate)
+    {
+        // Using std::optional to manage the lifetime of HashAggregationOperator
+        hashAggOpBuffer.emplace(*rootOp, plan.group_by_attrs, plan.aggr_funcs);
+        if (statistics != nullptr && access.rows >= 0)
+        {
+            double groups = 1;
+            for (size_t attr : plan.group_by_attrs)
+            {
+                groups *= attr < statistics->columns.size() ? statistics->columns[attr].distinct : access.rows;
+            }
+            hashAggOpBuffer->expectGroups(static_cast<size_t>(std::min(groups, access.rows)));
+        }
+        rootOp = &*hashAggOpBuffer;
+    }
+
+    // Apply ORDER BY and LIMIT; a sort with a limit keeps only the rows
+    // that can still make it into the output. ORDER BY numbers the selected
+    // columns, so they are fetched before sorting; after a plain LIMIT,
+    // only for the rows it lets through.
+    if (!plan.projected_attrs.empty() && plan.project_before_sort)
+    {
+        projectionOpBuffer.emplace(*rootOp, plan.projected_attrs, buffer_manager);
+        rootOp = &*projectionOpBuffer;
+    }
+    if (!plan.sort_keys.empty())
+    {
+        sortOpBuffer.emplace(*rootOp, plan.sort_keys, plan.limit);
+        rootOp = &*sortOpBuffer;
+    }
+    else if (plan.limit)
+    {
+        limitOpBuffer.emplace(*rootOp, *plan.limit);
+        rootOp = &*limitOpBuffer;
+    }
+    if (!plan.projected_attrs.empty() && !plan.project_before_sort)
+    {
+        projectionOpBuffer.emplace(*rootOp, plan.projected_attrs, buffer_manager);
+        rootOp = &*projectionOpBuffer;
+    }
+
+    // Execute the Root Operator
+    rootOp->open();
+    Batch batch;
+    while (rootOp->nextBatch(batch))
+    {
+        // Print the selected rows of the batch
+        for (uint16_t row : batch.selection)
+        {
+            for (const ColumnVector &column : batch.columns)
+            {
+                column.fieldAt(row).print();
+                std::cout << " ";
+            }
+            std::cout << std::endl;
+        }
+    }
+    rootOp->close();
+}
+
+void executeQuery(const QueryComponents &components,
+                  BufferManager &buffer_manager,
+                  const std::map<size_t, BPlusTree *> &indexes = {},
+                  const ZoneMaps *zone_maps = nullptr,
+                  const TableStatistics *statistics = nullptr)
+{
+    QueryPlan plan = planQuery(components, buffer_manager);
+    std::unique_ptr<IPredicate> predicate = wherePredicate(components, plan.column_types);
+    executePlan(plan, std::move(predicate), buffer_manager, indexes, zone_maps, statistics);
+}
+
+// Default number of plans PlanCache keeps, and the environment variable
+// that overrides it (0 disables the cache).
+constexpr size_t DEFAULT_PLAN_CACHE_ENTRIES = 1024;
+const char *PLAN_CACHE_ENV = "BUZZDB_PLAN_CACHE";
+
+size_t planCacheEntriesFromEnvironment()
+{
+    if (const char *entries = std::getenv(PLAN_CACHE_ENV))
+    {
+        return std::stoul(entries);
+    }
+    return DEFAULT_PLAN_CACHE_ENTRIES;
+}
+
+// Parsed and planned queries, keyed by their text with the constants taken
+// out (see extractQueryParameters), so queries that differ only in their
+// constants are parsed and planned once. A hit only tokenizes the query to
+// find its key and parameters. The least recently used plan makes room for
+// a new one. Safe to use from several threads.
+class PlanCache
+{
+public:
+    struct Entry
+    {
+        QueryComponents query; // Without parameters
+        QueryPlan plan;
+    };
+
+    // A cached plan with the parameters of one query
+    struct PreparedQuery
+    {
+        std::shared_ptr<const Entry> entry;
+        std::vector<Field> parameters;
+    };
+
+private:
+    size_t capacity;
+    std::mutex latch;
+    std::list<std::pair<std::string, std::shared_ptr<const Entry>>> lru; // Most recently used first
+    std::unordered_map<std::string_view, decltype(lru)::iterator> entries; // Keys point into `lru`
+
+public:
+    explicit PlanCache(size_t capacity = planCacheEntriesFromEnvironment()) : capacity(capacity) {}
+
+    PreparedQuery prepare(std::string_view query, BufferManager &buffer_manager, std::vector<Field> arguments = {})
+    {
+        std::vector<QueryToken> tokens = tokenizeQuery(query);
+        PreparedQuery prepared;
+        std::string key = extractQueryParameters(tokens, std::move(arguments), prepared.parameters);
+        {
+            std::lock_guard<std::mutex> lock(latch);
+            auto it = entries.find(key);
+            if (it != entries.end())
+            {
+                lru.splice(lru.begin(), lru, it->second);
+                engineStats().plan_cache_hits.add(1);
+                prepared.entry = it->second->second;
+                return prepared;
+            }
+        }
+        engineStats().plan_cache_misses.add(1);
+        auto entry = std::make_shared<Entry>();
+        entry->query = QueryParser(tokens).parse();
+        entry->plan = planQuery(entry->query, buffer_manager);
+        prepared.entry = entry;
+        // A plan made before the table has rows knows none of its column
+        // types, so it could not bind constants for the rows that come later
+        if (capacity == 0 || entry->plan.column_types.empty())
+        {
+            return prepared;
+        }
+
+        std::lock_guard<std::mutex> lock(latch);
+        if (entries.find(key) == entries.end())
+        {
+            if (entries.size() == capacity)
+            {
+                entries.erase(lru.back().first);
+                lru.pop_back();
+            }
+            lru.emplace_front(std::move(key), entry);
+            entries.emplace(lru.front().first, lru.begin());
+        }
+        return prepared;
+    }
+
+    // Runs a prepared query; ANALYZE is left to the owner of the catalog
+    static void run(const PreparedQuery &prepared,
+                    BufferManager &buffer_manager,
+                    const std::map<size_t, BPlusTree *> &indexes = {},
+                    const ZoneMaps *zone_maps = nullptr,
+                    const TableStatistics *statistics = nullptr)
+    {
+        if (prepared.entry->query.analyze)
+        {
+            throw std::runtime_error("ANALYZE needs a catalog to store its statistics in.");
+        }
+        std::unique_ptr<IPredicate> predicate;
+        if (prepared.entry->query.where)
+        {
+            predicate = bindWhere(*prepared.entry->query.where, prepared.parameters, prepared.entry->plan.column_types);
+        }
+        executePlan(prepared.entry->plan, std::move(predicate), buffer_manager, indexes, zone_maps, statistics);
+    }
+
+    void execute(std::string_view query,
+                 BufferManager &buffer_manager,
+                 const std::map<size_t, BPlusTree *> &indexes = {},
+                 const ZoneMaps *zone_maps = nullptr,
+                 const TableStatistics *statistics = nullptr,
+                 std::vector<Field> arguments = {})
+    {
+        run(prepare(query, buffer_manager, std::move(arguments)), buffer_manager, indexes, zone_maps, statistics);
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(latch);
+        return entries.size();
+    }
+};
+
+// Secondary B+tree indexes on integer columns of the heap, one index file
+// per column, and the zone maps of indexed and declared columns. Inserts
+// and deletes report each heap change here, so both always match the
+// table. An index update that fails is undone before the error reaches the
+// caller, which then undoes its heap change.
+class SecondaryIndexes
+{
+private:
+    BufferManager &bufferManager;
+    std::map<size_t, std::unique_ptr<BPlusTree>> indexes;
+    ZoneMaps zone_maps;
+
+public:
+    explicit SecondaryIndexes(BufferManager &manager) : bufferManager(manager) {}
+
+    static std::string filenameFor(size_t column)
+    {
+        return "buzzdb.col" + std::to_string(column + 1) + ".idx";
+    }
+
+    // Builds an index on the column from the table's current contents: the
+    // (key, record id) pairs of a parallel scan go through an external sort
+    // and are bulk loaded bottom-up. An index file left by an earlier run is
+    // rebuilt, as the table may have changed while the index was not open.
+    BPlusTree &create(size_t column)
+    {
+        auto it = indexes.find(column);
+        if (it != indexes.end())
+        {
+            return *it->second;
+        }
+        std::string filename = filenameFor(column);
+        std::remove(filename.c_str());
+        auto index = std::make_unique<BPlusTree>(bufferManager, filename);
+        // The column's zone maps are filled by the same scan
+        bool had_zone_maps = zone_maps.covers(column);
+        zone_maps.addColumn(column, zoneMapBloomFromEnvironment(), bufferManager.getNumPages());
+        try
+        {
+            ExternalSorter<BTreeEntry> sorter;
+            scanColumn(column, sorter);
+            sorter.finish();
+            index->bulkLoad(sorter.size(), [&sorter](BTreeEntry &entry)
+                            { return sorter.next(entry); });
+        }
+        catch (...)
+        {
+            if (!had_zone_maps)
+            {
+                zone_maps.removeColumn(column);
+            }
+            throw;
+        }
+        return *(indexes[column] = std::move(index));
+    }
+
+    // Keeps zone maps of a column without indexing it, built from a scan
+    // of the table's current contents
+    void createZoneMap(size_t column, bool use_bloom = zoneMapBloomFromEnvironment())
+    {
+        if (zone_maps.covers(column))
+        {
+            return;
+        }
+        zone_maps.addColumn(column, use_bloom, bufferManager.getNumPages());
+        try
+        {
+            ScanOperator scan(bufferManager);
+            scan.open();
+            for (bool has_tuple = true; has_tuple; has_tuple = scan.next())
+            {
+                RecordId rid = scan.getRecordId();
+                auto fields = scan.getOutput();
+                if (fields.empty())
+                {
+                    break;
+                }
+                zone_maps.include(rid.page_id, fields);
+            }
+            scan.close();
+        }
+        catch (...)
+        {
+            zone_maps.removeColumn(column);
+            throw;
+        }
+    }
+
+    const ZoneMaps &zoneMaps() const { return zone_maps; }
+
+    BPlusTree *find(size_t column) const
+    {
+        auto it = indexes.find(column);
+        return it == indexes.end() ? nullptr : it->second.get();
+    }
+
+    // Column -> index, in the form executeQuery takes
+    std::map<size_t, BPlusTree *> all() const
+    {
+        std::map<size_t, BPlusTree *> result;
+        for (const auto &[column, index] : indexes)
+        {
+            result[column] = index.get();
+        }
+        return result;
+    }
+
+    bool empty() const { return indexes.empty() && zone_maps.empty(); }
+
+    void onInsert(const std::vector<std::unique_ptr<Field>> &fields, RecordId rid)
+    {
+        std::vector<std::pair<BPlusTree *, int64_t>> keys = keysOf(fields);
+        size_t done = 0;
+        try
+        {
+            for (; done < keys.size(); done++)
+            {
+                keys[done].first->insert(keys[done].second, rid);
+            }
+        }
+        catch (...)
+        {
+            for (size_t i = 0; i < done; i++)
+            {
+                keys[i].first->erase(keys[i].second, rid);
+            }
+            throw;
+        }
+        zone_maps.include(rid.page_id, fields);
+    }
+
+    // Called before the tuple is removed from the heap; afterDelete() once it is
+    void onDelete(const std::vector<std::unique_ptr<Field>> &fields, RecordId rid)
+    {
+        std::vector<std::pair<BPlusTree *, int64_t>> keys = keysOf(fields);
+        size_t done = 0;
+        try
+        {
+            for (; done < keys.size(); done++)
+            {
+                keys[done].first->erase(keys[done].second, rid);
+            }
+        }
+        catch (...)
+        {
+            for (size_t i = 0; i < done; i++)
+            {
+                keys[i].first->insert(keys[i].second, rid);
+            }
+            throw;
+        }
+    }
+
+    void afterDelete(const std::vector<std::unique_ptr<Field>> &fields, RecordId rid, const SlottedPage &page)
+    {
+        zone_maps.onDelete(rid.page_id, fields, page);
+    }
+
+private:
+    // The tuple's key in every index; throws before anything changes when
+    // an indexed column is missing or not an integer
+    std::vector<std::pair<BPlusTree *, int64_t>> keysOf(const std::vector<std::unique_ptr<Field>> &fields) const
+    {
+        std::vector<std::pair<BPlusTree *, int64_t>> keys;
+        for (const auto &[column, index] : indexes)
+        {
+            if (column >= fields.size() || fields[column]->getType() != INT)
+            {
+                throw std::runtime_error("Indexed column " + std::to_string(column + 1) + " is not an integer.");
+            }
+            keys.emplace_back(index.get(), fields[column]->asInt());
+        }
+        return keys;
+    }
+
+    // Adds (key, record id) of every tuple to the sorter. Page ranges are
+    // scanned on several threads, so decryption and deserialization run in
+    // parallel; each thread hands its entries over in chunks. Every scan may
+    // take a full bulk-read ring, and half of the pool stays free for
+    // everyone else.
+    void scanColumn(size_t column, ExternalSorter<BTreeEntry> &sorter)
+    {
+        static constexpr size_t CHUNK_SIZE = 4096;
+        std::mutex sorter_latch;
+        size_t num_pages = bufferManager.getNumPages();
+        size_t max_rings = bufferManager.getPoolSize() / (2 * BULK_READ_RING_BYTES / PAGE_SIZE);
+        size_t num_threads = std::clamp<size_t>(std::min<size_t>(std::thread::hardware_concurrency(), max_rings),
+                                                1, std::max<size_t>(1, num_pages));
+
+        std::vector<std::exception_ptr> errors(num_threads);
+        std::vector<std::thread> threads;
+        for (size_t t = 0; t < num_threads; t++)
+        {
+            threads.emplace_back([&, t]
+                                 {
+                try
+                {
+                    std::vector<BTreeEntry> chunk;
+                    auto handOver = [&]
+                    {
+                        std::lock_guard<std::mutex> lock(sorter_latch);
+                        for (const BTreeEntry &entry : chunk)
+                        {
+                            sorter.add(entry);
+                        }
+                        chunk.clear();
+                    };
+                    ScanOperator scan(bufferManager, num_pages * t / num_threads, num_pages * (t + 1) / num_threads);
+                    scan.open();
+                    for (bool has_tuple = true; has_tuple; has_tuple = scan.next())
+                    {
+                        RecordId rid = scan.getRecordId();
+                        auto fields = scan.getOutput();
+                        if (fields.empty())
+                        {
+                            break;
+                        }
+                        if (column >= fields.size() || fields[column]->getType() != INT)
+                        {
+                            throw std::runtime_error("Indexed column " + std::to_string(column + 1) + " is not an integer.");
+                        }
+                        chunk.push_back(BTreeEntry{fields[column]->asInt(), rid.pack()});
+                        zone_maps.include(rid.page_id, fields);
+                        if (chunk.size() == CHUNK_SIZE)
+                        {
+                            handOver();
+                        }
+                    }
+                    handOver();
+                    scan.close();
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                } });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        for (auto &error : errors)
+        {
+            if (error)
+            {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+};
+
+class InsertOperator : public Operator
+{
+private:
+    BufferManager &bufferManager;
+    std::unique_ptr<Tuple> tupleToInsert;
+    std::vector<Swip> local_swips;
+    std::vector<Swip> *page_swips;
+    SecondaryIndexes *indexes;
+
+public:
+    // `page_swips` (one swip per heap page, grown as needed) lets inserts
+    // probe pages for free space optimistically across operator instances.
+    // Inserted tuples are added to `indexes`, when given.
+    InsertOperator(BufferManager &manager, std::vector<Swip> *page_swips = nullptr,
+                   SecondaryIndexes *indexes = nullptr)
+        : bufferManager(manager), page_swips(page_swips ? page_swips : &local_swips), indexes(indexes) {}
+
+    // Set the tuple to be inserted by this operator.
+    void setTupleToInsert(std::unique_ptr<Tuple> tuple)
+    {
+        tupleToInsert = std::move(tuple);
+    }
+
+    void open() override
+    {
+        // Not used in this context
+    }
+
+    bool next() override
+    {
+        if (!tupleToInsert)
+            return false; // No tuple to insert
+
+        size_t tuple_size = tupleToInsert->serialize().size();
+        for (size_t pageId = 0; pageId < bufferManager.getNumPages(); ++pageId)
+        {
+            // Skip full pages without latching them or touching the LRU list
+            bool has_space = bufferManager.readOptimistic(pageSwip(pageId), [tuple_size](const SlottedPage &page)
+                                                          { return page.hasSpaceFor(tuple_size); });
+            if (!has_space)
+            {
+                continue;
+            }
+
+            auto page = bufferManager.fixPageExclusive(pageId);
+            // Attempt to insert the tuple
+            if (auto slot = page->insertTuple(tupleToInsert->clone()))
+            {
+                indexInsertedTuple(*page, RecordId{static_cast<PageID>(pageId), static_cast<uint16_t>(*slot)});
+                // Flush the page to disk after insertion
+                bufferManager.flushPage(pageId);
+                return true; // Insertion successful
+            }
+        }
+
+        // If insertion failed in all existing pages, extend the database and try again
+        PageID newPageId = bufferManager.extend();
+        auto newPage = bufferManager.fixPageExclusive(newPageId);
+        if (auto slot = newPage->insertTuple(tupleToInsert->clone()))
+        {
+            indexInsertedTuple(*newPage, RecordId{newPageId, static_cast<uint16_t>(*slot)});
+            bufferManager.flushPage(newPageId);
+            return true; // Insertion successful after extending the database
+        }
+
+        return false; // Insertion failed even after extending the database
+    }
+
+    void close() override
+    {
+        // Not used in this context
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        return {}; // Return empty vector
+    }
+
+private:
+    // Adds the tuple to the indexes. If that fails, the tuple is taken back
+    // out of the page, which has not been flushed yet, before the error is
+    // passed on.
+    void indexInsertedTuple(SlottedPage &page, RecordId rid)
+    {
+        if (indexes == nullptr)
+        {
+            return;
+        }
+        try
+        {
+            indexes->onInsert(tupleToInsert->fields, rid);
+        }
+        catch (...)
+        {
+            page.deleteTuple(rid.slot);
+            throw;
+        }
+    }
+
+    Swip &pageSwip(size_t pageId)
+    {
+        while (page_swips->size() <= pageId)
+        {
+            page_swips->emplace_back(static_cast<PageID>(page_swips->size()));
+        }
+        return (*page_swips)[pageId];
+    }
+};
+
+class DeleteOperator : public Operator
+{
+private:
+    BufferManager &bufferManager;
+    size_t pageId;
+    size_t tupleId;
+    SecondaryIndexes *indexes;
+
+public:
+    // The deleted tuple is removed from `indexes`, when given
+    DeleteOperator(BufferManager &manager, size_t pageId, size_t tupleId, SecondaryIndexes *indexes = nullptr)
+        : bufferManager(manager), pageId(pageId), tupleId(tupleId), indexes(indexes) {}
+
+    void open() override
+    {
+        // Not used in this context
+    }
+
+    bool next() override
+    {
+        auto page = bufferManager.fixPageExclusive(pageId);
+        if (!page)
+        {
+            std::cerr << "Page not found." << std::endl;
+            return false;
+        }
+
+        // Read the tuple first: its keys name the index entries to remove.
+        // The indexes go first, since removing a slot from the page cannot fail.
+        const Slot *slot_array = reinterpret_cast<const Slot *>(page->page_data.get());
+        RecordId rid{static_cast<PageID>(pageId), static_cast<uint16_t>(tupleId)};
+        std::unique_ptr<Tuple> tuple;
+        if (indexes != nullptr && !indexes->empty() && tupleId < MAX_SLOTS && !slot_array[tupleId].empty)
+        {
+            const Slot &slot = slot_array[tupleId];
+            std::istringstream iss(std::string(page->page_data.get() + slot.offset, slot.length));
+            tuple = Tuple::deserialize(iss);
+            indexes->onDelete(tuple->fields, rid);
+        }
+
+        page->deleteTuple(tupleId);      // Perform deletion
+        if (tuple)
+        {
+            indexes->afterDelete(tuple->fields, rid, *page);
+        }
+        bufferManager.flushPage(pageId); // Flush the page to disk after deletion
+        return true;
+    }
+
+    void close() override
+    {
+        // Not used in this context
+    }
+
+    std::vector<std::unique_ptr<Field>> getOutput() override
+    {
+        return {}; // Return empty vector
+    }
+};
+
+class BuzzDB
+{
+public:
+    HashIndex hash_index;
+    BufferManager buffer_manager;
+    std::vector<Swip> heap_page_swips; // Used by inserts to find free space
+    SecondaryIndexes indexes{buffer_manager};
+    Catalog catalog;
+    PlanCache plan_cache;
+
+public:
+    size_t max_number_of_tuples = 5000;
+    size_t tuple_insertion_attempt_counter = 0;
+
+    BuzzDB()
+    {
+        // Storage Manager automatically created
+    }
+
+    // Builds the indexes BUZZDB_INDEXES lists, e.g. "1" or "1,2", and the
+    // zone maps of the columns BUZZDB_ZONE_MAPS lists. Called once the
+    // table is loaded, so each index is bulk loaded from it.
+    void createIndexesFromEnvironment()
+    {
+        if (const char *columns = std::getenv("BUZZDB_INDEXES"))
+        {
+            std::istringstream list(columns);
+            std::string column;
+            while (std::getline(list, column, ','))
+            {
+                createIndex(std::stoul(column) - 1);
+            }
+        }
+        if (const char *columns = std::getenv("BUZZDB_ZONE_MAPS"))
+        {
+            std::istringstream list(columns);
+            std::string column;
+            while (std::getline(list, column, ','))
+            {
+                indexes.createZoneMap(std::stoul(column) - 1);
+            }
+        }
+    }
+
+    // Indexes the (0-based) column; later inserts and deletes keep it current
+    BPlusTree &createIndex(size_t column)
+    {
+        return indexes.create(column);
+    }
+
+    // insert function
+    void insert(int key, int value)
+    {
+        tuple_insertion_attempt_counter += 1;
+
+        InsertOperator insertOp(buffer_manager, &heap_page_swips, &indexes);
+        insertOp.setTupleToInsert(makeTuple(key, value));
+        bool status = insertOp.next();
+
+        assert(status == true);
+
+        if (tuple_insertion_attempt_counter % 10 != 0)
+        {
+            // Assuming you want to delete the first tuple from the first page
+            DeleteOperator delOp(buffer_manager, 0, 0, &indexes);
+            if (!delOp.next())
+            {
+                std::cerr << "Failed to delete tuple." << std::endl;
+            }
+        }
+    }
+
+    std::unique_ptr<Tuple> makeTuple(int key, int value)
+    {
+        // Create a new tuple with the given key and value
+        auto newTuple = std::make_unique<Tuple>();
+
+        auto key_field = std::make_unique<Field>(key);
+        auto value_field = std::make_unique<Field>(value);
+        float float_val = 132.04;
+        auto float_field = std::make_unique<Field>(float_val);
+        auto string_field = std::make_unique<Field>("buzzdb");
+
+        newTuple->addField(std::move(key_field));
+        newTuple->addField(std::move(value_field));
+        newTuple->addField(std::move(float_field));
+        newTuple->addField(std::move(string_field));
+        return newTuple;
+    }
+
+    // Runs a query and prints its rows. ANALYZE samples the table and
+    // replaces the statistics in the catalog that later queries plan with.
+    void execute(std::string_view query, std::vector<Field> arguments = {})
+    {
+        PlanCache::PreparedQuery prepared = plan_cache.prepare(query, buffer_manager, std::move(arguments));
+        if (prepared.entry->query.analyze)
+        {
+            catalog.setStatistics(analyzeTable(buffer_manager));
+            return;
+        }
+        PlanCache::run(prepared, buffer_manager, indexes.all(), &indexes.zoneMaps(), catalog.statistics().get());
+    }
+
+    void executeQueries()
+    {
+
+        std::vector<std::string> test_queries = {
+            "ANALYZE",
+            "SUM{1} GROUP BY {1} WHERE {1} > 2 and {1} < 6"};
+
+        for (const auto &query : test_queries)
+        {
+            // prettyPrint(parseQuery(query));
+            execute(query);
+        }
+    }
+};
+
+// Interleaves point lookups on a small hot set of pages with full-table
+// scans and reports the hit ratio the lookups see, once with scans going
+// through the shared LRU list and once with the bulk-read ring.
+void benchmarkScanStrategy(BufferManager &buffer_manager)
+{
+    const size_t hot_pages = std::min<size_t>(buffer_manager.getPoolSize() / 2, buffer_manager.getNumPages());
+    const size_t lookups_every_n_tuples = 100;
+    const size_t scan_rounds = 3;
+
+    for (bool use_bulk_read : {false, true})
+    {
+        size_t lookup_hits = 0;
+        size_t lookup_misses = 0;
+        size_t next_hot_page = 0;
+
+        for (size_t round = 0; round < scan_rounds; round++)
+        {
+            ScanOperator scanOp(buffer_manager, use_bulk_read);
+            scanOp.open();
+            size_t tuples = 0;
+            while (scanOp.next())
+            {
+                if (++tuples % lookups_every_n_tuples != 0)
+                {
+                    continue;
+                }
+                size_t hits_before = engineStats().buffer_hits.value();
+                buffer_manager.getPage(next_hot_page);
+                next_hot_page = (next_hot_page + 1) % hot_pages;
+                if (engineStats().buffer_hits.value() > hits_before)
+                {
+                    lookup_hits++;
+                }
+                else
+                {
+                    lookup_misses++;
+                }
+            }
+            scanOp.close();
+        }
+
+        double hit_ratio = 100.0 * lookup_hits / std::max<size_t>(1, lookup_hits + lookup_misses);
+        std::cout << "Scan strategy " << (use_bulk_read ? "BULKREAD" : "NORMAL")
+                  << " :: point lookups: " << lookup_hits + lookup_misses
+                  << " hit ratio: " << hit_ratio << "%" << std::endl;
+    }
+}
+
+// Measures page lookup throughput on a fully resident working set with 1 to
+// 64 threads: fixPage with a single page table partition, fixPage with the
+// maximum number of partitions, and optimistic reads through swips.
+void benchmarkBufferScaling()
+{
+    const size_t lookups_per_thread = 50000;
+
+    for (std::string mode : {"fixPage", "optimistic"})
+    {
+        for (size_t num_partitions : {size_t(1), MAX_BUFFER_PARTITIONS})
+        {
+            BufferPoolConfig config;
+            config.num_frames = 1024;
+            config.num_partitions = num_partitions;
+            BufferManager buffer_manager(config);
+            size_t num_pages = std::min(buffer_manager.getNumPages(), config.num_frames);
+            std::vector<Swip> swips;
+            for (size_t page_id = 0; page_id < num_pages; page_id++)
+            {
+                swips.emplace_back(page_id);
+                buffer_manager.readOptimistic(swips.back(), [](const SlottedPage &)
+                                              { return true; });
+            }
+
+            for (size_t num_threads = 1; num_threads <= 64; num_threads *= 2)
+            {
+                size_t hits_before = engineStats().buffer_hits.value();
+                size_t misses_before = engineStats().buffer_misses.value();
+                auto start = std::chrono::high_resolution_clock::now();
+
+                std::vector<std::thread> threads;
+                for (size_t t = 0; t < num_threads; t++)
+                {
+                    threads.emplace_back([&, t]
+                                         {
+                        uint64_t state = 0x9E3779B97F4A7C15ull * (t + 1);
+                        for (size_t i = 0; i < lookups_per_thread; i++)
+                        {
+                            state ^= state << 13;
+                            state ^= state >> 7;
+                            state ^= state << 17;
+                            if (mode == "optimistic")
+                            {
+                                buffer_manager.readOptimistic(swips[state % num_pages], [](const SlottedPage &page)
+                                                              { return page.page_data[0]; });
+                            }
+                            else
+                            {
+                                auto page = buffer_manager.fixPage(state % num_pages);
+                            }
+                        } });
+                }
+                for (auto &thread : threads)
+                {
+                    thread.join();
+                }
+
+                std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+                size_t hits = engineStats().buffer_hits.value() - hits_before;
+                size_t lookups = hits + engineStats().buffer_misses.value() - misses_before;
+                std::cout << "Mode: " << mode
+                          << " Partitions: " << buffer_manager.getNumPartitions()
+                          << " Threads: " << num_threads
+                          << " Lookups/s: " << static_cast<size_t>(lookups / elapsed.count())
+                          << " Hit ratio: " << 100.0 * hits / lookups << "%" << std::endl;
+            }
+        }
+    }
+}
+
+// Fixed-capacity index the engine used before HashIndex. Only kept as the
+// baseline of the hash-index benchmark.
+class LegacyHashIndex
+{
+private:
+    struct HashEntry
+    {
+        int key;
+        int value;
+        int position; // Final position within the array
+        bool exists;  // Flag to check if entry exists
+
+        // Default constructor
+        HashEntry() : key(0), value(0), position(-1), exists(false) {}
+
+        // Constructor for initializing with key, value, and exists flag
+        HashEntry(int k, int v, int pos) : key(k), value(v), position(pos), exists(true) {}
+    };
+
+    static const size_t capacity = 100; // Hard-coded capacity
+    HashEntry hashTable[capacity];      // Static-sized array
+
+    size_t hashFunction(int key) const
+    {
+        return key % capacity; // Simple modulo hash function
+    }
+
+public:
+    LegacyHashIndex()
+    {
+        // Initialize all entries as non-existing by default
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            hashTable[i] = HashEntry();
+        }
+    }
+
+    void insertOrUpdate(int key, int value)
+    {
+        size_t index = hashFunction(key);
+        size_t originalIndex = index;
+        bool inserted = false;
+        int i = 0; // Attempt counter
+
+        do
+        {
+            if (!hashTable[index].exists)
+            {
+                hashTable[index] = HashEntry(key, value, true);
+                hashTable[index].position = index;
+                inserted = true;
+                break;
+            }
+            else if (hashTable[index].key == key)
+            {
+                hashTable[index].value += value;
+                hashTable[index].position = index;
+                inserted = true;
+                break;
+            }
+            i++;
+            index = (originalIndex + i * i) % capacity; // Quadratic probing
+        } while (index != originalIndex && !inserted);
 
-        if (right_operand.type == DIRECT)
+        if (!inserted)
+        {
+            std::cerr << "HashTable is full or cannot insert key: " << key << std::endl;
+        }
+    }
+
+    int getValue(int key) const
+    {
+        size_t index = hashFunction(key);
+        size_t originalIndex = index;
+
+        do
+        {
+            if (hashTable[index].exists && hashTable[index].key == key)
+            {
+                return hashTable[index].value;
+            }
+            if (!hashTable[index].exists)
+            {
+                break; // Stop if we find a slot that has never been used
+            }
+            index = (index + 1) % capacity;
+        } while (index != originalIndex);
+
+        return -1; // Key not found
+    }
+
+    // This method is not efficient for range queries
+    // as this is an unordered index
+    // but is included for comparison
+    std::vector<int> rangeQuery(int lowerBound, int upperBound) const
+    {
+        std::vector<int> values;
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            if (hashTable[i].exists && hashTable[i].key >= lowerBound && hashTable[i].key <= upperBound)
+            {
+                std::cout << "Key: " << hashTable[i].key << ", Value: " << hashTable[i].value << std::endl;
+                values.push_back(hashTable[i].value);
+            }
+        }
+        return values;
+    }
+
+    void print() const
+    {
+        for (size_t i = 0; i < capacity; ++i)
+        {
+            if (hashTable[i].exists)
+            {
+                std::cout << "Position: " << hashTable[i].position << ", Key: " << hashTable[i].key << ", Value: " << hashTable[i].value << std::endl;
+            }
+        }
+    }
+};
+
+// Runs `insert(key)` for every key, then `lookup(key)` for every key in
+// shuffled order, and prints both throughputs
+template <typename Insert, typename Lookup>
+void benchmarkIndexOps(const std::string &name, const std::vector<int64_t> &keys, size_t rounds, Insert &&insert, Lookup &&lookup)
+{
+    std::vector<int64_t> probes = keys;
+    std::shuffle(probes.begin(), probes.end(), std::mt19937_64(42));
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (size_t round = 0; round < rounds; round++)
+    {
+        for (int64_t key : keys)
+        {
+            insert(key);
+        }
+    }
+    std::chrono::duration<double> insert_time = std::chrono::high_resolution_clock::now() - start;
+
+    int64_t checksum = 0;
+    start = std::chrono::high_resolution_clock::now();
+    for (size_t round = 0; round < rounds; round++)
+    {
+        for (int64_t key : probes)
+        {
+            checksum += lookup(key);
+        }
+    }
+    std::chrono::duration<double> lookup_time = std::chrono::high_resolution_clock::now() - start;
+
+    size_t ops = keys.size() * rounds;
+    std::cout << "Index: " << name
+              << " Keys: " << keys.size()
+              << " Inserts/s: " << static_cast<size_t>(ops / insert_time.count())
+              << " Lookups/s: " << static_cast<size_t>(ops / lookup_time.count())
+              << " Checksum: " << checksum << std::endl;
+}
+
+// Compares HashIndex against the fixed-capacity LegacyHashIndex on a key set
+// small enough for the latter, and against std::unordered_map on a large one
+void benchmarkHashIndex()
+{
+    std::vector<int64_t> small_keys(90);
+    std::iota(small_keys.begin(), small_keys.end(), 0);
+    const size_t small_rounds = 20000;
+    {
+        auto legacy = std::make_unique<LegacyHashIndex>();
+        benchmarkIndexOps("LegacyHashIndex", small_keys, small_rounds, [&](int64_t key)
+                          { legacy->insertOrUpdate(key, 1); }, [&](int64_t key)
+                          { return legacy->getValue(key); });
+    }
+    {
+        HashIndex index;
+        benchmarkIndexOps("HashIndex", small_keys, small_rounds, [&](int64_t key)
+                          { index.insertOrUpdate(key, 1); }, [&](int64_t key)
+                          { return index.getValue(key); });
+    }
+    {
+        std::unordered_map<int64_t, int64_t> map;
+        benchmarkIndexOps("std::unordered_map", small_keys, small_rounds, [&](int64_t key)
+                          { map[key] += 1; }, [&](int64_t key)
+                          { auto it = map.find(key);
+                            return it == map.end() ? -1 : it->second; });
+    }
+
+    std::vector<int64_t> large_keys(1 << 20);
+    std::mt19937_64 rng(7);
+    for (int64_t &key : large_keys)
+    {
+        key = static_cast<int64_t>(rng());
+    }
+    {
+        HashIndex index;
+        benchmarkIndexOps("HashIndex", large_keys, 1, [&](int64_t key)
+                          { index.insertOrUpdate(key, 1); }, [&](int64_t key)
+                          { return index.getValue(key); });
+    }
+    {
+        std::unordered_map<int64_t, int64_t> map;
+        benchmarkIndexOps("std::unordered_map", large_keys, 1, [&](int64_t key)
+                          { map[key] += 1; }, [&](int64_t key)
+                          { auto it = map.find(key);
+                            return it == map.end() ? -1 : it->second; });
+    }
+}
+
+// Appends tuples with random keys to fresh heap pages, indexes the key
+// column, and times WHERE ranges of growing width with and without the
+// index. The index is built in a scratch file that is removed afterwards.
+void benchmarkIndexScan(BufferManager &buffer_manager)
+{
+    // Pages only take tuples of one serialized size: three-digit keys and
+    // one-digit values serialize like the loaded data
+    const size_t num_tuples = 50000;
+    const int min_key = 100;
+    const int key_domain = 900;
+    const std::string index_filename = "buzzdb.bench.idx";
+
+    std::mt19937 rng(11);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(min_key + rng() % key_domain)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>("buzzdb"));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    std::remove(index_filename.c_str());
+    {
+        BPlusTree index(buffer_manager, index_filename);
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        scan.open();
+        for (bool has_tuple = true; has_tuple; has_tuple = scan.next())
+        {
+            RecordId rid = scan.getRecordId();
+            auto fields = scan.getOutput();
+            if (!fields.empty())
+            {
+                index.insert(fields[0]->asInt(), rid);
+            }
+        }
+        scan.close();
+        std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Index entries: " << index.size() << " Height: " << index.height()
+                  << " Build ms: " << build_time.count() * 1000 << std::endl;
+
+        for (int width : {1, 9, 45, 180})
+        {
+            QueryComponents components;
+            components.sumOperation = true;
+            components.sumAttributeIndex = 1;
+            components.whereCondition = true;
+            components.whereAttributeIndex = 0;
+            components.lowerBound = min_key + key_domain / 2;
+            components.upperBound = min_key + key_domain / 2 + width + 1;
+
+            std::map<size_t, BPlusTree *> indexes{{0, &index}};
+            auto start_full = std::chrono::high_resolution_clock::now();
+            executeQuery(components, buffer_manager);
+            std::chrono::duration<double> full_time = std::chrono::high_resolution_clock::now() - start_full;
+            auto start_index = std::chrono::high_resolution_clock::now();
+            executeQuery(components, buffer_manager, indexes);
+            std::chrono::duration<double> index_time = std::chrono::high_resolution_clock::now() - start_index;
+
+            std::cout << "Selectivity: " << 100.0 * width / key_domain << "%"
+                      << " Full scan us: " << static_cast<size_t>(full_time.count() * 1e6)
+                      << " Planned us: " << static_cast<size_t>(index_time.count() * 1e6) << std::endl;
+        }
+    }
+    std::remove(index_filename.c_str());
+}
+
+// Appends tuples whose keys grow with their position, as with data loaded
+// in time order, and runs range queries on the key with a full scan and
+// with a scan that consults zone maps. Reports how many pages each had to
+// decrypt.
+void benchmarkZoneMaps(BufferManager &buffer_manager)
+{
+    // Three-digit keys and one-digit values serialize like the loaded data
+    const size_t num_tuples = 50000;
+    const int min_key = 100;
+    const int key_domain = 900;
+
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(min_key + i * key_domain / num_tuples)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(i % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>("buzzdb"));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    SecondaryIndexes zone_index(buffer_manager);
+    auto start = std::chrono::high_resolution_clock::now();
+    zone_index.createZoneMap(0, true);
+    std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - start;
+    std::cout << "Pages: " << buffer_manager.getNumPages()
+              << " Zone map build ms: " << build_time.count() * 1000 << std::endl;
+
+    for (int width : {1, 9, 90, 450})
+    {
+        QueryComponents components;
+        components.sumOperation = true;
+        components.sumAttributeIndex = 1;
+        components.whereCondition = true;
+        components.whereAttributeIndex = 0;
+        components.lowerBound = min_key + key_domain / 3;
+        components.upperBound = min_key + key_domain / 3 + width + 1;
+
+        for (const ZoneMaps *zone_maps : {static_cast<const ZoneMaps *>(nullptr), &zone_index.zoneMaps()})
+        {
+            uint64_t decrypted_before = engineStats().bytes_decrypted.value();
+            auto query_start = std::chrono::high_resolution_clock::now();
+            executeQuery(components, buffer_manager, {}, zone_maps);
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - query_start;
+            std::cout << "Selectivity: " << 100.0 * width / key_domain << "%"
+                      << (zone_maps ? " Zone maps" : " Full scan")
+                      << " us: " << static_cast<size_t>(elapsed.count() * 1e6)
+                      << " Pages decrypted: " << (engineStats().bytes_decrypted.value() - decrypted_before) / PAGE_SIZE
+                      << std::endl;
+        }
+    }
+}
+
+// Runs a grouped SUM over a filtered scan of random tuples twice: with
+// every operator passing tuples through next() and getOutput(), and with
+// the operators exchanging batches of column vectors
+void benchmarkBatchExecution(BufferManager &buffer_manager)
+{
+    // Three-digit keys and one-digit values serialize like the loaded data
+    const size_t num_tuples = 100000;
+    const int min_key = 100;
+    const int key_domain = 900;
+    const size_t rounds = 5;
+
+    std::mt19937 rng(17);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(min_key + rng() % key_domain)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>("buzzdb"));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    for (bool batches : {false, true})
+    {
+        double total_ms = 0;
+        size_t groups = 0;
+        for (size_t round = 0; round < rounds; round++)
+        {
+            auto predicate = std::make_unique<ComplexPredicate>(ComplexPredicate::AND);
+            predicate->addPredicate(std::make_unique<SimplePredicate>(
+                SimplePredicate::Operand(static_cast<size_t>(0)),
+                SimplePredicate::Operand(std::make_unique<Field>(min_key + key_domain / 4)), SimplePredicate::GT));
+            predicate->addPredicate(std::make_unique<SimplePredicate>(
+                SimplePredicate::Operand(static_cast<size_t>(0)),
+                SimplePredicate::Operand(std::make_unique<Field>(min_key + 3 * key_domain / 4)), SimplePredicate::LT));
+
+            auto start = std::chrono::high_resolution_clock::now();
+            ScanOperator scan(buffer_manager);
+            SelectOperator select(scan, std::move(predicate));
+            TupleAtATimeAdapter tuples(select);
+            Operator *aggregation_input = batches ? static_cast<Operator *>(&select) : &tuples;
+            HashAggregationOperator aggregation(*aggregation_input, {0}, {{AggrFuncType::SUM, 1}});
+            aggregation.open();
+            for (groups = 0; aggregation.next(); groups++)
+            {
+            }
+            aggregation.close();
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            total_ms += elapsed.count() * 1000;
+        }
+        std::cout << (batches ? "Batches" : "Tuple at a time") << " Tuples: " << num_tuples
+                  << " Groups: " << groups << " ms: " << total_ms / rounds << std::endl;
+    }
+}
+
+// Runs a filtered, grouped SUM over a table loaded like the batch
+// benchmark's, once on the calling thread and then with the scan split
+// into morsels and the aggregation into two phases over 1, 2, 4, ...
+// workers, up to the degree the buffer pool allows (see BUZZDB_BUFFER_POOL
+// and BUZZDB_THREADS)
+void benchmarkParallelScan(BufferManager &buffer_manager)
+{
+    const size_t num_tuples = 200000;
+    const int min_key = 100;
+    const int key_domain = 900;
+
+    std::mt19937 rng(31);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(min_key + rng() % key_domain)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>("buzzdb"));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    auto predicate = []
+    {
+        auto both = std::make_unique<ComplexPredicate>(ComplexPredicate::AND);
+        both->addPredicate(std::make_unique<SimplePredicate>(
+            SimplePredicate::Operand(static_cast<size_t>(0)),
+            SimplePredicate::Operand(std::make_unique<Field>(min_key + key_domain / 4)), SimplePredicate::GT));
+        both->addPredicate(std::make_unique<SimplePredicate>(
+            SimplePredicate::Operand(static_cast<size_t>(0)),
+            SimplePredicate::Operand(std::make_unique<Field>(min_key + 3 * key_domain / 4)), SimplePredicate::LT));
+        return both;
+    };
+    auto run = [&](const std::string &name, Operator &input)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        HashAggregationOperator aggregation(input, {0}, {{AggrFuncType::SUM, 1}});
+        aggregation.open();
+        size_t groups = 0;
+        int64_t total = 0;
+        for (; aggregation.next(); groups++)
+        {
+            total += aggregation.getOutput()[1]->asInt();
+        }
+        aggregation.close();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Groups: " << groups << " Sum: " << total
+                  << " ms: " << elapsed.count() * 1000 << std::endl;
+    };
+
+    {
+        ScanOperator scan(buffer_manager);
+        SelectOperator select(scan, predicate());
+        run("Serial", select);
+    }
+    size_t max_degree = ParallelScanOperator::degreeFor(buffer_manager);
+    if (max_degree < 2)
+    {
+        std::cout << "The buffer pool has no room for parallel scans; raise BUZZDB_BUFFER_POOL" << std::endl;
+        return;
+    }
+    std::vector<size_t> degrees;
+    for (size_t degree = 1; degree < max_degree; degree *= 2)
+    {
+        degrees.push_back(degree);
+    }
+    degrees.push_back(max_degree);
+    for (size_t degree : degrees)
+    {
+        ParallelScanOperator scan(buffer_manager, degree, predicate());
+        run("Parallel Workers: " + std::to_string(degree), scan);
+    }
+}
+
+// Groups a table by a string column with many distinct values (SUM and
+// COUNT(*) per group), with a memory budget the groups fit into and with
+// budgets that force the aggregation to spill, once and recursively
+void benchmarkSpillingAggregation(BufferManager &buffer_manager)
+{
+    // Six-letter keys serialize like the loaded data's "buzzdb"
+    const size_t num_tuples = 300000;
+    const size_t key_domain = 150000;
+
+    std::mt19937 rng(37);
+    auto keyName = [](size_t key)
+    {
+        std::string name(6, 'a');
+        for (size_t i = 0; i < name.size(); i++, key /= 26)
+        {
+            name[i] = static_cast<char>('a' + key % 26);
+        }
+        return name;
+    };
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(100 + rng() % 900)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>(keyName(rng() % key_domain)));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    for (size_t budget : {DEFAULT_OPERATOR_MEMORY, size_t(1) << 20, size_t(128) << 10})
+    {
+        uint64_t spilled_before = engineStats().spill_bytes.value();
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        HashAggregationOperator aggregation(scan, {3}, {{AggrFuncType::SUM, 1}, {AggrFuncType::COUNT_STAR, 0}}, budget);
+        aggregation.open();
+        size_t groups = 0;
+        int64_t total = 0;
+        Batch batch;
+        while (aggregation.nextBatch(batch))
+        {
+            groups += batch.num_rows;
+            for (uint16_t row : batch.selection)
+            {
+                total += batch.columns[2].ints[row];
+            }
+        }
+        aggregation.close();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Budget KiB: " << budget / 1024 << " Groups: " << groups << " Rows counted: " << total
+                  << " Spilled KiB: " << (engineStats().spill_bytes.value() - spilled_before) / 1024
+                  << " ms: " << elapsed.count() * 1000 << std::endl;
+    }
+}
+
+// Joins a table with the rows of itself whose first column is below a
+// bound, on that column, for every join type: in memory, with a budget
+// that forces the join to spill, and probing on a parallel scan
+void benchmarkHashJoin(BufferManager &buffer_manager)
+{
+    const size_t num_tuples = 100000;
+    const int min_key = 100;
+    const int key_domain = 900;
+    const int build_bound = 150;
+
+    std::mt19937 rng(41);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
+        {
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(min_key + rng() % key_domain)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                tuple->addField(std::make_unique<Field>("buzzdb"));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
+        }
+        if (i < num_tuples)
+        {
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    const std::vector<std::pair<JoinType, std::string>> join_types = {
+        {JoinType::INNER, "Inner"}, {JoinType::LEFT, "Left"}, {JoinType::SEMI, "Semi"}, {JoinType::ANTI, "Anti"}};
+    auto run = [&](const std::string &name, Operator &probe, JoinType type, size_t budget)
+    {
+        uint64_t spilled_before = engineStats().spill_bytes.value();
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        SelectOperator build(scan, std::make_unique<SimplePredicate>(
+                                       SimplePredicate::Operand(static_cast<size_t>(0)),
+                                       SimplePredicate::Operand(std::make_unique<Field>(build_bound)), SimplePredicate::LT));
+        HashJoinOperator join(probe, build, {0}, {0}, type, budget);
+        join.open();
+        size_t rows = 0;
+        Batch batch;
+        while (join.nextBatch(batch))
+        {
+            rows += batch.num_rows;
+        }
+        join.close();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Rows: " << rows
+                  << " Spilled KiB: " << (engineStats().spill_bytes.value() - spilled_before) / 1024
+                  << " ms: " << elapsed.count() * 1000 << std::endl;
+    };
+
+    size_t degree = ParallelScanOperator::degreeFor(buffer_manager);
+    for (const auto &[type, type_name] : join_types)
+    {
+        for (size_t budget : {DEFAULT_OPERATOR_MEMORY, size_t(64) << 10})
+        {
+            ScanOperator probe(buffer_manager);
+            run(type_name + " Serial Budget KiB: " + std::to_string(budget / 1024), probe, type, budget);
+        }
+        if (degree > 1)
+        {
+            ParallelScanOperator probe(buffer_manager, degree);
+            run(type_name + " Parallel Workers: " + std::to_string(degree), probe, type, DEFAULT_OPERATOR_MEMORY);
+        }
+    }
+    if (degree < 2)
+    {
+        std::cout << "The buffer pool has no room for parallel scans; raise BUZZDB_BUFFER_POOL" << std::endl;
+    }
+}
+
+// Sorts a table by an int and a string column with the normalized keys of
+// SortOperator, with a budget that makes it spill runs and in memory, as a
+// top-N (ORDER BY ... LIMIT 100) within a small budget, and Field by Field
+// with std::stable_sort
+void benchmarkSort(BufferManager &buffer_manager)
+{
+    const size_t num_tuples = 200000;
+    const std::vector<SortKey> sort_keys = {{0, false}, {3, true}};
+
+    std::mt19937 rng(43);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
         {
-            rightField = right_operand.directValue.get();
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(100 + rng() % 900)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(132.04f));
+                std::string name(6, 'a');
+                for (char &c : name)
+                {
+                    c = static_cast<char>('a' + rng() % 26);
+                }
+                tuple->addField(std::make_unique<Field>(name));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
         }
-        else if (right_operand.type == INDIRECT)
+        if (i < num_tuples)
         {
-            rightField = tupleFields[right_operand.index].get();
+            page_id = buffer_manager.extend();
         }
+    }
 
-        if (leftField == nullptr || rightField == nullptr)
+    auto run = [&](const std::string &name, std::optional<size_t> limit, size_t budget)
+    {
+        uint64_t spilled_before = engineStats().spill_bytes.value();
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        SortOperator sort(scan, sort_keys, limit, budget);
+        sort.open();
+        size_t rows = 0;
+        Batch batch;
+        while (sort.nextBatch(batch))
         {
-            std::cerr << "Error: Invalid field reference.\n";
-            return false;
+            rows += batch.num_rows;
         }
+        size_t runs = sort.numRuns();
+        sort.close();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Rows: " << rows << " Runs: " << runs
+                  << " Spilled KiB: " << (engineStats().spill_bytes.value() - spilled_before) / 1024
+                  << " ms: " << elapsed.count() * 1000 << std::endl;
+    };
+    run("Normalized keys Budget KiB: 1024", std::nullopt, size_t(1) << 20);
+    run("Normalized keys Budget KiB: " + std::to_string(DEFAULT_OPERATOR_MEMORY / 1024), std::nullopt,
+        DEFAULT_OPERATOR_MEMORY);
+    run("Top 100 Budget KiB: 64", 100, size_t(64) << 10);
 
-        if (leftField->getType() != rightField->getType())
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        scan.open();
+        std::vector<std::vector<std::unique_ptr<Field>>> rows;
+        for (bool has_next = true; has_next; has_next = scan.next())
         {
-            std::cerr << "Error: Comparing fields of different types.\n";
-            return false;
+            auto fields = scan.getOutput();
+            if (fields.empty())
+            {
+                break;
+            }
+            rows.push_back(std::move(fields));
         }
+        scan.close();
+        std::stable_sort(rows.begin(), rows.end(), [&](const auto &a, const auto &b)
+                         {
+            for (const SortKey &key : sort_keys)
+            {
+                const Field &x = *a[key.attr];
+                const Field &y = *b[key.attr];
+                bool less = x.getType() == INT ? x.asInt() < y.asInt() : x.asString() < y.asString();
+                bool greater = x.getType() == INT ? y.asInt() < x.asInt() : y.asString() < x.asString();
+                if (less || greater)
+                {
+                    return key.descending ? greater : less;
+                }
+            }
+            return false; });
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Field comparison Rows: " << rows.size() << " ms: " << elapsed.count() * 1000 << std::endl;
+    }
+}
 
-        // Perform comparison based on field type
-        switch (leftField->getType())
-        {
-        case FieldType::INT:
+// Runs a selective filter on column 0 that outputs two other columns, with a
+// scan that decodes every column of every row and with one that decodes only
+// the filtered column and lets ProjectionOperator fetch the rest for the rows
+// that pass
+void benchmarkProjection(BufferManager &buffer_manager)
+{
+    const size_t num_tuples = 200000;
+    const std::vector<size_t> attrs = {2, 3};
+
+    std::mt19937 rng(47);
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
+    {
         {
-            int left_val = leftField->asInt();
-            int right_val = rightField->asInt();
-            return compare(left_val, right_val);
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
+            {
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(100 + rng() % 900)));
+                tuple->addField(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+                tuple->addField(std::make_unique<Field>(static_cast<float>(100 + rng() % 900) + 0.25f));
+                std::string name(6, 'a');
+                for (char &c : name)
+                {
+                    c = static_cast<char>('a' + rng() % 26);
+                }
+                tuple->addField(std::make_unique<Field>(name));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
+                }
+            }
+            buffer_manager.flushPage(page_id);
         }
-        case FieldType::FLOAT:
+        if (i < num_tuples)
         {
-            float left_val = leftField->asFloat();
-            float right_val = rightField->asFloat();
-            return compare(left_val, right_val);
+            page_id = buffer_manager.extend();
         }
-        case FieldType::STRING:
+    }
+
+    auto run = [&](const std::string &name, int bound, bool late)
+    {
+        auto start = std::chrono::high_resolution_clock::now();
+        ScanOperator scan(buffer_manager);
+        if (late)
         {
-            std::string left_val = leftField->asString();
-            std::string right_val = rightField->asString();
-            return compare(left_val, right_val);
+            scan.decodeOnly({0});
         }
-        default:
-            std::cerr << "Invalid field type\n";
-            return false;
+        SelectOperator select(scan, std::make_unique<SimplePredicate>(
+                                        SimplePredicate::Operand(static_cast<size_t>(0)),
+                                        SimplePredicate::Operand(std::make_unique<Field>(bound)), SimplePredicate::LT));
+        ProjectionOperator projection(select, attrs, buffer_manager);
+        projection.open();
+        size_t rows = 0;
+        Batch batch;
+        while (projection.nextBatch(batch))
+        {
+            rows += batch.num_rows;
         }
+        projection.close();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Rows: " << rows << " ms: " << elapsed.count() * 1000 << std::endl;
+    };
+    for (int bound : {101, 109, 190, 1000})
+    {
+        std::string selectivity = "{1} < " + std::to_string(bound);
+        run("Eager " + selectivity, bound, false);
+        run("Late " + selectivity, bound, true);
     }
+}
 
-private:
-    // Compares two values of the same type
-    template <typename T>
-    bool compare(const T &left_val, const T &right_val) const
+// Parses and plans short queries that differ only in their constants, the
+// way dashboards send them: with the parser and planQuery on every query,
+// and through PlanCache, which only tokenizes a query it has seen the shape
+// of
+void benchmarkQueryParser(BufferManager &buffer_manager)
+{
+    const size_t num_queries = 20000;
+    std::mt19937 rng(53);
+    std::vector<std::string> queries;
+    for (size_t i = 0; i < num_queries; i++)
     {
-        switch (comparison_operator)
+        int lower = static_cast<int>(rng() % 10);
+        switch (i % 3)
         {
-        case ComparisonOperator::EQ:
-            return left_val == right_val;
-        case ComparisonOperator::NE:
-            return left_val != right_val;
-        case ComparisonOperator::GT:
-            return left_val > right_val;
-        case ComparisonOperator::GE:
-            return left_val >= right_val;
-        case ComparisonOperator::LT:
-            return left_val < right_val;
-        case ComparisonOperator::LE:
-            return left_val <= right_val;
+        case 0:
+            queries.push_back("SUM{2} GROUP BY {1} WHERE {1} > " + std::to_string(lower) + " and {1} < " +
+                              std::to_string(lower + 1 + rng() % 5));
+            break;
+        case 1:
+            queries.push_back("{1}, {2} WHERE {1} > " + std::to_string(lower) + " and {1} < " +
+                              std::to_string(lower + 3) + " ORDER BY {2} DESC LIMIT 10");
+            break;
         default:
-            std::cerr << "Invalid predicate type\n";
-            return false;
+            queries.push_back("{2} WHERE {1} > " + std::to_string(lower) + " and {1} < " +
+                              std::to_string(lower + 2) + " LIMIT " + std::to_string(1 + i % 4));
         }
     }
-};
 
-class ComplexPredicate : public IPredicate
-{
-public:
-    enum LogicOperator
+    auto run = [&](const std::string &name, auto &&prepare)
     {
-        AND,
-        OR
+        auto start = std::chrono::high_resolution_clock::now();
+        size_t checksum = 0;
+        for (const std::string &query : queries)
+        {
+            checksum += prepare(query);
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Queries: " << queries.size() << " Checksum: " << checksum
+                  << " ns per query: " << static_cast<size_t>(elapsed.count() * 1e9 / queries.size()) << std::endl;
     };
 
-private:
-    std::vector<std::unique_ptr<IPredicate>> predicates;
-    LogicOperator logic_operator;
-
-public:
-    ComplexPredicate(LogicOperator op) : logic_operator(op) {}
-
-    void addPredicate(std::unique_ptr<IPredicate> predicate)
-    {
-        predicates.push_back(std::move(predicate));
-    }
+    run("Parse and plan", [&](const std::string &query)
+        {
+        QueryComponents components = parseQuery(query);
+        QueryPlan plan = planQuery(components, buffer_manager);
+        return components.selectAttributes.size() + components.parameters.size() + components.orderBy.size() +
+               plan.limit.has_value(); });
+    PlanCache cache;
+    run("Plan cache", [&](const std::string &query)
+        {
+        PlanCache::PreparedQuery prepared = cache.prepare(query, buffer_manager);
+        const QueryComponents &components = prepared.entry->query;
+        return components.selectAttributes.size() + prepared.parameters.size() + components.orderBy.size() +
+               prepared.entry->plan.limit.has_value(); });
+    std::cout << "Cached plans: " << cache.size() << std::endl;
+}
 
-    bool check(const std::vector<std::unique_ptr<Field>> &tupleFields) const
+// Loads a table with a clustered column {1} with zone maps, a skewed,
+// indexed column {2} and a string column of unique values, runs ANALYZE,
+// and times queries planned without statistics, by the fixed rules, and
+// with them, by the cost model. Prints the access path of each, and the
+// rows the statistics predicted against those that came out.
+void benchmarkOptimizer(BufferManager &buffer_manager)
+{
+    const size_t num_tuples = 200000;
+    // Share of the rows per value of {2}, out of 1000
+    const int value_weights[] = {500, 200, 100, 33, 33, 33, 33, 33, 33, 2};
+
+    std::mt19937 rng(59);
+    std::discrete_distribution<int> values(std::begin(value_weights), std::end(value_weights));
+    PageID page_id = buffer_manager.extend();
+    for (size_t i = 0; i < num_tuples;)
     {
-
-        if (logic_operator == AND)
         {
-            for (const auto &pred : predicates)
+            auto page = buffer_manager.fixPageExclusive(page_id);
+            for (; i < num_tuples; i++)
             {
-                if (!pred->check(tupleFields))
+                auto tuple = std::make_unique<Tuple>();
+                tuple->addField(std::make_unique<Field>(static_cast<int>(100 + i * 900 / num_tuples)));
+                tuple->addField(std::make_unique<Field>(values(rng)));
+                tuple->addField(std::make_unique<Field>(static_cast<float>(100 + rng() % 900) + 0.25f));
+                std::string name(6, 'a');
+                for (char &c : name)
                 {
-                    return false; // If any predicate fails, the AND condition fails
+                    c = static_cast<char>('a' + rng() % 26);
+                }
+                tuple->addField(std::make_unique<Field>(name));
+                if (!page->addTuple(std::move(tuple)))
+                {
+                    break;
                 }
             }
-            return true; // All predicates passed
+            buffer_manager.flushPage(page_id);
         }
-        else if (logic_operator == OR)
+        if (i < num_tuples)
         {
-            for (const auto &pred : predicates)
+            page_id = buffer_manager.extend();
+        }
+    }
+
+    {
+        SecondaryIndexes indexes(buffer_manager);
+        indexes.create(1);
+        indexes.createZoneMap(0);
+
+        auto start = std::chrono::high_resolution_clock::now();
+        TableStatistics statistics = analyzeTable(buffer_manager);
+        std::chrono::duration<double> analyze_time = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "ANALYZE Sampled pages: " << statistics.sampled_pages << " of " << statistics.num_pages
+                  << " ms: " << analyze_time.count() * 1000 << std::endl;
+        for (size_t c = 0; c < statistics.columns.size(); c++)
+        {
+            std::cout << "Column {" << c + 1 << "} Estimated distinct values: "
+                      << static_cast<size_t>(statistics.columns[c].distinct) << std::endl;
+        }
+
+        const char *path_names[] = {"full scan", "zone-map scan", "index scan"};
+        auto run = [&](const std::string &name, const std::string &query, const TableStatistics *stats)
+        {
+            QueryComponents components = parseQuery(query);
+            QueryPlan plan = planQuery(components, buffer_manager);
+            std::unique_ptr<IPredicate> predicate = wherePredicate(components);
+            std::vector<ColumnRange> ranges = extractColumnRanges(*predicate);
+            AccessPathChoice choice = chooseAccessPath(predicate.get(), ranges, indexes.all(), &indexes.zoneMaps(),
+                                                       stats, buffer_manager);
+
+            std::ostringstream out;
+            auto *previous = std::cout.rdbuf(out.rdbuf());
+            auto start = std::chrono::high_resolution_clock::now();
+            executePlan(plan, std::move(predicate), buffer_manager, indexes.all(), &indexes.zoneMaps(), stats);
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            std::cout.rdbuf(previous);
+            std::cout << name << " " << path_names[static_cast<int>(choice.path)];
+            if (stats != nullptr)
             {
-                if (pred->check(tupleFields))
-                {
-                    return true; // If any predicate passes, the OR condition passes
-                }
+                std::cout << " Estimated rows: " << static_cast<size_t>(choice.rows);
             }
-            return false; // No predicates passed
+            std::cout << " ms: " << elapsed.count() * 1000 << std::endl;
+        };
+        for (const std::string query : {"SUM{3} WHERE {2} = 9",
+                                        "SUM{3} WHERE {2} >= 7",
+                                        "SUM{3} WHERE {2} = 0",
+                                        "SUM{3} WHERE {1} > 500 and {1} < 540 and {2} = 5",
+                                        "SUM{3} WHERE {1} > 150 and {1} < 400 and {2} = 9"})
+        {
+            std::ostringstream count_out;
+            auto *previous = std::cout.rdbuf(count_out.rdbuf());
+            QueryComponents count_query = parseQuery(query);
+            count_query.sumOperation = false;
+            count_query.selectAttributes = {0};
+            executeQuery(count_query, buffer_manager);
+            std::cout.rdbuf(previous);
+            std::string rows = count_out.str();
+            std::cout << query << " Rows: " << std::count(rows.begin(), rows.end(), '\n') << std::endl;
+            run("  Rules:", query, nullptr);
+            run("  Costs:", query, &statistics);
+        }
+
+        for (const TableStatistics *stats : std::initializer_list<const TableStatistics *>{nullptr, &statistics})
+        {
+            std::ostringstream out;
+            auto *previous = std::cout.rdbuf(out.rdbuf());
+            QueryComponents components = parseQuery("SUM{3} GROUP BY {4}");
+            auto start = std::chrono::high_resolution_clock::now();
+            executeQuery(components, buffer_manager, {}, nullptr, stats);
+            std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+            std::cout.rdbuf(previous);
+            std::cout << "SUM{3} GROUP BY {4} " << (stats ? "Table sized from statistics" : "Table grown as groups come")
+                      << " ms: " << elapsed.count() * 1000 << std::endl;
         }
-        return false;
     }
-};
+    std::remove(SecondaryIndexes::filenameFor(1).c_str());
+}
 
-class SelectOperator : public UnaryOperator
+// Evaluates the range filter {1} > lo and {1} < hi over batches of random
+// integers, once with SimplePredicate::check() on each row and once per
+// instruction set the CPU supports with the bitmap kernels
+void benchmarkPredicateKernels()
 {
-private:
-    std::unique_ptr<IPredicate> predicate;
-    bool has_next;
-    std::vector<std::unique_ptr<Field>> currentOutput; // Store the current output here
-
-public:
-    SelectOperator(Operator &input, std::unique_ptr<IPredicate> predicate)
-        : UnaryOperator(input), predicate(std::move(predicate)), has_next(false) {}
+    const size_t num_batches = 64;
+    const size_t rounds = 200;
+    const int lower = 250;
+    const int upper = 750;
+
+    std::mt19937 rng(19);
+    std::vector<Batch> batches(num_batches);
+    for (Batch &batch : batches)
+    {
+        for (size_t row = 0; row < BATCH_CAPACITY; row++)
+        {
+            std::vector<std::unique_ptr<Field>> fields;
+            fields.push_back(std::make_unique<Field>(static_cast<int>(rng() % 1000)));
+            batch.appendRow(fields);
+        }
+    }
+    auto report = [](const std::string &name, double seconds, size_t rows, size_t passed)
+    {
+        std::cout << "Kernels: " << name << " Rows passed: " << passed
+                  << " ns/row: " << seconds * 1e9 / rows
+                  << " GB/s: " << rows * sizeof(int) / seconds / 1e9 << std::endl;
+    };
 
-    void open() override
+    SimplePredicate above(SimplePredicate::Operand(static_cast<size_t>(0)),
+                          SimplePredicate::Operand(std::make_unique<Field>(lower)), SimplePredicate::GT);
+    SimplePredicate below(SimplePredicate::Operand(static_cast<size_t>(0)),
+                          SimplePredicate::Operand(std::make_unique<Field>(upper)), SimplePredicate::LT);
     {
-        input->open();
-        has_next = false;
-        currentOutput.clear(); // Ensure currentOutput is cleared at the beginning
+        size_t passed = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const Batch &batch : batches)
+        {
+            for (size_t row = 0; row < batch.num_rows; row++)
+            {
+                auto fields = batch.row(row);
+                passed += above.check(fields) && below.check(fields);
+            }
+        }
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        report("check() per row", elapsed.count(), num_batches * BATCH_CAPACITY, passed);
     }
 
-    bool next() override
+    for (const PredicateKernels *kernels : supportedPredicateKernels())
     {
-        while (input->next())
+        size_t passed = 0;
+        SelectionBitmap above_bits;
+        SelectionBitmap below_bits;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t round = 0; round < rounds; round++)
         {
-            const auto &output = input->getOutput(); // Temporarily hold the output
-            if (predicate->check(output))
+            for (const Batch &batch : batches)
             {
-                // If the predicate is satisfied, store the output in the member variable
-                currentOutput.clear(); // Clear previous output
-                for (const auto &field : output)
+                const int *values = batch.columns[0].ints.data();
+                kernels->compare_int32(values, batch.num_rows, lower, CompareOp::GT, above_bits.data());
+                kernels->compare_int32(values, batch.num_rows, upper, CompareOp::LT, below_bits.data());
+                for (size_t word = 0; word < above_bits.size(); word++)
                 {
-                    // Assuming Field class has a clone method or copy constructor to duplicate fields
-                    currentOutput.push_back(field->clone());
+                    passed += __builtin_popcountll(above_bits[word] & below_bits[word]);
                 }
-                has_next = true;
-                return true;
             }
         }
-        has_next = false;
-        currentOutput.clear(); // Clear output if no more tuples satisfy the predicate
-        return false;
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        report(kernels->name, elapsed.count(), rounds * num_batches * BATCH_CAPACITY, passed / rounds);
     }
+}
 
-    void close() override
+// Tests tuples against a filter over int, float and string columns, once
+// by interpreting the predicate tree and once with the tree compiled
+void benchmarkPredicateCompiler()
+{
+    using SP = SimplePredicate;
+    const size_t num_tuples = 10000; // Fits in cache: measures evaluation, not memory
+    const size_t rounds = 200;
+
+    std::mt19937 rng(23);
+    std::vector<std::vector<std::unique_ptr<Field>>> tuples(num_tuples);
+    for (auto &fields : tuples)
     {
-        input->close();
-        currentOutput.clear(); // Ensure currentOutput is cleared at the end
+        fields.push_back(std::make_unique<Field>(static_cast<int>(rng() % 1000)));
+        fields.push_back(std::make_unique<Field>(static_cast<int>(rng() % 10)));
+        fields.push_back(std::make_unique<Field>(static_cast<float>(rng() % 1000) / 10));
+        fields.push_back(std::make_unique<Field>(rng() % 4 == 0 ? "archived" : "buzzdb"));
     }
 
-    std::vector<std::unique_ptr<Field>> getOutput() override
+    // {1} > 100 and {1} < 900 and ({3} >= 20.0 or {2} == 7) and {4} != "archived"
+    auto either = std::make_unique<ComplexPredicate>(ComplexPredicate::OR);
+    either->addPredicate(std::make_unique<SP>(SP::Operand(static_cast<size_t>(2)), SP::Operand(std::make_unique<Field>(20.0f)), SP::GE));
+    either->addPredicate(std::make_unique<SP>(SP::Operand(static_cast<size_t>(1)), SP::Operand(std::make_unique<Field>(7)), SP::EQ));
+    ComplexPredicate predicate(ComplexPredicate::AND);
+    predicate.addPredicate(std::make_unique<SP>(SP::Operand(static_cast<size_t>(0)), SP::Operand(std::make_unique<Field>(100)), SP::GT));
+    predicate.addPredicate(std::make_unique<SP>(SP::Operand(static_cast<size_t>(0)), SP::Operand(std::make_unique<Field>(900)), SP::LT));
+    predicate.addPredicate(std::move(either));
+    predicate.addPredicate(std::make_unique<SP>(SP::Operand(static_cast<size_t>(3)), SP::Operand(std::make_unique<Field>("archived")), SP::NE));
+
+    auto run = [&](const std::string &name, auto &&passes)
     {
-        if (has_next)
+        size_t passed = 0;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (size_t round = 0; round < rounds; round++)
         {
-            // Since currentOutput already holds the desired output, simply return it
-            // Need to create a deep copy to return since we're returning by value
-            std::vector<std::unique_ptr<Field>> outputCopy;
-            for (const auto &field : currentOutput)
+            for (const auto &fields : tuples)
             {
-                outputCopy.push_back(field->clone()); // Clone each field
+                passed += passes(fields);
             }
-            return outputCopy;
-        }
-        else
-        {
-            return {}; // Return an empty vector if no matching tuple is found
         }
-    }
-};
-
-enum class AggrFuncType
-{
-    COUNT,
-    MAX,
-    MIN,
-    SUM
-};
-
-struct AggrFunc
-{
-    AggrFuncType func;
-    size_t attr_index; // Index of the attribute to aggregate
-};
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Tuples passed: " << passed / rounds
+                  << " ns/tuple: " << elapsed.count() * 1e9 / (rounds * num_tuples) << std::endl;
+    };
+    run("Interpreted", [&predicate](const auto &fields)
+        { return predicate.check(fields); });
+    CompiledPredicate compiled(predicate, tuples.front());
+    run("Compiled", [&compiled](const auto &fields)
+        { return compiled(fields); });
+}
 
-class HashAggregationOperator : public UnaryOperator
+// The group-by table HashAggregationOperator used before AggregationTable:
+// Field vectors hashed through their string forms, every group a node of an
+// unordered_map. Kept as the baseline of the aggregation benchmark.
+class LegacyAggregationTable
 {
 private:
     std::vector<size_t> group_by_attrs;
     std::vector<AggrFunc> aggr_funcs;
-    std::vector<Tuple> output_tuples; // Use your Tuple class for output
-    size_t output_tuples_index = 0;
 
     struct FieldVectorHasher
     {
@@ -1247,105 +12283,35 @@ private:
             }
             return hash;
         }
-    };
-
-public:
-    HashAggregationOperator(Operator &input, std::vector<size_t> group_by_attrs, std::vector<AggrFunc> aggr_funcs)
-        : UnaryOperator(input), group_by_attrs(group_by_attrs), aggr_funcs(aggr_funcs) {}
-
-    void open() override
-    {
-        input->open(); // Ensure the input operator is opened
-        output_tuples_index = 0;
-        output_tuples.clear();
-
-        // Assume a hash map to aggregate tuples based on group_by_attrs
-        std::unordered_map<std::vector<Field>, std::vector<Field>, FieldVectorHasher> hash_table;
-
-        while (input->next())
-        {
-            const auto &tuple = input->getOutput(); // Assume getOutput returns a reference to the current tuple
-
-            // Extract group keys and initialize aggregation values
-            std::vector<Field> group_keys;
-            for (auto &index : group_by_attrs)
-            {
-                group_keys.push_back(*tuple[index]); // Deep copy the Field object for group key
-            }
-
-            // Process aggregation functions
-            if (!hash_table.count(group_keys))
-            {
-                // Initialize aggregate values for a new group
-                std::vector<Field> aggr_values(aggr_funcs.size(), Field(0)); // Assuming Field(int) initializes an integer Field
-                hash_table[group_keys] = aggr_values;
-            }
-
-            // Update aggregate values
-            auto &aggr_values = hash_table[group_keys];
-            for (size_t i = 0; i < aggr_funcs.size(); ++i)
-            {
-                // Simplified update logic for demonstration
-                // You'll need to implement actual aggregation logic here
-                aggr_values[i] = updateAggregate(aggr_funcs[i], aggr_values[i], *tuple[aggr_funcs[i].attr_index]);
-            }
-        }
-
-        // Prepare output tuples from the hash table
-        for (const auto &entry : hash_table)
-        {
-            const auto &group_keys = entry.first;
-            const auto &aggr_values = entry.second;
-            Tuple output_tuple;
-            // Assuming Tuple has a method to add Fields
-            for (const auto &key : group_keys)
-            {
-                output_tuple.addField(std::make_unique<Field>(key)); // Add group keys to the tuple
-            }
-            for (const auto &value : aggr_values)
-            {
-                output_tuple.addField(std::make_unique<Field>(value)); // Add aggregated values to the tuple
-            }
-            output_tuples.push_back(std::move(output_tuple));
-        }
-    }
-
-    bool next() override
-    {
-        if (output_tuples_index < output_tuples.size())
-        {
-            output_tuples_index++;
-            return true;
-        }
-        return false;
-    }
-
-    void close() override
-    {
-        input->close();
-    }
+    };
 
-    std::vector<std::unique_ptr<Field>> getOutput() override
-    {
-        std::vector<std::unique_ptr<Field>> outputCopy;
+    std::unordered_map<std::vector<Field>, std::vector<Field>, FieldVectorHasher> hash_table;
 
-        if (output_tuples_index == 0 || output_tuples_index > output_tuples.size())
-        {
-            // If there is no current tuple because next() hasn't been called yet or we're past the last tuple,
-            // return an empty vector.
-            return outputCopy; // This will be an empty vector
-        }
+public:
+    LegacyAggregationTable(std::vector<size_t> group_by_attrs, std::vector<AggrFunc> aggr_funcs)
+        : group_by_attrs(std::move(group_by_attrs)), aggr_funcs(std::move(aggr_funcs)) {}
 
-        // Assuming that output_tuples stores Tuple objects and each Tuple has a vector of Field objects or similar
-        const auto &currentTuple = output_tuples[output_tuples_index - 1]; // Adjust for 0-based indexing after increment in next()
+    size_t size() const { return hash_table.size(); }
 
-        // Assuming the Tuple class provides a way to access its fields, e.g., a method or a public member
-        for (const auto &field : currentTuple.fields)
+    void add(const Batch &batch)
+    {
+        std::vector<Field> group_keys;
+        for (uint16_t row : batch.selection)
         {
-            outputCopy.push_back(field->clone()); // Use the clone method to create a deep copy of each field
-        }
+            // Extract group keys and initialize aggregation values
+            group_keys.clear();
+            for (auto &index : group_by_attrs)
+            {
+                group_keys.push_back(batch.columns[index].fieldAt(row));
+            }
 
-        return outputCopy;
+            // New groups start with integer zeros
+            auto &aggr_values = hash_table.try_emplace(group_keys, aggr_funcs.size(), Field(0)).first->second;
+            for (size_t i = 0; i < aggr_funcs.size(); ++i)
+            {
+                aggr_values[i] = updateAggregate(aggr_funcs[i], aggr_values[i], batch.columns[aggr_funcs[i].attr_index].fieldAt(row));
+            }
+        }
     }
 
 private:
@@ -1420,366 +12386,251 @@ private:
     }
 };
 
-struct QueryComponents
+// Groups the same in-memory batches with the unordered_map table the
+// aggregation operator used to have and with AggregationTable, for a small
+// int key domain, a large one and a composite key
+void benchmarkAggregation()
 {
-    std::vector<int> selectAttributes;
-    bool sumOperation = false;
-    int sumAttributeIndex = -1;
-    bool groupBy = false;
-    int groupByAttributeIndex = -1;
-    bool whereCondition = false;
-    int whereAttributeIndex = -1;
-    int lowerBound = std::numeric_limits<int>::min();
-    int upperBound = std::numeric_limits<int>::max();
-};
+    const size_t num_rows = 1000000;
 
-QueryComponents parseQuery(const std::string &query)
-{
-    QueryComponents components;
+    std::mt19937 rng(29);
+    std::vector<Batch> batches((num_rows + BATCH_CAPACITY - 1) / BATCH_CAPACITY);
+    for (size_t i = 0; i < num_rows; i++)
+    {
+        Batch &batch = batches[i / BATCH_CAPACITY];
+        batch.columns.resize(3);
+        batch.columns[0].ints.push_back(static_cast<int>(rng() % 100));
+        batch.columns[1].ints.push_back(static_cast<int>(rng() % 200000));
+        batch.columns[2].ints.push_back(static_cast<int>(rng() % 10));
+        batch.selection.push_back(static_cast<uint16_t>(batch.num_rows++));
+    }
 
-    // Parse selected attributes
-    std::regex selectRegex("\\{(\\d+)\\}(, \\{(\\d+)\\})?");
-    std::smatch selectMatches;
-    std::string::const_iterator queryStart(query.cbegin());
-    while (std::regex_search(queryStart, query.cend(), selectMatches, selectRegex))
+    auto run = [&](const std::string &name, auto &&table)
     {
-        for (size_t i = 1; i < selectMatches.size(); i += 2)
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const Batch &batch : batches)
         {
-            if (!selectMatches[i].str().empty())
-            {
-                components.selectAttributes.push_back(std::stoi(selectMatches[i]) - 1);
-            }
+            table.add(batch);
         }
-        queryStart = selectMatches.suffix().first;
-    }
-
-    // Check for SUM operation
-    std::regex sumRegex("SUM\\{(\\d+)\\}");
-    std::smatch sumMatches;
-    if (std::regex_search(query, sumMatches, sumRegex))
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << name << " Groups: " << table.size()
+                  << " ns/row: " << elapsed.count() * 1e9 / num_rows << std::endl;
+    };
+    const std::vector<std::pair<std::string, std::vector<size_t>>> keys = {
+        {"small domain", {0}}, {"large domain", {1}}, {"composite", {0, 2}}};
+    for (const auto &[key_name, group_by] : keys)
     {
-        components.sumOperation = true;
-        components.sumAttributeIndex = std::stoi(sumMatches[1]) - 1;
+        std::vector<AggrFunc> aggregates = {{AggrFuncType::SUM, 2}, {AggrFuncType::COUNT, 2}};
+        run("Legacy " + key_name, LegacyAggregationTable(group_by, aggregates));
+        run("Typed " + key_name, AggregationTable(group_by, aggregates));
     }
+}
 
-    // Check for GROUP BY clause
-    std::regex groupByRegex("GROUP BY \\{(\\d+)\\}");
-    std::smatch groupByMatches;
-    if (std::regex_search(query, groupByMatches, groupByRegex))
+// Builds the same index over random (key, record id) pairs twice: by one
+// top-down insert per entry in arrival order, and by an external sort
+// (with a small memory budget, so it spills encrypted runs) followed by a
+// bottom-up bulk load. The indexes live in scratch files.
+void benchmarkIndexBuild(BufferManager &buffer_manager)
+{
+    const size_t num_entries = 200000;
+    const size_t sort_memory = 512 * 1024;
+    const std::string top_down_filename = "buzzdb.bench-insert.idx";
+    const std::string bulk_filename = "buzzdb.bench-bulk.idx";
+
+    std::mt19937_64 rng(13);
+    std::vector<BTreeEntry> entries(num_entries);
+    for (size_t i = 0; i < num_entries; i++)
     {
-        components.groupBy = true;
-        components.groupByAttributeIndex = std::stoi(groupByMatches[1]) - 1;
+        entries[i] = BTreeEntry{static_cast<int64_t>(rng() % 1000000), RecordId{static_cast<PageID>(i / 26), static_cast<uint16_t>(i % 26)}.pack()};
     }
 
-    // Extract WHERE conditions more accurately
-    std::regex whereRegex("\\{(\\d+)\\} > (\\d+) and \\{(\\d+)\\} < (\\d+)");
-    std::smatch whereMatches;
-    if (std::regex_search(query, whereMatches, whereRegex))
+    std::remove(top_down_filename.c_str());
+    std::remove(bulk_filename.c_str());
     {
-        components.whereCondition = true;
-        // Correctly identify the attribute index for the WHERE condition
-        components.whereAttributeIndex = std::stoi(whereMatches[1]) - 1;
-        components.lowerBound = std::stoi(whereMatches[2]);
-        // Ensure the same attribute is used for both conditions
-        if (std::stoi(whereMatches[3]) - 1 == components.whereAttributeIndex)
+        BPlusTree index(buffer_manager, top_down_filename);
+        auto start = std::chrono::high_resolution_clock::now();
+        for (const BTreeEntry &entry : entries)
         {
-            components.upperBound = std::stoi(whereMatches[4]);
+            index.insert(entry.key, RecordId::unpack(entry.rid));
         }
-        else
+        index.flush();
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Build: top-down inserts Entries: " << index.size() << " Height: " << index.height()
+                  << " Pages: " << index.numPages() << " ms: " << elapsed.count() * 1000 << std::endl;
+    }
+    {
+        BPlusTree index(buffer_manager, bulk_filename);
+        auto start = std::chrono::high_resolution_clock::now();
+        ExternalSorter<BTreeEntry> sorter(sort_memory);
+        for (const BTreeEntry &entry : entries)
         {
-            std::cerr << "Error: WHERE clause conditions apply to different attributes." << std::endl;
-            // Handle error or set components.whereCondition = false;
+            sorter.add(entry);
         }
+        sorter.finish();
+        index.bulkLoad(sorter.size(), [&sorter](BTreeEntry &entry)
+                       { return sorter.next(entry); });
+        std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start;
+        std::cout << "Build: sort + bulk load Entries: " << index.size() << " Height: " << index.height()
+                  << " Pages: " << index.numPages() << " Sort runs: " << sorter.numRuns()
+                  << " ms: " << elapsed.count() * 1000 << std::endl;
     }
-
-    return components;
+    std::remove(top_down_filename.c_str());
+    std::remove(bulk_filename.c_str());
 }
 
-void prettyPrint(const QueryComponents &components)
+// Stops the periodic dump and prints a final snapshot when BUZZDB_STATS is set
+void printStatsIfRequested()
 {
-    std::cout << "Query Components:\n";
-    std::cout << "  Selected Attributes: ";
-    for (auto attr : components.selectAttributes)
+    StatsRegistry::global().stopPeriodicDump();
+    if (std::getenv("BUZZDB_STATS") != nullptr)
     {
-        std::cout << "{" << attr + 1 << "} "; // Convert back to 1-based indexing for display
+        StatsRegistry::global().snapshot().print(std::cout);
     }
-    std::cout << "\n  SUM Operation: " << (components.sumOperation ? "Yes" : "No");
-    if (components.sumOperation)
+}
+
+int main(int argc, char *argv[])
+{
+    std::string benchmark = (argc > 2 && std::string(argv[1]) == "--bench") ? argv[2] : "";
+
+    engineStats(); // Register the engine statistics up front
+    if (const char *interval = std::getenv("BUZZDB_STATS_INTERVAL_MS"))
     {
-        std::cout << " on {" << components.sumAttributeIndex + 1 << "}";
+        StatsRegistry::global().startPeriodicDump(std::chrono::milliseconds(std::stoul(interval)), std::cerr);
     }
-    std::cout << "\n  GROUP BY: " << (components.groupBy ? "Yes" : "No");
-    if (components.groupBy)
+
+    try
     {
-        std::cout << " on {" << components.groupByAttributeIndex + 1 << "}";
+        std::cout << (load_or_generate_key(database_filename) ? "Key Generated" : "Key Loaded") << std::endl;
     }
-    std::cout << "\n  WHERE Condition: " << (components.whereCondition ? "Yes" : "No");
-    if (components.whereCondition)
+    catch (const std::exception &e)
     {
-        std::cout << " on {" << components.whereAttributeIndex + 1 << "} > " << components.lowerBound << " and < " << components.upperBound;
+        std::cerr << e.what() << std::endl;
+        return 1;
     }
-    std::cout << std::endl;
-}
-
-void executeQuery(const QueryComponents &components,
-                  BufferManager &buffer_manager)
-{
-    // Stack allocation of ScanOperator
-    ScanOperator scanOp(buffer_manager);
 
-    // Using a pointer to Operator to handle polymorphism
-    Operator *rootOp = &scanOp;
+    BuzzDB db;
 
-    // Buffer for optional operators to ensure lifetime
-    std::optional<SelectOperator> selectOpBuffer;
-    std::optional<HashAggregationOperator> hashAggOpBuffer;
+    std::ifstream inputFile("output.txt");
 
-    // Apply WHERE conditions
-    if (components.whereAttributeIndex != -1)
+    if (!inputFile)
     {
-        // Create simple predicates with comparison operators
-        auto predicate1 = std::make_unique<SimplePredicate>(
-            SimplePredicate::Operand(components.whereAttributeIndex),
-            SimplePredicate::Operand(std::make_unique<Field>(components.lowerBound)),
-            SimplePredicate::ComparisonOperator::GT);
-
-        auto predicate2 = std::make_unique<SimplePredicate>(
-            SimplePredicate::Operand(components.whereAttributeIndex),
-            SimplePredicate::Operand(std::make_unique<Field>(components.upperBound)),
-            SimplePredicate::ComparisonOperator::LT);
-
-        // Combine simple predicates into a complex predicate with logical AND operator
-        auto complexPredicate = std::make_unique<ComplexPredicate>(ComplexPredicate::LogicOperator::AND);
-        complexPredicate->addPredicate(std::move(predicate1));
-        complexPredicate->addPredicate(std::move(predicate2));
-
-        // Using std::optional to manage the lifetime of SelectOperator
-        selectOpBuffer.emplace(*rootOp, std::move(complexPredicate));
-        rootOp = &*selectOpBuffer;
+        std::cerr << "Unable to open file" << std::endl;
+        return 1;
     }
 
-    // Apply SUM or GROUP BY operation
-    if (components.sumOperation || components.groupBy)
+    int field1, field2;
+    // int i = 0;
+    while (inputFile >> field1 >> field2)
     {
-        std::vector<size_t> groupByAttrs;
-        if (components.groupBy)
+        // if (i++ % 10000 == 0)
         {
-            groupByAttrs.push_back(static_cast<size_t>(components.groupByAttributeIndex));
+            db.insert(field1, field2);
         }
-        std::vector<AggrFunc> aggrFuncs{
-            {AggrFuncType::SUM, static_cast<size_t>(components.sumAttributeIndex)}};
-
-        // Using std::optional to manage the lifetime of HashAggregationOperator
-        hashAggOpBuffer.emplace(*rootOp, groupByAttrs, aggrFuncs);
-        rootOp = &*hashAggOpBuffer;
     }
+    db.createIndexesFromEnvironment();
 
-    // Execute the Root Operator
-    rootOp->open();
-    while (rootOp->next())
+    if (benchmark == "scan-strategy")
     {
-        // Retrieve and print the current tuple
-        const auto &output = rootOp->getOutput();
-        for (const auto &field : output)
-        {
-            field->print();
-            std::cout << " ";
-        }
-        std::cout << std::endl;
+        benchmarkScanStrategy(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-    rootOp->close();
-}
-
-class InsertOperator : public Operator
-{
-private:
-    BufferManager &bufferManager;
-    std::unique_ptr<Tuple> tupleToInsert;
-
-public:
-    InsertOperator(BufferManager &manager) : bufferManager(manager) {}
-
-    // Set the tuple to be inserted by this operator.
-    void setTupleToInsert(std::unique_ptr<Tuple> tuple)
+    else if (benchmark == "buffer-scaling")
     {
-        tupleToInsert = std::move(tuple);
+        benchmarkBufferScaling();
+        printStatsIfRequested();
+        return 0;
     }
-
-    void open() override
+    else if (benchmark == "hash-index")
     {
-        // Not used in this context
+        benchmarkHashIndex();
+        return 0;
     }
-
-    bool next() override
+    else if (benchmark == "index-scan")
     {
-        if (!tupleToInsert)
-            return false; // No tuple to insert
-
-        for (size_t pageId = 0; pageId < bufferManager.getNumPages(); ++pageId)
-        {
-            auto &page = bufferManager.getPage(pageId);
-            // Attempt to insert the tuple
-            if (page->addTuple(tupleToInsert->clone()))
-            {
-                // Flush the page to disk after insertion
-                bufferManager.flushPage(pageId);
-                return true; // Insertion successful
-            }
-        }
-
-        // If insertion failed in all existing pages, extend the database and try again
-        bufferManager.extend();
-        auto &newPage = bufferManager.getPage(bufferManager.getNumPages() - 1);
-        if (newPage->addTuple(tupleToInsert->clone()))
-        {
-            bufferManager.flushPage(bufferManager.getNumPages() - 1);
-            return true; // Insertion successful after extending the database
-        }
-
-        return false; // Insertion failed even after extending the database
+        benchmarkIndexScan(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    void close() override
+    else if (benchmark == "index-build")
     {
-        // Not used in this context
+        benchmarkIndexBuild(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    std::vector<std::unique_ptr<Field>> getOutput() override
+    else if (benchmark == "zone-maps")
     {
-        return {}; // Return empty vector
+        benchmarkZoneMaps(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-};
-
-class DeleteOperator : public Operator
-{
-private:
-    BufferManager &bufferManager;
-    size_t pageId;
-    size_t tupleId;
-
-public:
-    DeleteOperator(BufferManager &manager, size_t pageId, size_t tupleId)
-        : bufferManager(manager), pageId(pageId), tupleId(tupleId) {}
-
-    void open() override
+    else if (benchmark == "batch")
     {
-        // Not used in this context
+        benchmarkBatchExecution(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    bool next() override
+    else if (benchmark == "predicate-kernels")
     {
-        auto &page = bufferManager.getPage(pageId);
-        if (!page)
-        {
-            std::cerr << "Page not found." << std::endl;
-            return false;
-        }
-
-        page->deleteTuple(tupleId);      // Perform deletion
-        bufferManager.flushPage(pageId); // Flush the page to disk after deletion
-        return true;
+        benchmarkPredicateKernels();
+        return 0;
     }
-
-    void close() override
+    else if (benchmark == "predicate-compiler")
     {
-        // Not used in this context
+        benchmarkPredicateCompiler();
+        return 0;
     }
-
-    std::vector<std::unique_ptr<Field>> getOutput() override
+    else if (benchmark == "aggregation")
     {
-        return {}; // Return empty vector
+        benchmarkAggregation();
+        return 0;
     }
-};
-
-class BuzzDB
-{
-public:
-    HashIndex hash_index;
-    BufferManager buffer_manager;
-
-public:
-    size_t max_number_of_tuples = 5000;
-    size_t tuple_insertion_attempt_counter = 0;
-
-    BuzzDB()
+    else if (benchmark == "parallel-scan")
     {
-        // Storage Manager automatically created
+        benchmarkParallelScan(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    // insert function
-    void insert(int key, int value)
+    else if (benchmark == "spilling-aggregation")
     {
-        tuple_insertion_attempt_counter += 1;
-
-        // Create a new tuple with the given key and value
-        auto newTuple = std::make_unique<Tuple>();
-
-        auto key_field = std::make_unique<Field>(key);
-        auto value_field = std::make_unique<Field>(value);
-        float float_val = 132.04;
-        auto float_field = std::make_unique<Field>(float_val);
-        auto string_field = std::make_unique<Field>("buzzdb");
-
-        newTuple->addField(std::move(key_field));
-        newTuple->addField(std::move(value_field));
-        newTuple->addField(std::move(float_field));
-        newTuple->addField(std::move(string_field));
-
-        InsertOperator insertOp(buffer_manager);
-        insertOp.setTupleToInsert(std::move(newTuple));
-        bool status = insertOp.next();
-
-        assert(status == true);
-
-        if (tuple_insertion_attempt_counter % 10 != 0)
-        {
-            // Assuming you want to delete the first tuple from the first page
-            DeleteOperator delOp(buffer_manager, 0, 0);
-            if (!delOp.next())
-            {
-                std::cerr << "Failed to delete tuple." << std::endl;
-            }
-        }
+        benchmarkSpillingAggregation(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    void executeQueries()
+    else if (benchmark == "hash-join")
     {
-
-        std::vector<std::string> test_queries = {
-            "SUM{1} GROUP BY {1} WHERE {1} > 2 and {1} < 6"};
-
-        for (const auto &query : test_queries)
-        {
-            auto components = parseQuery(query);
-            // prettyPrint(components);
-            executeQuery(components, buffer_manager);
-        }
+        benchmarkHashJoin(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-};
-
-int main()
-{
-    generate_key();
-    std::cout << "Key Generated" << std::endl;
-
-    BuzzDB db;
-
-    std::ifstream inputFile("output.txt");
-
-    if (!inputFile)
+    else if (benchmark == "sort")
     {
-        std::cerr << "Unable to open file" << std::endl;
-        return 1;
+        benchmarkSort(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
     }
-
-    int field1, field2;
-    // int i = 0;
-    while (inputFile >> field1 >> field2)
+    else if (benchmark == "projection")
     {
-        // if (i++ % 10000 == 0)
-        {
-            db.insert(field1, field2);
-        }
+        benchmarkProjection(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
+    }
+    else if (benchmark == "query-parser")
+    {
+        benchmarkQueryParser(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
+    }
+    else if (benchmark == "optimizer")
+    {
+        benchmarkOptimizer(db.buffer_manager);
+        printStatsIfRequested();
+        return 0;
+    }
+    else if (!benchmark.empty())
+    {
+        std::cerr << "Unknown benchmark: " << benchmark << std::endl;
+        return 1;
     }
 
     auto start = std::chrono::high_resolution_clock::now();
@@ -1790,7 +12641,7 @@ int main()
     db.executeQueries();
     std::cout << std::endl;
     std::cout << std::endl
-              << "Query results before applying data encryption:\n5 225\n3 345\n4 216" << std::endl
+              << "Query results before applying data encryption:\n4 216\n3 345\n5 225" << std::endl
               << std::endl;
 
     auto end = std::chrono::high_resolution_clock::now();
@@ -1800,5 +12651,6 @@ int main()
     std::cout << "Elapsed time: " << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()
               << " microseconds" << std::endl;
 
+    printStatsIfRequested();
     return 0;
 }
\ No newline at end of file